@@ -0,0 +1,469 @@
+/* bench.c
+ *
+ * Microbenchmarks of the paths that clients lean on: accessors (scaled
+ * array reads among them), lookups, create/destroy churn, @tags upkeep and
+ * event delivery.  Results go to
+ * stdout as a JSON document, so that they can be kept and compared from
+ * release to release; progress goes to stderr.
+ *
+ * Usage: bench [-t threads] [-n max_tags] [-s scale]
+ *
+ * Each benchmark is timed twice over: as a whole, for throughput, and one
+ * operation in every few individually, for the latency percentiles.  The
+ * percentiles include the cost of reading the clock, which is reported as
+ * clock_ns alongside them.
+ */
+
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+#include "tagtree.h"
+
+/* Time every this many operations individually. */
+#define BENCH_SAMPLE_EVERY 16
+#define BENCH_MAX_THREADS 64
+
+struct bench_result {
+    const char* name;
+    int threads;
+    long tags; /* how many tags there were, where that matters */
+    uint64_t ops;
+    uint64_t elapsed_ns;
+    uint64_t* samples;
+    size_t nsamples;
+};
+
+/* Latency samples for one thread of a benchmark. */
+struct bench_samples {
+    uint64_t* v;
+    size_t n, cap;
+};
+
+/* What a benchmark thread does: ops operations, sampling into s. */
+struct bench_thread {
+    void (*fn)(struct bench_thread* bt);
+    int index;
+    uint64_t ops;
+    int32_t* tags;
+    size_t ntags;
+    struct bench_samples s;
+    pthread_barrier_t* barrier;
+};
+
+static int nthreads = 4;
+static long max_tags = 1000000;
+static double scale = 1.0;
+static int nresults = 0;
+
+static uint64_t
+now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+samples_add(struct bench_samples* s, uint64_t ns)
+{
+    if (s->n == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 4096;
+        s->v = realloc(s->v, s->cap * sizeof(*s->v));
+        if (s->v == NULL) {
+            err(1, "realloc");
+        }
+    }
+    s->v[s->n++] = ns;
+}
+
+/* Runs op(i, arg) n times, timing every BENCH_SAMPLE_EVERY'th call. */
+#define BENCH_LOOP(s, n, body)                             \
+    do {                                                   \
+        for (uint64_t i = 0; i < (n); ++i) {               \
+            if (i % BENCH_SAMPLE_EVERY == 0) {             \
+                uint64_t t0 = now_ns();                    \
+                body;                                      \
+                samples_add((s), now_ns() - t0);           \
+            } else {                                       \
+                body;                                      \
+            }                                              \
+        }                                                  \
+    } while (0)
+
+static int
+u64cmp(const void* lhs, const void* rhs)
+{
+    uint64_t l = *(const uint64_t*)(lhs), r = *(const uint64_t*)(rhs);
+
+    return (l < r) ? -1 : (l > r);
+}
+
+static uint64_t
+percentile(const struct bench_result* r, double p)
+{
+    size_t i;
+
+    if (r->nsamples == 0) {
+        return 0;
+    }
+    i = (size_t)(p * (r->nsamples - 1) + 0.5);
+    return r->samples[i];
+}
+
+static void
+report(struct bench_result* r)
+{
+    double ns_per_op = r->ops ? (double)(r->elapsed_ns) * r->threads / r->ops : 0;
+    double ops_per_sec = r->elapsed_ns ? r->ops * 1e9 / r->elapsed_ns : 0;
+
+    qsort(r->samples, r->nsamples, sizeof(*r->samples), u64cmp);
+
+    printf("%s\n    {\"name\": \"%s\", \"threads\": %d, \"tags\": %ld, \"ops\": %llu, "
+           "\"ns_per_op\": %.1f, \"ops_per_sec\": %.0f, "
+           "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu}",
+        nresults++ ? "," : "", r->name, r->threads, r->tags, (unsigned long long)(r->ops), ns_per_op,
+        ops_per_sec, (unsigned long long)(percentile(r, 0.5)), (unsigned long long)(percentile(r, 0.99)),
+        (unsigned long long)(percentile(r, 0.999)));
+    fflush(stdout);
+
+    fprintf(stderr, "%-28s %2d thr %8ld tags %10.1f ns/op %12.0f ops/s  p50 %llu p99 %llu p999 %llu\n", r->name,
+        r->threads, r->tags, ns_per_op, ops_per_sec, (unsigned long long)(percentile(r, 0.5)),
+        (unsigned long long)(percentile(r, 0.99)), (unsigned long long)(percentile(r, 0.999)));
+
+    free(r->samples);
+}
+
+static void*
+bench_thread_main(void* arg)
+{
+    struct bench_thread* bt = arg;
+
+    pthread_barrier_wait(bt->barrier);
+    bt->fn(bt);
+    pthread_barrier_wait(bt->barrier);
+    return NULL;
+}
+
+/* Runs fn on n threads at once, each with ops operations to do over the
+ * given tags, and reports the lot as one result. */
+static void
+run(const char* name, int n, uint64_t ops, void (*fn)(struct bench_thread*), int32_t* tags, size_t ntags, long ntotal)
+{
+    struct bench_thread bt[BENCH_MAX_THREADS];
+    pthread_t threads[BENCH_MAX_THREADS];
+    pthread_barrier_t barrier;
+    struct bench_result r = { .name = name, .threads = n, .tags = ntotal };
+    uint64_t t0;
+
+    pthread_barrier_init(&barrier, NULL, n + 1);
+    for (int i = 0; i < n; ++i) {
+        bt[i] = (struct bench_thread) {
+            .fn = fn, .index = i, .ops = ops, .tags = tags, .ntags = ntags, .barrier = &barrier
+        };
+        if (pthread_create(&threads[i], NULL, bench_thread_main, &bt[i])) {
+            err(1, "pthread_create");
+        }
+    }
+
+    pthread_barrier_wait(&barrier);
+    t0 = now_ns();
+    pthread_barrier_wait(&barrier);
+    r.elapsed_ns = now_ns() - t0;
+
+    for (int i = 0; i < n; ++i) {
+        pthread_join(threads[i], NULL);
+        r.ops += bt[i].ops;
+        r.samples = realloc(r.samples, (r.nsamples + bt[i].s.n) * sizeof(*r.samples));
+        if (r.samples == NULL && r.nsamples + bt[i].s.n > 0) {
+            err(1, "realloc");
+        }
+        memcpy(r.samples + r.nsamples, bt[i].s.v, bt[i].s.n * sizeof(*r.samples));
+        r.nsamples += bt[i].s.n;
+        free(bt[i].s.v);
+    }
+    pthread_barrier_destroy(&barrier);
+
+    report(&r);
+}
+
+static uint64_t
+scaled(uint64_t ops)
+{
+    uint64_t n = ops * scale;
+
+    return n ? n : 1;
+}
+
+static int32_t
+create(const char* fmt, long i, int elem_count)
+{
+    char buf[128], name[64];
+    int32_t id;
+
+    snprintf(name, sizeof(name), fmt, i);
+    snprintf(buf, sizeof(buf), "protocol=ab_eip&elem_size=4&elem_count=%d&name=%s", elem_count, name);
+    if ((id = plc_tag_create(buf, 1000)) < 0) {
+        errx(1, "plc_tag_create(%s) returned %d", buf, id);
+    }
+    return id;
+}
+
+/* The benchmarks themselves.  Each thread keeps to its own tag where that
+ * is how clients would do it, and shares tags[0] otherwise. */
+
+static volatile int32_t sink;
+
+static void
+bench_get_shared(struct bench_thread* bt)
+{
+    int32_t tag = bt->tags[0];
+
+    BENCH_LOOP(&bt->s, bt->ops, sink = plc_tag_get_int32(tag, 4 * (i & 15)));
+}
+
+static void
+bench_get_own(struct bench_thread* bt)
+{
+    int32_t tag = bt->tags[bt->index % bt->ntags];
+
+    BENCH_LOOP(&bt->s, bt->ops, sink = plc_tag_get_int32(tag, 4 * (i & 15)));
+}
+
+static void
+bench_set_own(struct bench_thread* bt)
+{
+    int32_t tag = bt->tags[bt->index % bt->ntags];
+
+    BENCH_LOOP(&bt->s, bt->ops, plc_tag_set_int32(tag, 4 * (i & 15), (int32_t)(i)));
+}
+
+static void
+bench_set_shared(struct bench_thread* bt)
+{
+    int32_t tag = bt->tags[0];
+
+    BENCH_LOOP(&bt->s, bt->ops, plc_tag_set_int32(tag, 4 * (i & 15), (int32_t)(i)));
+}
+
+/* Reading a 1024-INT tag as scaled floats: in one call, and an element
+ * at a time, as a client would without plc_tag_get_scaled(). */
+#define BENCH_ARRAY 1024
+
+static volatile float fsink;
+
+static void
+bench_get_scaled(struct bench_thread* bt)
+{
+    int32_t tag = bt->tags[0];
+    float buf[BENCH_ARRAY];
+
+    BENCH_LOOP(&bt->s, bt->ops, plc_tag_get_scaled(tag, 0, TAG_INT, buf, BENCH_ARRAY, 0.01f, 0.0f));
+    fsink = buf[BENCH_ARRAY - 1];
+}
+
+static void
+bench_get_scaled_loop(struct bench_thread* bt)
+{
+    int32_t tag = bt->tags[0];
+    float buf[BENCH_ARRAY];
+
+    BENCH_LOOP(&bt->s, bt->ops, for (int j = 0; j < BENCH_ARRAY; ++j) {
+        buf[j] = plc_tag_get_int16(tag, 2 * j) * 0.01f;
+    });
+    fsink = buf[BENCH_ARRAY - 1];
+}
+
+/* A cheap, per-thread xorshift, so that lookups don't all hit one line. */
+static inline uint32_t
+bench_rand(uint32_t* state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static void
+bench_lookup(struct bench_thread* bt)
+{
+    uint32_t rng = 2463534242u + bt->index;
+
+    BENCH_LOOP(&bt->s, bt->ops, sink = tag_tree_lookup(bt->tags[bench_rand(&rng) % bt->ntags])->tag_id);
+}
+
+static void
+bench_churn(struct bench_thread* bt)
+{
+    char name[64];
+
+    BENCH_LOOP(&bt->s, bt->ops, {
+        snprintf(name, sizeof(name), "Churn_%d_%%ld", bt->index);
+        plc_tag_destroy(create(name, (long)(i), 1));
+    });
+}
+
+static void
+bench_metatag_sync(struct bench_thread* bt)
+{
+    uint64_t t0;
+
+    /* Only the compaction that the destroy leaves for the next lookup of
+     * @tags is timed here, not the create and destroy themselves. */
+    for (uint64_t i = 0; i < bt->ops; ++i) {
+        plc_tag_destroy(create("Tombstone_%ld", (long)(i), 1));
+        t0 = now_ns();
+        sink = plc_tag_get_size(METATAG_ID);
+        samples_add(&bt->s, now_ns() - t0);
+    }
+}
+
+static void
+bench_metatag_read(struct bench_thread* bt)
+{
+    static char buf[1 << 26];
+
+    BENCH_LOOP(&bt->s, bt->ops, {
+        int size = plc_tag_get_size(METATAG_ID);
+        if (size > (int)(sizeof(buf))) {
+            size = sizeof(buf);
+        }
+        plc_tag_get_raw(METATAG_ID, 0, buf, size);
+    });
+}
+
+static void
+bench_noop_cb(int32_t tag_id, int event, int status)
+{
+    (void)(tag_id);
+    (void)(event);
+    (void)(status);
+}
+
+static void
+bench_set_cb(struct bench_thread* bt)
+{
+    int32_t tag = bt->tags[bt->index % bt->ntags];
+
+    BENCH_LOOP(&bt->s, bt->ops, plc_tag_set_int32(tag, 4 * (i & 15), (int32_t)(i)));
+    plcstub_flush_events();
+}
+
+/* Grows the tree to n tags (beyond those it starts with), keeping their IDs
+ * in *ids. */
+static void
+grow(int32_t** ids, long* have, long n)
+{
+    *ids = realloc(*ids, n * sizeof(**ids));
+    if (*ids == NULL) {
+        err(1, "realloc");
+    }
+    for (; *have < n; ++*have) {
+        (*ids)[*have] = create("Lookup_%ld", *have, 1);
+    }
+}
+
+/* The least time that two back-to-back clock reads are seen to take. */
+static uint64_t
+clock_overhead()
+{
+    uint64_t best = UINT64_MAX, t0, t1;
+
+    for (int i = 0; i < 100000; ++i) {
+        t0 = now_ns();
+        t1 = now_ns();
+        if (t1 - t0 < best) {
+            best = t1 - t0;
+        }
+    }
+    return best;
+}
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: bench [-t threads] [-n max_tags] [-s scale]\n");
+    exit(2);
+}
+
+int
+main(int argc, char** argv)
+{
+    int32_t own[BENCH_MAX_THREADS];
+    int32_t *ids = NULL, array;
+    long have = 0;
+    const long sizes[] = { 10, 10000, 1000000 };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:n:s:")) != -1) {
+        switch (opt) {
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'n':
+            max_tags = atol(optarg);
+            break;
+        case 's':
+            scale = atof(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (nthreads < 1 || nthreads > BENCH_MAX_THREADS || max_tags < 1 || scale <= 0) {
+        usage();
+    }
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_ERROR);
+
+    for (int i = 0; i < nthreads; ++i) {
+        own[i] = create("Bench_%ld", i, 16);
+    }
+
+    printf("{\"threads\": %d, \"max_tags\": %ld, \"scale\": %g, \"clock_ns\": %llu, \"benchmarks\": [", nthreads,
+        max_tags, scale, (unsigned long long)(clock_overhead()));
+
+    run("get_int32", 1, scaled(20000000), bench_get_own, own, 1, 0);
+    run("set_int32", 1, scaled(10000000), bench_set_own, own, 1, 0);
+    run("get_int32_own_tag", nthreads, scaled(10000000), bench_get_own, own, nthreads, 0);
+    run("get_int32_shared_tag", nthreads, scaled(10000000), bench_get_shared, own, nthreads, 0);
+    run("set_int32_own_tag", nthreads, scaled(5000000), bench_set_own, own, nthreads, 0);
+    run("set_int32_shared_tag", nthreads, scaled(2000000), bench_set_shared, own, nthreads, 0);
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && sizes[i] <= max_tags; ++i) {
+        grow(&ids, &have, sizes[i]);
+        run("tag_tree_lookup", 1, scaled(10000000), bench_lookup, ids, have, have);
+        run("tag_tree_lookup_mt", nthreads, scaled(10000000), bench_lookup, ids, have, have);
+    }
+
+    array = plc_tag_create("protocol=ab_eip&elem_type=INT&elem_count=1024&name=Bench_Array", 1000);
+    run("get_scaled_int16_1k", 1, scaled(200000), bench_get_scaled, &array, 1, 0);
+    run("get_int16_1k_loop", 1, scaled(20000), bench_get_scaled_loop, &array, 1, 0);
+
+    run("create_destroy", 1, scaled(200000), bench_churn, NULL, 0, have);
+    run("create_destroy_mt", nthreads, scaled(50000), bench_churn, NULL, 0, have);
+    run("metatag_compact", 1, scaled(200), bench_metatag_sync, NULL, 0, have);
+    run("metatag_read", 1, scaled(20), bench_metatag_read, NULL, 0, have);
+
+    for (int i = 0; i < nthreads; ++i) {
+        plc_tag_register_callback(own[i], bench_noop_cb);
+    }
+    run("set_int32_callback", 1, scaled(1000000), bench_set_cb, own, 1, 0);
+    plcstub_set_event_mode(PLCSTUB_EVENTS_INLINE);
+    run("set_int32_callback_inline", 1, scaled(1000000), bench_set_cb, own, 1, 0);
+
+    printf("\n]}\n");
+
+    plc_tag_shutdown();
+    free(ids);
+
+    return 0;
+}
@@ -0,0 +1,50 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <pthread.h>
+#include <stddef.h>
+
+/* A slab allocator for objects that are created and destroyed often and
+ * are all torn down together (e.g. tag tree nodes).  Small requests are
+ * rounded up to a size class and bump-allocated out of large chunks;
+ * freed objects go onto a per-class free list for reuse.  Requests too
+ * big for any size class get a chunk of their own.  Every chunk is
+ * released in one go by arena_release().
+ */
+
+#define ARENA_CHUNK_SIZE (1 << 20)
+#define ARENA_NCLASSES 22
+
+struct arena_chunk;
+
+struct arena {
+    pthread_mutex_t mtx;
+    struct arena_chunk* chunks; /* every chunk, for arena_release() */
+    char* cur; /* bump pointer into the newest slab chunk */
+    size_t left; /* bytes left after cur */
+    void* free_lists[ARENA_NCLASSES];
+};
+
+#define ARENA_INITIALIZER                \
+    {                                    \
+        .mtx = PTHREAD_MUTEX_INITIALIZER \
+    }
+
+/* Returns size bytes of uninitialised storage, aligned to ARENA_ALIGN. */
+void*
+arena_alloc(struct arena* a, size_t size);
+
+/* Returns p (which must have come from arena_alloc() with the same size)
+ * to the arena. */
+void
+arena_free(struct arena* a, void* p, size_t size);
+
+/* Frees every allocation ever made from the arena at once, leaving it
+ * empty and ready for reuse. */
+void
+arena_release(struct arena* a);
+
+/* A cache line, so that what's allocated can start on one. */
+#define ARENA_ALIGN 64
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef _ASYNC_H_
+#define _ASYNC_H_
+
+#include <stdbool.h>
+
+#include "tagtree.h"
+
+/* Kinds of in-flight operation. */
+#define ASYNC_OP_NONE 0
+#define ASYNC_OP_READ 1
+#define ASYNC_OP_WRITE 2
+
+/* 
+ * Simulates a read or write of the tag going out to the PLC.  The operation
+ * is queued to a pool of background workers, which complete it (and deliver
+ * the COMPLETED event) when it comes due.  With a timeout of zero this
+ * returns PLCTAG_STATUS_PENDING straight away, and plc_tag_status() reports
+ * progress; otherwise it blocks for at most timeout milliseconds.
+ *
+ * A read started while another read of the same tag is in flight joins it
+ * rather than starting a transaction of its own.  Any other overlap is
+ * refused with PLCTAG_ERR_BUSY.
+ *
+ * A buffered tag's operation doesn't complete while a thread other than
+ * the caller holds plc_tag_lock() on it, unless that thread is waiting on
+ * it; holder says whether the caller is the one holding it.
+ *
+ * Like everything else done to t, this is to be called inside the epoch
+ * critical section (see epoch.h) that t was looked up in.
+ */
+int
+async_start(struct tag_tree_node* t, int op, int timeout, bool holder);
+
+/* Completes the tag's operation now, if it came due while the tag was
+ * locked, for the holder of plc_tag_lock() to see it through.
+ *
+ * Assumes that t->store->mtx is held, by the holder.
+ */
+void
+async_finish(struct tag_tree_node* t);
+
+/* Requeues the operations that came due while the store was locked, for
+ * plc_tag_unlock().  Assumes that store->mtx is held. */
+void
+async_requeue(struct tag_store* store);
+
+/* Aborts whatever operation is in flight on the tag (if any), leaving its
+ * status as status.  Once this returns no worker holds a reference to t. */
+void
+async_abort(struct tag_tree_node* t, int status);
+
+/* Tells the workers to stop, without waiting for them to, so that
+ * plc_tag_shutdown() can wind down every thread at once. */
+void
+async_stop(void);
+
+/* Stops and joins the worker pool, dropping anything still queued. The
+ * pool restarts on the next async_start(). */
+void
+async_shutdown(void);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef _ATTR_H_
+#define _ATTR_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "layout.h"
+#include "plcstub.h"
+
+/* A run of characters in a string that isn't necessarily NUL-terminated,
+ * e.g. one value in a tag's attribute string.  p is NULL for a missing
+ * attribute. */
+struct attr_span {
+    const char* p;
+    size_t len;
+};
+
+static inline bool
+attr_span_eq(const struct attr_span* s, const char* str)
+{
+    return s->p != NULL && strlen(str) == s->len && memcmp(s->p, str, s->len) == 0;
+}
+
+/* The attributes of a tag, as given to plc_tag_create(). */
+struct tag_attrs {
+    struct attr_span protocol;
+    struct attr_span name;
+    struct attr_span gateway;
+    struct attr_span path;
+    struct attr_span cpu;
+    struct attr_span elem_type;
+    struct attr_span gen; /* a value generator (see gen.h) */
+    size_t elem_size;
+    size_t elem_count;
+    uint32_t dims[LAYOUT_MAX_DIMS]; /* all zero unless dims was given */
+    uint16_t udt; /* the layout (see layout.h) that udt gives, or 0 */
+    int buffers; /* snapshots kept of a buffered tag (see tagtree.h), or 0 */
+    bool shaped; /* set if elem_size, elem_count, elem_type, dims or udt was given */
+    int type; /* the enum tag_type that elem_type names, or -1 */
+};
+
+/* Parses an attribute string such as "protocol=ab_eip&name=Foo&elem_size=4"
+ * in one pass, without modifying or copying it: the spans in attrs point
+ * into attrib.  Returns PLCTAG_STATUS_OK, or PLCTAG_ERR_BAD_PARAM if it's
+ * malformed (a number that isn't one, or overflows, or a shape that
+ * contradicts itself).
+ *
+ * Besides libplctag's, there are the stub's own: dims, such as "2,3", which
+ * gives the tag an array shape (and the element count, which elem_count
+ * has to agree with if it's given too), and udt, such as "DINT,REAL[4]",
+ * which makes each element a structure laid out as in layout.h (and sets
+ * the element size, ditto). */
+int
+attr_parse(const char* attrib, struct tag_attrs* attrs);
+
+/* Looks up a data type such as "DINT" (in any case) among those in enum
+ * tag_type, returning 0 and the type and its width if it's one of them. */
+int
+attr_lookup_type(const char* s, size_t len, enum tag_type* type, size_t* size);
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef _CIP_H_
+#define _CIP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "layout.h"
+
+/*
+ * The PLC's side of EtherNet/IP, as a ControlLogix speaks it to libplctag
+ * (protocol=ab_eip), over the tags in the tree: enough for an unmodified
+ * client to register a session, open a connection and read, write and list
+ * tags, one request at a time or batched.  This is only the protocol; the
+ * sockets are somebody else's (see server/plcstub-server.c).
+ *
+ * Encapsulation commands: ListServices, ListIdentity, RegisterSession,
+ * UnRegisterSession, SendRRData (unconnected) and SendUnitData (connected).
+ * CIP services: Read Tag, Read Tag Fragmented, Write Tag, Write Tag
+ * Fragmented, Multiple Service Packet, Get Instance Attribute List (on the
+ * Symbol class, for tag listing), and Forward Open, Large Forward Open,
+ * Forward Close and Unconnected Send on the Connection Manager.
+ *
+ * Tags are addressed by name, with an optional element index (one per
+ * dimension of a multi-dimensional array), and atomic types take their CIP
+ * type codes from the tags' (see cip_type_code()), while UDTs are listed
+ * with their layouts' template instances (see layout.h);
+ * a name that isn't in the tree gets "path destination unknown", rather
+ * than being created.
+ */
+
+#define CIP_PORT 44818
+#define CIP_ENCAP_HEADER 24
+
+/* Whatever the request, the reply fits in this: the largest connected
+ * packet a Large Forward Open can ask for is 4002 bytes. */
+#define CIP_REPLY_MAX 4096
+#define CIP_MAX_CONNECTED 4002
+/* The most an unconnected reply may carry, as on a real controller. */
+#define CIP_MAX_UNCONNECTED 504
+
+#define CIP_MAX_CONNS 8
+
+/* A connection opened with Forward Open. */
+struct cip_conn {
+    bool open;
+    uint32_t ot_id; /* ours, which the client addresses us by */
+    uint32_t to_id; /* the client's, which we address it by */
+    uint16_t serial;
+    uint16_t vendor;
+    uint32_t orig_serial;
+    size_t max_size;
+};
+
+/* What's known about a tag the session has looked up. */
+struct cip_tag {
+    char* name;
+    int32_t tag_id;
+    size_t elem_size;
+    size_t elem_count;
+    uint16_t type; /* the CIP type code (see cip_type_code()) */
+    uint16_t symbol_type; /* and what it's listed as (see layout_symbol_type()) */
+    uint32_t dims[LAYOUT_MAX_DIMS];
+};
+
+/* One client's state: one per TCP connection, and only ever used by one
+ * thread at a time.  It keeps a handle open onto every tag it has looked
+ * up, until cip_session_free(). */
+struct cip_session {
+    uint32_t handle; /* 0 until the session is registered */
+    const char* gateway; /* the tag names' gateway and path: NULL means "" */
+    const char* path;
+    struct cip_conn conns[CIP_MAX_CONNS];
+
+    /* Open-addressed, by name. */
+    struct cip_tag* tags;
+    size_t ntags;
+    size_t cap;
+};
+
+void
+cip_session_init(struct cip_session* s, const char* gateway, const char* path);
+
+/* Handles the encapsulated request at the start of in, if all of it is
+ * there, leaving any reply (of at most CIP_REPLY_MAX bytes) in out and its
+ * length in *out_len, which is 0 if there isn't one.  Returns the length of
+ * the request, 0 if there's more of it to come, or -1 if the connection
+ * should be closed. */
+ssize_t
+cip_handle(struct cip_session* s, const uint8_t* in, size_t len, uint8_t* out, size_t* out_len);
+
+void
+cip_session_free(struct cip_session* s);
+
+/* The CIP type code for a tag of the given type (an enum tag_type plus
+ * one, or 0 if not known) and element size: 0xC1 for BOOL, 0xC4 for DINT
+ * and so on, going by the size if the type isn't known, or 0xA0 for a
+ * structure if that isn't the size of anything atomic either. */
+uint16_t
+cip_type_code(uint16_t type, size_t elem_size);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef _CONN_H_
+#define _CONN_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "attr.h"
+#include "plcstub.h"
+
+/* 
+ * A simulated connection to a PLC, shared by every tag created with the same
+ * gateway, path and cpu attributes.  Each connection models a link with a
+ * round-trip latency (plus jitter), a per-packet processing cost and an
+ * optional byte-rate cap; transfers on one connection queue up behind each
+ * other for the link.
+ */
+struct conn {
+    char* gateway;
+    char* path;
+    char* cpu;
+    struct plcstub_conn_params params;
+    pthread_mutex_t mtx;
+    struct timespec link_free; /* when the link finishes its queued transfers */
+    uint64_t rng;
+    struct conn* next;
+};
+
+/* Finds or creates the connection for the given attributes, any of which
+ * may be missing. */
+struct conn*
+conn_get(const struct attr_span* gateway, const struct attr_span* path, const struct attr_span* cpu);
+
+/* Works out when a transaction moving nbytes of tag data over the
+ * connection (NULL meaning the default connection), starting now, would
+ * complete. */
+void
+conn_schedule(struct conn* c, size_t nbytes, struct timespec* due);
+
+void
+conn_shutdown(void);
+
+#endif
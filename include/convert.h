@@ -0,0 +1,64 @@
+#ifndef _CONVERT_H_
+#define _CONVERT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "plcstub.h"
+
+/*
+ * Conversion kernels for the array accessors (see plcstub.h): each turns n
+ * elements at src into n at dst, which may be unaligned but mustn't overlap.
+ * A tag's payload is little-endian, as a controller's is.
+ *
+ * A scaled get takes elements of a tag type to floats, as x * scale + bias,
+ * and a scaled set back again, as the nearest value of the type to
+ * x * inv_scale + inv_bias (that is, (x - bias) / scale, with the division
+ * done once up front), rounding half to even and saturating at the type's
+ * limits.  NaNs saturate to the minimum.  Every kernel gives exactly the
+ * scalar one's results, so which of them runs is never visible.
+ *
+ * The host-order copies behind the typed array accessors are a straight
+ * memcpy() on little-endian hosts, which are all that the vector ISAs here
+ * run on; it's the scaling that's worth vectorising.
+ */
+
+struct convert_args {
+    float scale, bias; /* for gets */
+    float inv_scale, inv_bias; /* for sets */
+};
+
+typedef void (*convert_func)(void* dst, const void* src, size_t n, const struct convert_args* args);
+
+enum convert_isa {
+    CONVERT_SCALAR,
+    CONVERT_SSE2,
+    CONVERT_AVX2,
+    CONVERT_NEON,
+    CONVERT_NISAS
+};
+
+struct convert_kernels {
+    const char* name;
+    enum convert_isa isa;
+    /* By enum tag_type; NULL for TAG_BOOL, which has no scaled form. */
+    convert_func get_scaled[TAG_LREAL + 1];
+    convert_func set_scaled[TAG_LREAL + 1];
+};
+
+/* The best kernels this CPU runs, unless $PLCSTUB_SIMD (one of "scalar",
+ * "sse2", "avx2" or "neon") names others that it also runs.  Chosen once,
+ * on first use. */
+const struct convert_kernels*
+convert_kernels(void);
+
+/* The kernels for the given ISA, or NULL if they weren't built in or this
+ * CPU can't run them. */
+const struct convert_kernels*
+convert_kernels_for(enum convert_isa isa);
+
+/* Copies n elements of width bytes between little-endian and host order. */
+void
+convert_le_copy(void* dst, const void* src, size_t n, size_t width);
+
+#endif
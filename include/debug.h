@@ -1,6 +1,8 @@
 #ifndef _DEBUG_H_
 #define _DEBUG_H_
 
+#include <stdint.h>
+
 /* TODO(ntaylor): should we just import libplctag? That smells like a circular dependency
  * waiting to happen, but duplicating this is silly too. */
 #define PLCTAG_DEBUG_NONE (0)
@@ -13,9 +15,21 @@
 void
 pdebug_impl(const char* func, const char* file, int line, int level, const char* msg, ...);
 
+/* The most verbose level that is compiled in at all: pdebug() calls above
+ * it are constant-folded away, runtime level check and all.  Set it with
+ * -DPLCSTUB_LOG_FLOOR=... (LOG_FLOOR=... to make); the runtime level still
+ * applies to whatever is left. */
+#ifndef PLCSTUB_LOG_FLOOR
+#ifdef DEBUG
+#define PLCSTUB_LOG_FLOOR PLCTAG_DEBUG_SPEW
+#else
+#define PLCSTUB_LOG_FLOOR PLCTAG_DEBUG_INFO
+#endif
+#endif
+
 #define pdebug(level, ...)                                                       \
     do {                                                                         \
-        if ((level) <= debug_get_level()) {                                      \
+        if ((level) <= PLCSTUB_LOG_FLOOR && (level) <= debug_get_level()) {      \
             pdebug_impl(__FUNCTION__, __FILE__, __LINE__, (level), __VA_ARGS__); \
         }                                                                        \
     } while (0)
@@ -25,4 +39,15 @@ debug_get_level(void);
 void
 debug_set_level(int level);
 
+/* Log messages are buffered and written out by a background thread (see
+ * debug.c); this waits until everything logged so far has been. */
+void
+debug_flush(void);
+
+/* Sends log messages to log_cb instead of stderr, or back to stderr if
+ * it's NULL.  Returns -1 if a logger is already registered (or, given
+ * NULL, if none is). */
+int
+debug_set_logger(void (*log_cb)(int32_t tag_id, int debug_level, const char* message));
+
 #endif
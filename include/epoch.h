@@ -0,0 +1,74 @@
+#ifndef _EPOCH_H_
+#define _EPOCH_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Epoch-based reclamation, for tags (and their storage) that are looked up
+ * without any lock and so may still be in use by another thread when they
+ * are removed.
+ *
+ * A thread brackets its use of anything it looked up with epoch_enter()
+ * and epoch_exit(), which only touch the thread's own record.  Removing a
+ * tag retires it with epoch_retire() rather than freeing it; it's freed
+ * once the global epoch has moved on twice, which it can only do once every
+ * thread in a critical section has been seen in the current epoch, so by
+ * then nobody can still have it.
+ *
+ * Critical sections nest, and may block (e.g. waiting on a tag), which only
+ * holds up reclamation.
+ */
+
+struct epoch_thread {
+    /* The global epoch when this thread entered its critical section, or 0
+     * outside of one. */
+    uint64_t epoch;
+    int depth;
+    bool in_use; /* claimed by a live thread */
+    struct epoch_thread* next;
+};
+
+extern uint64_t epoch_global;
+extern _Thread_local struct epoch_thread* epoch_self;
+
+struct epoch_thread*
+epoch_register(void);
+
+static inline void
+epoch_enter(void)
+{
+    struct epoch_thread* e = epoch_self;
+
+    if (e == NULL) {
+        e = epoch_register();
+    }
+    if (e->depth++ == 0) {
+        __atomic_store_n(&e->epoch, __atomic_load_n(&epoch_global, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        /* Our announcement must be visible before we load anything that
+         * we then rely on not being freed. */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+static inline void
+epoch_exit(void)
+{
+    struct epoch_thread* e = epoch_self;
+
+    if (--e->depth == 0) {
+        __atomic_store_n(&e->epoch, 0, __ATOMIC_RELEASE);
+    }
+}
+
+/* Arranges for fn(p) to be called once no thread can still be using p,
+ * which must already be unreachable for anybody not yet using it. */
+void
+epoch_retire(void (*fn)(void*), void* p);
+
+/* Reclaims everything retired straight away.  Like plc_tag_shutdown(),
+ * this is NOT thread safe: nothing else may be using the library. */
+void
+epoch_shutdown(void);
+
+#endif
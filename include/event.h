@@ -0,0 +1,27 @@
+#ifndef _EVENT_H_
+#define _EVENT_H_
+
+#include "plcstub.h"
+#include "stats.h"
+
+/* 
+ * Delivers a tag event to cb.  In the default, deferred mode the event is
+ * pushed onto a lock-free queue and delivered later by a dedicated
+ * dispatcher thread, so it's cheap to post events with a tag's mutex held;
+ * callbacks then run without any of the library's locks.  In inline mode
+ * (see plcstub_set_event_mode()) cb is called straight away, by the
+ * posting thread.
+ *
+ * Events are delivered in the order they were posted.  Each is counted as
+ * a callback against tag_id (see stats.h).
+ */
+void
+event_post(tag_callback_func cb, int32_t tag_id, int event, int status);
+
+/* Delivers everything still queued and stops the dispatcher, putting the
+ * event mode and batch callback back to their defaults.  It restarts on
+ * the next event_post(). */
+void
+event_shutdown(void);
+
+#endif
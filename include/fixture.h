@@ -0,0 +1,107 @@
+#ifndef _FIXTURE_H_
+#define _FIXTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gen.h"
+#include "tagtree.h"
+
+/*
+ * Tag fixtures: files describing a set of tags (and their initial values)
+ * to be created in one go, e.g. to mirror a real controller's program.
+ * $PLCSTUB_FIXTURE names one to create in place of the dummy tags at
+ * startup.  There are two forms, told apart by the binary form's magic:
+ *
+ * A text form, one tag per line, in the spirit of an L5X/CSV tag export:
+ *
+ *     # name,data type[,initial value...]
+ *     Program:Main.Speed,REAL,12.5
+ *     Line1_Counts,DINT[4],1,2,3,4
+ *     Raw_Block,16[2]
+ *
+ * where the data type is BOOL, SINT, INT, DINT, LINT, REAL or LREAL, an
+ * element size in bytes, or a UDT's members in braces (as for the udt
+ * attribute, see layout.h), optionally followed by up to three dimensions
+ * in brackets:
+ *
+ *     Grid,REAL[4,8]
+ *     Motors,{DINT,REAL,BOOL,BOOL,INT[2]}[10]
+ *
+ * Missing values are zero, and UDT tags can't be given any.  A last field
+ * of the form gen=... gives the tag a value generator (see gen.h), as the
+ * gen attribute does:
+ *
+ *     Line1_Speed,REAL,gen=sine:0:1500:600
+ *
+ * And a compact binary form (see struct fixture_header), as written by
+ * plcstub_compile_fixture(), which is mapped into memory rather than read:
+ * tags' names and payloads are used in place, straight out of the (private,
+ * copy-on-write) mapping, which stays up until tag_tree_shutdown().  It
+ * has no room for generators, which plcstub_compile_fixture() drops.
+ */
+
+#define FIXTURE_MAGIC "PLCSTUBF"
+#define FIXTURE_VERSION 2
+
+/* All offsets are from the start of the file; each payload is aligned to
+ * FIXTURE_ALIGN. */
+struct fixture_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t ntags;
+    uint64_t records_off; /* ntags struct fixture_records */
+    uint64_t names_off; /* NUL-terminated names */
+    uint64_t data_off; /* payloads */
+    uint64_t size; /* of the whole file */
+};
+
+struct fixture_record {
+    uint64_t data_off; /* from data_off */
+    uint32_t elem_size;
+    uint32_t elem_count;
+    uint32_t name_off; /* from names_off */
+    uint16_t type; /* enum tag_type + 1, or 0 if only the size is known */
+    uint16_t reserved;
+    uint32_t dims[LAYOUT_MAX_DIMS]; /* all zero for no dimensions */
+    uint32_t udt_off; /* from names_off, of the UDT's members, or FIXTURE_NO_UDT */
+};
+
+#define FIXTURE_NO_UDT UINT32_MAX
+
+/* A cache line, as for the payloads of other tags (see tagtree.h). */
+#define FIXTURE_ALIGN 64
+
+struct fixture {
+    struct tag_tree_spec* specs;
+    uint16_t* types; /* as in struct fixture_record */
+    struct gen_spec* gens; /* kind GEN_NONE for none, or NULL for none at all */
+    size_t ntags;
+    void* scratch; /* names and values parsed out of a text fixture */
+};
+
+/* Reads the fixture at path into f->specs, ready for tag_tree_bulk_create().
+ * Returns PLCTAG_STATUS_OK, or an error if the file can't be read or is
+ * malformed (in which case there's nothing to clean up). */
+int
+fixture_open(const char* path, struct fixture* f);
+
+/* Gives the tags created from f, with consecutive IDs from first, their
+ * generators. */
+void
+fixture_attach_gens(struct fixture* f, int32_t first);
+
+/* Disposes of what fixture_open() allocated, once the tags exist.  A binary
+ * fixture's mapping survives this: the tags are still using it. */
+void
+fixture_close(struct fixture* f);
+
+/* Unmaps every binary fixture, once none of the tags using them remain. */
+void
+fixture_unmap_all(void);
+
+/* Writes the text fixture at src out in binary form to dst. */
+int
+fixture_compile(const char* src, const char* dst);
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef _GEN_H_
+#define _GEN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Value generators: tags whose payloads move on their own, as a real
+ * controller's would from scan to scan.  A tag gets one with a "gen"
+ * attribute at create time, or a "gen=" field in a text fixture, e.g.
+ *
+ *     gen=ramp:lo:hi:step      lo, lo + step, ... up to hi, then lo again
+ *     gen=sine:lo:hi:period    a sine wave over [lo, hi], period scans long
+ *     gen=walk:lo:hi:step      a random walk of +/- step, kept to [lo, hi]
+ *     gen=counter:step         0, step, 2 * step, ...
+ *     gen=replay:path          the numbers in path, one per scan, looping
+ *
+ * where every parameter after the kind is optional (ramp, sine and walk
+ * default to 0:100:1, 0:100:100 and 0:100:1, counter to 1).  Every element
+ * of the tag takes the same value, converted to its type.
+ *
+ * A single ticker thread updates every generated tag once a scan (see
+ * plcstub_set_scan_rate()), a kind at a time: one pass over each kind's
+ * state, stored column by column so that the compiler can vectorise it,
+ * then one pass copying the new values into the tags' payloads, each
+ * bracketed by the tag's seqlock so that readers see all of an update or
+ * none of it.  Tags held with plc_tag_lock() are left alone until the
+ * next scan.
+ */
+
+enum gen_kind {
+    GEN_NONE,
+    GEN_RAMP,
+    GEN_SINE,
+    GEN_WALK,
+    GEN_COUNTER,
+    GEN_REPLAY,
+    GEN_NKINDS
+};
+
+/* How a generated value is stored in each element. */
+enum gen_format {
+    GEN_BOOL,
+    GEN_INT8,
+    GEN_INT16,
+    GEN_INT32,
+    GEN_INT64,
+    GEN_FLOAT32,
+    GEN_FLOAT64
+};
+
+/* A parsed generator, ready for gen_attach(). */
+struct gen_spec {
+    enum gen_kind kind;
+    enum gen_format format;
+    double lo, hi, step;
+    double* replay; /* malloc()ed values, for GEN_REPLAY */
+    size_t nreplay;
+};
+
+/* Parses a generator such as "ramp:0:10:0.5" (the value of a gen
+ * attribute) for a tag of the given type (an enum tag_type, or -1 if only
+ * elem_size is known).  Returns PLCTAG_STATUS_OK, PLCTAG_ERR_BAD_PARAM if
+ * it's malformed or the tag's type can't hold a number, or an error
+ * reading a replay file. */
+int
+gen_parse(const char* s, size_t len, int type, size_t elem_size, struct gen_spec* spec);
+
+/* Frees what gen_parse() allocated, if gen_attach() hasn't taken it. */
+void
+gen_spec_free(struct gen_spec* spec);
+
+/* Has the ticker run spec on the tag from the next scan on, starting the
+ * ticker if need be.  Takes over spec's allocations. */
+void
+gen_attach(int32_t tag_id, struct gen_spec* spec);
+
+/* Stops generating values for the tag, if anything was. */
+void
+gen_detach(int32_t tag_id);
+
+/* Tells the ticker to stop, without waiting for it to. */
+void
+gen_stop(void);
+
+/* Stops the ticker and forgets every generator, and any scan rate set. */
+void
+gen_shutdown(void);
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef _LAYOUT_H_
+#define _LAYOUT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "plcstub.h"
+
+/*
+ * The shapes of tags beyond their element size and count: the dimensions
+ * of array tags, and the layouts of user-defined types (UDTs), as a Logix
+ * controller has them.  A tag's elements are laid out row-major, so
+ * INT[2,3] is six INTs with the last index varying fastest.
+ *
+ * A UDT is a list of members of the types in enum tag_type, each of them
+ * optionally an array, such as "DINT,REAL[4],BOOL,BOOL,LINT", which is
+ * laid out by Logix's rules: each member is aligned to its own size (BOOL
+ * and SINT to a byte, INT to two and so on); consecutive BOOLs are packed
+ * into the bits of a hidden SINT, eight to a byte; BOOL arrays are packed
+ * 32 to a DINT; and the whole is padded to a multiple of four bytes (of
+ * eight, with a LINT or LREAL in it), which is its stride in arrays.
+ *
+ * Each distinct layout is interned, and numbered from 1 in the order they
+ * are first seen, which is the template instance it is listed with in
+ * @tags and over EtherNet/IP.  Layouts live until plc_tag_shutdown(), after
+ * which they are numbered afresh.
+ */
+
+#define LAYOUT_MAX_DIMS 3
+#define LAYOUT_MAX_MEMBERS 512
+#define LAYOUT_MAX_UDTS 0xfff /* template instances are 12 bits */
+
+struct udt_member {
+    enum tag_type type;
+    uint32_t count; /* elements, or 0 for a scalar */
+    uint32_t offset; /* in bytes, from the start of the structure */
+    uint8_t bit; /* of a BOOL scalar, in the byte at offset */
+};
+
+struct udt {
+    uint16_t id;
+    size_t size; /* padded: the stride of an array of them */
+    size_t nmembers;
+    char* spec; /* as given to udt_intern(), for comparison */
+    struct udt_member members[];
+};
+
+/* Parses up to LAYOUT_MAX_DIMS comma-separated dimensions, such as "2,3",
+ * into dims (zeroing those not given), returning how many there were, or -1
+ * if they're malformed or zero, or their product overflows. */
+int
+layout_parse_dims(const char* s, size_t len, uint32_t dims[LAYOUT_MAX_DIMS]);
+
+/* The number of elements that dims call for. */
+size_t
+layout_dims_count(const uint32_t dims[LAYOUT_MAX_DIMS]);
+
+/* Lays out the members listed in s, returning the layout (the same one
+ * each time for the same list), or NULL if the list is malformed or there
+ * are too many layouts already. */
+const struct udt*
+udt_intern(const char* s, size_t len);
+
+/* The layout with the given ID, or NULL. */
+const struct udt*
+udt_get(uint16_t id);
+
+/* Forgets every layout.  Nothing may still be using one. */
+void
+layout_shutdown(void);
+
+/* The CIP code for an atomic type (an enum tag_type plus one, or 0 if not
+ * known), going by the element size if the type isn't known: 0xC1 for
+ * BOOL, 0xC4 for DINT and so on, or 0 if it's not atomic at all. */
+uint16_t
+layout_type_code(uint16_t type, size_t elem_size);
+
+/* The symbol type that @tags and the Symbol class list a tag with: the
+ * CIP code of an atomic type, or bit 15 and the UDT's ID for a structure,
+ * with the number of dimensions in bits 13 and 14.  A tag of more than one
+ * element with no dimensions of its own has one, of elem_count. */
+uint16_t
+layout_symbol_type(uint16_t type, size_t elem_size, size_t elem_count, uint16_t udt,
+    const uint32_t dims[LAYOUT_MAX_DIMS]);
+
+/* The dimensions that @tags and the Symbol class list a tag with, which
+ * are all zero for a scalar. */
+void
+layout_symbol_dims(size_t elem_count, const uint32_t dims[LAYOUT_MAX_DIMS], uint32_t out[LAYOUT_MAX_DIMS]);
+
+#endif
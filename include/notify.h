@@ -0,0 +1,51 @@
+#ifndef _NOTIFY_H_
+#define _NOTIFY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "tagtree.h"
+
+/*
+ * Change notifications (see plcstub_subscribe()).  Storage that any of its
+ * handles subscribes to has a slot of its own, its notify_slot, and
+ * whatever changes its payload marks the slot dirty in a two-level bitmap:
+ * a bit per slot, and a bit per word of those.  Marking takes no locks,
+ * and costs storage that nobody subscribes to a single load.  The notifier
+ * thread visits only the slots that are marked, so it does work in
+ * proportion to how many tags change rather than how many there are, and
+ * coalesces however many changes an interval brings into one event.
+ */
+#define NOTIFY_MAX_SLOTS (1 << 20)
+
+extern uint64_t notify_dirty[NOTIFY_MAX_SLOTS / 64];
+extern uint64_t notify_summary[NOTIFY_MAX_SLOTS / 64 / 64];
+
+/* Marks store's payload as changed, if anything is watching it.  Called
+ * after the change has been made, with whatever lock made it held. */
+static inline void
+notify_mark(struct tag_store* store)
+{
+    unsigned slot = __atomic_load_n(&store->notify_slot, __ATOMIC_RELAXED);
+
+    if (slot == 0) {
+        return;
+    }
+    if (__atomic_fetch_or(&notify_dirty[slot / 64], 1ULL << (slot % 64), __ATOMIC_ACQ_REL) == 0) {
+        __atomic_fetch_or(&notify_summary[slot / 4096], 1ULL << (slot / 64 % 64), __ATOMIC_RELEASE);
+    }
+}
+
+/* Drops the tag's subscription, if it has one, returning whether it did. */
+bool
+notify_detach(int32_t tag_id);
+
+/* Tells the notifier to stop, without waiting for it to. */
+void
+notify_stop(void);
+
+/* Stops the notifier and forgets every subscription. */
+void
+notify_shutdown(void);
+
+#endif
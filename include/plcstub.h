@@ -1,12 +1,13 @@
 #ifndef _PLCSTUB_H_
 #define _PLCSTUB_H_
 
+#include <stddef.h>
 #include <stdint.h>
 #include <sys/tree.h>
 
 #define NTAGS 10
 
-#ifdef __APPLE__
+#if defined(__APPLE__) || defined(__linux__)
 typedef uintptr_t __uintptr_t;
 #endif
 
@@ -20,7 +21,8 @@ enum tag_type {
     TAG_INT,
     TAG_DINT,
     TAG_REAL,
-    TAG_LINT
+    TAG_LINT,
+    TAG_LREAL
 };
 
 struct __attribute__((packed)) metatag_t {
@@ -32,4 +34,205 @@ struct __attribute__((packed)) metatag_t {
     char data[0];
 };
 
+/* Stub extensions to the libplctag API. */
+
+/* Copies len bytes at offset out of (or into) a tag's buffer in one go,
+ * rather than element by element.  Returns a PLCTAG_STATUS/PLCTAG_ERR code. */
+int
+plc_tag_get_raw(int32_t tag, int offset, void* buf, int len);
+int
+plc_tag_set_raw(int32_t tag, int offset, const void* buf, int len);
+
+/* Copies count consecutive elements, starting at offset, out of (or into) a
+ * tag's buffer, converting each between the controller's little-endian
+ * order and the host's, with one lookup, one lock and one pair of events
+ * for the lot.  Returns a PLCTAG_STATUS/PLCTAG_ERR code. */
+int
+plc_tag_get_uint64_array(int32_t tag, int offset, uint64_t* buf, int count);
+int
+plc_tag_set_uint64_array(int32_t tag, int offset, const uint64_t* buf, int count);
+int
+plc_tag_get_int64_array(int32_t tag, int offset, int64_t* buf, int count);
+int
+plc_tag_set_int64_array(int32_t tag, int offset, const int64_t* buf, int count);
+int
+plc_tag_get_uint32_array(int32_t tag, int offset, uint32_t* buf, int count);
+int
+plc_tag_set_uint32_array(int32_t tag, int offset, const uint32_t* buf, int count);
+int
+plc_tag_get_int32_array(int32_t tag, int offset, int32_t* buf, int count);
+int
+plc_tag_set_int32_array(int32_t tag, int offset, const int32_t* buf, int count);
+int
+plc_tag_get_uint16_array(int32_t tag, int offset, uint16_t* buf, int count);
+int
+plc_tag_set_uint16_array(int32_t tag, int offset, const uint16_t* buf, int count);
+int
+plc_tag_get_int16_array(int32_t tag, int offset, int16_t* buf, int count);
+int
+plc_tag_set_int16_array(int32_t tag, int offset, const int16_t* buf, int count);
+int
+plc_tag_get_uint8_array(int32_t tag, int offset, uint8_t* buf, int count);
+int
+plc_tag_set_uint8_array(int32_t tag, int offset, const uint8_t* buf, int count);
+int
+plc_tag_get_int8_array(int32_t tag, int offset, int8_t* buf, int count);
+int
+plc_tag_set_int8_array(int32_t tag, int offset, const int8_t* buf, int count);
+int
+plc_tag_get_float64_array(int32_t tag, int offset, double* buf, int count);
+int
+plc_tag_set_float64_array(int32_t tag, int offset, const double* buf, int count);
+int
+plc_tag_get_float32_array(int32_t tag, int offset, float* buf, int count);
+int
+plc_tag_set_float32_array(int32_t tag, int offset, const float* buf, int count);
+
+/* The same for count elements of the given type (any but TAG_BOOL), as
+ * floats in engineering units: each raw value x gets as x * scale + bias,
+ * and a float v sets the nearest value of the type to (v - bias) / scale,
+ * saturating at the type's limits.  E.g. scale = 100.0f / 27648 reads a
+ * 4-20 mA input's INT counts as percentages.  The conversion is vectorised
+ * where the CPU allows (see convert.h). */
+int
+plc_tag_get_scaled(int32_t tag, int offset, enum tag_type type, float* buf, int count, float scale, float bias);
+int
+plc_tag_set_scaled(int32_t tag, int offset, enum tag_type type, const float* buf, int count, float scale,
+    float bias);
+
+/* One element of a scatter/gather access: the value of the given type at
+ * offset within tag_id is copied into (or out of) buf, and the outcome left
+ * in status. */
+struct plc_tag_access {
+    int32_t tag_id;
+    int offset;
+    enum tag_type type;
+    void* buf;
+    int status;
+};
+
+/* Performs a batch of accesses across any number of tags, looking up and
+ * locking each distinct tag only once (and delivering one pair of events
+ * to its callback, if it has one).  Returns PLCTAG_STATUS_OK if every access
+ * succeeded, otherwise the first failing access's status. */
+int
+plc_tag_get_multi(struct plc_tag_access* accesses, int n);
+int
+plc_tag_set_multi(struct plc_tag_access* accesses, int n);
+
+/* Parameters of a simulated connection (see conn.h).  All times are in
+ * microseconds; zero values disable that part of the model. */
+enum plcstub_jitter {
+    PLCSTUB_JITTER_UNIFORM, /* uniform on [0, jitter_us) */
+    PLCSTUB_JITTER_NORMAL, /* |N(0, jitter_us)| */
+    PLCSTUB_JITTER_EXPONENTIAL /* exponential with mean jitter_us */
+};
+
+struct plcstub_conn_params {
+    long latency_us; /* fixed round-trip time */
+    long jitter_us;
+    enum plcstub_jitter jitter;
+    size_t packet_size; /* bytes of tag data per packet */
+    long packet_us; /* processing cost per packet */
+    double bytes_per_sec; /* link byte-rate cap */
+};
+
+/* Sets the parameters of the connection that tags created with the given
+ * gateway and path use, or (if gateway is "*") of connections that have no
+ * parameters of their own.  Only affects tags created afterwards.  This can
+ * also be done with $PLCSTUB_CONN; see the README. */
+int
+plcstub_set_conn_params(const char* gateway, const char* path, const struct plcstub_conn_params* params);
+
+/* How tag callbacks are invoked.  Deferred (the default, unless
+ * $PLCSTUB_EVENTS is "inline") hands events to a dispatcher thread, so that
+ * callbacks never run with any of the library's locks held.  Inline calls
+ * them there and then, with the tag locked, for deterministic tests. */
+#define PLCSTUB_EVENTS_DEFERRED 0
+#define PLCSTUB_EVENTS_INLINE 1
+
+int
+plcstub_set_event_mode(int mode);
+
+struct plcstub_event {
+    int32_t tag_id;
+    int event;
+    int status;
+};
+
+typedef void (*plcstub_batch_callback_func)(const struct plcstub_event* events, int count);
+
+/* In deferred mode, has the dispatcher hand events to cb up to max_batch at
+ * a time, in place of the tags' own callbacks (which still have to be
+ * registered for a tag to generate events at all).  A NULL cb goes back to
+ * calling each tag's callback. */
+int
+plcstub_set_event_batch_callback(plcstub_batch_callback_func cb, int max_batch);
+
+/* Waits until every event posted so far has been delivered. */
+void
+plcstub_flush_events(void);
+
+/* Raised on a subscribed tag's callback when its value has changed. */
+#define PLCSTUB_EVENT_CHANGED (100)
+
+/* Subscribes the tag's callback (which has to be registered for anything
+ * to be delivered) to PLCSTUB_EVENT_CHANGED, raised no more than once
+ * every interval_ms, however many times the value has changed in the
+ * meantime.  Changes of REAL and LREAL tags that leave every element
+ * within deadband of what it was at the last event don't count.  For a
+ * buffered tag, it's the snapshot written by plc_tag_write() that's
+ * watched.  Subscribing again changes the interval and deadband. */
+int
+plcstub_subscribe(int32_t tag, int interval_ms, double deadband);
+
+int
+plcstub_unsubscribe(int32_t tag);
+
+/* Log messages are buffered and written out (or handed to the logger
+ * registered with plc_tag_register_logger()) by a background thread; this
+ * waits until everything logged so far has been. */
+void
+plcstub_flush_log(void);
+
+/* How often, in milliseconds, tags with value generators (see the "gen"
+ * attribute in the README) are updated.  Defaults to $PLCSTUB_SCAN_MS, or
+ * 100. */
+int
+plcstub_set_scan_rate(int ms);
+
+/* Creates every tag in a fixture file (see $PLCSTUB_FIXTURE in the README),
+ * with consecutive IDs.  Returns the first of them, or an error having
+ * created none. */
+int32_t
+plcstub_load_fixture(const char* path);
+
+/* Converts a text fixture to the binary form, which loads faster. */
+int
+plcstub_compile_fixture(const char* src, const char* dst);
+
+/* Removes the shared-memory segment of the given name (see $PLCSTUB_SHM in
+ * the README), and with it every tag kept there, once nothing has it
+ * attached any more. */
+int
+plcstub_shm_remove(const char* name);
+
+/* Records every tag created or destroyed, every plc_tag_read() and
+ * plc_tag_write(), and every typed access, to a trace file at path, until
+ * plcstub_trace_stop() (or exit).  Cheap enough to leave on: see the README
+ * for the format.  This can also be done with $PLCSTUB_TRACE. */
+int
+plcstub_trace_start(const char* path);
+
+int
+plcstub_trace_stop(void);
+
+/* Makes the calls recorded in a trace again, in the order they were made,
+ * from this thread.  With a speed of 1 they're made with the same timing as
+ * they were recorded with, 2 twice as fast and so on; with 0, as fast as
+ * they can be.  Tags created in the trace are created again, with their
+ * IDs mapped to the new ones.  Returns the number of calls made. */
+int
+plcstub_trace_replay(const char* path, double speed);
+
 #endif
\ No newline at end of file
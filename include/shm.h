@@ -0,0 +1,61 @@
+#ifndef _SHM_H_
+#define _SHM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "tagtree.h"
+
+/*
+ * Shared-memory mode.  With $PLCSTUB_SHM naming a POSIX shared-memory
+ * segment, tag storage is kept there rather than in the process, so that
+ * every process pointed at the same segment sees the same simulated PLC.
+ * The segment holds a hash directory of its tags by (gateway, path, name)
+ * and, for each, a struct tag_store (with process-shared mutex and
+ * condition variable, and the tag's seqlock) and its payload.  Everything
+ * in it refers to everything else by offset from the start of the
+ * segment, since it's mapped at a different address in each process;
+ * handles find the payload and name from the store's data_off and
+ * name_off.  Storage in the segment lasts as long as the segment does,
+ * however many handles onto it come and go.
+ *
+ * Tag IDs, handles, @tags and subscriptions stay private to each process,
+ * just as a real PLC's clients each have their own, and so do buffered
+ * tags, whose handles hold payloads of their own anyway.
+ */
+
+/* Folded into the identities of plc_tag_lock() holders (see plcstub.c)
+ * so that threads in different processes never look alike; 0 unless a
+ * segment is attached. */
+extern uintptr_t shm_proc_id;
+
+/* This process's ID, while a segment is attached, for telling whether a
+ * plc_tag_lock() holder's process still exists; 0 otherwise. */
+extern pid_t shm_pid;
+
+/* Attaches the segment named by $PLCSTUB_SHM, if there is one, creating
+ * it if need be.  Fatal if it can't be.  Returns whether one is attached. */
+bool
+shm_attach(void);
+
+/* Finds the tag described by spec in the segment, creating it if it isn't
+ * there (unless spec is for an existing tag), and sets *store to its
+ * storage.  Returns 0 on success, 1 if it exists with a different shape
+ * (so has to be given storage in the process instead) or isn't there to be
+ * found, or -1 if the segment is full.
+ *
+ * Assumes that a segment is attached and spec isn't for a buffered tag.
+ */
+int
+shm_store_get(const struct tag_tree_spec* spec, uint64_t hash, struct tag_store** store);
+
+/* Where a shared store's data_off or name_off points in this process. */
+void*
+shm_ptr(uint64_t off);
+
+/* Detaches the segment, leaving it for other processes (and next time). */
+void
+shm_detach(void);
+
+#endif
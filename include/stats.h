@@ -0,0 +1,145 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Counters of what clients do to the library, readable through
+ * plc_tag_get_int_attribute() as "stat.<name>", for a tag or (with tag ID
+ * 0) for the library as a whole.
+ *
+ * Every count is kept per thread, in records that only their own thread
+ * writes, and summed when read, so counting costs no more than a store to
+ * a line that nobody else touches, and none is ever lost.  Besides its
+ * share of the global counts, each thread's record has a table of counts
+ * for each tag handle it has used, indexed by the handle's slot (as the
+ * tag table is; see tagtree.h) and made on demand, a chunk of slots at a
+ * time.  An entry is for one tag ID, and is started afresh when a thread
+ * first counts against another ID in the same slot.
+ */
+
+#define STATS_MAP                                                                    \
+    /* X(id, name) */                                                                \
+    X(STAT_READS, "reads") /* accesses reading the tag's data */                     \
+    X(STAT_WRITES, "writes") /* accesses changing the tag's data */                  \
+    X(STAT_BYTES, "bytes") /* bytes copied by those accesses */                      \
+    X(STAT_BOUNDS_ERRORS, "bounds_errors") /* accesses out of bounds */              \
+    X(STAT_CALLBACKS, "callbacks") /* events delivered to callbacks */              \
+    X(STAT_LOCK_WAIT_NS, "lock_wait_ns") /* time spent waiting on a tag's locks */   \
+    X(STAT_READ_REQUESTS, "read_requests") /* plc_tag_read() calls */                \
+    X(STAT_WRITE_REQUESTS, "write_requests") /* plc_tag_write() calls */             \
+    X(STAT_METATAG_REBUILDS, "metatag_rebuilds") /* compactions of @tags */
+
+enum stats_counter {
+#define X(id, name) id,
+    STATS_MAP
+#undef X
+    STAT_COUNT
+};
+
+/* As TAG_ID_SLOT_BITS. */
+#define STATS_SLOT_BITS 24
+#define STATS_CHUNK_BITS 10
+#define STATS_CHUNK_SIZE (1 << STATS_CHUNK_BITS)
+#define STATS_CHUNK_MASK (STATS_CHUNK_SIZE - 1)
+#define STATS_NCHUNKS (1 << (STATS_SLOT_BITS - STATS_CHUNK_BITS))
+
+/* A thread's counts for one tag handle. */
+struct stats_tag {
+    int32_t tag_id; /* whose counts these are, or 0 */
+    uint64_t count[STAT_COUNT];
+};
+
+/* A thread's share of the global counts, and its counts for each tag. */
+struct stats_thread {
+    uint64_t count[STAT_COUNT];
+    bool in_use; /* claimed by a live thread */
+    struct stats_tag** tags; /* STATS_NCHUNKS chunks, or NULL until needed */
+    struct stats_thread* next;
+} __attribute__((aligned(64)));
+
+extern _Thread_local struct stats_thread* stats_self;
+
+struct stats_thread*
+stats_register(void);
+
+/* Finds or starts st's entry for the tag: the slow part of counting
+ * against a tag for the first time. */
+uint64_t*
+stats_tag_claim(struct stats_thread* st, int32_t tag_id);
+
+/* The calling thread's counts for the tag. */
+static inline uint64_t*
+stats_tag_counts(struct stats_thread* st, int32_t tag_id)
+{
+    uint32_t slot = (uint32_t)(tag_id) & ((1U << STATS_SLOT_BITS) - 1);
+    struct stats_tag* e;
+
+    if (st->tags == NULL || (e = st->tags[slot >> STATS_CHUNK_BITS]) == NULL
+        || e[slot & STATS_CHUNK_MASK].tag_id != tag_id) {
+        return stats_tag_claim(st, tag_id);
+    }
+    return e[slot & STATS_CHUNK_MASK].count;
+}
+
+static inline struct stats_thread*
+stats_me(void)
+{
+    struct stats_thread* st = stats_self;
+
+    return st != NULL ? st : stats_register();
+}
+
+/* Counts n more of s, globally and against the tag (unless tag_id is 0). */
+static inline void
+stats_add(int32_t tag_id, enum stats_counter s, uint64_t n)
+{
+    struct stats_thread* st = stats_me();
+    uint64_t* tc;
+
+    __atomic_store_n(&st->count[s], st->count[s] + n, __ATOMIC_RELAXED);
+    if (tag_id != 0) {
+        tc = stats_tag_counts(st, tag_id);
+        __atomic_store_n(&tc[s], tc[s] + n, __ATOMIC_RELAXED);
+    }
+}
+
+/* Counts one access of s (STAT_READS or STAT_WRITES) moving width bytes:
+ * stats_add() twice over, for the hot paths. */
+static inline void
+stats_add_access(int32_t tag_id, enum stats_counter s, uint64_t width)
+{
+    struct stats_thread* st = stats_me();
+    uint64_t* tc = stats_tag_counts(st, tag_id);
+
+    __atomic_store_n(&st->count[s], st->count[s] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->count[STAT_BYTES], st->count[STAT_BYTES] + width, __ATOMIC_RELAXED);
+    __atomic_store_n(&tc[s], tc[s] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&tc[STAT_BYTES], tc[STAT_BYTES] + width, __ATOMIC_RELAXED);
+}
+
+/* The global count of s, so far. */
+uint64_t
+stats_global(enum stats_counter s);
+
+/* The count of s for the tag, so far, summed over every thread. */
+uint64_t
+stats_tag(int32_t tag_id, enum stats_counter s);
+
+/* Zeroes the global counts and forgets every tag's (the records
+ * themselves are kept, for their threads to go on using).  Nothing may be
+ * counting meanwhile. */
+void
+stats_reset(void);
+
+/* The counter called name (without the "stat." prefix), or -1 if there
+ * isn't one. */
+int
+stats_find(const char* name);
+
+/* The time on the monotonic clock, in nanoseconds, for timing waits. */
+uint64_t
+stats_now_ns(void);
+
+#endif
@@ -1,47 +1,333 @@
 #ifndef _TAGTREE_H_
 #define _TAGTREE_H_
 
+#include "attr.h"
+#include "layout.h"
 #include "plcstub.h"
+#include "stats.h"
 
 #include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+#include <stdbool.h>
 #include <string.h>
 
 /* The tag ID for the "@tag" metatag. */
 #define METATAG_ID 1
 
+struct conn;
+
+/* The alignment of tags' payloads (and of each snapshot of a buffered
+ * tag's), wherever they're kept: a cache line. */
+#define TAG_DATA_ALIGN 64
+
+/* The most snapshots a buffered tag (see tag_tree_spec) can have. */
+#define TAG_STORE_MAX_BUFS 3
+
+/*
+ * The storage behind a tag: its payload, and what guards it.  Creating the
+ * same name on the same gateway and path again doesn't make another one,
+ * but another handle (a tag_tree_node, with its own ID) onto this, found
+ * through a hash index on (gateway, path, name); see tagtree.c.
+ */
+struct tag_store {
+    /* Protects the payload and the state of every handle onto it (their
+     * in-flight operations, see async.h).  cond is signalled whenever any
+     * of that state changes or plc_tag_lock() is released. */
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+
+    /* Seqlock over data: odd while a writer, or a holder of plc_tag_lock(),
+     * may be changing it, so that readers who don't take mtx know to retry
+     * or fall back to it.  Only changed with mtx held. */
+    unsigned seq;
+
+    /* The thread holding plc_tag_lock() on the tag, through any of its
+     * handles, and how many times over; protected by mtx.  While it's set,
+     * other threads wait on cond before touching data. */
+    const void* lock_owner;
+    int lock_depth;
+    pid_t lock_pid; /* the holder's process, for storage in the segment */
+
+    /* How many of its handles' operations came due while it was locked,
+     * and are waiting for it to be released, and whether the lock's holder
+     * is waiting on one (see async.h); protected by mtx. */
+    int nparked;
+    int holder_waiting;
+
+    /* The handles onto this storage, and its place in the index (if it's
+     * in it: a tag created with a different shape from an existing one of
+     * the same name gets storage of its own).  Protected by tag_tree_mtx. */
+    int refs;
+    bool indexed;
+    uint64_t hash;
+    struct tag_store* next;
+
+    /* The key: NUL-terminated, and never changed. */
+    const char* gateway;
+    const char* path;
+    char* name;
+
+    /* of length (elem_size * elem_count), which never change either.
+     * NULL for a buffered tag, whose handles have payloads of their own. */
+    char* data;
+    size_t elem_size;
+    size_t elem_count;
+
+    /* The enum tag_type of the elements plus one, or 0 if not known, and
+     * the array dimensions and UDT layout (see layout.h), if any, as given
+     * when the storage was created.  UDT IDs are the creating process's
+     * own, even for storage in the shared segment. */
+    uint16_t type;
+    uint16_t udt;
+    uint32_t dims[LAYOUT_MAX_DIMS];
+
+    /* Where changes to the payload are marked, if anything subscribes to
+     * them (see notify.h), or 0. */
+    unsigned notify_slot;
+
+    /* For a buffered tag, the PLC's side of the payload: nbufs snapshots
+     * of it, of which snap is the current one, and the readers copying
+     * out of each.  A new snapshot is written into one that is neither
+     * current nor pinned by a reader, with snap_mtx held, then published
+     * by swapping snap, so readers take no lock and never see one half
+     * written.  Handles copy to and from them in plc_tag_write() and
+     * plc_tag_read() (see tag_store_push() and tag_store_pull()).
+     * snap_mtx may be taken with mtx held, but not the other way around. */
+    int nbufs;
+    int snap;
+    unsigned pins[TAG_STORE_MAX_BUFS];
+    char* bufs[TAG_STORE_MAX_BUFS];
+    pthread_mutex_t snap_mtx;
+
+    /* Size of the arena allocation holding this. */
+    size_t alloc_size;
+
+    /* Set if data and name are borrowed from memory that outlives the
+     * storage (a mapped fixture, see fixture.h) rather than being owned by
+     * it. */
+    bool borrowed;
+
+    /* Set for storage in the shared segment (see shm.h), which is never
+     * freed, and whose data and name pointers would mean nothing in other
+     * processes: the payload and name are at data_off and name_off in it
+     * instead, and refs, hash chains and the rest of the per-process
+     * bookkeeping go unused. */
+    bool shared;
+    uint64_t data_off;
+    uint64_t name_off;
+
+    /* The payload followed by the NUL-terminated name, gateway and path,
+     * allocated along with the rest.  Payloads start on a cache line. */
+    char storage[0] __attribute__((aligned(TAG_DATA_ALIGN)));
+};
+
+/* A handle onto a tag: what a tag ID refers to. */
 struct tag_tree_node {
     RB_ENTRY(tag_tree_node)
     rb_entry;
     int tag_id;
-    char* name; /* TODO: TAG_BASE_STRUCT doesn't contain a name: where does the name live? */
     tag_callback_func cb;
-    pthread_mutex_t mtx;
+    struct tag_store* store;
 
+    /* Copies of the store's, which never change (except for the metatag,
+     * whose mutex covers them).  A handle onto a buffered tag has data of
+     * its own, allocated along with it, which store->mtx still covers. */
+    char* name; /* TODO: TAG_BASE_STRUCT doesn't contain a name: where does the name live? */
+    char* data;
     size_t elem_size;
     size_t elem_count;
 
-    /* of length (elem_size * elem_count) 
-     * TODO: can this buffer ever be resized?  If not, let's make it a char[0] and save
-     * an allocation. */
-    char* data;
+    /* State of the simulated in-flight operation (see async.h), protected
+     * by store->mtx. */
+    int status;
+    int op;
+    uint64_t op_seq;
+    int nwaiters; /* threads blocked on the operation */
+    bool parked; /* waiting for plc_tag_lock() to be released */
+
+    /* The simulated connection this tag is read and written over (NULL for
+     * the default one). */
+    struct conn* conn;
+
+    /* Where this tag's record lives in the metatag's data, for tombstoning. */
+    size_t meta_off;
+
+    /* Size of the arena allocation holding this. */
+    size_t alloc_size;
 };
 
-struct tag_tree_node*
-tag_tree_metanode_create();
+/* 
+ * Dense, ID-indexed view of the tag tree, used for lookups.  The RB tree in
+ * tagtree.c remains the authoritative ordered set (we walk it to build the
+ * metatag), and both are only ever mutated with the tree's lock held for
+ * writing.  Readers index the table without taking any lock at all.
+ *
+ * The table is two-level so that growing it never moves a slot that a
+ * concurrent reader might be looking at: chunks are allocated on demand
+ * and are never freed or resized once published.
+ *
+ * A tag ID is its slot in the table (the low TAG_ID_SLOT_BITS bits) plus
+ * the generation of the slot (the bits above, short of the sign bit),
+ * which goes up each time the slot is reused.  So a stale ID, whose slot
+ * has since been given to another tag, is just one that doesn't match the
+ * tag found in the slot, rather than an alias for it.
+ */
+#define TAG_ID_SLOT_BITS 24
+#define TAG_ID_SLOT_MASK ((1 << TAG_ID_SLOT_BITS) - 1)
+#define TAG_ID_GEN_MASK 0x7f
+#define TAG_ID_NSLOTS (1 << TAG_ID_SLOT_BITS)
+#if TAG_ID_SLOT_BITS != STATS_SLOT_BITS
+#error "stats.h indexes its tag counts by slot too"
+#endif
 
-struct tag_tree_node*
-tag_tree_node_create();
+#define TAG_TABLE_CHUNK_BITS 12
+#define TAG_TABLE_CHUNK_SIZE (1 << TAG_TABLE_CHUNK_BITS)
+#define TAG_TABLE_CHUNK_MASK (TAG_TABLE_CHUNK_SIZE - 1)
+#define TAG_TABLE_NCHUNKS (1 << (TAG_ID_SLOT_BITS - TAG_TABLE_CHUNK_BITS))
+
+extern struct tag_tree_node** tag_table[TAG_TABLE_NCHUNKS];
+extern bool tag_tree_ready;
+
+static inline struct tag_tree_node*
+tag_table_get(int32_t tag_id)
+{
+    struct tag_tree_node **chunk, *tag;
+    int32_t slot = tag_id & TAG_ID_SLOT_MASK;
+
+    if (tag_id <= 0) {
+        return NULL;
+    }
+
+    chunk = __atomic_load_n(&tag_table[slot >> TAG_TABLE_CHUNK_BITS], __ATOMIC_ACQUIRE);
+    if (chunk == NULL) {
+        return NULL;
+    }
+
+    tag = __atomic_load_n(&chunk[slot & TAG_TABLE_CHUNK_MASK], __ATOMIC_ACQUIRE);
+    return (tag != NULL && tag->tag_id == tag_id) ? tag : NULL;
+}
 
 void
-tag_tree_node_destroy(struct tag_tree_node*);
+tag_tree_init(void);
+
+struct tag_tree_spec;
+
+struct tag_tree_node*
+tag_tree_node_create(const struct tag_tree_spec* spec);
 
 struct tag_tree_node*
 tag_tree_lookup(int32_t tag_id);
 
-int
-tag_tree_insert(struct tag_tree_node* node);
+/* The same as tag_tree_lookup(), but inlinable into hot paths: once the
+ * tree is up, looking up anything but the metatag is just a table load. */
+static inline struct tag_tree_node*
+tag_tree_lookup_fast(int32_t tag_id)
+{
+    if (tag_id == METATAG_ID || !__atomic_load_n(&tag_tree_ready, __ATOMIC_ACQUIRE)) {
+        return tag_tree_lookup(tag_id);
+    }
+    return tag_table_get(tag_id);
+}
+
+/* A tag for tag_tree_node_create() or tag_tree_bulk_create() to create. */
+struct tag_tree_spec {
+    const char* name;
+    /* The length of name, which needn't be NUL-terminated unless borrowed. */
+    size_t name_len;
+    /* Where the tag lives; missing meaning "". */
+    struct attr_span gateway;
+    struct attr_span path;
+    size_t elem_size;
+    size_t elem_count;
+    /* The enum tag_type of the elements plus one, or 0 if not known. */
+    uint16_t type;
+    /* The UDT layout of each element, or 0, and the array dimensions, or
+     * all zeroes: see layout.h.  Neither changes the size, which still has
+     * to be given in elem_size and elem_count. */
+    uint16_t udt;
+    uint32_t dims[LAYOUT_MAX_DIMS];
+    /* Take the shape of an existing tag of the same name, if there is one,
+     * rather than elem_size and elem_count. */
+    bool any_shape;
+    /* The connection the tag is read and written over (NULL for the
+     * default one). */
+    struct conn* conn;
+    /* The initial payload, or NULL for zeroes. */
+    const void* init;
+    /* Use name and init in place rather than copying them; they must stay
+     * put (and init writable) for as long as the tag exists. */
+    bool borrow;
+    /* Between 2 and TAG_STORE_MAX_BUFS for a buffered tag, or 0: see
+     * struct tag_store.  Never along with borrow. */
+    int nbufs;
+    /* Only make another handle onto an existing tag: if there isn't one
+     * that fits, create nothing. */
+    bool existing;
+};
+
+/* Creates n tags at once, with consecutive IDs, taking the tree's lock only
+ * once.  Returns the first ID, or an error (having created nothing) if any
+ * of the tags is too large or there's no room for them all. */
+int32_t
+tag_tree_bulk_create(const struct tag_tree_spec* specs, size_t n);
 
 int
 tag_tree_remove(int32_t tag_id);
 
+/* Starts a new snapshot of a buffered tag, returning the buffer to fill in
+ * and publish with tag_store_publish(); snap_mtx is held in between. */
+char*
+tag_store_stage(struct tag_store* store);
+
+void
+tag_store_publish(struct tag_store* store, char* buf);
+
+/* Copies a buffered tag's current snapshot into t's payload, or t's
+ * payload out as its next snapshot.
+ *
+ * Assume that t->store->mtx is held.
+ */
+void
+tag_store_pull(struct tag_tree_node* t);
+
+void
+tag_store_push(struct tag_tree_node* t);
+
+void
+tag_store_recover(struct tag_store* store, int ret);
+
+/* Takes store->mtx.  Storage in the shared segment (see shm.h) has robust
+ * mutexes, so that a process dying with one held doesn't wedge the tag for
+ * the rest: whoever takes it next puts right what was left (see
+ * tag_store_reap()) and carries on. */
+static inline void
+tag_store_lock(struct tag_store* store)
+{
+    int ret = pthread_mutex_lock(&store->mtx);
+
+    if (ret != 0) {
+        tag_store_recover(store, ret);
+    }
+}
+
+/* Waits on store->cond, which store->mtx is held for, until deadline (on
+ * CLOCK_MONOTONIC) if it isn't NULL.  Returns 0 or ETIMEDOUT. */
+int
+tag_store_wait(struct tag_store* store, const struct timespec* deadline);
+
+/* Puts right a shared store whose plc_tag_lock() holder's process has
+ * died, releasing the lock (or, if owner_died, whose mutex's holder did,
+ * leaving seq odd), waking anybody waiting.  Returns whether there was
+ * anything to do.  Assumes that store->mtx is held. */
+bool
+tag_store_reap(struct tag_store* store, bool owner_died);
+
+/* Copies a buffered tag's current snapshot to dst, taking no locks. */
+void
+tag_store_snapshot(struct tag_store* store, char* dst);
+
+void
+tag_tree_shutdown(void);
+
 #endif
\ No newline at end of file
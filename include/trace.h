@@ -0,0 +1,110 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Recording of what clients do to tags (see plcstub_trace_start()), for
+ * plcstub_trace_replay() to do again later.  A trace is a file of fixed-size
+ * records: one per plc_tag_create(), plc_tag_destroy(), plc_tag_read() and
+ * plc_tag_write() call and per typed accessor or mutator call, an access's
+ * value included.  (Raw and scatter/gather accesses, and the rest of the
+ * stub's extensions, aren't recorded.)
+ *
+ * As with logging (see debug.c), each thread appends records to a ring of
+ * its own, with no locks and no syscalls beyond reading the clock, and the
+ * tracer thread drains every ring into the file, which it has mapped.  A
+ * thread whose ring is full drops the record rather than wait, counting it
+ * in the file's header, so recording never stalls the client.  Records from
+ * different threads land in the file out of order; they're sorted by time
+ * when they're replayed.
+ */
+
+/* The typed accessors, by the name they go by in plc_tag_get_<name>(): the
+ * GETTER() and SETTER() expansions in plcstub.c, and the types of trace
+ * records' values.  All but bit have array forms too, in ARRAYMAP. */
+#define TYPEMAP        \
+/* X(name, type) */    \
+X(bit, int)            \
+ARRAYMAP
+
+#define ARRAYMAP       \
+X(uint64, uint64_t)    \
+X(int64, int64_t)      \
+X(uint32, uint32_t)    \
+X(int32, int32_t)      \
+X(uint16, uint16_t)    \
+X(int16, int16_t)      \
+X(uint8, uint8_t)      \
+X(int8, int8_t)        \
+X(float64, double)     \
+X(float32, float)
+
+enum trace_type {
+#define X(name, type) TRACE_TYPE_##name,
+    TYPEMAP
+#undef X
+    TRACE_TYPE_COUNT
+};
+
+enum trace_op {
+    TRACE_OP_NONE, /* the unused end of the file */
+    TRACE_OP_CREATE, /* followed by the attribute string (see below) */
+    TRACE_OP_DESTROY,
+    TRACE_OP_READ,
+    TRACE_OP_WRITE,
+    TRACE_OP_GET,
+    TRACE_OP_SET,
+};
+
+#define TRACE_MAGIC "PLCTRACE"
+#define TRACE_VERSION 1
+
+/* The first record's worth of the file. */
+struct trace_header {
+    char magic[8];
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t dropped; /* records that didn't fit in their thread's ring */
+    uint64_t start_ns; /* CLOCK_REALTIME, when recording started */
+    uint64_t nrecords; /* written so far, continuations included */
+};
+
+struct trace_record {
+    uint64_t t_ns; /* since recording started */
+    int32_t tag_id; /* for TRACE_OP_CREATE, the ID it returned */
+    uint8_t op; /* enum trace_op */
+    uint8_t type; /* enum trace_type, for TRACE_OP_GET and TRACE_OP_SET */
+    uint16_t len; /* for TRACE_OP_CREATE, the attribute string's length */
+    int32_t arg; /* the offset accessed, or the timeout */
+    int32_t status; /* what the call returned (a getter's value aside) */
+    uint64_t value; /* the value got or set, zero-extended */
+};
+
+/* A TRACE_OP_CREATE record is followed by enough more to hold len bytes of
+ * attribute string, unterminated, which is cut short at this length. */
+#define TRACE_MAX_ATTRIB 1024
+#define TRACE_CONT(len) (((len) + sizeof(struct trace_record) - 1) / sizeof(struct trace_record))
+
+extern int trace_on;
+
+static inline bool
+trace_enabled(void)
+{
+    return __builtin_expect(__atomic_load_n(&trace_on, __ATOMIC_RELAXED), 0);
+}
+
+/* Records a call, if recording (which the caller should have checked with
+ * trace_enabled(), to keep the cost of not recording to a load). */
+void
+trace_call(enum trace_op op, int32_t tag_id, enum trace_type type, int32_t arg, int32_t status, uint64_t value);
+
+void
+trace_create(const char* attrib, int timeout, int32_t ret);
+
+/* Starts recording to $PLCSTUB_TRACE, if it's set. */
+void
+trace_init(void);
+
+#endif
@@ -0,0 +1,324 @@
+/* plcstub-server.c
+ *
+ * Serves the stub's tags over EtherNet/IP (see cip.h), so that unmodified
+ * clients, linked against the real libplctag, can be pointed at it in
+ * place of a controller, e.g. with gateway=127.0.0.1&path=1,0.
+ *
+ * Usage: plcstub-server [-a address] [-p port] [-t threads] [-f fixture]
+ *                       [-g gateway] [-P path]
+ *
+ * Each of the threads has an epoll instance and a listening socket of its
+ * own (with SO_REUSEPORT, so that the kernel spreads connections across
+ * them), and owns the connections it accepts.  Every complete request that
+ * a read brings in is handled before any replies are written, and their
+ * replies go out together, so a client pipelining requests, or batching
+ * them in Multiple Service Packets, costs a syscall or two per batch.
+ *
+ * The tags are the stub's usual ones: the dummies, $PLCSTUB_FIXTURE or
+ * those in the -f fixture, and $PLCSTUB_SHM shares them with other
+ * processes using the stub.  Names are looked up with the given gateway
+ * and path, "" by default.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "cip.h"
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+
+#define SERVER_MAX_THREADS 64
+#define SERVER_MAX_EVENTS 64
+/* The biggest request there can be: its length is 16 bits. */
+#define SERVER_IN_SIZE (CIP_ENCAP_HEADER + 65535)
+
+struct server_conn {
+    int fd;
+    struct cip_session session;
+    uint8_t* in;
+    size_t in_len;
+    uint8_t* out;
+    size_t out_off, out_len, out_cap;
+    bool writing; /* waiting for EPOLLOUT */
+};
+
+static const char* address = "0.0.0.0";
+static int port = CIP_PORT;
+static int nthreads = 1;
+static const char* gateway = NULL;
+static const char* path = NULL;
+static int stopping = 0;
+
+static void
+on_signal(int sig)
+{
+    (void)(sig);
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+}
+
+static int
+server_listen(void)
+{
+    struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(port) };
+    int fd, one = 1;
+
+    if (inet_pton(AF_INET, address, &sa.sin_addr) != 1) {
+        errx(2, "Bad address %s", address);
+    }
+    if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+        err(1, "socket");
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0
+        || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        err(1, "setsockopt");
+    }
+    if (bind(fd, (struct sockaddr*)(&sa), sizeof(sa)) < 0) {
+        err(1, "bind(%s:%d)", address, port);
+    }
+    if (listen(fd, 128) < 0) {
+        err(1, "listen");
+    }
+    return fd;
+}
+
+static void
+server_close(int ep, struct server_conn* c)
+{
+    epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    cip_session_free(&c->session);
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+static void
+server_accept(int ep, int lfd)
+{
+    struct epoll_event ev = { .events = EPOLLIN };
+    struct server_conn* c;
+    int fd, one = 1;
+
+    while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if ((c = calloc(1, sizeof(*c))) == NULL || (c->in = malloc(SERVER_IN_SIZE)) == NULL) {
+            err(1, "malloc");
+        }
+        c->fd = fd;
+        cip_session_init(&c->session, gateway, path);
+        ev.data.ptr = c;
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            err(1, "epoll_ctl");
+        }
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        warn("accept4");
+    }
+}
+
+/* Writes out whatever replies are waiting, watching for the socket to take
+ * more if it won't take them all.  Returns false if the connection's gone. */
+static bool
+server_flush(int ep, struct server_conn* c)
+{
+    struct epoll_event ev = { .data.ptr = c };
+    ssize_t n;
+
+    while (c->out_off < c->out_len) {
+        n = write(c->fd, c->out + c->out_off, c->out_len - c->out_off);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        c->out_off += n;
+    }
+    if (c->out_off == c->out_len) {
+        c->out_off = c->out_len = 0;
+    }
+
+    if (c->writing != (c->out_len != 0)) {
+        c->writing = c->out_len != 0;
+        ev.events = c->writing ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        if (epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+            err(1, "epoll_ctl");
+        }
+    }
+    return true;
+}
+
+/* Reads what there is and handles every complete request in it.  Returns
+ * false if the connection's gone, or is to be closed. */
+static bool
+server_read(struct server_conn* c)
+{
+    ssize_t n, used;
+    size_t off = 0, reply_len;
+
+    for (;;) {
+        n = read(c->fd, c->in + c->in_len, SERVER_IN_SIZE - c->in_len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        c->in_len += n;
+        if (c->in_len == SERVER_IN_SIZE) {
+            break;
+        }
+    }
+
+    for (;;) {
+        if (c->out_cap - c->out_len < CIP_REPLY_MAX) {
+            c->out_cap = c->out_cap ? c->out_cap * 2 : 4 * CIP_REPLY_MAX;
+            if ((c->out = realloc(c->out, c->out_cap)) == NULL) {
+                err(1, "realloc");
+            }
+        }
+        used = cip_handle(&c->session, c->in + off, c->in_len - off, c->out + c->out_len, &reply_len);
+        if (used < 0) {
+            return false;
+        }
+        if (used == 0) {
+            break;
+        }
+        off += used;
+        c->out_len += reply_len;
+    }
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+    return true;
+}
+
+static void*
+server_thread(void* arg)
+{
+    struct epoll_event ev = { .events = EPOLLIN }, events[SERVER_MAX_EVENTS];
+    int lfd = server_listen(), ep = epoll_create1(0), n;
+
+    (void)(arg);
+    if (ep < 0) {
+        err(1, "epoll_create1");
+    }
+    ev.data.ptr = NULL;
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev) < 0) {
+        err(1, "epoll_ctl");
+    }
+
+    while (!__atomic_load_n(&stopping, __ATOMIC_RELAXED)) {
+        if ((n = epoll_wait(ep, events, SERVER_MAX_EVENTS, 200)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            err(1, "epoll_wait");
+        }
+        for (int i = 0; i < n; ++i) {
+            struct server_conn* c = events[i].data.ptr;
+
+            if (c == NULL) {
+                server_accept(ep, lfd);
+                continue;
+            }
+            if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && !server_read(c)) {
+                server_flush(ep, c);
+                server_close(ep, c);
+                continue;
+            }
+            if (!server_flush(ep, c)) {
+                server_close(ep, c);
+            }
+        }
+    }
+
+    /* Connections still open when stopping are left to the exit. */
+    close(lfd);
+    close(ep);
+    return NULL;
+}
+
+static void
+usage()
+{
+    fprintf(stderr,
+        "usage: plcstub-server [-a address] [-p port] [-t threads] [-f fixture] [-g gateway] [-P path]\n");
+    exit(2);
+}
+
+int
+main(int argc, char** argv)
+{
+    pthread_t threads[SERVER_MAX_THREADS];
+    const char* fixture = NULL;
+    struct sigaction sa = { .sa_handler = on_signal };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:p:t:f:g:P:")) != -1) {
+        switch (opt) {
+        case 'a':
+            address = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'f':
+            fixture = optarg;
+            break;
+        case 'g':
+            gateway = optarg;
+            break;
+        case 'P':
+            path = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (nthreads < 1 || nthreads > SERVER_MAX_THREADS || port < 0 || port > 65535 || optind != argc) {
+        usage();
+    }
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+    if (fixture != NULL && plcstub_load_fixture(fixture) < 0) {
+        errx(1, "Can't load %s", fixture);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    for (int i = 0; i < nthreads; ++i) {
+        if (pthread_create(&threads[i], NULL, server_thread, NULL)) {
+            err(1, "pthread_create");
+        }
+    }
+    fprintf(stderr, "Serving on %s:%d with %d thread%s\n", address, port, nthreads, nthreads == 1 ? "" : "s");
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    plc_tag_shutdown();
+    return 0;
+}
@@ -0,0 +1,164 @@
+/* arena.c
+ *
+ * A size-classed slab allocator with bulk release.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "debug.h"
+#include "lock_utils.h"
+
+/* Header of every chunk.  Doubly-linked so that oversized allocations,
+ * which own their chunk, can be unlinked when they are freed.  Aligned so
+ * that the storage just past it is, too. */
+struct __attribute__((aligned(ARENA_ALIGN))) arena_chunk {
+    struct arena_chunk* prev;
+    struct arena_chunk* next;
+};
+
+/* Size classes are 64-byte steps up to 1KiB, then powers of two up to
+ * 64KiB; anything bigger is oversized. */
+#define ARENA_SMALL_STEP 64
+#define ARENA_SMALL_MAX 1024
+#define ARENA_MAX_CLASS_SIZE (64 * 1024)
+
+static int
+arena_class(size_t size)
+{
+    int cls;
+    size_t cls_size;
+
+    if (size <= ARENA_SMALL_MAX) {
+        return (size == 0) ? 0 : (size - 1) / ARENA_SMALL_STEP;
+    }
+    if (size > ARENA_MAX_CLASS_SIZE) {
+        return -1;
+    }
+
+    cls = ARENA_SMALL_MAX / ARENA_SMALL_STEP;
+    for (cls_size = 2 * ARENA_SMALL_MAX; cls_size < size; cls_size *= 2) {
+        cls++;
+    }
+    return cls;
+}
+
+static size_t
+arena_class_size(int cls)
+{
+    int nsmall = ARENA_SMALL_MAX / ARENA_SMALL_STEP;
+
+    if (cls < nsmall) {
+        return (cls + 1) * ARENA_SMALL_STEP;
+    }
+    return (size_t)(2 * ARENA_SMALL_MAX) << (cls - nsmall);
+}
+
+/* Assumes that a->mtx is held. */
+static struct arena_chunk*
+arena_chunk_new(struct arena* a, size_t size)
+{
+    struct arena_chunk* c;
+
+    if (posix_memalign((void**)(&c), ARENA_ALIGN, sizeof(struct arena_chunk) + size) != 0) {
+        err(1, "posix_memalign");
+    }
+
+    c->prev = NULL;
+    c->next = a->chunks;
+    if (a->chunks) {
+        a->chunks->prev = c;
+    }
+    a->chunks = c;
+
+    return c;
+}
+
+void*
+arena_alloc(struct arena* a, size_t size)
+{
+    int cls = arena_class(size);
+    void* p;
+
+    MTX_LOCK(&a->mtx);
+
+    if (cls < 0) {
+        p = arena_chunk_new(a, size) + 1;
+        MTX_UNLOCK(&a->mtx);
+        return p;
+    }
+
+    if ((p = a->free_lists[cls]) != NULL) {
+        a->free_lists[cls] = *(void**)(p);
+        MTX_UNLOCK(&a->mtx);
+        return p;
+    }
+
+    size = arena_class_size(cls);
+    if (a->left < size) {
+        /* Whatever's left in the old chunk is too small for this class;
+         * it's reclaimed along with the chunk by arena_release(). */
+        a->cur = (char*)(arena_chunk_new(a, ARENA_CHUNK_SIZE) + 1);
+        a->left = ARENA_CHUNK_SIZE;
+    }
+    p = a->cur;
+    a->cur += size;
+    a->left -= size;
+
+    MTX_UNLOCK(&a->mtx);
+
+    return p;
+}
+
+void
+arena_free(struct arena* a, void* p, size_t size)
+{
+    int cls = arena_class(size);
+
+    if (p == NULL) {
+        return;
+    }
+
+    MTX_LOCK(&a->mtx);
+
+    if (cls < 0) {
+        struct arena_chunk* c = (struct arena_chunk*)(p)-1;
+        if (c->prev) {
+            c->prev->next = c->next;
+        } else {
+            a->chunks = c->next;
+        }
+        if (c->next) {
+            c->next->prev = c->prev;
+        }
+        free(c);
+    } else {
+        *(void**)(p) = a->free_lists[cls];
+        a->free_lists[cls] = p;
+    }
+
+    MTX_UNLOCK(&a->mtx);
+}
+
+void
+arena_release(struct arena* a)
+{
+    struct arena_chunk *c, *next;
+
+    MTX_LOCK(&a->mtx);
+
+    for (c = a->chunks; c != NULL; c = next) {
+        next = c->next;
+        free(c);
+    }
+
+    a->chunks = NULL;
+    a->cur = NULL;
+    a->left = 0;
+    memset(a->free_lists, 0, sizeof(a->free_lists));
+
+    MTX_UNLOCK(&a->mtx);
+}
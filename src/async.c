@@ -0,0 +1,546 @@
+/* async.c
+ *
+ * Simulated in-flight reads and writes, completed by a worker pool.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "async.h"
+#include "conn.h"
+#include "debug.h"
+#include "epoch.h"
+#include "event.h"
+#include "libplctag.h"
+#include "lock_utils.h"
+#include "tagtree.h"
+
+#define ASYNC_DEFAULT_WORKERS 4
+#define ASYNC_MAX_WORKERS 64
+#define ASYNC_RETRY_MS 1
+
+/* Queued operations refer to their tag by ID, not pointer, so that one
+ * that's destroyed in the meantime is simply not found. */
+struct async_op {
+    struct timespec due;
+    int32_t tag_id;
+    uint64_t seq; /* the tag's op_seq when this was queued */
+};
+
+/* 
+ * Ensures mutual exclusion on everything below.  Lock ordering: a tag's
+ * mutex may be held when taking this, but never the other way around.
+ */
+static pthread_mutex_t async_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond; /* signalled when the queue changes */
+static pthread_cond_t async_idle_cond; /* signalled when a worker finishes an op */
+
+/* Queued operations, as a binary min-heap ordered by due time. */
+static struct async_op* heap;
+static size_t heap_len, heap_cap;
+
+/* Operations on buffered tags that came due while another thread held
+ * plc_tag_lock() on them, waiting for it to be released (see
+ * async_complete()). */
+static struct async_op* parked;
+static size_t parked_len, parked_cap;
+
+static pthread_t workers[ASYNC_MAX_WORKERS];
+static int32_t running[ASYNC_MAX_WORKERS]; /* the tag each worker is completing, or 0 */
+static int nworkers;
+static bool stopping;
+
+static int
+timespec_cmp(const struct timespec* lhs, const struct timespec* rhs)
+{
+    if (lhs->tv_sec != rhs->tv_sec) {
+        return lhs->tv_sec < rhs->tv_sec ? -1 : 1;
+    }
+    return (lhs->tv_nsec < rhs->tv_nsec) ? -1 : (lhs->tv_nsec > rhs->tv_nsec);
+}
+
+static void
+timespec_add_ms(struct timespec* ts, long ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+/* Heap manipulation.  Assume that async_mtx is held. */
+
+static void
+heap_swap(size_t i, size_t j)
+{
+    struct async_op tmp = heap[i];
+    heap[i] = heap[j];
+    heap[j] = tmp;
+}
+
+static void
+heap_push(struct async_op* op)
+{
+    size_t i;
+
+    if (heap_len == heap_cap) {
+        heap_cap = heap_cap ? heap_cap * 2 : 64;
+        heap = realloc(heap, heap_cap * sizeof(*heap));
+        if (heap == NULL) {
+            err(1, "realloc");
+        }
+    }
+
+    for (i = heap_len++, heap[i] = *op; i > 0 && timespec_cmp(&heap[i].due, &heap[(i - 1) / 2].due) < 0; i = (i - 1) / 2) {
+        heap_swap(i, (i - 1) / 2);
+    }
+}
+
+static void
+heap_sift_down(size_t i)
+{
+    for (;;) {
+        size_t l = 2 * i + 1, r = l + 1, min = i;
+
+        if (l < heap_len && timespec_cmp(&heap[l].due, &heap[min].due) < 0) {
+            min = l;
+        }
+        if (r < heap_len && timespec_cmp(&heap[r].due, &heap[min].due) < 0) {
+            min = r;
+        }
+        if (min == i) {
+            return;
+        }
+        heap_swap(i, min);
+        i = min;
+    }
+}
+
+static void
+heap_pop(struct async_op* op)
+{
+    *op = heap[0];
+    heap[0] = heap[--heap_len];
+    heap_sift_down(0);
+}
+
+/* Gives up on the operation in flight on the tag, if there is one.  Any
+ * queued completion for it is left to be ignored when it comes due.
+ *
+ * Assumes that t->store->mtx is held.
+ */
+static void
+async_abort_locked(struct tag_tree_node* t, int status)
+{
+    if (t->status != PLCTAG_STATUS_PENDING) {
+        return;
+    }
+
+    pdebug(PLCTAG_DEBUG_DETAIL, "Aborting operation on tag %d", t->tag_id);
+
+    t->op_seq++;
+    t->status = status;
+    t->op = ASYNC_OP_NONE;
+    if (t->cb) {
+        pdebug(PLCTAG_DEBUG_SPEW, "Calling cb for %d with PLCTAG_EVENT_ABORTED", t->tag_id);
+        event_post(t->cb, t->tag_id, PLCTAG_EVENT_ABORTED, status);
+    }
+    pthread_cond_broadcast(&t->store->cond);
+}
+
+/* Completes the operation in flight on the tag.
+ *
+ * Assumes that t->store->mtx is held, and that nothing but this thread
+ * may be touching t's payload.
+ */
+static void
+async_complete_locked(struct tag_tree_node* t)
+{
+    int event = (t->op == ASYNC_OP_READ) ? PLCTAG_EVENT_READ_COMPLETED : PLCTAG_EVENT_WRITE_COMPLETED;
+
+    /* A buffered tag's handle only sees what was written through the
+     * others once it reads, and they only see what it wrote once it
+     * writes. */
+    if (t->store->nbufs != 0) {
+        if (t->op == ASYNC_OP_READ) {
+            tag_store_pull(t);
+        } else {
+            tag_store_push(t);
+        }
+    }
+    t->status = PLCTAG_STATUS_OK;
+    t->op = ASYNC_OP_NONE;
+
+    if (t->cb) {
+        pdebug(PLCTAG_DEBUG_SPEW, "Calling cb for %d with %s", t->tag_id,
+            event == PLCTAG_EVENT_READ_COMPLETED ? "PLCTAG_EVENT_READ_COMPLETED" : "PLCTAG_EVENT_WRITE_COMPLETED");
+        event_post(t->cb, t->tag_id, event, PLCTAG_STATUS_OK);
+    }
+    pthread_cond_broadcast(&t->store->cond);
+}
+
+/* Drops the tag's parked operation, if it has one.
+ *
+ * Assumes that t->store->mtx and async_mtx are held.
+ */
+static void
+async_unpark_locked(struct tag_tree_node* t)
+{
+    if (!t->parked) {
+        return;
+    }
+    for (size_t i = 0; i < parked_len; ++i) {
+        if (parked[i].tag_id == t->tag_id) {
+            parked[i] = parked[--parked_len];
+            break;
+        }
+    }
+    t->parked = false;
+    t->store->nparked--;
+}
+
+/* Completes an operation that has come due, unless it was aborted (or
+ * superseded) while it was queued.
+ *
+ * A buffered tag's completion copies its handle's payload, which a
+ * plc_tag_lock() holder writes without taking the store's mutex.  So
+ * while another thread holds the lock (and isn't just waiting on the
+ * operation, as it would be in a blocking plc_tag_read()), the operation
+ * is parked instead, and stays pending until plc_tag_unlock() requeues it
+ * or the holder finishes it itself (see async_finish()).  The holder of a
+ * shared tag's lock may be in another process, which can't requeue what
+ * this one parks, so those are retried every ASYNC_RETRY_MS instead. */
+static void
+async_complete(struct async_op* op)
+{
+    struct tag_tree_node* t;
+
+    epoch_enter();
+    if ((t = tag_tree_lookup_fast(op->tag_id)) == NULL) {
+        epoch_exit();
+        return;
+    }
+
+    tag_store_lock(t->store);
+
+    if (t->op_seq == op->seq && t->status == PLCTAG_STATUS_PENDING) {
+        if (t->store->nbufs == 0 || t->store->lock_owner == NULL || t->store->holder_waiting != 0) {
+            async_complete_locked(t);
+        } else if (t->store->shared) {
+            clock_gettime(CLOCK_MONOTONIC, &op->due);
+            timespec_add_ms(&op->due, ASYNC_RETRY_MS);
+            MTX_LOCK(&async_mtx);
+            heap_push(op);
+            MTX_UNLOCK(&async_mtx);
+        } else {
+            pdebug(PLCTAG_DEBUG_SPEW, "Parking the operation on locked tag %d", t->tag_id);
+            MTX_LOCK(&async_mtx);
+            if (parked_len == parked_cap) {
+                parked_cap = parked_cap ? parked_cap * 2 : 16;
+                if ((parked = realloc(parked, parked_cap * sizeof(*parked))) == NULL) {
+                    err(1, "realloc");
+                }
+            }
+            parked[parked_len++] = *op;
+            MTX_UNLOCK(&async_mtx);
+            t->parked = true;
+            t->store->nparked++;
+        }
+    }
+
+    MTX_UNLOCK(&t->store->mtx);
+    epoch_exit();
+}
+
+static void*
+async_worker(void* arg)
+{
+    int self = (int)(intptr_t)(arg);
+    struct async_op op;
+    struct timespec now;
+
+    MTX_LOCK(&async_mtx);
+
+    while (!stopping) {
+        if (heap_len == 0) {
+            pthread_cond_wait(&async_cond, &async_mtx);
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (timespec_cmp(&heap[0].due, &now) > 0) {
+            pthread_cond_timedwait(&async_cond, &async_mtx, &heap[0].due);
+            continue;
+        }
+
+        heap_pop(&op);
+        running[self] = op.tag_id;
+        MTX_UNLOCK(&async_mtx);
+
+        async_complete(&op);
+
+        MTX_LOCK(&async_mtx);
+        running[self] = 0;
+        pthread_cond_broadcast(&async_idle_cond);
+    }
+
+    MTX_UNLOCK(&async_mtx);
+
+    return NULL;
+}
+
+/* Starts the worker pool if it isn't already running.  The pool size comes
+ * from $PLCSTUB_ASYNC_WORKERS.
+ *
+ * Assumes that async_mtx is held.
+ */
+static void
+async_start_workers()
+{
+    static bool conds_inited = false;
+    const char* env;
+    pthread_condattr_t attr;
+    int ret;
+
+    if (nworkers > 0) {
+        return;
+    }
+
+    if (!conds_inited) {
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&async_cond, &attr);
+        pthread_cond_init(&async_idle_cond, &attr);
+        pthread_condattr_destroy(&attr);
+        conds_inited = true;
+    }
+
+    nworkers = ASYNC_DEFAULT_WORKERS;
+    if ((env = getenv("PLCSTUB_ASYNC_WORKERS")) != NULL) {
+        nworkers = atoi(env);
+        if (nworkers < 1 || nworkers > ASYNC_MAX_WORKERS) {
+            errx(1, "PLCSTUB_ASYNC_WORKERS must be between 1 and %d", ASYNC_MAX_WORKERS);
+        }
+    }
+
+    pdebug(PLCTAG_DEBUG_DETAIL, "Starting %d async workers", nworkers);
+
+    stopping = false;
+    for (int i = 0; i < nworkers; ++i) {
+        if ((ret = pthread_create(&workers[i], NULL, async_worker, (void*)(intptr_t)(i))) != 0) {
+            errx(1, "pthread_create: %s", strerror(ret));
+        }
+    }
+}
+
+int
+async_start(struct tag_tree_node* t, int op, int timeout, bool holder)
+{
+    struct async_op aop;
+    struct timespec deadline;
+    int ret;
+
+    tag_store_lock(t->store);
+
+    if (t->status == PLCTAG_STATUS_PENDING && t->op == ASYNC_OP_READ && op == ASYNC_OP_READ) {
+        /* Coalesce with the read that is already in flight, as libplctag
+         * does: there's one transaction, one pair of events, and everybody
+         * waiting on it is released together. */
+        pdebug(PLCTAG_DEBUG_SPEW, "Joining the read in flight on tag %d", t->tag_id);
+        aop.seq = t->op_seq;
+    } else if (t->status == PLCTAG_STATUS_PENDING) {
+        MTX_UNLOCK(&t->store->mtx);
+        pdebug(PLCTAG_DEBUG_WARN, "Tag %d already has an operation in flight", t->tag_id);
+        return PLCTAG_ERR_BUSY;
+    } else {
+        t->status = PLCTAG_STATUS_PENDING;
+        t->op = op;
+        aop.tag_id = t->tag_id;
+        aop.seq = ++t->op_seq;
+
+        if (t->cb) {
+            pdebug(PLCTAG_DEBUG_SPEW, "Calling cb for %d with %s", t->tag_id,
+                op == ASYNC_OP_READ ? "PLCTAG_EVENT_READ_STARTED" : "PLCTAG_EVENT_WRITE_STARTED");
+            event_post(t->cb, t->tag_id,
+                op == ASYNC_OP_READ ? PLCTAG_EVENT_READ_STARTED : PLCTAG_EVENT_WRITE_STARTED, PLCTAG_STATUS_OK);
+        }
+
+        /* The operation comes due after however long the connection says
+         * moving the tag's data would take. */
+        conn_schedule(t->conn, t->elem_size * t->elem_count, &aop.due);
+
+        MTX_LOCK(&async_mtx);
+        async_start_workers();
+        heap_push(&aop);
+        pthread_cond_signal(&async_cond);
+        MTX_UNLOCK(&async_mtx);
+    }
+
+    if (timeout == 0) {
+        MTX_UNLOCK(&t->store->mtx);
+        return PLCTAG_STATUS_PENDING;
+    }
+
+    /* Block for the operation, but no longer than the timeout. */
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    timespec_add_ms(&deadline, timeout);
+
+    /* A plc_tag_lock() holder waiting on the operation won't be touching
+     * the payload meanwhile, so it can complete, and may even have been
+     * parked already. */
+    if (holder) {
+        async_finish(t);
+        t->store->holder_waiting++;
+    }
+    t->nwaiters++;
+    while (t->op_seq == aop.seq && t->status == PLCTAG_STATUS_PENDING) {
+        if (tag_store_wait(t->store, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    t->nwaiters--;
+    if (holder) {
+        t->store->holder_waiting--;
+    }
+
+    if (t->op_seq == aop.seq && t->status == PLCTAG_STATUS_PENDING) {
+        /* Timed out: give up on it, as libplctag does, unless somebody
+         * who joined it is still prepared to wait. */
+        pdebug(PLCTAG_DEBUG_WARN, "Operation on tag %d timed out", t->tag_id);
+        if (t->nwaiters == 0) {
+            async_abort_locked(t, PLCTAG_ERR_TIMEOUT);
+        }
+        MTX_UNLOCK(&t->store->mtx);
+        return PLCTAG_ERR_TIMEOUT;
+    }
+
+    ret = (t->op_seq == aop.seq) ? t->status : PLCTAG_ERR_ABORT;
+    MTX_UNLOCK(&t->store->mtx);
+
+    return ret;
+}
+
+void
+async_abort(struct tag_tree_node* t, int status)
+{
+    tag_store_lock(t->store);
+    async_abort_locked(t, status);
+    MTX_LOCK(&async_mtx);
+    async_unpark_locked(t);
+
+    /* Drop anything still queued for the tag... */
+    for (size_t i = 0; i < heap_len;) {
+        if (heap[i].tag_id == t->tag_id) {
+            heap[i] = heap[--heap_len];
+        } else {
+            i++;
+        }
+    }
+    for (size_t i = heap_len / 2 + 1; i-- > 0;) {
+        heap_sift_down(i);
+    }
+
+    MTX_UNLOCK(&t->store->mtx);
+
+    /* ...and wait out any worker that is busy completing it. */
+    for (;;) {
+        bool busy = false;
+        for (int i = 0; i < nworkers; ++i) {
+            busy = busy || running[i] == t->tag_id;
+        }
+        if (!busy) {
+            break;
+        }
+        pthread_cond_wait(&async_idle_cond, &async_mtx);
+    }
+
+    MTX_UNLOCK(&async_mtx);
+}
+
+void
+async_finish(struct tag_tree_node* t)
+{
+    if (!t->parked) {
+        return;
+    }
+    MTX_LOCK(&async_mtx);
+    async_unpark_locked(t);
+    MTX_UNLOCK(&async_mtx);
+    if (t->status == PLCTAG_STATUS_PENDING) {
+        async_complete_locked(t);
+    }
+}
+
+void
+async_requeue(struct tag_store* store)
+{
+    struct tag_tree_node* t;
+    struct timespec now;
+    bool any = false;
+
+    if (store->nparked == 0) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    MTX_LOCK(&async_mtx);
+    for (size_t i = 0; i < parked_len;) {
+        if ((t = tag_tree_lookup_fast(parked[i].tag_id)) == NULL || t->store != store) {
+            i++;
+            continue;
+        }
+        t->parked = false;
+        store->nparked--;
+        parked[i].due = now;
+        heap_push(&parked[i]);
+        parked[i] = parked[--parked_len];
+        any = true;
+    }
+    if (any) {
+        pthread_cond_broadcast(&async_cond);
+    }
+    MTX_UNLOCK(&async_mtx);
+}
+
+void
+async_stop(void)
+{
+    MTX_LOCK(&async_mtx);
+    stopping = true;
+    if (nworkers > 0) {
+        pthread_cond_broadcast(&async_cond);
+    }
+    MTX_UNLOCK(&async_mtx);
+}
+
+void
+async_shutdown(void)
+{
+    int n;
+
+    async_stop();
+    MTX_LOCK(&async_mtx);
+    n = nworkers;
+    MTX_UNLOCK(&async_mtx);
+
+    for (int i = 0; i < n; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+
+    MTX_LOCK(&async_mtx);
+    nworkers = 0;
+    free(heap);
+    heap = NULL;
+    heap_len = heap_cap = 0;
+    free(parked);
+    parked = NULL;
+    parked_len = parked_cap = 0;
+    MTX_UNLOCK(&async_mtx);
+}
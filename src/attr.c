@@ -0,0 +1,270 @@
+/* attr.c
+ *
+ * Parses tag attribute strings.
+ */
+
+#include <stdint.h>
+#include <strings.h>
+
+#include "attr.h"
+#include "debug.h"
+#include "libplctag.h"
+#include "tagtree.h"
+
+/* Until we know better, tags are single INTs unless told otherwise. */
+#define ATTR_DEFAULT_ELEM_SIZE 2
+#define ATTR_DEFAULT_ELEM_COUNT 1
+
+enum attr_key {
+    ATTR_UNKNOWN,
+    ATTR_PROTOCOL,
+    ATTR_NAME,
+    ATTR_GATEWAY,
+    ATTR_PATH,
+    ATTR_CPU,
+    ATTR_ELEM_SIZE,
+    ATTR_ELEM_COUNT,
+    ATTR_ELEM_TYPE,
+    ATTR_GEN,
+    ATTR_BUFFERS,
+    ATTR_DIMS,
+    ATTR_UDT,
+};
+
+static const struct {
+    const char* name;
+    enum tag_type type;
+    size_t size;
+} attr_types[] = {
+    { "BOOL", TAG_BOOL, 1 },
+    { "SINT", TAG_SINT, 1 },
+    { "INT", TAG_INT, 2 },
+    { "DINT", TAG_DINT, 4 },
+    { "LINT", TAG_LINT, 8 },
+    { "REAL", TAG_REAL, 4 },
+    { "LREAL", TAG_LREAL, 8 },
+};
+
+#define KEY_IS(lit) (memcmp(key, (lit), sizeof(lit) - 1) == 0)
+
+/* Identifies a key by its length and first character, then confirms it,
+ * so that each key costs at most one comparison. */
+static enum attr_key
+attr_key(const char* key, size_t len)
+{
+    switch (len) {
+    case 3:
+        if (key[0] == 'c') {
+            return KEY_IS("cpu") ? ATTR_CPU : ATTR_UNKNOWN;
+        }
+        if (key[0] == 'u') {
+            return KEY_IS("udt") ? ATTR_UDT : ATTR_UNKNOWN;
+        }
+        return KEY_IS("gen") ? ATTR_GEN : ATTR_UNKNOWN;
+    case 4:
+        if (key[0] == 'n') {
+            return KEY_IS("name") ? ATTR_NAME : ATTR_UNKNOWN;
+        }
+        if (key[0] == 'd') {
+            return KEY_IS("dims") ? ATTR_DIMS : ATTR_UNKNOWN;
+        }
+        return KEY_IS("path") ? ATTR_PATH : ATTR_UNKNOWN;
+    case 7:
+        if (key[0] == 'b') {
+            return KEY_IS("buffers") ? ATTR_BUFFERS : ATTR_UNKNOWN;
+        }
+        return KEY_IS("gateway") ? ATTR_GATEWAY : ATTR_UNKNOWN;
+    case 8:
+        return KEY_IS("protocol") ? ATTR_PROTOCOL : ATTR_UNKNOWN;
+    case 9:
+        if (key[5] == 's') {
+            return KEY_IS("elem_size") ? ATTR_ELEM_SIZE : ATTR_UNKNOWN;
+        }
+        return KEY_IS("elem_type") ? ATTR_ELEM_TYPE : ATTR_UNKNOWN;
+    case 10:
+        return KEY_IS("elem_count") ? ATTR_ELEM_COUNT : ATTR_UNKNOWN;
+    }
+    return ATTR_UNKNOWN;
+}
+
+#undef KEY_IS
+
+/* Parses a decimal size, rejecting anything but digits and values too big
+ * to be a tag's size. */
+static int
+attr_parse_size(const struct attr_span* v, size_t* out)
+{
+    size_t n = 0;
+
+    if (v->len == 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < v->len; ++i) {
+        unsigned d = (unsigned char)(v->p[i]) - '0';
+        if (d > 9 || n > (SIZE_MAX / 2 - d) / 10) {
+            return -1;
+        }
+        n = n * 10 + d;
+    }
+    *out = n;
+    return 0;
+}
+
+int
+attr_lookup_type(const char* s, size_t len, enum tag_type* type, size_t* size)
+{
+    for (size_t i = 0; i < sizeof(attr_types) / sizeof(attr_types[0]); ++i) {
+        if (strlen(attr_types[i].name) == len && strncasecmp(s, attr_types[i].name, len) == 0) {
+            *type = attr_types[i].type;
+            *size = attr_types[i].size;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Keeps the last of a repeated attribute, as plc_tag_create() always has. */
+static void
+attr_set(struct attr_span* dst, const struct attr_span* val, const char* key)
+{
+    if (dst->p != NULL) {
+        pdebug(PLCTAG_DEBUG_WARN, "Overwriting attribute %s", key);
+    }
+    *dst = *val;
+}
+
+int
+attr_parse(const char* attrib, struct tag_attrs* attrs)
+{
+    struct attr_span elem_size = { 0 }, elem_count = { 0 }, buffers = { 0 }, dims = { 0 }, udt = { 0 };
+    struct attr_span val;
+    const struct udt* layout = NULL;
+    const char *p, *end, *eq;
+    enum tag_type type;
+    size_t size = 0;
+
+    memset(attrs, 0, sizeof(*attrs));
+    attrs->type = -1;
+
+    for (p = attrib; *p != '\0'; p = (*end == '\0') ? end : end + 1) {
+        end = p + strcspn(p, "&");
+        if (end == p) {
+            continue;
+        }
+
+        eq = memchr(p, '=', end - p);
+        if (eq == NULL) {
+            /* At the moment, the only attribute we've seen that isn't a
+             * key-value pair is "protocol".  If we encounter others, we can
+             * either check for them or just ignore them altogether,
+             * depending on our confidence of things. */
+            if (attr_key(p, end - p) == ATTR_PROTOCOL) {
+                continue;
+            }
+            pdebug(PLCTAG_DEBUG_WARN, "Missing '=' in non-'protocol' attribute %.*s", (int)(end - p), p);
+            return PLCTAG_ERR_BAD_PARAM;
+        }
+
+        val.p = eq + 1;
+        val.len = end - val.p;
+
+        switch (attr_key(p, eq - p)) {
+        case ATTR_PROTOCOL:
+            attr_set(&attrs->protocol, &val, "protocol");
+            break;
+        case ATTR_NAME:
+            attr_set(&attrs->name, &val, "name");
+            break;
+        case ATTR_GATEWAY:
+            attr_set(&attrs->gateway, &val, "gateway");
+            break;
+        case ATTR_PATH:
+            attr_set(&attrs->path, &val, "path");
+            break;
+        case ATTR_CPU:
+            attr_set(&attrs->cpu, &val, "cpu");
+            break;
+        case ATTR_ELEM_SIZE:
+            attr_set(&elem_size, &val, "elem_size");
+            break;
+        case ATTR_ELEM_COUNT:
+            attr_set(&elem_count, &val, "elem_count");
+            break;
+        case ATTR_ELEM_TYPE:
+            attr_set(&attrs->elem_type, &val, "elem_type");
+            break;
+        case ATTR_GEN:
+            attr_set(&attrs->gen, &val, "gen");
+            break;
+        case ATTR_BUFFERS:
+            attr_set(&buffers, &val, "buffers");
+            break;
+        case ATTR_DIMS:
+            attr_set(&dims, &val, "dims");
+            break;
+        case ATTR_UDT:
+            attr_set(&udt, &val, "udt");
+            break;
+        case ATTR_UNKNOWN:
+            pdebug(PLCTAG_DEBUG_SPEW, "Ignoring attribute %.*s", (int)(end - p), p);
+            break;
+        }
+    }
+
+    if (attrs->elem_type.p != NULL) {
+        if (attr_lookup_type(attrs->elem_type.p, attrs->elem_type.len, &type, &size) != 0) {
+            pdebug(PLCTAG_DEBUG_WARN, "Unknown elem_type %.*s", (int)(attrs->elem_type.len), attrs->elem_type.p);
+            return PLCTAG_ERR_BAD_PARAM;
+        }
+        attrs->type = type;
+    }
+
+    if (udt.p != NULL) {
+        if (attrs->elem_type.p != NULL || (layout = udt_intern(udt.p, udt.len)) == NULL) {
+            pdebug(PLCTAG_DEBUG_WARN, "Bad udt %.*s", (int)(udt.len), udt.p);
+            return PLCTAG_ERR_BAD_PARAM;
+        }
+        attrs->udt = layout->id;
+    }
+
+    attrs->shaped = elem_size.p != NULL || elem_count.p != NULL || attrs->elem_type.p != NULL
+        || dims.p != NULL || udt.p != NULL;
+
+    /* An explicit elem_size wins over the width of elem_type, but has to
+     * be a UDT's size if there is one. */
+    if (elem_size.p != NULL) {
+        if (attr_parse_size(&elem_size, &attrs->elem_size) != 0
+            || (layout != NULL && attrs->elem_size != layout->size)) {
+            pdebug(PLCTAG_DEBUG_WARN, "Bad elem_size %.*s", (int)(elem_size.len), elem_size.p);
+            return PLCTAG_ERR_BAD_PARAM;
+        }
+    } else {
+        attrs->elem_size = layout ? layout->size : (attrs->type >= 0) ? size : ATTR_DEFAULT_ELEM_SIZE;
+    }
+
+    if (dims.p != NULL && layout_parse_dims(dims.p, dims.len, attrs->dims) < 0) {
+        pdebug(PLCTAG_DEBUG_WARN, "Bad dims %.*s", (int)(dims.len), dims.p);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    if (elem_count.p != NULL) {
+        if (attr_parse_size(&elem_count, &attrs->elem_count) != 0
+            || (dims.p != NULL && attrs->elem_count != layout_dims_count(attrs->dims))) {
+            pdebug(PLCTAG_DEBUG_WARN, "Bad elem_count %.*s", (int)(elem_count.len), elem_count.p);
+            return PLCTAG_ERR_BAD_PARAM;
+        }
+    } else {
+        attrs->elem_count = dims.p != NULL ? layout_dims_count(attrs->dims) : ATTR_DEFAULT_ELEM_COUNT;
+    }
+
+    /* Double or triple buffering. */
+    if (buffers.p != NULL) {
+        if (attr_parse_size(&buffers, &size) != 0 || size < 2 || size > TAG_STORE_MAX_BUFS) {
+            pdebug(PLCTAG_DEBUG_WARN, "Bad buffers %.*s", (int)(buffers.len), buffers.p);
+            return PLCTAG_ERR_BAD_PARAM;
+        }
+        attrs->buffers = size;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
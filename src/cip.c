@@ -0,0 +1,1007 @@
+/* cip.c
+ *
+ * The controller's side of EtherNet/IP and CIP, over the tag tree (see
+ * cip.h).  Everything on the wire is little-endian.
+ */
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cip.h"
+#include "layout.h"
+#include "debug.h"
+#include "epoch.h"
+#include "libplctag.h"
+#include "lock_utils.h"
+#include "plcstub.h"
+#include "tagtree.h"
+
+/* Encapsulation commands. */
+#define ENCAP_NOP 0x0000
+#define ENCAP_LIST_SERVICES 0x0004
+#define ENCAP_LIST_IDENTITY 0x0063
+#define ENCAP_REGISTER_SESSION 0x0065
+#define ENCAP_UNREGISTER_SESSION 0x0066
+#define ENCAP_SEND_RR_DATA 0x006f
+#define ENCAP_SEND_UNIT_DATA 0x0070
+
+/* Encapsulation statuses. */
+#define ENCAP_ERR_COMMAND 0x0001
+#define ENCAP_ERR_DATA 0x0003
+#define ENCAP_ERR_SESSION 0x0064
+#define ENCAP_ERR_PROTOCOL 0x0069
+
+/* Common packet format items. */
+#define CPF_NULL_ADDRESS 0x0000
+#define CPF_CONNECTED_ADDRESS 0x00a1
+#define CPF_CONNECTED_DATA 0x00b1
+#define CPF_UNCONNECTED_DATA 0x00b2
+
+/* CIP services, and the bit set on their replies. */
+#define CIP_MULTIPLE_SERVICE 0x0a
+#define CIP_FORWARD_CLOSE 0x4e
+#define CIP_READ_TAG 0x4c
+#define CIP_WRITE_TAG 0x4d
+#define CIP_READ_TAG_FRAG 0x52 /* or Unconnected Send, to the Connection Manager */
+#define CIP_WRITE_TAG_FRAG 0x53
+#define CIP_FORWARD_OPEN 0x54
+#define CIP_GET_INSTANCE_ATTRIBUTE_LIST 0x55
+#define CIP_LARGE_FORWARD_OPEN 0x5b
+#define CIP_REPLY 0x80
+
+/* The classes that services are sent to rather than tags. */
+#define CIP_CLASS_CONNECTION_MANAGER 0x06
+#define CIP_CLASS_SYMBOL 0x6b
+
+/* CIP general statuses, and the extended statuses along with them. */
+#define CIP_OK 0x00
+#define CIP_ERR_CONNECTION 0x01
+#define CIP_ERR_PATH_SEGMENT 0x04
+#define CIP_ERR_PATH_UNKNOWN 0x05
+#define CIP_PARTIAL 0x06
+#define CIP_ERR_SERVICE 0x08
+#define CIP_ERR_REPLY_TOO_LARGE 0x11
+#define CIP_ERR_NOT_ENOUGH_DATA 0x13
+#define CIP_ERR_TOO_MUCH_DATA 0x15
+#define CIP_ERR_EMBEDDED 0x1e
+#define CIP_ERR_GENERAL 0xff
+
+#define CIP_EXT_CONNECTION_NOT_FOUND 0x0107
+#define CIP_EXT_INVALID_SIZE 0x0109
+#define CIP_EXT_NO_CONNECTIONS 0x0113
+#define CIP_EXT_OUT_OF_RANGE 0x2105
+#define CIP_EXT_TYPE_MISMATCH 0x2107
+
+/* The type code of a structure, which is followed by its handle. */
+#define CIP_TYPE_STRUCT 0x02a0
+
+/* Symbol attributes, for tag listing. */
+#define CIP_ATTR_NAME 1
+#define CIP_ATTR_TYPE 2
+#define CIP_ATTR_ELEM_SIZE 7
+#define CIP_ATTR_DIMS 8
+
+/* The least room any reply needs: its header and an extended status. */
+#define CIP_MIN_REPLY 6
+
+/* Forward Open's and Forward Close's replies, past the header. */
+#define CIP_FORWARD_OPEN_REPLY 26
+#define CIP_FORWARD_CLOSE_REPLY 10
+
+/* What ListIdentity calls us. */
+#define CIP_PRODUCT_NAME "plcstub 1756"
+
+/* The longest tag name (with its members joined up by dots). */
+#define CIP_MAX_NAME 512
+
+static uint32_t cip_next_session = 0;
+static uint32_t cip_next_conn = 0;
+
+static uint16_t
+get16(const uint8_t* p)
+{
+    return p[0] | (uint16_t)(p[1]) << 8;
+}
+
+static uint32_t
+get32(const uint8_t* p)
+{
+    return p[0] | (uint32_t)(p[1]) << 8 | (uint32_t)(p[2]) << 16 | (uint32_t)(p[3]) << 24;
+}
+
+static void
+put16(uint8_t* p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void
+put32(uint8_t* p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+uint16_t
+cip_type_code(uint16_t type, size_t elem_size)
+{
+    uint16_t code = layout_type_code(type, elem_size);
+
+    return code ? code : CIP_TYPE_STRUCT;
+}
+
+/* The length of a tag's type in a read reply or write request: a
+ * structure's type code is followed by its handle. */
+static size_t
+cip_type_len(uint16_t code)
+{
+    return code == CIP_TYPE_STRUCT ? 4 : 2;
+}
+
+/* Writes a tag's type.  The stub knows nothing of a structure's members,
+ * so its handle says only how big it is. */
+static void
+cip_put_type(uint8_t* p, const struct cip_tag* t)
+{
+    put16(p, t->type);
+    if (t->type == CIP_TYPE_STRUCT) {
+        put16(p + 2, (uint16_t)(t->elem_size));
+    }
+}
+
+void
+cip_session_init(struct cip_session* s, const char* gateway, const char* path)
+{
+    memset(s, 0, sizeof(*s));
+    s->gateway = gateway;
+    s->path = path;
+}
+
+void
+cip_session_free(struct cip_session* s)
+{
+    for (size_t i = 0; i < s->cap; ++i) {
+        if (s->tags[i].name != NULL) {
+            plc_tag_destroy(s->tags[i].tag_id);
+            free(s->tags[i].name);
+        }
+    }
+    free(s->tags);
+    memset(s, 0, sizeof(*s));
+}
+
+static uint64_t
+cip_hash(const char* name)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (*name) {
+        h = (h ^ (unsigned char)(*name++)) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Where name is, or would go, in the session's table. */
+static struct cip_tag*
+cip_slot(struct cip_tag* tags, size_t cap, const char* name)
+{
+    size_t i = cip_hash(name) & (cap - 1);
+
+    while (tags[i].name != NULL && strcmp(tags[i].name, name) != 0) {
+        i = (i + 1) & (cap - 1);
+    }
+    return &tags[i];
+}
+
+/* Looks a tag up by name, opening a handle onto it the first time, or
+ * returns NULL if there's no such tag. */
+static struct cip_tag*
+cip_lookup(struct cip_session* s, const char* name)
+{
+    struct tag_tree_spec spec;
+    struct tag_tree_node* node;
+    struct cip_tag *t, *tags, tag;
+
+    if (s->cap != 0 && (t = cip_slot(s->tags, s->cap, name))->name != NULL) {
+        return t;
+    }
+
+    spec = (struct tag_tree_spec) {
+        .name = name,
+        .name_len = strlen(name),
+        .gateway = { s->gateway, s->gateway ? strlen(s->gateway) : 0 },
+        .path = { s->path, s->path ? strlen(s->path) : 0 },
+        .any_shape = true,
+        .existing = true,
+    };
+
+    epoch_enter();
+    if ((node = tag_tree_node_create(&spec)) == NULL) {
+        epoch_exit();
+        pdebug(PLCTAG_DEBUG_DETAIL, "No tag %s to serve", name);
+        return NULL;
+    }
+    tag = (struct cip_tag) {
+        .tag_id = node->tag_id,
+        .elem_size = node->elem_size,
+        .elem_count = node->elem_count,
+        .type = node->store->udt ? CIP_TYPE_STRUCT : cip_type_code(node->store->type, node->elem_size),
+    };
+    /* Plain arrays have always been listed with their bare type code. */
+    if (node->store->udt || node->store->dims[0]) {
+        tag.symbol_type = layout_symbol_type(node->store->type, node->elem_size, node->elem_count,
+            node->store->udt, node->store->dims);
+    } else {
+        tag.symbol_type = tag.type == CIP_TYPE_STRUCT ? 0x8000 : tag.type;
+    }
+    layout_symbol_dims(node->elem_count, node->store->dims, tag.dims);
+    epoch_exit();
+
+    /* Kept at most half full. */
+    if (2 * (s->ntags + 1) > s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 64;
+
+        if ((tags = calloc(cap, sizeof(*tags))) == NULL) {
+            err(1, "calloc");
+        }
+        for (size_t i = 0; i < s->cap; ++i) {
+            if (s->tags[i].name != NULL) {
+                *cip_slot(tags, cap, s->tags[i].name) = s->tags[i];
+            }
+        }
+        free(s->tags);
+        s->tags = tags;
+        s->cap = cap;
+    }
+
+    if ((tag.name = strdup(name)) == NULL) {
+        err(1, "strdup");
+    }
+    t = cip_slot(s->tags, s->cap, name);
+    *t = tag;
+    s->ntags++;
+    return t;
+}
+
+/* Starts a reply to service, returning its length so far. */
+static size_t
+cip_reply(uint8_t* resp, uint8_t service, uint8_t status, uint16_t ext)
+{
+    resp[0] = service | CIP_REPLY;
+    resp[1] = 0;
+    resp[2] = status;
+    resp[3] = ext ? 1 : 0;
+    if (ext) {
+        put16(resp + 4, ext);
+        return 6;
+    }
+    return 4;
+}
+
+/* A request's path, as far as tags go: the name (its symbolic segments
+ * joined by dots) and the element's indices, one per dimension, if any. */
+struct cip_path {
+    char name[CIP_MAX_NAME];
+    uint32_t indices[LAYOUT_MAX_DIMS];
+    int nindices;
+    /* Or the class and instance of a logical path. */
+    int cls;
+    uint32_t instance;
+};
+
+/* Parses the request path of len bytes at p, returning a CIP status. */
+static int
+cip_parse_path(const uint8_t* p, size_t len, struct cip_path* path)
+{
+    size_t name_len = 0, n;
+
+    memset(path, 0, sizeof(*path));
+    path->cls = -1;
+
+    while (len > 0) {
+        switch (p[0]) {
+        case 0x91: /* symbolic: length, name, padded to a word */
+            if (len < 2 || (n = p[1]) + 2 > len || path->nindices || name_len + n + 2 > sizeof(path->name)) {
+                return CIP_ERR_PATH_SEGMENT;
+            }
+            if (name_len != 0) {
+                path->name[name_len++] = '.';
+            }
+            memcpy(path->name + name_len, p + 2, n);
+            name_len += n;
+            path->name[name_len] = '\0';
+            n = 2 + n + (n & 1);
+            break;
+        case 0x28: /* element: 8, 16 or 32 bits */
+        case 0x29:
+        case 0x2a:
+            n = p[0] == 0x28 ? 2 : p[0] == 0x29 ? 4 : 6;
+            if (n > len || path->nindices == LAYOUT_MAX_DIMS || name_len == 0) {
+                return CIP_ERR_PATH_SEGMENT;
+            }
+            path->indices[path->nindices++] = p[0] == 0x28 ? p[1] : p[0] == 0x29 ? get16(p + 2) : get32(p + 2);
+            break;
+        case 0x20: /* class, 8 or 16 bits */
+        case 0x21:
+            n = p[0] == 0x20 ? 2 : 4;
+            if (n > len) {
+                return CIP_ERR_PATH_SEGMENT;
+            }
+            path->cls = p[0] == 0x20 ? p[1] : get16(p + 2);
+            break;
+        case 0x24: /* instance, 8, 16 or 32 bits */
+        case 0x25:
+        case 0x26:
+            n = p[0] == 0x24 ? 2 : p[0] == 0x25 ? 4 : 6;
+            if (n > len) {
+                return CIP_ERR_PATH_SEGMENT;
+            }
+            path->instance = p[0] == 0x24 ? p[1] : p[0] == 0x25 ? get16(p + 2) : get32(p + 2);
+            break;
+        default:
+            return CIP_ERR_PATH_SEGMENT;
+        }
+        if (n > len) {
+            return CIP_ERR_PATH_SEGMENT;
+        }
+        p += n;
+        len -= n;
+    }
+    return CIP_OK;
+}
+
+/* Finds the element that the path's indices pick out, in row-major order:
+ * one index for a tag of one dimension (or none, counting elem_count as
+ * one), otherwise one for each.  Returns false if they don't fit. */
+static bool
+cip_element(const struct cip_tag* t, const struct cip_path* path, uint32_t* index)
+{
+    int ndims = 0;
+    uint64_t i = 0;
+
+    while (ndims < LAYOUT_MAX_DIMS && t->dims[ndims] != 0) {
+        ndims++;
+    }
+    if (path->nindices <= 1) {
+        *index = path->nindices ? path->indices[0] : 0;
+        return path->nindices == 0 || ndims <= 1;
+    }
+    if (path->nindices != ndims) {
+        return false;
+    }
+    for (int d = 0; d < ndims; ++d) {
+        if (path->indices[d] >= t->dims[d]) {
+            return false;
+        }
+        i = i * t->dims[d] + path->indices[d];
+    }
+    *index = i;
+    return true;
+}
+
+/* Checks that count elements from index (and then another off bytes and
+ * len more) lie within the tag. */
+static bool
+cip_in_bounds(const struct cip_tag* t, uint32_t index, size_t count, size_t off, size_t len)
+{
+    size_t bytes;
+
+    if (index > t->elem_count || count > t->elem_count - index) {
+        return false;
+    }
+    bytes = count * t->elem_size;
+    return off <= bytes && len <= bytes - off;
+}
+
+/* Read Tag and Read Tag Fragmented: the reply carries as much of the
+ * requested elements, from offset bytes into them, as fits in max. */
+static size_t
+cip_read(struct cip_session* s, uint8_t service, const struct cip_path* path, const uint8_t* data, size_t len,
+    uint8_t* resp, size_t max)
+{
+    struct cip_tag* t;
+    uint32_t off = 0, index;
+    size_t count, total, n, hdr;
+    int ret;
+
+    if (len < (service == CIP_READ_TAG_FRAG ? 6u : 2u)) {
+        return cip_reply(resp, service, CIP_ERR_NOT_ENOUGH_DATA, 0);
+    }
+    if ((t = cip_lookup(s, path->name)) == NULL) {
+        return cip_reply(resp, service, CIP_ERR_PATH_UNKNOWN, 0);
+    }
+    count = get16(data);
+    if (service == CIP_READ_TAG_FRAG) {
+        off = get32(data + 2);
+    }
+    if (!cip_element(t, path, &index) || !cip_in_bounds(t, index, count, off, 0)) {
+        return cip_reply(resp, service, CIP_ERR_GENERAL, CIP_EXT_OUT_OF_RANGE);
+    }
+
+    /* Whatever doesn't fit is left for the next fragment, in whole
+     * elements where there's room for one. */
+    total = count * t->elem_size - off;
+    hdr = 4 + cip_type_len(t->type);
+    if (max < hdr) {
+        return cip_reply(resp, service, CIP_ERR_REPLY_TOO_LARGE, 0);
+    }
+    n = total < max - hdr ? total : max - hdr;
+    if (n < total && n >= t->elem_size) {
+        n -= n % t->elem_size;
+    }
+
+    ret = plc_tag_get_raw(t->tag_id, index * t->elem_size + off, resp + hdr, n);
+    if (ret != PLCTAG_STATUS_OK) {
+        return cip_reply(resp, service, CIP_ERR_GENERAL, 0);
+    }
+    cip_reply(resp, service, n < total ? CIP_PARTIAL : CIP_OK, 0);
+    cip_put_type(resp + 4, t);
+    return hdr + n;
+}
+
+/* Write Tag and Write Tag Fragmented. */
+static size_t
+cip_write(struct cip_session* s, uint8_t service, const struct cip_path* path, const uint8_t* data, size_t len,
+    uint8_t* resp)
+{
+    struct cip_tag* t;
+    uint16_t type;
+    uint32_t off = 0, index;
+    size_t count, hdr;
+
+    if (len < 4) {
+        return cip_reply(resp, service, CIP_ERR_NOT_ENOUGH_DATA, 0);
+    }
+    if ((t = cip_lookup(s, path->name)) == NULL) {
+        return cip_reply(resp, service, CIP_ERR_PATH_UNKNOWN, 0);
+    }
+    type = get16(data);
+    hdr = cip_type_len(type) + 2 + (service == CIP_WRITE_TAG_FRAG ? 4 : 0);
+    if (len < hdr) {
+        return cip_reply(resp, service, CIP_ERR_NOT_ENOUGH_DATA, 0);
+    }
+    if (type != t->type) {
+        return cip_reply(resp, service, CIP_ERR_GENERAL, CIP_EXT_TYPE_MISMATCH);
+    }
+    count = get16(data + cip_type_len(type));
+    if (service == CIP_WRITE_TAG_FRAG) {
+        off = get32(data + cip_type_len(type) + 2);
+    }
+    data += hdr;
+    len -= hdr;
+
+    if (!cip_element(t, path, &index) || !cip_in_bounds(t, index, count, off, len)) {
+        return cip_reply(resp, service, CIP_ERR_GENERAL, CIP_EXT_OUT_OF_RANGE);
+    }
+    /* All of it, unless it's a fragment. */
+    if (service == CIP_WRITE_TAG && len != count * t->elem_size) {
+        return cip_reply(
+            resp, service, len < count * t->elem_size ? CIP_ERR_NOT_ENOUGH_DATA : CIP_ERR_TOO_MUCH_DATA, 0);
+    }
+    if (plc_tag_set_raw(t->tag_id, index * t->elem_size + off, data, len) != PLCTAG_STATUS_OK) {
+        return cip_reply(resp, service, CIP_ERR_GENERAL, 0);
+    }
+    return cip_reply(resp, service, CIP_OK, 0);
+}
+
+/* A tag for listing: its instance and name.  The instance of a tag is the
+ * lowest ID of any handle onto it, which stays put while it exists. */
+struct cip_symbol {
+    uint32_t instance;
+    char* name;
+};
+
+static int
+cip_symbol_cmp(const void* lhs, const void* rhs)
+{
+    const struct cip_symbol *l = lhs, *r = rhs;
+    int c = strcmp(l->name, r->name);
+
+    if (c != 0) {
+        return c;
+    }
+    return (l->instance > r->instance) - (l->instance < r->instance);
+}
+
+static int
+cip_instance_cmp(const void* lhs, const void* rhs)
+{
+    const struct cip_symbol *l = lhs, *r = rhs;
+
+    return (l->instance > r->instance) - (l->instance < r->instance);
+}
+
+/* Gets every tag in the tree, one of each name, in order of instance,
+ * returning how many there are (and *syms, to free along with each name). */
+static size_t
+cip_symbols(struct cip_symbol** syms)
+{
+    struct tag_tree_node* meta;
+    struct cip_symbol* v;
+    size_t n = 0, cap = 0, unique = 0;
+    const char *p, *end;
+
+    *syms = NULL;
+    epoch_enter();
+    if ((meta = tag_tree_lookup(METATAG_ID)) == NULL) {
+        epoch_exit();
+        return 0;
+    }
+    tag_store_lock(meta->store);
+    for (p = meta->data, end = meta->data + meta->elem_size; p < end;) {
+        const struct metatag_t* mt = (const struct metatag_t*)(p);
+
+        if (mt->id != 0) {
+            if (n == cap) {
+                cap = cap ? cap * 2 : 256;
+                if ((v = realloc(*syms, cap * sizeof(*v))) == NULL) {
+                    err(1, "realloc");
+                }
+                *syms = v;
+            }
+            (*syms)[n].instance = mt->id;
+            if (((*syms)[n].name = strndup(mt->data, mt->length)) == NULL) {
+                err(1, "strndup");
+            }
+            n++;
+        }
+        p += sizeof(struct metatag_t) + mt->length;
+    }
+    MTX_UNLOCK(&meta->store->mtx);
+    epoch_exit();
+
+    /* One of each name, the first created. */
+    qsort(*syms, n, sizeof(**syms), cip_symbol_cmp);
+    for (size_t i = 0; i < n; ++i) {
+        if (unique > 0 && strcmp((*syms)[unique - 1].name, (*syms)[i].name) == 0) {
+            free((*syms)[i].name);
+        } else {
+            (*syms)[unique++] = (*syms)[i];
+        }
+    }
+    qsort(*syms, unique, sizeof(**syms), cip_instance_cmp);
+    return unique;
+}
+
+/* Get Instance Attribute List on the Symbol class: the tags from the
+ * given instance on, with whichever of their name, type, element size and
+ * dimensions are asked for, in that order, for as many as fit. */
+static size_t
+cip_list(struct cip_session* s, const struct cip_path* path, const uint8_t* data, size_t len, uint8_t* resp,
+    size_t max)
+{
+    const uint8_t service = CIP_GET_INSTANCE_ATTRIBUTE_LIST;
+    struct cip_symbol* syms;
+    bool want[CIP_ATTR_DIMS + 1] = { false };
+    size_t nsyms, nattrs, pos, need, i;
+    uint8_t status = CIP_OK;
+
+    if (len < 2 || len < 2 + 2 * (size_t)(get16(data))) {
+        return cip_reply(resp, service, CIP_ERR_NOT_ENOUGH_DATA, 0);
+    }
+    nattrs = get16(data);
+    for (i = 0; i < nattrs; ++i) {
+        uint16_t a = get16(data + 2 + 2 * i);
+
+        if (a != CIP_ATTR_NAME && a != CIP_ATTR_TYPE && a != CIP_ATTR_ELEM_SIZE && a != CIP_ATTR_DIMS) {
+            return cip_reply(resp, service, CIP_ERR_GENERAL, 0);
+        }
+        want[a] = true;
+    }
+
+    pos = cip_reply(resp, service, CIP_OK, 0);
+    nsyms = cip_symbols(&syms);
+    for (i = 0; i < nsyms; ++i) {
+        struct cip_tag* t;
+        size_t name_len = strlen(syms[i].name);
+
+        if (syms[i].instance < path->instance || (t = cip_lookup(s, syms[i].name)) == NULL) {
+            continue;
+        }
+        need = 4 + (want[CIP_ATTR_NAME] ? 2 + name_len : 0) + (want[CIP_ATTR_TYPE] ? 2 : 0)
+            + (want[CIP_ATTR_ELEM_SIZE] ? 2 : 0) + (want[CIP_ATTR_DIMS] ? 12 : 0);
+        if (pos + need > max) {
+            status = CIP_PARTIAL;
+            break;
+        }
+        put32(resp + pos, syms[i].instance);
+        pos += 4;
+        if (want[CIP_ATTR_NAME]) {
+            put16(resp + pos, name_len);
+            memcpy(resp + pos + 2, syms[i].name, name_len);
+            pos += 2 + name_len;
+        }
+        if (want[CIP_ATTR_TYPE]) {
+            put16(resp + pos, t->symbol_type);
+            pos += 2;
+        }
+        if (want[CIP_ATTR_ELEM_SIZE]) {
+            put16(resp + pos, t->elem_size);
+            pos += 2;
+        }
+        if (want[CIP_ATTR_DIMS]) {
+            put32(resp + pos, t->dims[0]);
+            put32(resp + pos + 4, t->dims[1]);
+            put32(resp + pos + 8, t->dims[2]);
+            pos += 12;
+        }
+    }
+    for (i = 0; i < nsyms; ++i) {
+        free(syms[i].name);
+    }
+    free(syms);
+
+    resp[2] = status;
+    return pos;
+}
+
+/* Forward Open, and Large Forward Open, whose connection parameters are
+ * 32 bits wide so can ask for bigger packets. */
+static size_t
+cip_forward_open(struct cip_session* s, uint8_t service, const uint8_t* data, size_t len, uint8_t* resp,
+                 size_t max)
+{
+    bool large = service == CIP_LARGE_FORWARD_OPEN;
+    size_t params_len = large ? 4 : 2, pos, max_size;
+    struct cip_conn* c = NULL;
+    uint32_t ot_rpi, to_rpi, to_params;
+
+    if (len < 32 + 2 * params_len) {
+        return cip_reply(resp, service, CIP_ERR_NOT_ENOUGH_DATA, 0);
+    }
+    if (cip_reply(resp, service, CIP_OK, 0) + CIP_FORWARD_OPEN_REPLY > max) {
+        return cip_reply(resp, service, CIP_ERR_REPLY_TOO_LARGE, 0);
+    }
+    ot_rpi = get32(data + 22);
+    to_rpi = get32(data + 26 + params_len);
+    to_params = large ? get32(data + 30 + params_len) : get16(data + 30 + params_len);
+
+    /* What we send is bounded by the T->O parameters, of which the low 16
+     * (Large) or 9 bits are the packet size, and which must leave room for
+     * at least an error reply. */
+    max_size = to_params & (large ? 0xffff : 0x1ff);
+    if (max_size < CIP_MIN_REPLY) {
+        return cip_reply(resp, service, CIP_ERR_CONNECTION, CIP_EXT_INVALID_SIZE);
+    }
+    if (max_size > CIP_MAX_CONNECTED) {
+        max_size = CIP_MAX_CONNECTED;
+    }
+
+    for (size_t i = 0; i < CIP_MAX_CONNS && c == NULL; ++i) {
+        if (!s->conns[i].open) {
+            c = &s->conns[i];
+        }
+    }
+    if (c == NULL) {
+        return cip_reply(resp, service, CIP_ERR_CONNECTION, CIP_EXT_NO_CONNECTIONS);
+    }
+
+    c->open = true;
+    c->ot_id = __atomic_add_fetch(&cip_next_conn, 1, __ATOMIC_RELAXED) ^ 0x50430000U;
+    c->to_id = get32(data + 6);
+    c->serial = get16(data + 10);
+    c->vendor = get16(data + 12);
+    c->orig_serial = get32(data + 14);
+    c->max_size = max_size;
+
+    pdebug(PLCTAG_DEBUG_DETAIL, "Opened connection %08x for packets of %zu bytes", c->ot_id, c->max_size);
+
+    pos = cip_reply(resp, service, CIP_OK, 0);
+    put32(resp + pos, c->ot_id);
+    put32(resp + pos + 4, c->to_id);
+    put16(resp + pos + 8, c->serial);
+    put16(resp + pos + 10, c->vendor);
+    put32(resp + pos + 12, c->orig_serial);
+    put32(resp + pos + 16, ot_rpi);
+    put32(resp + pos + 20, to_rpi);
+    resp[pos + 24] = 0; /* application reply size */
+    resp[pos + 25] = 0;
+    return pos + CIP_FORWARD_OPEN_REPLY;
+}
+
+static size_t
+cip_forward_close(struct cip_session* s, const uint8_t* data, size_t len, uint8_t* resp, size_t max)
+{
+    const uint8_t service = CIP_FORWARD_CLOSE;
+    size_t pos;
+
+    if (len < 10) {
+        return cip_reply(resp, service, CIP_ERR_NOT_ENOUGH_DATA, 0);
+    }
+    /* Left open, rather than closed with nobody told. */
+    if (cip_reply(resp, service, CIP_OK, 0) + CIP_FORWARD_CLOSE_REPLY > max) {
+        return cip_reply(resp, service, CIP_ERR_REPLY_TOO_LARGE, 0);
+    }
+    for (size_t i = 0; i < CIP_MAX_CONNS; ++i) {
+        struct cip_conn* c = &s->conns[i];
+
+        if (c->open && c->serial == get16(data + 2) && c->vendor == get16(data + 4)
+            && c->orig_serial == get32(data + 6)) {
+            c->open = false;
+            pos = cip_reply(resp, service, CIP_OK, 0);
+            memcpy(resp + pos, data + 2, 8);
+            resp[pos + 8] = 0;
+            resp[pos + 9] = 0;
+            return pos + CIP_FORWARD_CLOSE_REPLY;
+        }
+    }
+    return cip_reply(resp, service, CIP_ERR_CONNECTION, CIP_EXT_CONNECTION_NOT_FOUND);
+}
+
+static size_t
+cip_request(struct cip_session* s, const uint8_t* req, size_t len, uint8_t* resp, size_t max);
+
+/* Multiple Service Packet: each of the requests, in turn, its reply
+ * getting whatever room the ones before it left. */
+static size_t
+cip_multiple(struct cip_session* s, const uint8_t* data, size_t len, uint8_t* resp, size_t max)
+{
+    const uint8_t service = CIP_MULTIPLE_SERVICE;
+    size_t n, pos, base, start, stop;
+    uint8_t status = CIP_OK;
+
+    if (len < 2 || len < 2 + 2 * (size_t)(get16(data))) {
+        return cip_reply(resp, service, CIP_ERR_NOT_ENOUGH_DATA, 0);
+    }
+    n = get16(data);
+    base = cip_reply(resp, service, CIP_OK, 0);
+    pos = base + 2 + 2 * n;
+    if (pos > max) {
+        return cip_reply(resp, service, CIP_ERR_REPLY_TOO_LARGE, 0);
+    }
+    put16(resp + base, n);
+
+    for (size_t i = 0; i < n; ++i) {
+        start = get16(data + 2 + 2 * i);
+        stop = i + 1 < n ? get16(data + 2 + 2 * (i + 1)) : len;
+        if (start < 2 + 2 * n || start > stop || stop > len) {
+            return cip_reply(resp, service, CIP_ERR_NOT_ENOUGH_DATA, 0);
+        }
+        if (pos + CIP_MIN_REPLY > max) {
+            return cip_reply(resp, service, CIP_ERR_REPLY_TOO_LARGE, 0);
+        }
+        /* Offsets are from the count, as those in the request are. */
+        put16(resp + base + 2 + 2 * i, pos - base);
+        pos += cip_request(s, data + start, stop - start, resp + pos, max - pos);
+    }
+
+    /* Any reply of the lot failing shows up in the overall status. */
+    for (size_t i = 0; i < n; ++i) {
+        uint8_t sub = resp[base + get16(resp + base + 2 + 2 * i) + 2];
+
+        if (sub != CIP_OK && sub != CIP_PARTIAL) {
+            status = CIP_ERR_EMBEDDED;
+        }
+    }
+    resp[2] = status;
+    return pos;
+}
+
+/* Unconnected Send: the embedded request, its reply going back as is. */
+static size_t
+cip_unconnected_send(struct cip_session* s, const uint8_t* data, size_t len, uint8_t* resp, size_t max)
+{
+    size_t n;
+
+    if (len < 4 || (n = get16(data + 2)) > len - 4) {
+        return cip_reply(resp, CIP_READ_TAG_FRAG, CIP_ERR_NOT_ENOUGH_DATA, 0);
+    }
+    return cip_request(s, data + 4, n, resp, max);
+}
+
+/* Handles the CIP request of len bytes at req, leaving a reply of at most
+ * max (at least CIP_MIN_REPLY) bytes at resp and returning its length. */
+static size_t
+cip_request(struct cip_session* s, const uint8_t* req, size_t len, uint8_t* resp, size_t max)
+{
+    struct cip_path path;
+    uint8_t service;
+    size_t path_len;
+    int ret;
+
+    if (len < 2 || (path_len = 2 * (size_t)(req[1])) > len - 2) {
+        return cip_reply(resp, len ? req[0] : 0, CIP_ERR_PATH_SEGMENT, 0);
+    }
+    service = req[0];
+    if ((ret = cip_parse_path(req + 2, path_len, &path)) != CIP_OK) {
+        return cip_reply(resp, service, ret, 0);
+    }
+    req += 2 + path_len;
+    len -= 2 + path_len;
+
+    if (path.cls == CIP_CLASS_CONNECTION_MANAGER) {
+        switch (service) {
+        case CIP_FORWARD_OPEN:
+        case CIP_LARGE_FORWARD_OPEN:
+            return cip_forward_open(s, service, req, len, resp, max);
+        case CIP_FORWARD_CLOSE:
+            return cip_forward_close(s, req, len, resp, max);
+        case CIP_READ_TAG_FRAG:
+            return cip_unconnected_send(s, req, len, resp, max);
+        }
+    } else if (path.cls == CIP_CLASS_SYMBOL && path.name[0] == '\0') {
+        if (service == CIP_GET_INSTANCE_ATTRIBUTE_LIST) {
+            return cip_list(s, &path, req, len, resp, max);
+        }
+    } else if (path.name[0] != '\0') {
+        switch (service) {
+        case CIP_READ_TAG:
+        case CIP_READ_TAG_FRAG:
+            return cip_read(s, service, &path, req, len, resp, max);
+        case CIP_WRITE_TAG:
+        case CIP_WRITE_TAG_FRAG:
+            return cip_write(s, service, &path, req, len, resp);
+        }
+    } else if (service == CIP_MULTIPLE_SERVICE) {
+        return cip_multiple(s, req, len, resp, max);
+    }
+
+    pdebug(PLCTAG_DEBUG_DETAIL, "Unsupported CIP service %02x", service);
+    return cip_reply(resp, service, CIP_ERR_SERVICE, 0);
+}
+
+/* Finds the connection a client addresses by id. */
+static struct cip_conn*
+cip_conn_find(struct cip_session* s, uint32_t id)
+{
+    for (size_t i = 0; i < CIP_MAX_CONNS; ++i) {
+        if (s->conns[i].open && s->conns[i].ot_id == id) {
+            return &s->conns[i];
+        }
+    }
+    return NULL;
+}
+
+/* SendRRData and SendUnitData: a common packet format holding an address
+ * item and a data item with the CIP request in it, replied to in kind.
+ * Returns the length of the reply's data, or -1 if the packet is bad. */
+static ssize_t
+cip_send_data(struct cip_session* s, uint16_t cmd, const uint8_t* data, size_t len, uint8_t* out)
+{
+    bool connected = cmd == ENCAP_SEND_UNIT_DATA;
+    uint16_t addr_type, addr_len, data_type, data_len;
+    const uint8_t* p = data + 8;
+    struct cip_conn* c = NULL;
+    size_t n, pos;
+
+    /* interface handle, timeout, item count, then the two items */
+    if (len < 8 || get16(data + 6) != 2 || len < 12) {
+        return -1;
+    }
+    addr_type = get16(p);
+    addr_len = get16(p + 2);
+    if ((size_t)(addr_len) + 16 > len) {
+        return -1;
+    }
+    p += 4 + addr_len;
+    data_type = get16(p);
+    data_len = get16(p + 2);
+    p += 4;
+    if ((size_t)(p - data) + data_len > len) {
+        return -1;
+    }
+
+    if (connected) {
+        if (addr_type != CPF_CONNECTED_ADDRESS || addr_len != 4 || data_type != CPF_CONNECTED_DATA || data_len < 2
+            || (c = cip_conn_find(s, get32(data + 12))) == NULL) {
+            return -1;
+        }
+    } else if (addr_type != CPF_NULL_ADDRESS || data_type != CPF_UNCONNECTED_DATA) {
+        return -1;
+    }
+
+    put32(out, 0);
+    put16(out + 4, 0);
+    put16(out + 6, 2);
+    if (connected) {
+        /* The sequence number goes back as it came. */
+        put16(out + 8, CPF_CONNECTED_ADDRESS);
+        put16(out + 10, 4);
+        put32(out + 12, c->to_id);
+        put16(out + 16, CPF_CONNECTED_DATA);
+        memcpy(out + 20, p, 2);
+        pos = 22;
+        n = cip_request(s, p + 2, data_len - 2, out + pos, c->max_size);
+        put16(out + 18, 2 + n);
+    } else {
+        put16(out + 8, CPF_NULL_ADDRESS);
+        put16(out + 10, 0);
+        put16(out + 12, CPF_UNCONNECTED_DATA);
+        pos = 16;
+        n = cip_request(s, p, data_len, out + pos, CIP_MAX_UNCONNECTED);
+        put16(out + 14, n);
+    }
+    return pos + n;
+}
+
+ssize_t
+cip_handle(struct cip_session* s, const uint8_t* in, size_t len, uint8_t* out, size_t* out_len)
+{
+    uint16_t cmd;
+    size_t data_len;
+    ssize_t n = 0;
+    uint32_t status = 0;
+    const uint8_t* data = in + CIP_ENCAP_HEADER;
+    uint8_t* reply = out + CIP_ENCAP_HEADER;
+
+    *out_len = 0;
+    if (len < CIP_ENCAP_HEADER || len < CIP_ENCAP_HEADER + (data_len = get16(in + 2))) {
+        return 0;
+    }
+    cmd = get16(in);
+
+    switch (cmd) {
+    case ENCAP_NOP:
+        return CIP_ENCAP_HEADER + data_len;
+    case ENCAP_UNREGISTER_SESSION:
+        return -1;
+    case ENCAP_LIST_SERVICES:
+        put16(reply, 1);
+        put16(reply + 2, 0x0100);
+        put16(reply + 4, 20);
+        put16(reply + 6, 1); /* version */
+        put16(reply + 8, 0x0120); /* CIP over TCP and UDP */
+        memset(reply + 10, 0, 16);
+        memcpy(reply + 10, "Communications", 14);
+        n = 26;
+        break;
+    case ENCAP_LIST_IDENTITY:
+        /* One CIP Identity item, its length being what follows the
+         * length. */
+        put16(reply, 1);
+        put16(reply + 2, 0x000c);
+        put16(reply + 6, 1); /* version */
+        memset(reply + 8, 0, 16); /* socket address */
+        put16(reply + 24, 1); /* Rockwell */
+        put16(reply + 26, 0x0e); /* a PLC */
+        put16(reply + 28, 0x0001);
+        reply[30] = 20; /* revision */
+        reply[31] = 0;
+        put16(reply + 32, 0); /* status */
+        put32(reply + 34, 0x504c4353); /* serial */
+        reply[38] = sizeof(CIP_PRODUCT_NAME) - 1;
+        memcpy(reply + 39, CIP_PRODUCT_NAME, reply[38]);
+        n = 39 + reply[38];
+        reply[n++] = 3; /* running */
+        put16(reply + 4, n - 6);
+        break;
+    case ENCAP_REGISTER_SESSION:
+        if (data_len < 4) {
+            status = ENCAP_ERR_DATA;
+        } else if (get16(data) != 1) {
+            status = ENCAP_ERR_PROTOCOL;
+            memcpy(reply, data, 4);
+            n = 4;
+        } else {
+            if (s->handle == 0) {
+                s->handle = __atomic_add_fetch(&cip_next_session, 1, __ATOMIC_RELAXED) | 0x10000;
+            }
+            memcpy(reply, data, 4);
+            n = 4;
+        }
+        break;
+    case ENCAP_SEND_RR_DATA:
+    case ENCAP_SEND_UNIT_DATA:
+        if (s->handle == 0 || get32(in + 4) != s->handle) {
+            status = ENCAP_ERR_SESSION;
+        } else if ((n = cip_send_data(s, cmd, data, data_len, reply)) < 0) {
+            status = ENCAP_ERR_DATA;
+            n = 0;
+        }
+        break;
+    default:
+        status = ENCAP_ERR_COMMAND;
+        break;
+    }
+
+    memcpy(out, in, CIP_ENCAP_HEADER);
+    put16(out + 2, n);
+    put32(out + 4, cmd == ENCAP_REGISTER_SESSION ? s->handle : get32(in + 4));
+    put32(out + 8, status);
+    *out_len = CIP_ENCAP_HEADER + n;
+    return CIP_ENCAP_HEADER + data_len;
+}
@@ -0,0 +1,437 @@
+/* conn.c
+ *
+ * Simulated PLC connections: a latency, jitter and bandwidth model for
+ * in-flight reads and writes.
+ */
+
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "conn.h"
+#include "debug.h"
+#include "libplctag.h"
+#include "lock_utils.h"
+
+/* Parameters that connections pick up when they are created. */
+struct conn_config {
+    char* gateway;
+    char* path; /* NULL to match any path */
+    struct plcstub_conn_params params;
+    struct conn_config* next;
+};
+
+/* Ensures mutual exclusion on the connection and configuration lists (but
+ * not on the connections themselves, which have their own mutex). */
+static pthread_mutex_t conn_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct conn* conns;
+static struct conn_config* configs;
+static bool env_parsed = false;
+
+/* Used by tags that weren't created with connection attributes. */
+static struct conn default_conn = {
+    .mtx = PTHREAD_MUTEX_INITIALIZER,
+    .rng = 0x9e3779b97f4a7c15ULL,
+};
+
+static int
+strcmp_null(const char* lhs, const char* rhs)
+{
+    return strcmp(lhs ? lhs : "", rhs ? rhs : "");
+}
+
+/* Compares a connection's attribute with one from a tag's attribute
+ * string, a missing one matching "". */
+static bool
+conn_attr_eq(const char* s, const struct attr_span* v)
+{
+    size_t len = v->p ? v->len : 0;
+
+    return strlen(s) == len && (len == 0 || memcmp(s, v->p, len) == 0);
+}
+
+/* Copies an attribute from a tag's attribute string, a missing one being "". */
+static char*
+conn_attr_dup(const struct attr_span* v)
+{
+    char* s = v->p ? strndup(v->p, v->len) : strdup("");
+
+    if (s == NULL) {
+        err(1, "strdup");
+    }
+    return s;
+}
+
+/* Finds the configuration best matching a gateway and path: one for that
+ * exact gateway and path, then one for the gateway alone, then the
+ * wildcard.
+ *
+ * Assumes that conn_mtx is held.
+ */
+static const struct plcstub_conn_params*
+conn_config_find(const char* gateway, const char* path)
+{
+    struct conn_config *cfg, *gw_match = NULL, *wildcard = NULL;
+
+    for (cfg = configs; cfg != NULL; cfg = cfg->next) {
+        if (strcmp(cfg->gateway, "*") == 0) {
+            wildcard = cfg;
+        } else if (strcmp_null(cfg->gateway, gateway) == 0) {
+            if (cfg->path == NULL) {
+                gw_match = cfg;
+            } else if (strcmp_null(cfg->path, path) == 0) {
+                return &cfg->params;
+            }
+        }
+    }
+
+    if (gw_match) {
+        return &gw_match->params;
+    }
+    return wildcard ? &wildcard->params : NULL;
+}
+
+/* Assumes that conn_mtx is held. */
+static void
+conn_config_set(const char* gateway, const char* path, const struct plcstub_conn_params* params)
+{
+    struct conn_config* cfg;
+
+    for (cfg = configs; cfg != NULL; cfg = cfg->next) {
+        if (strcmp(cfg->gateway, gateway) == 0 && strcmp_null(cfg->path, path) == 0
+            && (cfg->path == NULL) == (path == NULL)) {
+            break;
+        }
+    }
+
+    if (cfg == NULL) {
+        cfg = calloc(1, sizeof(*cfg));
+        if (cfg == NULL) {
+            err(1, "calloc");
+        }
+        cfg->gateway = strdup(gateway);
+        cfg->path = path ? strdup(path) : NULL;
+        if (cfg->gateway == NULL || (path && cfg->path == NULL)) {
+            err(1, "strdup");
+        }
+        cfg->next = configs;
+        configs = cfg;
+    }
+    cfg->params = *params;
+
+    if (strcmp(gateway, "*") == 0) {
+        MTX_LOCK(&default_conn.mtx);
+        default_conn.params = *params;
+        MTX_UNLOCK(&default_conn.mtx);
+    }
+}
+
+/* Parses one "key=value" connection setting into params. */
+static int
+conn_parse_setting(char* kv, struct plcstub_conn_params* params)
+{
+    char *key = kv, *val = strchr(kv, '=');
+
+    if (val == NULL) {
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+    *val++ = '\0';
+
+    if (strcmp(key, "latency_us") == 0) {
+        params->latency_us = atol(val);
+    } else if (strcmp(key, "jitter_us") == 0) {
+        params->jitter_us = atol(val);
+    } else if (strcmp(key, "jitter") == 0) {
+        if (strcmp(val, "uniform") == 0) {
+            params->jitter = PLCSTUB_JITTER_UNIFORM;
+        } else if (strcmp(val, "normal") == 0) {
+            params->jitter = PLCSTUB_JITTER_NORMAL;
+        } else if (strcmp(val, "exponential") == 0) {
+            params->jitter = PLCSTUB_JITTER_EXPONENTIAL;
+        } else {
+            return PLCTAG_ERR_BAD_PARAM;
+        }
+    } else if (strcmp(key, "packet_size") == 0) {
+        params->packet_size = atol(val);
+    } else if (strcmp(key, "packet_us") == 0) {
+        params->packet_us = atol(val);
+    } else if (strcmp(key, "bytes_per_sec") == 0) {
+        params->bytes_per_sec = atof(val);
+    } else {
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+/* Reads connection configuration from $PLCSTUB_CONN, which holds
+ * ';'-separated entries of the form
+ *
+ *     gateway[/path]:key=value,key=value...
+ *
+ * with a gateway of "*" setting the default.
+ *
+ * Assumes that conn_mtx is held.
+ */
+static void
+conn_parse_env()
+{
+    const char* env;
+    char *str, *entry, *entry_ctx;
+
+    if (env_parsed) {
+        return;
+    }
+    env_parsed = true;
+
+    if ((env = getenv("PLCSTUB_CONN")) == NULL) {
+        return;
+    }
+
+    str = strdup(env);
+    if (str == NULL) {
+        err(1, "strdup");
+    }
+
+    for (entry = strtok_r(str, ";", &entry_ctx);
+         entry != NULL;
+         entry = strtok_r(NULL, ";", &entry_ctx)) {
+        struct plcstub_conn_params params = { 0 };
+        char *target = entry, *settings, *path, *kv, *kv_ctx;
+
+        if ((settings = strchr(entry, ':')) == NULL) {
+            errx(1, "PLCSTUB_CONN: missing ':' in \"%s\"", entry);
+        }
+        *settings++ = '\0';
+        if ((path = strchr(target, '/')) != NULL) {
+            *path++ = '\0';
+        }
+
+        for (kv = strtok_r(settings, ",", &kv_ctx);
+             kv != NULL;
+             kv = strtok_r(NULL, ",", &kv_ctx)) {
+            if (conn_parse_setting(kv, &params) != PLCTAG_STATUS_OK) {
+                errx(1, "PLCSTUB_CONN: bad setting \"%s\" for %s", kv, target);
+            }
+        }
+
+        pdebug(PLCTAG_DEBUG_DETAIL, "Connection parameters for %s%s%s from the environment",
+            target, path ? "/" : "", path ? path : "");
+        conn_config_set(target, path, &params);
+    }
+
+    free(str);
+}
+
+int
+plcstub_set_conn_params(const char* gateway, const char* path, const struct plcstub_conn_params* params)
+{
+    struct conn* c;
+
+    if (gateway == NULL || params == NULL) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    MTX_LOCK(&conn_mtx);
+
+    conn_parse_env();
+    conn_config_set(gateway, path, params);
+
+    /* Connections that already exist pick up the change too. */
+    for (c = conns; c != NULL; c = c->next) {
+        const struct plcstub_conn_params* p = conn_config_find(c->gateway, c->path);
+
+        MTX_LOCK(&c->mtx);
+        c->params = p ? *p : (struct plcstub_conn_params) { 0 };
+        MTX_UNLOCK(&c->mtx);
+    }
+
+    MTX_UNLOCK(&conn_mtx);
+
+    return PLCTAG_STATUS_OK;
+}
+
+struct conn*
+conn_get(const struct attr_span* gateway, const struct attr_span* path, const struct attr_span* cpu)
+{
+    struct conn* c;
+    const struct plcstub_conn_params* params;
+
+    MTX_LOCK(&conn_mtx);
+
+    conn_parse_env();
+
+    if (gateway->p == NULL && path->p == NULL && cpu->p == NULL) {
+        MTX_UNLOCK(&conn_mtx);
+        return &default_conn;
+    }
+
+    for (c = conns; c != NULL; c = c->next) {
+        if (conn_attr_eq(c->gateway, gateway) && conn_attr_eq(c->path, path) && conn_attr_eq(c->cpu, cpu)) {
+            MTX_UNLOCK(&conn_mtx);
+            return c;
+        }
+    }
+
+    c = calloc(1, sizeof(*c));
+    if (c == NULL) {
+        err(1, "calloc");
+    }
+    if (pthread_mutex_init(&c->mtx, NULL)) {
+        err(1, "pthread_mutex_init");
+    }
+    c->gateway = conn_attr_dup(gateway);
+    c->path = conn_attr_dup(path);
+    c->cpu = conn_attr_dup(cpu);
+    c->rng = 0x9e3779b97f4a7c15ULL ^ (uintptr_t)(c);
+    if ((params = conn_config_find(c->gateway, c->path)) != NULL) {
+        c->params = *params;
+    }
+    c->next = conns;
+    conns = c;
+
+    pdebug(PLCTAG_DEBUG_DETAIL, "New connection %s/%s/%s (latency %ldus)",
+        c->gateway, c->path, c->cpu, c->params.latency_us);
+
+    MTX_UNLOCK(&conn_mtx);
+
+    return c;
+}
+
+/* xorshift64*, returning a double on [0, 1).  Assumes that c->mtx is held. */
+static double
+conn_uniform(struct conn* c)
+{
+    c->rng ^= c->rng >> 12;
+    c->rng ^= c->rng << 25;
+    c->rng ^= c->rng >> 27;
+    return ((c->rng * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / (1ULL << 53));
+}
+
+/* Natural log, for the exponential jitter distribution, so that the library
+ * doesn't have to drag in libm.  Good to about 1e-10 on (0, 1]. */
+static double
+conn_ln(double x)
+{
+    double z, z2, term, sum = 0;
+    int e = 0;
+
+    while (x < 0.5) {
+        x *= 2;
+        e--;
+    }
+    z = (x - 1) / (x + 1);
+    z2 = z * z;
+    term = z;
+    for (int k = 1; k < 40; k += 2) {
+        sum += term / k;
+        term *= z2;
+    }
+    return 2 * sum + e * 0.69314718055994530942;
+}
+
+/* Assumes that c->mtx is held. */
+static long
+conn_jitter_ns(struct conn* c)
+{
+    double j = c->params.jitter_us * 1000.0, u;
+
+    if (j <= 0) {
+        return 0;
+    }
+
+    switch (c->params.jitter) {
+    case PLCSTUB_JITTER_NORMAL:
+        /* Irwin-Hall: the sum of twelve uniforms, less six, is close
+         * enough to a standard normal for our purposes. */
+        u = -6;
+        for (int i = 0; i < 12; ++i) {
+            u += conn_uniform(c);
+        }
+        return (long)(j * (u < 0 ? -u : u));
+    case PLCSTUB_JITTER_EXPONENTIAL:
+        return (long)(-j * conn_ln(1.0 - conn_uniform(c)));
+    case PLCSTUB_JITTER_UNIFORM:
+    default:
+        return (long)(j * conn_uniform(c));
+    }
+}
+
+static void
+timespec_add_ns(struct timespec* ts, long long ns)
+{
+    ns += ts->tv_nsec;
+    ts->tv_sec += ns / 1000000000LL;
+    ts->tv_nsec = ns % 1000000000LL;
+}
+
+void
+conn_schedule(struct conn* c, size_t nbytes, struct timespec* due)
+{
+    long long transfer_ns;
+    size_t npackets = 1;
+    struct timespec now;
+
+    if (c == NULL) {
+        c = &default_conn;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    MTX_LOCK(&c->mtx);
+
+    if (c->params.packet_size > 0 && nbytes > c->params.packet_size) {
+        npackets = (nbytes + c->params.packet_size - 1) / c->params.packet_size;
+    }
+    transfer_ns = (long long)(npackets)*c->params.packet_us * 1000;
+    if (c->params.bytes_per_sec > 0) {
+        transfer_ns += (long long)(nbytes * 1e9 / c->params.bytes_per_sec);
+    }
+
+    /* Transfers share the link, so each one starts once the link is free;
+     * the round-trip latency is paid on top of that, but overlaps. */
+    if (c->link_free.tv_sec < now.tv_sec
+        || (c->link_free.tv_sec == now.tv_sec && c->link_free.tv_nsec < now.tv_nsec)) {
+        c->link_free = now;
+    }
+    timespec_add_ns(&c->link_free, transfer_ns);
+
+    *due = c->link_free;
+    timespec_add_ns(due, c->params.latency_us * 1000LL + conn_jitter_ns(c));
+
+    MTX_UNLOCK(&c->mtx);
+}
+
+void
+conn_shutdown(void)
+{
+    struct conn *c, *c_next;
+    struct conn_config *cfg, *cfg_next;
+
+    MTX_LOCK(&conn_mtx);
+
+    for (c = conns; c != NULL; c = c_next) {
+        c_next = c->next;
+        pthread_mutex_destroy(&c->mtx);
+        free(c->gateway);
+        free(c->path);
+        free(c->cpu);
+        free(c);
+    }
+    for (cfg = configs; cfg != NULL; cfg = cfg_next) {
+        cfg_next = cfg->next;
+        free(cfg->gateway);
+        free(cfg->path);
+        free(cfg);
+    }
+    conns = NULL;
+    configs = NULL;
+    env_parsed = false;
+    memset(&default_conn.params, 0, sizeof(default_conn.params));
+    memset(&default_conn.link_free, 0, sizeof(default_conn.link_free));
+
+    MTX_UNLOCK(&conn_mtx);
+}
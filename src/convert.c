@@ -0,0 +1,859 @@
+/* convert.c
+ *
+ * Conversion kernels for the array accessors; see convert.h.
+ */
+
+#include <endian.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "convert.h"
+#include "debug.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONVERT_HAVE_X86 1
+#endif
+
+#if defined(__aarch64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define CONVERT_HAVE_NEON 1
+#endif
+
+/* The range of each integer type, as floats: the largest float below
+ * 2^31 (or 2^63) stands in for the maximum, which a float can't hold. */
+#define CONVERT_SINT_MIN -128.0f
+#define CONVERT_SINT_MAX 127.0f
+#define CONVERT_INT_MIN -32768.0f
+#define CONVERT_INT_MAX 32767.0f
+#define CONVERT_DINT_MIN -0x1p31f
+#define CONVERT_DINT_MAX 0x1.fffffep30f
+#define CONVERT_LINT_MIN -0x1p63f
+#define CONVERT_LINT_MAX 0x1.fffffep62f
+
+/* Loads and stores of single little-endian elements. */
+
+static inline int8_t
+convert_ld_SINT(const uint8_t* p)
+{
+    return (int8_t)(*p);
+}
+
+static inline int16_t
+convert_ld_INT(const uint8_t* p)
+{
+    uint16_t u;
+
+    memcpy(&u, p, sizeof(u));
+    return (int16_t)(le16toh(u));
+}
+
+static inline int32_t
+convert_ld_DINT(const uint8_t* p)
+{
+    uint32_t u;
+
+    memcpy(&u, p, sizeof(u));
+    return (int32_t)(le32toh(u));
+}
+
+static inline int64_t
+convert_ld_LINT(const uint8_t* p)
+{
+    uint64_t u;
+
+    memcpy(&u, p, sizeof(u));
+    return (int64_t)(le64toh(u));
+}
+
+static inline float
+convert_ld_REAL(const uint8_t* p)
+{
+    uint32_t u;
+    float f;
+
+    memcpy(&u, p, sizeof(u));
+    u = le32toh(u);
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+static inline double
+convert_ld_LREAL(const uint8_t* p)
+{
+    uint64_t u;
+    double d;
+
+    memcpy(&u, p, sizeof(u));
+    u = le64toh(u);
+    memcpy(&d, &u, sizeof(d));
+    return d;
+}
+
+static inline void
+convert_st_SINT(uint8_t* p, float f)
+{
+    *p = (uint8_t)((int8_t)(f));
+}
+
+static inline void
+convert_st_INT(uint8_t* p, float f)
+{
+    uint16_t u = htole16((uint16_t)((int16_t)(f)));
+
+    memcpy(p, &u, sizeof(u));
+}
+
+static inline void
+convert_st_DINT(uint8_t* p, float f)
+{
+    uint32_t u = htole32((uint32_t)((int32_t)(f)));
+
+    memcpy(p, &u, sizeof(u));
+}
+
+static inline void
+convert_st_LINT(uint8_t* p, float f)
+{
+    uint64_t u = htole64((uint64_t)((int64_t)(f)));
+
+    memcpy(p, &u, sizeof(u));
+}
+
+static inline void
+convert_st_REAL(uint8_t* p, float f)
+{
+    uint32_t u;
+
+    memcpy(&u, &f, sizeof(u));
+    u = htole32(u);
+    memcpy(p, &u, sizeof(u));
+}
+
+static inline void
+convert_st_LREAL(uint8_t* p, float f)
+{
+    double d = f;
+    uint64_t u;
+
+    memcpy(&u, &d, sizeof(u));
+    u = htole64(u);
+    memcpy(p, &u, sizeof(u));
+}
+
+/* Clamps x to [lo, hi] as the vector min and max instructions do (a NaN
+ * comes out as lo), then rounds it half to even as their conversions do,
+ * without libm: adding 2^23 to a smaller magnitude leaves no bits below
+ * the point, and floats from 2^23 up are integers already. */
+static inline float
+convert_clamp_round(float x, float lo, float hi)
+{
+    float a;
+
+    x = x > lo ? x : lo;
+    x = x < hi ? x : hi;
+    a = __builtin_fabsf(x);
+    if (a < 0x1p23f) {
+        a = (a + 0x1p23f) - 0x1p23f;
+        x = __builtin_copysignf(a, x);
+    }
+    return x;
+}
+
+/* The scalar kernels, which the vector ones finish their tails with. */
+
+#define SCALAR_GET(T, width)                                                      \
+    static void                                                                   \
+    convert_get_##T##_scalar(void* dst, const void* src, size_t n, const struct convert_args* a) \
+    {                                                                             \
+        float* d = dst;                                                           \
+        const uint8_t* s = src;                                                   \
+                                                                                  \
+        for (size_t i = 0; i < n; ++i) {                                          \
+            d[i] = (float)(convert_ld_##T(s + i * (width))) * a->scale + a->bias; \
+        }                                                                         \
+    }
+
+#define SCALAR_SET(T, width, lo, hi)                                              \
+    static void                                                                   \
+    convert_set_##T##_scalar(void* dst, const void* src, size_t n, const struct convert_args* a) \
+    {                                                                             \
+        uint8_t* d = dst;                                                         \
+        const float* s = src;                                                     \
+                                                                                  \
+        for (size_t i = 0; i < n; ++i) {                                          \
+            convert_st_##T(d + i * (width),                                       \
+                convert_clamp_round(s[i] * a->inv_scale + a->inv_bias, (lo), (hi))); \
+        }                                                                         \
+    }
+
+/* Floating-point types are neither clamped nor rounded. */
+#define SCALAR_SET_FLOAT(T, width)                                                \
+    static void                                                                   \
+    convert_set_##T##_scalar(void* dst, const void* src, size_t n, const struct convert_args* a) \
+    {                                                                             \
+        uint8_t* d = dst;                                                         \
+        const float* s = src;                                                     \
+                                                                                  \
+        for (size_t i = 0; i < n; ++i) {                                          \
+            convert_st_##T(d + i * (width), s[i] * a->inv_scale + a->inv_bias);   \
+        }                                                                         \
+    }
+
+SCALAR_GET(SINT, 1)
+SCALAR_GET(INT, 2)
+SCALAR_GET(DINT, 4)
+SCALAR_GET(LINT, 8)
+SCALAR_GET(REAL, 4)
+SCALAR_GET(LREAL, 8)
+SCALAR_SET(SINT, 1, CONVERT_SINT_MIN, CONVERT_SINT_MAX)
+SCALAR_SET(INT, 2, CONVERT_INT_MIN, CONVERT_INT_MAX)
+SCALAR_SET(DINT, 4, CONVERT_DINT_MIN, CONVERT_DINT_MAX)
+SCALAR_SET(LINT, 8, CONVERT_LINT_MIN, CONVERT_LINT_MAX)
+SCALAR_SET_FLOAT(REAL, 4)
+SCALAR_SET_FLOAT(LREAL, 8)
+
+static const struct convert_kernels convert_scalar = {
+    .name = "scalar",
+    .isa = CONVERT_SCALAR,
+    .get_scaled = {
+        [TAG_SINT] = convert_get_SINT_scalar,
+        [TAG_INT] = convert_get_INT_scalar,
+        [TAG_DINT] = convert_get_DINT_scalar,
+        [TAG_LINT] = convert_get_LINT_scalar,
+        [TAG_REAL] = convert_get_REAL_scalar,
+        [TAG_LREAL] = convert_get_LREAL_scalar,
+    },
+    .set_scaled = {
+        [TAG_SINT] = convert_set_SINT_scalar,
+        [TAG_INT] = convert_set_INT_scalar,
+        [TAG_DINT] = convert_set_DINT_scalar,
+        [TAG_LINT] = convert_set_LINT_scalar,
+        [TAG_REAL] = convert_set_REAL_scalar,
+        [TAG_LREAL] = convert_set_LREAL_scalar,
+    },
+};
+
+#ifdef CONVERT_HAVE_X86
+
+/* SSE2, four floats at a time.  (It's baseline on x86-64, but not on
+ * i386, hence the target attributes.) */
+
+#define SSE2 __attribute__((target("sse2")))
+
+SSE2 static inline void
+convert_sse2_put(float* d, __m128i x, __m128 scale, __m128 bias)
+{
+    _mm_storeu_ps(d, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(x), scale), bias));
+}
+
+/* The low and high halves of eight INTs, sign-extended to DINTs. */
+SSE2 static inline __m128i
+convert_sse2_lo16(__m128i v)
+{
+    return _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+}
+
+SSE2 static inline __m128i
+convert_sse2_hi16(__m128i v)
+{
+    return _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+}
+
+SSE2 static void
+convert_get_SINT_sse2(void* dst, const void* src, size_t n, const struct convert_args* a)
+{
+    __m128 scale = _mm_set1_ps(a->scale), bias = _mm_set1_ps(a->bias);
+    const uint8_t* s = src;
+    float* d = dst;
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i lo = _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8);
+        __m128i hi = _mm_srai_epi16(_mm_unpackhi_epi8(v, v), 8);
+
+        convert_sse2_put(d + i, convert_sse2_lo16(lo), scale, bias);
+        convert_sse2_put(d + i + 4, convert_sse2_hi16(lo), scale, bias);
+        convert_sse2_put(d + i + 8, convert_sse2_lo16(hi), scale, bias);
+        convert_sse2_put(d + i + 12, convert_sse2_hi16(hi), scale, bias);
+    }
+    convert_get_SINT_scalar(d + i, s + i, n - i, a);
+}
+
+SSE2 static void
+convert_get_INT_sse2(void* dst, const void* src, size_t n, const struct convert_args* a)
+{
+    __m128 scale = _mm_set1_ps(a->scale), bias = _mm_set1_ps(a->bias);
+    const uint8_t* s = src;
+    float* d = dst;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + 2 * i));
+
+        convert_sse2_put(d + i, convert_sse2_lo16(v), scale, bias);
+        convert_sse2_put(d + i + 4, convert_sse2_hi16(v), scale, bias);
+    }
+    convert_get_INT_scalar(d + i, s + 2 * i, n - i, a);
+}
+
+SSE2 static void
+convert_get_DINT_sse2(void* dst, const void* src, size_t n, const struct convert_args* a)
+{
+    __m128 scale = _mm_set1_ps(a->scale), bias = _mm_set1_ps(a->bias);
+    const uint8_t* s = src;
+    float* d = dst;
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        convert_sse2_put(d + i, _mm_loadu_si128((const __m128i*)(s + 4 * i)), scale, bias);
+    }
+    convert_get_DINT_scalar(d + i, s + 4 * i, n - i, a);
+}
+
+SSE2 static void
+convert_get_REAL_sse2(void* dst, const void* src, size_t n, const struct convert_args* a)
+{
+    __m128 scale = _mm_set1_ps(a->scale), bias = _mm_set1_ps(a->bias);
+    const uint8_t* s = src;
+    float* d = dst;
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128 x = _mm_loadu_ps((const float*)(s + 4 * i));
+
+        _mm_storeu_ps(d + i, _mm_add_ps(_mm_mul_ps(x, scale), bias));
+    }
+    convert_get_REAL_scalar(d + i, s + 4 * i, n - i, a);
+}
+
+/* Four floats, scaled, clamped and rounded to DINTs. */
+SSE2 static inline __m128i
+convert_sse2_get(const float* s, __m128 scale, __m128 bias, __m128 lo, __m128 hi)
+{
+    __m128 x = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(s), scale), bias);
+
+    return _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(x, lo), hi));
+}
+
+SSE2 static void
+convert_set_SINT_sse2(void* dst, const void* src, size_t n, const struct convert_args* a)
+{
+    __m128 scale = _mm_set1_ps(a->inv_scale), bias = _mm_set1_ps(a->inv_bias);
+    __m128 lo = _mm_set1_ps(CONVERT_SINT_MIN), hi = _mm_set1_ps(CONVERT_SINT_MAX);
+    const float* s = src;
+    uint8_t* d = dst;
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i w0 = _mm_packs_epi32(convert_sse2_get(s + i, scale, bias, lo, hi),
+            convert_sse2_get(s + i + 4, scale, bias, lo, hi));
+        __m128i w1 = _mm_packs_epi32(convert_sse2_get(s + i + 8, scale, bias, lo, hi),
+            convert_sse2_get(s + i + 12, scale, bias, lo, hi));
+
+        _mm_storeu_si128((__m128i*)(d + i), _mm_packs_epi16(w0, w1));
+    }
+    convert_set_SINT_scalar(d + i, s + i, n - i, a);
+}
+
+SSE2 static void
+convert_set_INT_sse2(void* dst, const void* src, size_t n, const struct convert_args* a)
+{
+    __m128 scale = _mm_set1_ps(a->inv_scale), bias = _mm_set1_ps(a->inv_bias);
+    __m128 lo = _mm_set1_ps(CONVERT_INT_MIN), hi = _mm_set1_ps(CONVERT_INT_MAX);
+    const float* s = src;
+    uint8_t* d = dst;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i w = _mm_packs_epi32(convert_sse2_get(s + i, scale, bias, lo, hi),
+            convert_sse2_get(s + i + 4, scale, bias, lo, hi));
+
+        _mm_storeu_si128((__m128i*)(d + 2 * i), w);
+    }
+    convert_set_INT_scalar(d + 2 * i, s + i, n - i, a);
+}
+
+SSE2 static void
+convert_set_DINT_sse2(void* dst, const void* src, size_t n, const struct convert_args* a)
+{
+    __m128 scale = _mm_set1_ps(a->inv_scale), bias = _mm_set1_ps(a->inv_bias);
+    __m128 lo = _mm_set1_ps(CONVERT_DINT_MIN), hi = _mm_set1_ps(CONVERT_DINT_MAX);
+    const float* s = src;
+    uint8_t* d = dst;
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_si128((__m128i*)(d + 4 * i), convert_sse2_get(s + i, scale, bias, lo, hi));
+    }
+    convert_set_DINT_scalar(d + 4 * i, s + i, n - i, a);
+}
+
+SSE2 static void
+convert_set_REAL_sse2(void* dst, const void* src, size_t n, const struct convert_args* a)
+{
+    __m128 scale = _mm_set1_ps(a->inv_scale), bias = _mm_set1_ps(a->inv_bias);
+    const float* s = src;
+    uint8_t* d = dst;
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps((float*)(d + 4 * i), _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(s + i), scale), bias));
+    }
+    convert_set_REAL_scalar(d + 4 * i, s + i, n - i, a);
+}
+
+static const struct convert_kernels convert_sse2 = {
+    .name = "sse2",
+    .isa = CONVERT_SSE2,
+    .get_scaled = {
+        [TAG_SINT] = convert_get_SINT_sse2,
+        [TAG_INT] = convert_get_INT_sse2,
+        [TAG_DINT] = convert_get_DINT_sse2,
+        [TAG_LINT] = convert_get_LINT_scalar,
+        [TAG_REAL] = convert_get_REAL_sse2,
+        [TAG_LREAL] = convert_get_LREAL_scalar,
+    },
+    .set_scaled = {
+        [TAG_SINT] = convert_set_SINT_sse2,
+        [TAG_INT] = convert_set_INT_sse2,
+        [TAG_DINT] = convert_set_DINT_sse2,
+        [TAG_LINT] = convert_set_LINT_scalar,
+        [TAG_REAL] = convert_set_REAL_sse2,
+        [TAG_LREAL] = convert_set_LREAL_scalar,
+    },
+};
+
+/* AVX2, eight floats at a time. */
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline void
+convert_avx2_put(float* d, __m256i x, __m256 scale, __m256 bias)
+{
+    _mm256_storeu_ps(d, _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(x), scale), bias));
+}
+
+AVX2 static void
+convert_get_SINT_avx2(void* dst, const void* src, size_t n, const struct convert_args* a)
+{
+    __m256 scale = _mm256_set1_ps(a->scale), bias = _mm256_set1_ps(a->bias);
+    const uint8_t* s = src;
+    float* d = dst;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        convert_avx2_put(d + i, _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(s + i))), scale, bias);
+    }
+    convert_get_SINT_scalar(d + i, s + i, n - i, a);
+}
+
+AVX2 static void
+convert_get_INT_avx2(void* dst, const void* src, size_t n, const struct convert_args* a)
+{
+    __m256 scale = _mm256_set1_ps(a->scale), bias = _mm256_set1_ps(a->bias);
+    const uint8_t* s = src;
+    float* d = dst;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        convert_avx2_put(d + i, _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(s + 2 * i))), scale, bias);
+    }
+    convert_get_INT_scalar(d + i, s + 2 * i, n - i, a);
+}
+
+AVX2 static void
+convert_get_DINT_avx2(void* dst, const void* src, size_t n, const struct convert_args* a)
+{
+    __m256 scale = _mm256_set1_ps(a->scale), bias = _mm256_set1_ps(a->bias);
+    const uint8_t* s = src;
+    float* d = dst;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        convert_avx2_put(d + i, _mm256_loadu_si256((const __m256i*)(s + 4 * i)), scale, bias);
+    }
+    convert_get_DINT_scalar(d + i, s + 4 * i, n - i, a);
+}
+
+AVX2 static void
+convert_get_REAL_avx2(void* dst, const void* src, size_t n, const struct convert_args* a)
+{
+    __m256 scale = _mm256_set1_ps(a->scale), bias = _mm256_set1_ps(a->bias);
+    const uint8_t* s = src;
+    float* d = dst;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_loadu_ps((const float*)(s + 4 * i));
+
+        _mm256_storeu_ps(d + i, _mm256_add_ps(_mm256_mul_ps(x, scale), bias));
+    }
+    convert_get_REAL_scalar(d + i, s + 4 * i, n - i, a);
+}
+
+/* Eight floats, scaled, clamped and rounded to DINTs. */
+AVX2 static inline __m256i
+convert_avx2_get(const float* s, __m256 scale, __m256 bias, __m256 lo, __m256 hi)
+{
+    __m256 x = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(s), scale), bias);
+
+    return _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(x, lo), hi));
+}
+
+/* The same, narrowed to INTs (which they fit, having been clamped). */
+AVX2 static inline __m128i
+convert_avx2_get16(const float* s, __m256 scale, __m256 bias, __m256 lo, __m256 hi)
+{
+    __m256i x = convert_avx2_get(s, scale, bias, lo, hi);
+
+    return _mm_packs_epi32(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+}
+
+AVX2 static void
+convert_set_SINT_avx2(void* dst, const void* src, size_t n, const struct convert_args* a)
+{
+    __m256 scale = _mm256_set1_ps(a->inv_scale), bias = _mm256_set1_ps(a->inv_bias);
+    __m256 lo = _mm256_set1_ps(CONVERT_SINT_MIN), hi = _mm256_set1_ps(CONVERT_SINT_MAX);
+    const float* s = src;
+    uint8_t* d = dst;
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i w0 = convert_avx2_get16(s + i, scale, bias, lo, hi);
+        __m128i w1 = convert_avx2_get16(s + i + 8, scale, bias, lo, hi);
+
+        _mm_storeu_si128((__m128i*)(d + i), _mm_packs_epi16(w0, w1));
+    }
+    convert_set_SINT_scalar(d + i, s + i, n - i, a);
+}
+
+AVX2 static void
+convert_set_INT_avx2(void* dst, const void* src, size_t n, const struct convert_args* a)
+{
+    __m256 scale = _mm256_set1_ps(a->inv_scale), bias = _mm256_set1_ps(a->inv_bias);
+    __m256 lo = _mm256_set1_ps(CONVERT_INT_MIN), hi = _mm256_set1_ps(CONVERT_INT_MAX);
+    const float* s = src;
+    uint8_t* d = dst;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        _mm_storeu_si128((__m128i*)(d + 2 * i), convert_avx2_get16(s + i, scale, bias, lo, hi));
+    }
+    convert_set_INT_scalar(d + 2 * i, s + i, n - i, a);
+}
+
+AVX2 static void
+convert_set_DINT_avx2(void* dst, const void* src, size_t n, const struct convert_args* a)
+{
+    __m256 scale = _mm256_set1_ps(a->inv_scale), bias = _mm256_set1_ps(a->inv_bias);
+    __m256 lo = _mm256_set1_ps(CONVERT_DINT_MIN), hi = _mm256_set1_ps(CONVERT_DINT_MAX);
+    const float* s = src;
+    uint8_t* d = dst;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_si256((__m256i*)(d + 4 * i), convert_avx2_get(s + i, scale, bias, lo, hi));
+    }
+    convert_set_DINT_scalar(d + 4 * i, s + i, n - i, a);
+}
+
+AVX2 static void
+convert_set_REAL_avx2(void* dst, const void* src, size_t n, const struct convert_args* a)
+{
+    __m256 scale = _mm256_set1_ps(a->inv_scale), bias = _mm256_set1_ps(a->inv_bias);
+    const float* s = src;
+    uint8_t* d = dst;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(s + i), scale), bias);
+
+        _mm256_storeu_ps((float*)(d + 4 * i), x);
+    }
+    convert_set_REAL_scalar(d + 4 * i, s + i, n - i, a);
+}
+
+static const struct convert_kernels convert_avx2 = {
+    .name = "avx2",
+    .isa = CONVERT_AVX2,
+    .get_scaled = {
+        [TAG_SINT] = convert_get_SINT_avx2,
+        [TAG_INT] = convert_get_INT_avx2,
+        [TAG_DINT] = convert_get_DINT_avx2,
+        [TAG_LINT] = convert_get_LINT_scalar,
+        [TAG_REAL] = convert_get_REAL_avx2,
+        [TAG_LREAL] = convert_get_LREAL_scalar,
+    },
+    .set_scaled = {
+        [TAG_SINT] = convert_set_SINT_avx2,
+        [TAG_INT] = convert_set_INT_avx2,
+        [TAG_DINT] = convert_set_DINT_avx2,
+        [TAG_LINT] = convert_set_LINT_scalar,
+        [TAG_REAL] = convert_set_REAL_avx2,
+        [TAG_LREAL] = convert_set_LREAL_scalar,
+    },
+};
+
+#endif /* CONVERT_HAVE_X86 */
+
+#ifdef CONVERT_HAVE_NEON
+
+/* NEON, four floats at a time.  Loads and stores go by way of bytes, as
+ * the payload needn't be aligned to its elements. */
+
+static inline void
+convert_neon_put(float* d, int32x4_t x, float32x4_t scale, float32x4_t bias)
+{
+    vst1q_f32(d, vaddq_f32(vmulq_f32(vcvtq_f32_s32(x), scale), bias));
+}
+
+static void
+convert_get_SINT_neon(void* dst, const void* src, size_t n, const struct convert_args* a)
+{
+    float32x4_t scale = vdupq_n_f32(a->scale), bias = vdupq_n_f32(a->bias);
+    const uint8_t* s = src;
+    float* d = dst;
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        int8x16_t v = vreinterpretq_s8_u8(vld1q_u8(s + i));
+        int16x8_t lo = vmovl_s8(vget_low_s8(v)), hi = vmovl_high_s8(v);
+
+        convert_neon_put(d + i, vmovl_s16(vget_low_s16(lo)), scale, bias);
+        convert_neon_put(d + i + 4, vmovl_high_s16(lo), scale, bias);
+        convert_neon_put(d + i + 8, vmovl_s16(vget_low_s16(hi)), scale, bias);
+        convert_neon_put(d + i + 12, vmovl_high_s16(hi), scale, bias);
+    }
+    convert_get_SINT_scalar(d + i, s + i, n - i, a);
+}
+
+static void
+convert_get_INT_neon(void* dst, const void* src, size_t n, const struct convert_args* a)
+{
+    float32x4_t scale = vdupq_n_f32(a->scale), bias = vdupq_n_f32(a->bias);
+    const uint8_t* s = src;
+    float* d = dst;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        int16x8_t v = vreinterpretq_s16_u8(vld1q_u8(s + 2 * i));
+
+        convert_neon_put(d + i, vmovl_s16(vget_low_s16(v)), scale, bias);
+        convert_neon_put(d + i + 4, vmovl_high_s16(v), scale, bias);
+    }
+    convert_get_INT_scalar(d + i, s + 2 * i, n - i, a);
+}
+
+static void
+convert_get_DINT_neon(void* dst, const void* src, size_t n, const struct convert_args* a)
+{
+    float32x4_t scale = vdupq_n_f32(a->scale), bias = vdupq_n_f32(a->bias);
+    const uint8_t* s = src;
+    float* d = dst;
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        convert_neon_put(d + i, vreinterpretq_s32_u8(vld1q_u8(s + 4 * i)), scale, bias);
+    }
+    convert_get_DINT_scalar(d + i, s + 4 * i, n - i, a);
+}
+
+static void
+convert_get_REAL_neon(void* dst, const void* src, size_t n, const struct convert_args* a)
+{
+    float32x4_t scale = vdupq_n_f32(a->scale), bias = vdupq_n_f32(a->bias);
+    const uint8_t* s = src;
+    float* d = dst;
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t x = vreinterpretq_f32_u8(vld1q_u8(s + 4 * i));
+
+        vst1q_f32(d + i, vaddq_f32(vmulq_f32(x, scale), bias));
+    }
+    convert_get_REAL_scalar(d + i, s + 4 * i, n - i, a);
+}
+
+/* Four floats, scaled, clamped and rounded to DINTs.  vmaxq_f32() and
+ * vminq_f32() pass NaNs through, so the clamp compares and selects, to
+ * treat them as the other ISAs do. */
+static inline int32x4_t
+convert_neon_get(const float* s, float32x4_t scale, float32x4_t bias, float32x4_t lo, float32x4_t hi)
+{
+    float32x4_t x = vaddq_f32(vmulq_f32(vld1q_f32(s), scale), bias);
+
+    x = vbslq_f32(vcgtq_f32(x, lo), x, lo);
+    x = vbslq_f32(vcltq_f32(x, hi), x, hi);
+    return vcvtnq_s32_f32(x);
+}
+
+static inline int16x8_t
+convert_neon_get16(const float* s, float32x4_t scale, float32x4_t bias, float32x4_t lo, float32x4_t hi)
+{
+    return vcombine_s16(vmovn_s32(convert_neon_get(s, scale, bias, lo, hi)),
+        vmovn_s32(convert_neon_get(s + 4, scale, bias, lo, hi)));
+}
+
+static void
+convert_set_SINT_neon(void* dst, const void* src, size_t n, const struct convert_args* a)
+{
+    float32x4_t scale = vdupq_n_f32(a->inv_scale), bias = vdupq_n_f32(a->inv_bias);
+    float32x4_t lo = vdupq_n_f32(CONVERT_SINT_MIN), hi = vdupq_n_f32(CONVERT_SINT_MAX);
+    const float* s = src;
+    uint8_t* d = dst;
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        int8x16_t b = vcombine_s8(vmovn_s16(convert_neon_get16(s + i, scale, bias, lo, hi)),
+            vmovn_s16(convert_neon_get16(s + i + 8, scale, bias, lo, hi)));
+
+        vst1q_u8(d + i, vreinterpretq_u8_s8(b));
+    }
+    convert_set_SINT_scalar(d + i, s + i, n - i, a);
+}
+
+static void
+convert_set_INT_neon(void* dst, const void* src, size_t n, const struct convert_args* a)
+{
+    float32x4_t scale = vdupq_n_f32(a->inv_scale), bias = vdupq_n_f32(a->inv_bias);
+    float32x4_t lo = vdupq_n_f32(CONVERT_INT_MIN), hi = vdupq_n_f32(CONVERT_INT_MAX);
+    const float* s = src;
+    uint8_t* d = dst;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        vst1q_u8(d + 2 * i, vreinterpretq_u8_s16(convert_neon_get16(s + i, scale, bias, lo, hi)));
+    }
+    convert_set_INT_scalar(d + 2 * i, s + i, n - i, a);
+}
+
+static void
+convert_set_DINT_neon(void* dst, const void* src, size_t n, const struct convert_args* a)
+{
+    float32x4_t scale = vdupq_n_f32(a->inv_scale), bias = vdupq_n_f32(a->inv_bias);
+    float32x4_t lo = vdupq_n_f32(CONVERT_DINT_MIN), hi = vdupq_n_f32(CONVERT_DINT_MAX);
+    const float* s = src;
+    uint8_t* d = dst;
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        vst1q_u8(d + 4 * i, vreinterpretq_u8_s32(convert_neon_get(s + i, scale, bias, lo, hi)));
+    }
+    convert_set_DINT_scalar(d + 4 * i, s + i, n - i, a);
+}
+
+static void
+convert_set_REAL_neon(void* dst, const void* src, size_t n, const struct convert_args* a)
+{
+    float32x4_t scale = vdupq_n_f32(a->inv_scale), bias = vdupq_n_f32(a->inv_bias);
+    const float* s = src;
+    uint8_t* d = dst;
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t x = vaddq_f32(vmulq_f32(vld1q_f32(s + i), scale), bias);
+
+        vst1q_u8(d + 4 * i, vreinterpretq_u8_f32(x));
+    }
+    convert_set_REAL_scalar(d + 4 * i, s + i, n - i, a);
+}
+
+static const struct convert_kernels convert_neon = {
+    .name = "neon",
+    .isa = CONVERT_NEON,
+    .get_scaled = {
+        [TAG_SINT] = convert_get_SINT_neon,
+        [TAG_INT] = convert_get_INT_neon,
+        [TAG_DINT] = convert_get_DINT_neon,
+        [TAG_LINT] = convert_get_LINT_scalar,
+        [TAG_REAL] = convert_get_REAL_neon,
+        [TAG_LREAL] = convert_get_LREAL_scalar,
+    },
+    .set_scaled = {
+        [TAG_SINT] = convert_set_SINT_neon,
+        [TAG_INT] = convert_set_INT_neon,
+        [TAG_DINT] = convert_set_DINT_neon,
+        [TAG_LINT] = convert_set_LINT_scalar,
+        [TAG_REAL] = convert_set_REAL_neon,
+        [TAG_LREAL] = convert_set_LREAL_scalar,
+    },
+};
+
+#endif /* CONVERT_HAVE_NEON */
+
+const struct convert_kernels*
+convert_kernels_for(enum convert_isa isa)
+{
+    switch (isa) {
+    case CONVERT_SCALAR:
+        return &convert_scalar;
+#ifdef CONVERT_HAVE_X86
+    case CONVERT_SSE2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse2") ? &convert_sse2 : NULL;
+    case CONVERT_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") ? &convert_avx2 : NULL;
+#endif
+#ifdef CONVERT_HAVE_NEON
+    case CONVERT_NEON:
+        return &convert_neon; /* baseline on AArch64 */
+#endif
+    default:
+        return NULL;
+    }
+}
+
+static pthread_once_t convert_once = PTHREAD_ONCE_INIT;
+static const struct convert_kernels* convert_chosen;
+
+static void
+convert_choose(void)
+{
+    const struct convert_kernels* k;
+    const char* env = getenv("PLCSTUB_SIMD");
+
+    for (int isa = CONVERT_NISAS - 1; isa >= CONVERT_SCALAR; --isa) {
+        if ((k = convert_kernels_for(isa)) == NULL) {
+            continue;
+        }
+        if (convert_chosen == NULL) {
+            convert_chosen = k;
+        }
+        if (env != NULL && strcmp(env, k->name) == 0) {
+            convert_chosen = k;
+            env = NULL;
+        }
+    }
+    if (env != NULL) {
+        pdebug(PLCTAG_DEBUG_WARN, "PLCSTUB_SIMD=%s isn't available here, using %s", env, convert_chosen->name);
+    }
+    pdebug(PLCTAG_DEBUG_DETAIL, "Using the %s conversion kernels", convert_chosen->name);
+}
+
+const struct convert_kernels*
+convert_kernels(void)
+{
+    pthread_once(&convert_once, convert_choose);
+    return convert_chosen;
+}
+
+void
+convert_le_copy(void* dst, const void* src, size_t n, size_t width)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(dst, src, n * width);
+#else
+    const uint8_t* s = src;
+    uint8_t* d = dst;
+
+    for (size_t i = 0; i < n; ++i, s += width, d += width) {
+        for (size_t j = 0; j < width; ++j) {
+            d[j] = s[width - 1 - j];
+        }
+    }
+#endif
+}
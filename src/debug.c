@@ -6,18 +6,89 @@
 
 #include <err.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include <pthread.h>
+#include <sched.h>
 
 #include "debug.h"
 
-/* 
- * Ensures mutual exclusion on the debug log output stream (currently just
- * stderr, but the libplctag API allows setting it elsewhere).
+/*
+ * Logging is buffered so that threads don't serialise on stderr: each
+ * thread appends its messages to a ring buffer of its own (single producer,
+ * single consumer, so no locks), and a background flusher thread drains all
+ * of them, formatting messages and writing them out in large batches (or
+ * handing them to the logger registered with plc_tag_register_logger()).
+ *
+ * Formatting is deferred to the flusher too: pdebug() only walks the format
+ * string to capture its arguments, copying strings, since they may not
+ * outlive the call.  The format, function and file names are expected to be
+ * literals.  Messages from one thread come out in order; there's no
+ * ordering between threads.
+ */
+
+#define LOG_RING_SIZE (64 * 1024) /* must be a power of two */
+#define LOG_MAX_RECORD 1024
+#define LOG_MAX_LINE 2048
+#define LOG_OUT_SIZE (64 * 1024)
+#define LOG_FLUSH_INTERVAL_MS 50
+
+struct log_record {
+    uint32_t len; /* of the whole record, arguments and all */
+    int level;
+    int line;
+    const char* func;
+    const char* file;
+    const char* fmt;
+    /* followed by the arguments, in order, as captured by log_capture() */
+};
+
+struct log_ring {
+    uint64_t head; /* written by the owning thread */
+    uint64_t tail; /* written by the flusher */
+    int dead; /* set once the owning thread exits */
+    struct log_ring* next;
+    char buf[LOG_RING_SIZE];
+};
+
+/*
+ * Ensures mutual exclusion on the list of rings, the flusher's lifecycle
+ * and the logger; the flusher sleeps on it.
  */
 static pthread_mutex_t debug_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t debug_cond = PTHREAD_COND_INITIALIZER; /* wakes the flusher */
+static pthread_cond_t debug_flushed_cond = PTHREAD_COND_INITIALIZER;
+static struct log_ring* rings = NULL;
+static pthread_t flusher;
+static int flusher_running = 0;
+static int flush_wanted = 0;
+static uint64_t flush_requested = 0;
+static uint64_t flush_done = 0;
+static void (*logger)(int32_t tag_id, int debug_level, const char* message) = NULL;
+
+/* Not MTX_LOCK(), which logs. */
+#define MTX_LOCK_DEBUG() debug_mtx_op(pthread_mutex_lock, "pthread_mutex_lock")
+#define MTX_UNLOCK_DEBUG() debug_mtx_op(pthread_mutex_unlock, "pthread_mutex_unlock")
+
+static void
+debug_mtx_op(int (*op)(pthread_mutex_t*), const char* name)
+{
+    int ret;
+
+    if ((ret = op(&debug_mtx)) != 0) {
+        errx(1, "%s: %s", name, strerror(ret));
+    }
+}
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local struct log_ring* my_ring = NULL;
+static _Thread_local int in_flusher = 0;
 
 #ifdef DEBUG
 volatile static int debug_level = PLCTAG_DEBUG_SPEW;
@@ -46,26 +117,684 @@ debug_level_str(int level)
     }
 }
 
+/************************ Format strings ************************/
+
+enum log_arg {
+    LOG_ARG_NONE, /* literal text, or %% */
+    LOG_ARG_INT,
+    LOG_ARG_UINT,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_LDOUBLE,
+    LOG_ARG_STRING,
+    LOG_ARG_PTR,
+    LOG_ARG_SKIP, /* %n, which is swallowed */
+};
+
+enum log_len {
+    LOG_LEN_NONE,
+    LOG_LEN_HH,
+    LOG_LEN_H,
+    LOG_LEN_L,
+    LOG_LEN_LL,
+    LOG_LEN_Z,
+    LOG_LEN_J,
+    LOG_LEN_T,
+    LOG_LEN_BIG_L,
+};
+
+struct log_spec {
+    const char* start; /* the '%' */
+    const char* end; /* just past the conversion */
+    int nstars; /* '*' widths and precisions, which take an int each */
+    enum log_len len;
+    enum log_arg arg;
+};
+
+/* Parses the conversion specification at p, which points to a '%'. */
+static void
+log_parse_spec(const char* p, struct log_spec* s)
+{
+    s->start = p++;
+    s->nstars = 0;
+    s->len = LOG_LEN_NONE;
+
+    if (*p == '%') {
+        s->arg = LOG_ARG_NONE;
+        s->end = p + 1;
+        return;
+    }
+
+    while (*p && strchr("-+ #0'", *p)) {
+        ++p;
+    }
+    for (int field = 0; field < 2; ++field) {
+        if (field == 1) {
+            if (*p != '.') {
+                break;
+            }
+            ++p;
+        }
+        if (*p == '*') {
+            s->nstars++;
+            ++p;
+        } else {
+            while (*p >= '0' && *p <= '9') {
+                ++p;
+            }
+        }
+    }
+
+    switch (*p) {
+    case 'h':
+        s->len = (p[1] == 'h') ? LOG_LEN_HH : LOG_LEN_H;
+        p += (p[1] == 'h') ? 2 : 1;
+        break;
+    case 'l':
+        s->len = (p[1] == 'l') ? LOG_LEN_LL : LOG_LEN_L;
+        p += (p[1] == 'l') ? 2 : 1;
+        break;
+    case 'z':
+        s->len = LOG_LEN_Z;
+        ++p;
+        break;
+    case 'j':
+        s->len = LOG_LEN_J;
+        ++p;
+        break;
+    case 't':
+        s->len = LOG_LEN_T;
+        ++p;
+        break;
+    case 'L':
+        s->len = LOG_LEN_BIG_L;
+        ++p;
+        break;
+    }
+
+    switch (*p) {
+    case 'd':
+    case 'i':
+        s->arg = LOG_ARG_INT;
+        break;
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+        s->arg = LOG_ARG_UINT;
+        break;
+    case 'c':
+        s->arg = LOG_ARG_INT;
+        s->len = LOG_LEN_NONE;
+        break;
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        s->arg = (s->len == LOG_LEN_BIG_L) ? LOG_ARG_LDOUBLE : LOG_ARG_DOUBLE;
+        break;
+    case 's':
+        s->arg = LOG_ARG_STRING;
+        break;
+    case 'p':
+        s->arg = LOG_ARG_PTR;
+        break;
+    case 'n':
+        s->arg = LOG_ARG_SKIP;
+        break;
+    default:
+        /* Malformed: print it as it stands. */
+        s->arg = LOG_ARG_NONE;
+        s->end = (*p) ? p + 1 : p;
+        return;
+    }
+    s->end = p + 1;
+}
+
+/* Appends n bytes at src to the record being built in rec, if they fit. */
+static int
+log_put_bytes(char* rec, size_t* len, const void* src, size_t n)
+{
+    if (*len + n > LOG_MAX_RECORD) {
+        return -1;
+    }
+    memcpy(rec + *len, src, n);
+    *len += n;
+    return 0;
+}
+
+/* Walks fmt, appending each of the arguments it calls for to rec, and
+ * returns the length of the record.  Integers are widened to 64 bits; a
+ * string is stored as its length (a uint16_t), the characters and a NUL,
+ * truncated if it would overflow the record. */
+static size_t
+log_capture(char* rec, size_t len, const char* fmt, va_list va)
+{
+    struct log_spec s;
+    int64_t i;
+    uint64_t u;
+    double d;
+    long double ld;
+    void* ptr;
+    const char* str;
+    uint16_t slen;
+    size_t room;
+
+    for (const char* p = fmt; (p = strchr(p, '%')) != NULL; p = s.end) {
+        log_parse_spec(p, &s);
+
+        for (int k = 0; k < s.nstars; ++k) {
+            i = va_arg(va, int);
+            log_put_bytes(rec, &len, &i, sizeof(i));
+        }
+
+        switch (s.arg) {
+        case LOG_ARG_NONE:
+            break;
+        case LOG_ARG_INT:
+            switch (s.len) {
+            case LOG_LEN_L:
+                i = va_arg(va, long);
+                break;
+            case LOG_LEN_LL:
+                i = va_arg(va, long long);
+                break;
+            case LOG_LEN_Z:
+                i = va_arg(va, ssize_t);
+                break;
+            case LOG_LEN_J:
+                i = va_arg(va, intmax_t);
+                break;
+            case LOG_LEN_T:
+                i = va_arg(va, ptrdiff_t);
+                break;
+            default:
+                i = va_arg(va, int);
+                break;
+            }
+            log_put_bytes(rec, &len, &i, sizeof(i));
+            break;
+        case LOG_ARG_UINT:
+            switch (s.len) {
+            case LOG_LEN_L:
+                u = va_arg(va, unsigned long);
+                break;
+            case LOG_LEN_LL:
+                u = va_arg(va, unsigned long long);
+                break;
+            case LOG_LEN_Z:
+                u = va_arg(va, size_t);
+                break;
+            case LOG_LEN_J:
+                u = va_arg(va, uintmax_t);
+                break;
+            case LOG_LEN_T:
+                u = va_arg(va, ptrdiff_t);
+                break;
+            default:
+                u = va_arg(va, unsigned int);
+                break;
+            }
+            log_put_bytes(rec, &len, &u, sizeof(u));
+            break;
+        case LOG_ARG_DOUBLE:
+            d = va_arg(va, double);
+            log_put_bytes(rec, &len, &d, sizeof(d));
+            break;
+        case LOG_ARG_LDOUBLE:
+            ld = va_arg(va, long double);
+            log_put_bytes(rec, &len, &ld, sizeof(ld));
+            break;
+        case LOG_ARG_STRING:
+            str = va_arg(va, const char*);
+            if (str == NULL) {
+                str = "(null)";
+            }
+            room = (len + sizeof(slen) + 1 < LOG_MAX_RECORD) ? LOG_MAX_RECORD - len - sizeof(slen) - 1 : 0;
+            slen = strnlen(str, room);
+            if (log_put_bytes(rec, &len, &slen, sizeof(slen)) == 0) {
+                log_put_bytes(rec, &len, str, slen);
+                log_put_bytes(rec, &len, "", 1);
+            }
+            break;
+        case LOG_ARG_PTR:
+        case LOG_ARG_SKIP:
+            ptr = va_arg(va, void*);
+            log_put_bytes(rec, &len, &ptr, sizeof(ptr));
+            break;
+        }
+    }
+
+    return len;
+}
+
+/* Takes the next sizeof(*dst) bytes of captured arguments, if there are
+ * any left (a record truncated by log_capture() runs out early). */
+#define LOG_TAKE(dst)                                    \
+    do {                                                 \
+        if (*pos + sizeof(*(dst)) > end) {               \
+            return -1;                                   \
+        }                                                \
+        memcpy((dst), rec + *pos, sizeof(*(dst)));       \
+        *pos += sizeof(*(dst));                          \
+    } while (0)
+
+/* Formats one conversion, whose arguments start at rec + *pos, into out. */
+static int
+log_format_spec(char* out, size_t size, const struct log_spec* s, const char* rec, size_t* pos, size_t end)
+{
+    char spec[64];
+    int64_t stars[2] = { 0, 0 };
+    size_t n = 0;
+    int64_t i;
+    uint64_t u;
+    double d;
+    long double ld;
+    void* ptr;
+    uint16_t slen;
+    int k;
+
+    for (k = 0; k < s->nstars; ++k) {
+        LOG_TAKE(&stars[k]);
+    }
+    k = 0;
+
+    /* Rebuild the specification with any '*'s filled in. */
+    for (const char* p = s->start; p < s->end && n < sizeof(spec) - 24; ++p) {
+        if (*p == '*') {
+            n += snprintf(spec + n, sizeof(spec) - n, "%d", (int)(stars[k++]));
+        } else {
+            spec[n++] = *p;
+        }
+    }
+    spec[n] = '\0';
+
+    switch (s->arg) {
+    case LOG_ARG_NONE:
+        if (s->end - s->start == 2 && s->start[1] == '%') {
+            return snprintf(out, size, "%%");
+        }
+        return snprintf(out, size, "%.*s", (int)(s->end - s->start), s->start);
+    case LOG_ARG_INT:
+        LOG_TAKE(&i);
+        switch (s->len) {
+        case LOG_LEN_L:
+            return snprintf(out, size, spec, (long)(i));
+        case LOG_LEN_LL:
+            return snprintf(out, size, spec, (long long)(i));
+        case LOG_LEN_Z:
+            return snprintf(out, size, spec, (ssize_t)(i));
+        case LOG_LEN_J:
+            return snprintf(out, size, spec, (intmax_t)(i));
+        case LOG_LEN_T:
+            return snprintf(out, size, spec, (ptrdiff_t)(i));
+        default:
+            return snprintf(out, size, spec, (int)(i));
+        }
+    case LOG_ARG_UINT:
+        LOG_TAKE(&u);
+        switch (s->len) {
+        case LOG_LEN_L:
+            return snprintf(out, size, spec, (unsigned long)(u));
+        case LOG_LEN_LL:
+            return snprintf(out, size, spec, (unsigned long long)(u));
+        case LOG_LEN_Z:
+            return snprintf(out, size, spec, (size_t)(u));
+        case LOG_LEN_J:
+            return snprintf(out, size, spec, (uintmax_t)(u));
+        case LOG_LEN_T:
+            return snprintf(out, size, spec, (ptrdiff_t)(u));
+        default:
+            return snprintf(out, size, spec, (unsigned int)(u));
+        }
+    case LOG_ARG_DOUBLE:
+        LOG_TAKE(&d);
+        return snprintf(out, size, spec, d);
+    case LOG_ARG_LDOUBLE:
+        LOG_TAKE(&ld);
+        return snprintf(out, size, spec, ld);
+    case LOG_ARG_STRING:
+        LOG_TAKE(&slen);
+        if (*pos + slen + 1 > end) {
+            return -1;
+        }
+        *pos += slen + 1;
+        return snprintf(out, size, spec, rec + *pos - slen - 1);
+    case LOG_ARG_PTR:
+        LOG_TAKE(&ptr);
+        return snprintf(out, size, spec, ptr);
+    case LOG_ARG_SKIP:
+        LOG_TAKE(&ptr);
+        return 0;
+    }
+    return 0;
+}
+
+/* Formats a captured record as a log line, without a trailing newline,
+ * and returns its length (truncated to fit, if need be). */
+static size_t
+log_format(char* out, size_t size, const char* rec)
+{
+    const struct log_record* r = (const struct log_record*)(rec);
+    size_t pos = sizeof(*r), n;
+    struct log_spec s;
+    const char* p = r->fmt;
+    const char* pct;
+    int ret;
+
+    ret = snprintf(out, size, "plcstub [%s]: %s:%d %s: ", debug_level_str(r->level), r->file, r->line, r->func);
+    n = (ret < 0) ? 0 : ((size_t)(ret) < size ? (size_t)(ret) : size - 1);
+
+    while (*p && n < size - 1) {
+        pct = strchr(p, '%');
+        if (pct == NULL) {
+            pct = p + strlen(p);
+        }
+        if (pct > p) {
+            ret = snprintf(out + n, size - n, "%.*s", (int)(pct - p), p);
+        } else {
+            log_parse_spec(pct, &s);
+            ret = log_format_spec(out + n, size - n, &s, rec, &pos, r->len);
+            pct = s.end;
+            if (ret < 0) {
+                break;
+            }
+        }
+        n += (ret < 0) ? 0 : ((size_t)(ret) < size - n ? (size_t)(ret) : size - n - 1);
+        p = pct;
+    }
+
+    return n;
+}
+
+/************************ Ring buffers ************************/
+
+/* Copies n bytes in to or out of the ring at the given (unwrapped) offset. */
+static void
+log_ring_copy(struct log_ring* ring, uint64_t off, void* data, size_t n, int in)
+{
+    size_t at = off & (LOG_RING_SIZE - 1);
+    size_t first = (n < LOG_RING_SIZE - at) ? n : LOG_RING_SIZE - at;
+
+    if (in) {
+        memcpy(ring->buf + at, data, first);
+        memcpy(ring->buf, (char*)(data) + first, n - first);
+    } else {
+        memcpy(data, ring->buf + at, first);
+        memcpy((char*)(data) + first, ring->buf, n - first);
+    }
+}
+
+static void
+log_ring_orphan(void* arg)
+{
+    struct log_ring* ring = arg;
+
+    __atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void
+log_ring_key_init(void)
+{
+    if (pthread_key_create(&ring_key, log_ring_orphan)) {
+        err(1, "pthread_key_create");
+    }
+}
+
+/* Writes out a batch of formatted lines, or hands them one by one to the
+ * registered logger.  Lines in buf are NUL-separated for the logger's
+ * sake; those are turned into newlines for stderr. */
+static void
+log_emit(char* buf, size_t n, void (*log_cb)(int32_t, int, const char*), const int* levels)
+{
+    size_t i = 0;
+    int k = 0;
+
+    if (n == 0) {
+        return;
+    }
+
+    if (log_cb) {
+        while (i < n) {
+            log_cb(0, levels[k++], buf + i);
+            i += strlen(buf + i) + 1;
+        }
+        return;
+    }
+
+    for (i = 0; i < n; ++i) {
+        if (buf[i] == '\0') {
+            buf[i] = '\n';
+        }
+    }
+    fwrite(buf, 1, n, stderr);
+    fflush(stderr);
+}
+
+/* Drains every ring.  Only called by the flusher. */
+static void
+log_drain(void)
+{
+    static char out[LOG_OUT_SIZE];
+    static int levels[LOG_OUT_SIZE / 2];
+    _Alignas(16) char rec[LOG_MAX_RECORD];
+    struct log_record* r = (struct log_record*)(rec);
+    struct log_ring *ring, **link;
+    void (*log_cb)(int32_t, int, const char*);
+    uint64_t head, tail;
+    uint32_t len;
+    size_t n = 0;
+    int nlines = 0;
+
+    MTX_LOCK_DEBUG();
+    log_cb = logger;
+    MTX_UNLOCK_DEBUG();
+
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        tail = ring->tail;
+
+        while (tail != head) {
+            log_ring_copy(ring, tail, &len, sizeof(len), 0);
+            log_ring_copy(ring, tail, rec, len, 0);
+            tail += len;
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+            if (n + LOG_MAX_LINE > sizeof(out)) {
+                log_emit(out, n, log_cb, levels);
+                n = nlines = 0;
+            }
+            levels[nlines++] = r->level;
+            n += log_format(out + n, LOG_MAX_LINE, rec) + 1;
+            out[n - 1] = '\0';
+        }
+    }
+    log_emit(out, n, log_cb, levels);
+
+    /* Free the rings of threads that have gone, now they're empty. */
+    MTX_LOCK_DEBUG();
+    for (link = &rings; (ring = *link) != NULL;) {
+        if (__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE)
+            && ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+            *link = ring->next;
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+    MTX_UNLOCK_DEBUG();
+}
+
+static void*
+log_flusher(void* arg)
+{
+    struct timespec deadline;
+    uint64_t requested;
+
+    (void)(arg);
+    in_flusher = 1;
+
+    MTX_LOCK_DEBUG();
+    for (;;) {
+        requested = flush_requested;
+        flush_wanted = 0;
+        MTX_UNLOCK_DEBUG();
+
+        log_drain();
+
+        MTX_LOCK_DEBUG();
+        flush_done = requested;
+        pthread_cond_broadcast(&debug_flushed_cond);
+        if (flush_wanted || flush_requested != requested) {
+            continue;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&debug_cond, &debug_mtx, &deadline);
+    }
+
+    return NULL;
+}
+
+/* Returns this thread's ring, creating it (and the flusher, the first
+ * time) if need be, or NULL if it can't be had. */
+static struct log_ring*
+log_get_ring(void)
+{
+    struct log_ring* ring = my_ring;
+    int ret;
+
+    if (ring) {
+        return ring;
+    }
+
+    pthread_once(&ring_key_once, log_ring_key_init);
+
+    ring = malloc(sizeof(*ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->head = ring->tail = 0;
+    ring->dead = 0;
+    pthread_setspecific(ring_key, ring);
+
+    MTX_LOCK_DEBUG();
+    ring->next = rings;
+    __atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+    if (!flusher_running) {
+        if ((ret = pthread_create(&flusher, NULL, log_flusher, NULL)) != 0) {
+            errx(1, "pthread_create: %s", strerror(ret));
+        }
+        flusher_running = 1;
+        atexit(debug_flush);
+    }
+    MTX_UNLOCK_DEBUG();
+
+    my_ring = ring;
+    return ring;
+}
+
 void
 pdebug_impl(const char* func, const char* file, int line, int level, const char* msg, ...)
 {
+    _Alignas(16) char rec[LOG_MAX_RECORD];
+    struct log_record* r = (struct log_record*)(rec);
+    struct log_ring* ring;
+    size_t len;
+    uint64_t head;
     va_list va;
+
+    r->level = level;
+    r->line = line;
+    r->func = func;
+    r->file = file;
+    r->fmt = msg;
     va_start(va, msg);
-    int ret;
+    len = log_capture(rec, sizeof(*r), msg, va);
+    va_end(va);
+    r->len = len;
+
+    ring = log_get_ring();
+    if (ring == NULL) {
+        char out[LOG_MAX_LINE];
+        fprintf(stderr, "%.*s\n", (int)(log_format(out, sizeof(out), rec)), out);
+        return;
+    }
 
-    if ((ret = pthread_mutex_lock(&debug_mtx)) != 0) {
-        err(1, "pthread_mutex_lock");
+    /* Wait for the flusher to make room, unless this is the flusher
+     * (logging from within a logger callback), which has to drop it. */
+    head = ring->head;
+    while (LOG_RING_SIZE - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) < len) {
+        if (in_flusher) {
+            return;
+        }
+        MTX_LOCK_DEBUG();
+        flush_wanted = 1;
+        pthread_cond_signal(&debug_cond);
+        MTX_UNLOCK_DEBUG();
+        sched_yield();
     }
 
-    fprintf(stderr, "plcstub [%s]: %s:%d %s: ", debug_level_str(level), file, line, func);
-    vfprintf(stderr, msg, va);
-    fprintf(stderr, "\n");
+    log_ring_copy(ring, head, rec, len, 1);
+    __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
 
-    if ((ret = pthread_mutex_unlock(&debug_mtx)) != 0) {
-        err(1, "pthread_mutex_unlock");
+    /* Errors go out straight away, in case they're followed by a crash. */
+    if (level <= PLCTAG_DEBUG_ERROR) {
+        debug_flush();
     }
+}
 
-    va_end(va);
+void
+debug_flush(void)
+{
+    uint64_t target;
+
+    /* The flusher can't wait on itself: a logger that wants to flush is out
+     * of luck. */
+    if (in_flusher) {
+        return;
+    }
+
+    MTX_LOCK_DEBUG();
+    if (!flusher_running) {
+        MTX_UNLOCK_DEBUG();
+        return;
+    }
+    target = ++flush_requested;
+    pthread_cond_signal(&debug_cond);
+    while (flush_done < target) {
+        pthread_cond_wait(&debug_flushed_cond, &debug_mtx);
+    }
+    MTX_UNLOCK_DEBUG();
+}
+
+int
+debug_set_logger(void (*log_cb)(int32_t tag_id, int debug_level, const char* message))
+{
+    int ret = 0;
+
+    /* Messages already logged go wherever they would have. */
+    debug_flush();
+
+    MTX_LOCK_DEBUG();
+    if (log_cb && logger) {
+        ret = -1;
+    } else if (!log_cb && !logger) {
+        ret = -1;
+    } else {
+        logger = log_cb;
+    }
+    MTX_UNLOCK_DEBUG();
+
+    return ret;
 }
 
 int
@@ -85,4 +814,4 @@ debug_set_level(int level)
         err(1, "Unknown debug level number %d", level);
     }
     __atomic_store(&debug_level, &level, __ATOMIC_RELEASE);
-}
\ No newline at end of file
+}
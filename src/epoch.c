@@ -0,0 +1,202 @@
+/* epoch.c
+ *
+ * Epoch-based reclamation of removed tags.
+ */
+
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "epoch.h"
+#include "libplctag.h"
+#include "lock_utils.h"
+
+/* Try to move the epoch on (and so free things) every this many retires. */
+#define EPOCH_RECLAIM_BATCH 64
+
+struct epoch_retired {
+    void (*fn)(void*);
+    void* p;
+    uint64_t epoch;
+    struct epoch_retired* next;
+};
+
+/* Starts at 1 so that a thread's epoch of 0 can mean "not in a critical
+ * section". */
+uint64_t epoch_global = 1;
+
+_Thread_local struct epoch_thread* epoch_self = NULL;
+
+/* Every thread record ever made, pushed lock-free.  Records outlive their
+ * threads, to be claimed by new ones, and are never freed. */
+static struct epoch_thread* threads = NULL;
+
+/* Clears a thread's claim on its record when it exits. */
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_key_once = PTHREAD_ONCE_INIT;
+
+/* Ensures mutual exclusion on the retired list, oldest first, and on
+ * advancing the epoch. */
+static pthread_mutex_t epoch_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct epoch_retired *retired_head = NULL, **retired_tail = &retired_head;
+static size_t nretired = 0;
+
+static void
+epoch_thread_exit(void* arg)
+{
+    struct epoch_thread* e = arg;
+
+    __atomic_store_n(&e->epoch, 0, __ATOMIC_RELEASE);
+    e->depth = 0;
+    __atomic_store_n(&e->in_use, false, __ATOMIC_RELEASE);
+}
+
+static void
+epoch_make_key()
+{
+    int ret;
+
+    if ((ret = pthread_key_create(&epoch_key, epoch_thread_exit)) != 0) {
+        errx(1, "pthread_key_create: %s", strerror(ret));
+    }
+}
+
+/* Finds or makes a record for this thread: the slow part of its first
+ * epoch_enter(). */
+struct epoch_thread*
+epoch_register(void)
+{
+    struct epoch_thread* e;
+    bool unused;
+    int ret;
+
+    pthread_once(&epoch_key_once, epoch_make_key);
+
+    for (e = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); e != NULL; e = e->next) {
+        unused = false;
+        if (!__atomic_load_n(&e->in_use, __ATOMIC_RELAXED)
+            && __atomic_compare_exchange_n(&e->in_use, &unused, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (e == NULL) {
+        e = calloc(1, sizeof(*e));
+        if (e == NULL) {
+            err(1, "calloc");
+        }
+        e->in_use = true;
+        e->next = __atomic_load_n(&threads, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&threads, &e->next, e, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    if ((ret = pthread_setspecific(epoch_key, e)) != 0) {
+        errx(1, "pthread_setspecific: %s", strerror(ret));
+    }
+    epoch_self = e;
+    return e;
+}
+
+/* Moves the global epoch on if every thread in a critical section has
+ * seen the current one.
+ *
+ * Assumes that epoch_mtx is held.
+ */
+static void
+epoch_try_advance()
+{
+    uint64_t g = __atomic_load_n(&epoch_global, __ATOMIC_RELAXED);
+    uint64_t e;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (struct epoch_thread* t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+        e = __atomic_load_n(&t->epoch, __ATOMIC_ACQUIRE);
+        if (e != 0 && e != g) {
+            return;
+        }
+    }
+    __atomic_store_n(&epoch_global, g + 1, __ATOMIC_RELEASE);
+}
+
+/* Unlinks whatever is old enough to free, for the caller to free once
+ * epoch_mtx is released.
+ *
+ * Assumes that epoch_mtx is held.
+ */
+static struct epoch_retired*
+epoch_collect()
+{
+    uint64_t g = __atomic_load_n(&epoch_global, __ATOMIC_RELAXED);
+    struct epoch_retired *done = retired_head, **pp = &retired_head;
+
+    while (*pp != NULL && (*pp)->epoch + 2 <= g) {
+        pp = &(*pp)->next;
+        nretired--;
+    }
+    if (pp == &retired_head) {
+        return NULL;
+    }
+    retired_head = *pp;
+    *pp = NULL;
+    if (retired_head == NULL) {
+        retired_tail = &retired_head;
+    }
+    return done;
+}
+
+static void
+epoch_free_list(struct epoch_retired* r)
+{
+    struct epoch_retired* next;
+
+    for (; r != NULL; r = next) {
+        next = r->next;
+        r->fn(r->p);
+        free(r);
+    }
+}
+
+void
+epoch_retire(void (*fn)(void*), void* p)
+{
+    struct epoch_retired *r, *done = NULL;
+
+    r = malloc(sizeof(*r));
+    if (r == NULL) {
+        err(1, "malloc");
+    }
+    r->fn = fn;
+    r->p = p;
+    r->next = NULL;
+
+    MTX_LOCK(&epoch_mtx);
+    r->epoch = __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST);
+    *retired_tail = r;
+    retired_tail = &r->next;
+    if (++nretired % EPOCH_RECLAIM_BATCH == 0) {
+        epoch_try_advance();
+        done = epoch_collect();
+    }
+    MTX_UNLOCK(&epoch_mtx);
+
+    epoch_free_list(done);
+}
+
+void
+epoch_shutdown(void)
+{
+    struct epoch_retired* done;
+
+    MTX_LOCK(&epoch_mtx);
+    pdebug(PLCTAG_DEBUG_DETAIL, "Reclaiming %zu retired objects", nretired);
+    done = retired_head;
+    retired_head = NULL;
+    retired_tail = &retired_head;
+    nretired = 0;
+    MTX_UNLOCK(&epoch_mtx);
+
+    epoch_free_list(done);
+}
@@ -0,0 +1,275 @@
+/* event.c
+ *
+ * Deferred delivery of tag events to user callbacks.
+ */
+
+#include <err.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "event.h"
+#include "libplctag.h"
+#include "lock_utils.h"
+#include "stats.h"
+
+#define EVENT_DEFAULT_BATCH 64
+#define EVENT_MAX_BATCH 4096
+
+/*
+ * Events are queued on an intrusive multi-producer, single-consumer queue
+ * (after Vyukov): producers swing head to their node with one atomic
+ * exchange and then link the old head to it; the dispatcher, the only
+ * consumer, follows next pointers from tail.  There is always at least one
+ * node in the queue (initially the stub), which is never delivered.
+ */
+struct event_node {
+    struct event_node* next;
+    tag_callback_func cb;
+    struct plcstub_event ev;
+};
+
+static struct event_node stub;
+static struct event_node* head = &stub;
+static struct event_node* tail = &stub;
+
+static int event_mode = -1; /* -1 until read from $PLCSTUB_EVENTS */
+
+/* Ensures mutual exclusion on the dispatcher's lifecycle and the
+ * configuration below, and is what the dispatcher sleeps on. */
+static pthread_mutex_t event_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t event_cond = PTHREAD_COND_INITIALIZER; /* wakes the dispatcher */
+static pthread_cond_t event_flush_cond = PTHREAD_COND_INITIALIZER; /* signalled as events are delivered */
+static pthread_t dispatcher;
+static bool dispatcher_running = false;
+static bool dispatcher_stopping = false;
+static int dispatcher_sleeping = 0;
+
+static plcstub_batch_callback_func batch_cb = NULL;
+static int batch_max = EVENT_DEFAULT_BATCH;
+
+/* Counts of events posted to and delivered from the queue, for flushing. */
+static uint64_t nposted = 0;
+static uint64_t ndelivered = 0;
+
+/* Pops the oldest queued event, or returns NULL if there are none (or the
+ * newest one is still being linked in).  Only the dispatcher calls this.
+ * The node returned is the queue's new stub, so may not be freed until the
+ * next pop; the previous stub is handed back through *retired. */
+static struct event_node*
+event_pop(struct event_node** retired)
+{
+    struct event_node* next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (next == NULL) {
+        return NULL;
+    }
+
+    *retired = tail;
+    tail = next;
+    return next;
+}
+
+static void
+event_free(struct event_node* n)
+{
+    if (n != &stub) {
+        free(n);
+    }
+}
+
+static void
+event_deliver(plcstub_batch_callback_func bcb, struct plcstub_event* batch, tag_callback_func* cbs, int n)
+{
+    if (bcb) {
+        bcb(batch, n);
+    } else {
+        for (int i = 0; i < n; ++i) {
+            cbs[i](batch[i].tag_id, batch[i].event, batch[i].status);
+        }
+    }
+
+    MTX_LOCK(&event_mtx);
+    ndelivered += n;
+    pthread_cond_broadcast(&event_flush_cond);
+    MTX_UNLOCK(&event_mtx);
+}
+
+static void*
+event_dispatcher(void* arg)
+{
+    struct plcstub_event batch[EVENT_MAX_BATCH];
+    tag_callback_func cbs[EVENT_MAX_BATCH];
+    struct event_node *n, *retired = NULL;
+    plcstub_batch_callback_func bcb;
+    int count, max;
+
+    (void)(arg);
+
+    for (;;) {
+        MTX_LOCK(&event_mtx);
+        bcb = batch_cb;
+        max = bcb ? batch_max : EVENT_DEFAULT_BATCH;
+        MTX_UNLOCK(&event_mtx);
+
+        for (count = 0; count < max && (n = event_pop(&retired)) != NULL; ++count) {
+            batch[count] = n->ev;
+            cbs[count] = n->cb;
+            event_free(retired);
+        }
+
+        if (count > 0) {
+            event_deliver(bcb, batch, cbs, count);
+            continue;
+        }
+
+        /* Nothing to do: sleep until a producer wakes us.  Announcing that
+         * we're asleep before checking the queue one last time means a
+         * producer either sees the announcement or we see its event. */
+        MTX_LOCK(&event_mtx);
+        __atomic_store_n(&dispatcher_sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&tail->next, __ATOMIC_SEQ_CST) == NULL) {
+            if (dispatcher_stopping) {
+                __atomic_store_n(&dispatcher_sleeping, 0, __ATOMIC_SEQ_CST);
+                MTX_UNLOCK(&event_mtx);
+                break;
+            }
+            pthread_cond_wait(&event_cond, &event_mtx);
+        }
+        __atomic_store_n(&dispatcher_sleeping, 0, __ATOMIC_SEQ_CST);
+        MTX_UNLOCK(&event_mtx);
+    }
+
+    return NULL;
+}
+
+/* Picks up the mode from $PLCSTUB_EVENTS the first time it's needed.
+ *
+ * Assumes that event_mtx is held.
+ */
+static int
+event_get_mode()
+{
+    const char* env;
+
+    if (event_mode < 0) {
+        env = getenv("PLCSTUB_EVENTS");
+        event_mode = (env && strcmp(env, "inline") == 0) ? PLCSTUB_EVENTS_INLINE : PLCSTUB_EVENTS_DEFERRED;
+    }
+    return event_mode;
+}
+
+void
+event_post(tag_callback_func cb, int32_t tag_id, int event, int status)
+{
+    struct event_node *n, *prev;
+    int mode = __atomic_load_n(&event_mode, __ATOMIC_ACQUIRE);
+    int ret;
+
+    stats_add(tag_id, STAT_CALLBACKS, 1);
+
+    if (mode < 0 || !__atomic_load_n(&dispatcher_running, __ATOMIC_ACQUIRE)) {
+        /* Slow path, taken until the dispatcher is up (or for good, in
+         * inline mode). */
+        MTX_LOCK(&event_mtx);
+        mode = event_get_mode();
+        if (mode == PLCSTUB_EVENTS_DEFERRED && !dispatcher_running) {
+            dispatcher_stopping = false;
+            if ((ret = pthread_create(&dispatcher, NULL, event_dispatcher, NULL)) != 0) {
+                errx(1, "pthread_create: %s", strerror(ret));
+            }
+            __atomic_store_n(&dispatcher_running, true, __ATOMIC_RELEASE);
+        }
+        MTX_UNLOCK(&event_mtx);
+    }
+
+    if (mode == PLCSTUB_EVENTS_INLINE) {
+        cb(tag_id, event, status);
+        return;
+    }
+
+    n = malloc(sizeof(*n));
+    if (n == NULL) {
+        err(1, "malloc");
+    }
+    n->next = NULL;
+    n->cb = cb;
+    n->ev.tag_id = tag_id;
+    n->ev.event = event;
+    n->ev.status = status;
+
+    __atomic_add_fetch(&nposted, 1, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&head, n, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&prev->next, n, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&dispatcher_sleeping, __ATOMIC_SEQ_CST)) {
+        MTX_LOCK(&event_mtx);
+        pthread_cond_signal(&event_cond);
+        MTX_UNLOCK(&event_mtx);
+    }
+}
+
+int
+plcstub_set_event_mode(int mode)
+{
+    if (mode != PLCSTUB_EVENTS_DEFERRED && mode != PLCSTUB_EVENTS_INLINE) {
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    /* Anything already queued is still delivered by the dispatcher. */
+    MTX_LOCK(&event_mtx);
+    __atomic_store_n(&event_mode, mode, __ATOMIC_RELEASE);
+    MTX_UNLOCK(&event_mtx);
+
+    return PLCTAG_STATUS_OK;
+}
+
+int
+plcstub_set_event_batch_callback(plcstub_batch_callback_func cb, int max_batch)
+{
+    if (cb && (max_batch < 1 || max_batch > EVENT_MAX_BATCH)) {
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    MTX_LOCK(&event_mtx);
+    batch_cb = cb;
+    batch_max = cb ? max_batch : EVENT_DEFAULT_BATCH;
+    MTX_UNLOCK(&event_mtx);
+
+    return PLCTAG_STATUS_OK;
+}
+
+void
+plcstub_flush_events(void)
+{
+    uint64_t target = __atomic_load_n(&nposted, __ATOMIC_SEQ_CST);
+
+    MTX_LOCK(&event_mtx);
+    while (dispatcher_running && ndelivered < target) {
+        pthread_cond_wait(&event_flush_cond, &event_mtx);
+    }
+    MTX_UNLOCK(&event_mtx);
+}
+
+void
+event_shutdown(void)
+{
+    MTX_LOCK(&event_mtx);
+    if (dispatcher_running) {
+        dispatcher_stopping = true;
+        pthread_cond_signal(&event_cond);
+        MTX_UNLOCK(&event_mtx);
+
+        pthread_join(dispatcher, NULL);
+
+        MTX_LOCK(&event_mtx);
+        __atomic_store_n(&dispatcher_running, false, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&event_mode, -1, __ATOMIC_RELEASE);
+    batch_cb = NULL;
+    batch_max = EVENT_DEFAULT_BATCH;
+    MTX_UNLOCK(&event_mtx);
+}
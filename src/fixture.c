@@ -0,0 +1,622 @@
+/* fixture.c
+ *
+ * Loads tag fixtures, in text or binary form; see fixture.h.
+ */
+
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "attr.h"
+#include "debug.h"
+#include "fixture.h"
+#include "layout.h"
+#include "libplctag.h"
+#include "lock_utils.h"
+#include "plcstub.h"
+
+/* Binary fixtures currently mapped, for fixture_unmap_all(). */
+struct fixture_mapping {
+    void* base;
+    size_t size;
+    struct fixture_mapping* next;
+};
+
+/* Ensures mutual exclusion on the list of mappings. */
+static pthread_mutex_t fixture_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct fixture_mapping* mappings = NULL;
+
+#define FIXTURE_MAX_FIELDS 4096
+
+/* Maps the whole of path, privately: writes to the mapping are the
+ * process's own and never reach the file. */
+static int
+fixture_map(const char* path, char** base, size_t* size)
+{
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        pdebug(PLCTAG_DEBUG_WARN, "Can't open fixture %s", path);
+        return PLCTAG_ERR_OPEN;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        pdebug(PLCTAG_DEBUG_WARN, "Fixture %s is empty", path);
+        return PLCTAG_ERR_NO_DATA;
+    }
+
+    *size = st.st_size;
+    *base = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (*base == MAP_FAILED) {
+        pdebug(PLCTAG_DEBUG_WARN, "Can't map fixture %s", path);
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+/************************ Binary fixtures ************************/
+
+/* Checks that [off, off + len) lies within a file of the given size. */
+static bool
+fixture_in_file(uint64_t off, uint64_t len, size_t size)
+{
+    return off <= size && len <= size - off;
+}
+
+/* Is there a NUL-terminated string at off? */
+static bool
+fixture_string(const char* base, size_t size, uint64_t off)
+{
+    return fixture_in_file(off, 1, size) && memchr(base + off, '\0', size - off) != NULL;
+}
+
+static int
+fixture_open_binary(char* base, size_t size, struct fixture* f)
+{
+    const struct fixture_header* h = (const struct fixture_header*)(base);
+    const struct fixture_record* r;
+    const struct udt* udt;
+    struct fixture_mapping* m;
+    uint64_t len;
+
+    if (size >= sizeof(*h) && h->version != FIXTURE_VERSION) {
+        pdebug(PLCTAG_DEBUG_WARN, "Binary fixture is version %u, not %u: compile it again",
+            h->version, FIXTURE_VERSION);
+        return PLCTAG_ERR_BAD_DATA;
+    }
+    if (size < sizeof(*h) || h->size != size
+        || h->ntags == 0
+        || h->records_off % sizeof(uint64_t) != 0 || h->data_off % FIXTURE_ALIGN != 0
+        || !fixture_in_file(h->records_off, (uint64_t)(h->ntags) * sizeof(*r), size)
+        || !fixture_in_file(h->names_off, 0, size) || !fixture_in_file(h->data_off, 0, size)) {
+        pdebug(PLCTAG_DEBUG_WARN, "Bad binary fixture header");
+        return PLCTAG_ERR_BAD_DATA;
+    }
+
+    f->ntags = h->ntags;
+    f->specs = calloc(f->ntags, sizeof(*f->specs));
+    f->types = calloc(f->ntags, sizeof(*f->types));
+    f->gens = NULL;
+    f->scratch = NULL;
+    if (f->specs == NULL || f->types == NULL) {
+        err(1, "calloc");
+    }
+
+    r = (const struct fixture_record*)(base + h->records_off);
+    for (size_t i = 0; i < f->ntags; ++i, ++r) {
+        len = (uint64_t)(r->elem_size) * r->elem_count;
+        udt = NULL;
+        if (r->udt_off != FIXTURE_NO_UDT && fixture_string(base, size, h->names_off + r->udt_off)) {
+            udt = udt_intern(base + h->names_off + r->udt_off, strlen(base + h->names_off + r->udt_off));
+        }
+        if (!fixture_string(base, size, h->names_off + r->name_off)
+            || r->data_off % FIXTURE_ALIGN != 0
+            || !fixture_in_file(h->data_off + r->data_off, len, size)
+            || (r->udt_off != FIXTURE_NO_UDT && (udt == NULL || udt->size != r->elem_size))
+            || (r->dims[0] != 0 && layout_dims_count(r->dims) != r->elem_count)) {
+            pdebug(PLCTAG_DEBUG_WARN, "Bad binary fixture record %zu", i);
+            free(f->specs);
+            free(f->types);
+            return PLCTAG_ERR_BAD_DATA;
+        }
+
+        f->specs[i].name = base + h->names_off + r->name_off;
+        f->specs[i].name_len = strlen(f->specs[i].name);
+        f->specs[i].elem_size = r->elem_size;
+        f->specs[i].elem_count = r->elem_count;
+        f->specs[i].init = base + h->data_off + r->data_off;
+        f->specs[i].borrow = true;
+        f->specs[i].type = r->type;
+        f->specs[i].udt = udt ? udt->id : 0;
+        memcpy(f->specs[i].dims, r->dims, sizeof(f->specs[i].dims));
+        f->types[i] = r->type;
+    }
+
+    m = malloc(sizeof(*m));
+    if (m == NULL) {
+        err(1, "malloc");
+    }
+    m->base = base;
+    m->size = size;
+    MTX_LOCK(&fixture_mtx);
+    m->next = mappings;
+    mappings = m;
+    MTX_UNLOCK(&fixture_mtx);
+
+    return PLCTAG_STATUS_OK;
+}
+
+/************************ Text fixtures ************************/
+
+static char*
+fixture_trim(char* s)
+{
+    char* end;
+
+    while (*s == ' ' || *s == '\t') {
+        ++s;
+    }
+    end = s + strlen(s);
+    while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) {
+        *--end = '\0';
+    }
+    return s;
+}
+
+/* Splits line on commas, except within brackets and braces, so that
+ * "DINT[2,3]" and "{DINT,REAL}" are one field each.  Returns the number of fields. */
+static int
+fixture_split(char* line, char** fields, int max)
+{
+    int n = 0, depth = 0;
+
+    fields[n++] = line;
+    for (char* p = line; *p; ++p) {
+        if (*p == '[' || *p == '{') {
+            depth++;
+        } else if ((*p == ']' || *p == '}') && depth > 0) {
+            depth--;
+        } else if (*p == ',' && depth == 0) {
+            if (n == max) {
+                return -1;
+            }
+            *p = '\0';
+            fields[n++] = p + 1;
+        }
+    }
+    for (int i = 0; i < n; ++i) {
+        fields[i] = fixture_trim(fields[i]);
+    }
+    return n;
+}
+
+/* Parses a data type such as "DINT", "REAL[10]", "4", "SINT[2,3]" or
+ * "{DINT,REAL}[5]" into spec's shape. */
+static int
+fixture_parse_type(char* s, struct tag_tree_spec* spec, uint16_t* type)
+{
+    char *dims, *end;
+    const struct udt* udt = NULL;
+    enum tag_type tag_type;
+
+    s = fixture_trim(s);
+    if (*s == '{') {
+        if ((end = strchr(s, '}')) == NULL || (udt = udt_intern(s + 1, end - s - 1)) == NULL) {
+            return -1;
+        }
+        s = end + 1;
+    }
+
+    spec->elem_count = 1;
+    if ((dims = strchr(s, '[')) != NULL) {
+        *dims++ = '\0';
+        if ((end = strchr(dims, ']')) == NULL || *fixture_trim(end + 1) != '\0'
+            || layout_parse_dims(dims, end - dims, spec->dims) < 0) {
+            return -1;
+        }
+        spec->elem_count = layout_dims_count(spec->dims);
+    }
+
+    s = fixture_trim(s);
+    *type = 0;
+    if (udt != NULL) {
+        spec->elem_size = udt->size;
+        spec->udt = udt->id;
+        return *s == '\0' ? 0 : -1;
+    }
+    if (attr_lookup_type(s, strlen(s), &tag_type, &spec->elem_size) == 0) {
+        *type = tag_type + 1;
+        return 0;
+    }
+
+    spec->elem_size = strtoull(s, &end, 10);
+    return (end == s || *end != '\0' || spec->elem_size == 0) ? -1 : 0;
+}
+
+/* Parses a value of the given type into dst. */
+static int
+fixture_parse_value(const char* s, uint16_t type, size_t elem_size, char* dst)
+{
+    char* end;
+    long long i;
+    double d;
+    float fl;
+
+    if (type == TAG_REAL + 1 || type == TAG_LREAL + 1) {
+        d = strtod(s, &end);
+        if (end == s || *end != '\0') {
+            return -1;
+        }
+        if (type == TAG_REAL + 1) {
+            fl = d;
+            memcpy(dst, &fl, sizeof(fl));
+        } else {
+            memcpy(dst, &d, sizeof(d));
+        }
+        return 0;
+    }
+
+    if (strcasecmp(s, "true") == 0) {
+        i = 1;
+    } else if (strcasecmp(s, "false") == 0) {
+        i = 0;
+    } else {
+        i = strtoll(s, &end, 0);
+        if (end == s || *end != '\0') {
+            return -1;
+        }
+    }
+
+    switch (elem_size) {
+    case 1: {
+        int8_t v = i;
+        memcpy(dst, &v, sizeof(v));
+        return 0;
+    }
+    case 2: {
+        int16_t v = i;
+        memcpy(dst, &v, sizeof(v));
+        return 0;
+    }
+    case 4: {
+        int32_t v = i;
+        memcpy(dst, &v, sizeof(v));
+        return 0;
+    }
+    case 8:
+        memcpy(dst, &i, sizeof(i));
+        return 0;
+    }
+    return -1;
+}
+
+/* Parses one non-blank line into spec (and its generator, if it has one,
+ * into gen), putting its name and any values in a fresh allocation that is
+ * stored in *block.  fields is room for FIXTURE_MAX_FIELDS pointers. */
+static int
+fixture_parse_line(char* line, char** fields, struct tag_tree_spec* spec, uint16_t* type, struct gen_spec* gen,
+    void** block)
+{
+    size_t name_len, nvalues, data_size;
+    char* buf;
+    int n;
+
+    memset(spec, 0, sizeof(*spec));
+    memset(gen, 0, sizeof(*gen));
+    n = fixture_split(line, fields, FIXTURE_MAX_FIELDS);
+    if (n < 2 || *fields[0] == '\0') {
+        return -1;
+    }
+    if (fixture_parse_type(fields[1], spec, type) != 0) {
+        return -1;
+    }
+
+    if (n > 2 && strncmp(fields[n - 1], "gen=", 4) == 0) {
+        if (gen_parse(fields[n - 1] + 4, strlen(fields[n - 1] + 4), (int)(*type) - 1, spec->elem_size, gen)
+            != PLCTAG_STATUS_OK) {
+            return -1;
+        }
+        n--;
+    }
+
+    nvalues = n - 2;
+    if (nvalues > spec->elem_count || (nvalues != 0 && spec->udt != 0)
+        || spec->elem_count > (SIZE_MAX / 2) / spec->elem_size) {
+        gen_spec_free(gen);
+        return -1;
+    }
+
+    /* Only lines with values need a payload here; the rest start zeroed. */
+    name_len = strlen(fields[0]) + 1;
+    data_size = nvalues ? spec->elem_size * spec->elem_count : 0;
+    buf = malloc(data_size + name_len);
+    if (buf == NULL) {
+        err(1, "malloc");
+    }
+    memset(buf, 0, data_size);
+    for (size_t i = 0; i < nvalues; ++i) {
+        if (fixture_parse_value(fields[2 + i], *type, spec->elem_size, buf + i * spec->elem_size) != 0) {
+            gen_spec_free(gen);
+            free(buf);
+            return -1;
+        }
+    }
+
+    spec->name = memcpy(buf + data_size, fields[0], name_len);
+    spec->name_len = name_len - 1;
+    spec->init = nvalues ? buf : NULL;
+    spec->borrow = false;
+    spec->type = *type;
+    *block = buf;
+    return 0;
+}
+
+static int
+fixture_open_text(const char* path, const char* text, size_t size, struct fixture* f)
+{
+    const char *p = text, *end = text + size, *eol;
+    void** blocks = NULL;
+    size_t cap = 0, lineno = 0, len;
+    char* line = NULL;
+    size_t line_cap = 0;
+    char** fields;
+    char* s;
+
+    fields = malloc(FIXTURE_MAX_FIELDS * sizeof(*fields));
+    if (fields == NULL) {
+        err(1, "malloc");
+    }
+
+    f->specs = NULL;
+    f->types = NULL;
+    f->gens = NULL;
+    f->ntags = 0;
+
+    for (; p < end; p = eol + 1) {
+        eol = memchr(p, '\n', end - p);
+        if (eol == NULL) {
+            eol = end;
+        }
+        len = eol - p;
+        ++lineno;
+
+        if (len + 1 > line_cap) {
+            line_cap = len + 1;
+            line = realloc(line, line_cap);
+            if (line == NULL) {
+                err(1, "realloc");
+            }
+        }
+        memcpy(line, p, len);
+        line[len] = '\0';
+
+        s = fixture_trim(line);
+        if (*s == '\0' || *s == '#') {
+            continue;
+        }
+
+        if (f->ntags == cap) {
+            cap = cap ? cap * 2 : 1024;
+            f->specs = realloc(f->specs, cap * sizeof(*f->specs));
+            f->types = realloc(f->types, cap * sizeof(*f->types));
+            f->gens = realloc(f->gens, cap * sizeof(*f->gens));
+            blocks = realloc(blocks, cap * sizeof(*blocks));
+            if (f->specs == NULL || f->types == NULL || f->gens == NULL || blocks == NULL) {
+                err(1, "realloc");
+            }
+        }
+
+        if (fixture_parse_line(s, fields, &f->specs[f->ntags], &f->types[f->ntags], &f->gens[f->ntags],
+                &blocks[f->ntags])
+            != 0) {
+            pdebug(PLCTAG_DEBUG_WARN, "%s:%zu: malformed tag", path, lineno);
+            f->scratch = blocks;
+            fixture_close(f);
+            free(line);
+            free(fields);
+            return PLCTAG_ERR_BAD_DATA;
+        }
+        f->ntags++;
+    }
+
+    free(line);
+    free(fields);
+    f->scratch = blocks;
+
+    if (f->ntags == 0) {
+        pdebug(PLCTAG_DEBUG_WARN, "Fixture %s has no tags in it", path);
+        fixture_close(f);
+        return PLCTAG_ERR_NO_DATA;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+/************************ Interface ************************/
+
+int
+fixture_open(const char* path, struct fixture* f)
+{
+    char* base;
+    size_t size;
+    int ret;
+
+    if ((ret = fixture_map(path, &base, &size)) != PLCTAG_STATUS_OK) {
+        return ret;
+    }
+
+    if (size >= sizeof(FIXTURE_MAGIC) - 1 && memcmp(base, FIXTURE_MAGIC, sizeof(FIXTURE_MAGIC) - 1) == 0) {
+        ret = fixture_open_binary(base, size, f);
+        if (ret != PLCTAG_STATUS_OK) {
+            munmap(base, size);
+        }
+        return ret;
+    }
+
+    /* A text fixture is copied out of, so needn't stay mapped. */
+    ret = fixture_open_text(path, base, size, f);
+    munmap(base, size);
+    return ret;
+}
+
+void
+fixture_attach_gens(struct fixture* f, int32_t first)
+{
+    if (f->gens == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < f->ntags; ++i) {
+        if (f->gens[i].kind != GEN_NONE) {
+            gen_attach(first + (int32_t)(i), &f->gens[i]);
+        }
+    }
+}
+
+void
+fixture_close(struct fixture* f)
+{
+    void** blocks = f->scratch;
+
+    if (blocks) {
+        for (size_t i = 0; i < f->ntags; ++i) {
+            free(blocks[i]);
+        }
+        free(blocks);
+    }
+    if (f->gens) {
+        for (size_t i = 0; i < f->ntags; ++i) {
+            gen_spec_free(&f->gens[i]);
+        }
+        free(f->gens);
+    }
+    free(f->specs);
+    free(f->types);
+    memset(f, 0, sizeof(*f));
+}
+
+void
+fixture_unmap_all(void)
+{
+    struct fixture_mapping* m;
+
+    MTX_LOCK(&fixture_mtx);
+    while ((m = mappings) != NULL) {
+        mappings = m->next;
+        munmap(m->base, m->size);
+        free(m);
+    }
+    MTX_UNLOCK(&fixture_mtx);
+}
+
+static size_t
+fixture_align(size_t off)
+{
+    return (off + (FIXTURE_ALIGN - 1)) & ~(size_t)(FIXTURE_ALIGN - 1);
+}
+
+int
+fixture_compile(const char* src, const char* dst)
+{
+    static const char zeroes[FIXTURE_ALIGN];
+    struct fixture_header h = { .magic = FIXTURE_MAGIC, .version = FIXTURE_VERSION };
+    struct fixture_record r = { 0 };
+    struct fixture f;
+    size_t names_len = 0, data_len = 0, len, pad;
+    FILE* out;
+    int ret;
+
+    if ((ret = fixture_open(src, &f)) != PLCTAG_STATUS_OK) {
+        return ret;
+    }
+
+    for (size_t i = 0; i < f.ntags; ++i) {
+        if (f.specs[i].elem_size > UINT32_MAX || f.specs[i].elem_count > UINT32_MAX) {
+            pdebug(PLCTAG_DEBUG_WARN, "Tag %s is too large for a binary fixture", f.specs[i].name);
+            fixture_close(&f);
+            return PLCTAG_ERR_TOO_LARGE;
+        }
+        if (f.gens && f.gens[i].kind != GEN_NONE) {
+            pdebug(PLCTAG_DEBUG_WARN, "Dropping the generator of %s: binary fixtures can't hold them", f.specs[i].name);
+        }
+        names_len += strlen(f.specs[i].name) + 1;
+        if (f.specs[i].udt != 0) {
+            names_len += strlen(udt_get(f.specs[i].udt)->spec) + 1;
+        }
+    }
+    h.ntags = f.ntags;
+    h.records_off = sizeof(h);
+    h.names_off = h.records_off + f.ntags * sizeof(r);
+    h.data_off = fixture_align(h.names_off + names_len);
+
+    if ((out = fopen(dst, "wb")) == NULL) {
+        pdebug(PLCTAG_DEBUG_WARN, "Can't create %s", dst);
+        fixture_close(&f);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    /* The header's size is filled in once everything else is written. */
+    fwrite(&h, sizeof(h), 1, out);
+
+    for (size_t i = 0, name_off = 0; i < f.ntags; ++i) {
+        r.data_off = data_len;
+        r.elem_size = f.specs[i].elem_size;
+        r.elem_count = f.specs[i].elem_count;
+        r.name_off = name_off;
+        r.type = f.types[i];
+        memcpy(r.dims, f.specs[i].dims, sizeof(r.dims));
+        name_off += strlen(f.specs[i].name) + 1;
+        r.udt_off = FIXTURE_NO_UDT;
+        if (f.specs[i].udt != 0) {
+            r.udt_off = name_off;
+            name_off += strlen(udt_get(f.specs[i].udt)->spec) + 1;
+        }
+        fwrite(&r, sizeof(r), 1, out);
+
+        data_len = fixture_align(data_len + f.specs[i].elem_size * f.specs[i].elem_count);
+    }
+
+    for (size_t i = 0; i < f.ntags; ++i) {
+        fwrite(f.specs[i].name, strlen(f.specs[i].name) + 1, 1, out);
+        if (f.specs[i].udt != 0) {
+            fwrite(udt_get(f.specs[i].udt)->spec, strlen(udt_get(f.specs[i].udt)->spec) + 1, 1, out);
+        }
+    }
+    fwrite(zeroes, h.data_off - (h.names_off + names_len), 1, out);
+
+    for (size_t i = 0; i < f.ntags; ++i) {
+        len = f.specs[i].elem_size * f.specs[i].elem_count;
+        if (f.specs[i].init) {
+            fwrite(f.specs[i].init, len, 1, out);
+        } else {
+            for (size_t k = 0; k < len; k += sizeof(zeroes)) {
+                fwrite(zeroes, (len - k < sizeof(zeroes)) ? len - k : sizeof(zeroes), 1, out);
+            }
+        }
+        pad = fixture_align(len) - len;
+        fwrite(zeroes, pad, 1, out);
+    }
+
+    h.size = h.data_off + data_len;
+    fseek(out, 0, SEEK_SET);
+    fwrite(&h, sizeof(h), 1, out);
+
+    ret = (ferror(out) ? PLCTAG_ERR_WRITE : PLCTAG_STATUS_OK);
+    if (fclose(out) != 0) {
+        ret = PLCTAG_ERR_WRITE;
+    }
+    fixture_close(&f);
+
+    return ret;
+}
@@ -0,0 +1,770 @@
+/* gen.c
+ *
+ * Value generators and the ticker thread that runs them; see gen.h.
+ */
+
+#include <err.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "debug.h"
+#include "epoch.h"
+#include "gen.h"
+#include "libplctag.h"
+#include "lock_utils.h"
+#include "notify.h"
+#include "plcstub.h"
+#include "tagtree.h"
+
+#define GEN_DEFAULT_SCAN_MS 100
+#define GEN_MAX_PARAMS 3
+
+/*
+ * The generators of one kind, column by column.  What a, b and c mean
+ * depends on the kind:
+ *
+ *     ramp     lo, hi, step
+ *     sine     centre, amplitude, cos and sin (in d) of the phase step,
+ *              with the phase itself kept as a point (x, y) on the unit
+ *              circle
+ *     walk     lo, hi, step
+ *     counter  -, -, step
+ *     replay   - (values in replay, next one at pos)
+ */
+struct gen_set {
+    size_t n, cap;
+    int32_t* tag_id;
+    uint8_t* format;
+    double* v; /* the value to publish at the next scan */
+    double *a, *b, *c, *d;
+    double *x, *y;
+    uint32_t* rng;
+    double** replay;
+    size_t* nreplay;
+    size_t* pos;
+};
+
+/* Ensures mutual exclusion on the generators and the ticker's lifecycle.
+ * Taken before any tag's store mutex. */
+static pthread_mutex_t gen_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gen_cond; /* wakes the ticker early */
+static struct gen_set gen_sets[GEN_NKINDS];
+static size_t gen_count = 0;
+
+static pthread_t ticker;
+static bool ticker_running = false;
+static bool ticker_stopping = false;
+static int scan_ms = -1; /* -1 until read from $PLCSTUB_SCAN_MS */
+static unsigned scan_gen = 0; /* bumped when scan_ms changes */
+
+static uint32_t gen_seed = 2463534242u;
+
+/************************ Parsing ************************/
+
+static const char* gen_names[GEN_NKINDS] = {
+    [GEN_RAMP] = "ramp",
+    [GEN_SINE] = "sine",
+    [GEN_WALK] = "walk",
+    [GEN_COUNTER] = "counter",
+    [GEN_REPLAY] = "replay",
+};
+
+/* Reads the numbers in path, separated by whitespace or commas. */
+static int
+gen_read_replay(const char* path, struct gen_spec* spec)
+{
+    size_t cap = 0;
+    char *buf = NULL, *p, *end;
+    size_t len = 0, n;
+    FILE* f;
+    char chunk[4096];
+
+    if ((f = fopen(path, "r")) == NULL) {
+        pdebug(PLCTAG_DEBUG_WARN, "Can't open replay file %s", path);
+        return PLCTAG_ERR_OPEN;
+    }
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        if ((buf = realloc(buf, len + n + 1)) == NULL) {
+            err(1, "realloc");
+        }
+        memcpy(buf + len, chunk, n);
+        len += n;
+    }
+    fclose(f);
+    if (buf == NULL) {
+        pdebug(PLCTAG_DEBUG_WARN, "Replay file %s is empty", path);
+        return PLCTAG_ERR_NO_DATA;
+    }
+    buf[len] = '\0';
+
+    spec->replay = NULL;
+    spec->nreplay = 0;
+    for (p = buf + strspn(buf, " \t\r\n,"); *p != '\0'; p = end + strspn(end, " \t\r\n,")) {
+        double v = strtod(p, &end);
+        if (end == p) {
+            pdebug(PLCTAG_DEBUG_WARN, "Bad value in replay file %s", path);
+            free(spec->replay);
+            free(buf);
+            return PLCTAG_ERR_BAD_DATA;
+        }
+        if (spec->nreplay == cap) {
+            cap = cap ? cap * 2 : 256;
+            if ((spec->replay = realloc(spec->replay, cap * sizeof(*spec->replay))) == NULL) {
+                err(1, "realloc");
+            }
+        }
+        spec->replay[spec->nreplay++] = v;
+    }
+    free(buf);
+
+    if (spec->nreplay == 0) {
+        pdebug(PLCTAG_DEBUG_WARN, "Replay file %s is empty", path);
+        free(spec->replay);
+        spec->replay = NULL;
+        return PLCTAG_ERR_NO_DATA;
+    }
+    return PLCTAG_STATUS_OK;
+}
+
+/* Picks the format of a tag's elements, or returns -1 if they aren't
+ * numbers of any width we know. */
+static int
+gen_pick_format(int type, size_t elem_size)
+{
+    if (type == TAG_REAL && elem_size == 4) {
+        return GEN_FLOAT32;
+    }
+    if (type == TAG_LREAL && elem_size == 8) {
+        return GEN_FLOAT64;
+    }
+    if (type == TAG_BOOL && elem_size == 1) {
+        return GEN_BOOL;
+    }
+    switch (elem_size) {
+    case 1:
+        return GEN_INT8;
+    case 2:
+        return GEN_INT16;
+    case 4:
+        return GEN_INT32;
+    case 8:
+        return GEN_INT64;
+    }
+    return -1;
+}
+
+int
+gen_parse(const char* s, size_t len, int type, size_t elem_size, struct gen_spec* spec)
+{
+    double params[GEN_MAX_PARAMS];
+    const char *colon, *end = s + len;
+    size_t kind_len, nparams = 0;
+    char num[64], *num_end, *path;
+    int format, ret;
+
+    memset(spec, 0, sizeof(*spec));
+
+    if ((format = gen_pick_format(type, elem_size)) < 0) {
+        pdebug(PLCTAG_DEBUG_WARN, "Can't generate values for elements of %zu bytes", elem_size);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+    spec->format = format;
+
+    colon = memchr(s, ':', len);
+    kind_len = (colon ? colon : end) - s;
+    for (int k = GEN_NONE + 1; k < GEN_NKINDS; ++k) {
+        if (strlen(gen_names[k]) == kind_len && memcmp(s, gen_names[k], kind_len) == 0) {
+            spec->kind = k;
+        }
+    }
+    if (spec->kind == GEN_NONE) {
+        pdebug(PLCTAG_DEBUG_WARN, "Unknown generator %.*s", (int)(len), s);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    if (spec->kind == GEN_REPLAY) {
+        if (colon == NULL || colon + 1 == end) {
+            pdebug(PLCTAG_DEBUG_WARN, "Generator %.*s needs a file", (int)(len), s);
+            return PLCTAG_ERR_BAD_PARAM;
+        }
+        if ((path = strndup(colon + 1, end - colon - 1)) == NULL) {
+            err(1, "strndup");
+        }
+        ret = gen_read_replay(path, spec);
+        free(path);
+        return ret;
+    }
+
+    for (const char* p = colon; p != NULL && p < end; p = colon) {
+        const char* q = p + 1;
+
+        colon = memchr(q, ':', end - q);
+        len = (colon ? colon : end) - q;
+        if (nparams == GEN_MAX_PARAMS || len == 0 || len >= sizeof(num)) {
+            pdebug(PLCTAG_DEBUG_WARN, "Bad generator parameters in %.*s", (int)(end - s), s);
+            return PLCTAG_ERR_BAD_PARAM;
+        }
+        memcpy(num, q, len);
+        num[len] = '\0';
+        params[nparams] = strtod(num, &num_end);
+        if (*num_end != '\0' || !isfinite(params[nparams])) {
+            pdebug(PLCTAG_DEBUG_WARN, "Bad generator parameter %s", num);
+            return PLCTAG_ERR_BAD_PARAM;
+        }
+        nparams++;
+    }
+
+    if (spec->kind == GEN_COUNTER) {
+        if (nparams > 1) {
+            pdebug(PLCTAG_DEBUG_WARN, "Too many generator parameters in %.*s", (int)(end - s), s);
+            return PLCTAG_ERR_BAD_PARAM;
+        }
+        spec->step = nparams ? params[0] : 1;
+        return PLCTAG_STATUS_OK;
+    }
+
+    spec->lo = nparams > 0 ? params[0] : 0;
+    spec->hi = nparams > 1 ? params[1] : 100;
+    spec->step = nparams > 2 ? params[2] : (spec->kind == GEN_SINE ? 100 : 1);
+    if (spec->lo > spec->hi || (spec->kind == GEN_SINE && spec->step <= 0)) {
+        pdebug(PLCTAG_DEBUG_WARN, "Bad generator parameters in %.*s", (int)(end - s), s);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+    return PLCTAG_STATUS_OK;
+}
+
+void
+gen_spec_free(struct gen_spec* spec)
+{
+    free(spec->replay);
+    spec->replay = NULL;
+}
+
+/* sin and cos of theta, by Taylor series (after reducing theta to
+ * [-pi, pi]), so as not to need libm just to set up a sine. */
+static void
+gen_sincos(double theta, double* sin_out, double* cos_out)
+{
+    double term_s, term_c, sum_s, sum_c, t2;
+
+    theta = theta - 2 * M_PI * (long)(theta / (2 * M_PI));
+    if (theta > M_PI) {
+        theta -= 2 * M_PI;
+    }
+    t2 = theta * theta;
+    term_s = sum_s = theta;
+    term_c = sum_c = 1;
+    for (int n = 1; n < 20; ++n) {
+        term_s *= -t2 / ((2 * n) * (2 * n + 1));
+        term_c *= -t2 / ((2 * n - 1) * (2 * n));
+        sum_s += term_s;
+        sum_c += term_c;
+    }
+    *sin_out = sum_s;
+    *cos_out = sum_c;
+}
+
+/************************ Generator sets ************************/
+
+/* Grows every column of s to hold at least one more generator.
+ *
+ * Assumes that gen_mtx is held.
+ */
+static void
+gen_set_reserve(struct gen_set* s)
+{
+    size_t cap;
+
+    if (s->n < s->cap) {
+        return;
+    }
+    cap = s->cap ? s->cap * 2 : 64;
+
+#define GROW(col)                                              \
+    do {                                                       \
+        s->col = realloc(s->col, cap * sizeof(*s->col));       \
+        if (s->col == NULL) {                                  \
+            err(1, "realloc");                                 \
+        }                                                      \
+    } while (0)
+    GROW(tag_id);
+    GROW(format);
+    GROW(v);
+    GROW(a);
+    GROW(b);
+    GROW(c);
+    GROW(d);
+    GROW(x);
+    GROW(y);
+    GROW(rng);
+    GROW(replay);
+    GROW(nreplay);
+    GROW(pos);
+#undef GROW
+
+    s->cap = cap;
+}
+
+/* Moves the last generator in s into slot i.
+ *
+ * Assumes that gen_mtx is held.
+ */
+static void
+gen_set_remove(struct gen_set* s, size_t i)
+{
+    size_t last = --s->n;
+
+    free(s->replay[i]);
+    s->tag_id[i] = s->tag_id[last];
+    s->format[i] = s->format[last];
+    s->v[i] = s->v[last];
+    s->a[i] = s->a[last];
+    s->b[i] = s->b[last];
+    s->c[i] = s->c[last];
+    s->d[i] = s->d[last];
+    s->x[i] = s->x[last];
+    s->y[i] = s->y[last];
+    s->rng[i] = s->rng[last];
+    s->replay[i] = s->replay[last];
+    s->nreplay[i] = s->nreplay[last];
+    s->pos[i] = s->pos[last];
+    __atomic_sub_fetch(&gen_count, 1, __ATOMIC_RELAXED);
+}
+
+static void
+gen_set_free(struct gen_set* s)
+{
+    for (size_t i = 0; i < s->n; ++i) {
+        free(s->replay[i]);
+    }
+    free(s->tag_id);
+    free(s->format);
+    free(s->v);
+    free(s->a);
+    free(s->b);
+    free(s->c);
+    free(s->d);
+    free(s->x);
+    free(s->y);
+    free(s->rng);
+    free(s->replay);
+    free(s->nreplay);
+    free(s->pos);
+    memset(s, 0, sizeof(*s));
+}
+
+/************************ The ticker ************************/
+
+/* Moves every generator in s on by one scan.  Each kind is its own loop
+ * over plain arrays, with no calls or branches that can't be made into
+ * selects, so that they vectorise.  Sines turn their phase point through
+ * the step angle rather than calling sin(), nudging it back onto the unit
+ * circle as they go so that rounding doesn't build up. */
+static void
+gen_step(enum gen_kind kind, struct gen_set* s)
+{
+    size_t n = s->n;
+    double *restrict v = s->v, *restrict a = s->a, *restrict b = s->b, *restrict c = s->c, *restrict d = s->d;
+    double *restrict x = s->x, *restrict y = s->y;
+    uint32_t* restrict rng = s->rng;
+
+    switch (kind) {
+    case GEN_RAMP:
+        for (size_t i = 0; i < n; ++i) {
+            double u = v[i] + c[i];
+            u = (u > b[i]) ? a[i] : u;
+            v[i] = (u < a[i]) ? b[i] : u;
+        }
+        break;
+    case GEN_SINE:
+        for (size_t i = 0; i < n; ++i) {
+            double nx = x[i] * c[i] - y[i] * d[i];
+            double ny = y[i] * c[i] + x[i] * d[i];
+            double k = (3 - (nx * nx + ny * ny)) / 2;
+
+            x[i] = nx * k;
+            y[i] = ny * k;
+            v[i] = a[i] + b[i] * y[i];
+        }
+        break;
+    case GEN_WALK:
+        for (size_t i = 0; i < n; ++i) {
+            uint32_t r = rng[i];
+            double u;
+
+            r ^= r << 13;
+            r ^= r >> 17;
+            r ^= r << 5;
+            rng[i] = r;
+            u = v[i] + ((r & 1) ? c[i] : -c[i]);
+            u = (u > b[i]) ? b[i] : u;
+            v[i] = (u < a[i]) ? a[i] : u;
+        }
+        break;
+    case GEN_COUNTER:
+        for (size_t i = 0; i < n; ++i) {
+            v[i] += c[i];
+        }
+        break;
+    case GEN_REPLAY:
+        for (size_t i = 0; i < n; ++i) {
+            v[i] = s->replay[i][s->pos[i]];
+            s->pos[i] = (s->pos[i] + 1 == s->nreplay[i]) ? 0 : s->pos[i] + 1;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* Fills n elements of width bytes at dst with x. */
+#define GEN_FILL(ctype, x)                                     \
+    do {                                                       \
+        ctype val = (x);                                       \
+        for (size_t i = 0; i < n; ++i) {                       \
+            memcpy(dst + i * sizeof(ctype), &val, sizeof(ctype)); \
+        }                                                      \
+    } while (0)
+
+static void
+gen_fill(char* dst, size_t n, enum gen_format format, double v)
+{
+    /* Converting straight to a narrower integer type is undefined for
+     * anything out of its range; going by way of int64_t wraps instead. */
+    int64_t iv = (v >= -9.2e18 && v <= 9.2e18) ? (int64_t)(v) : 0;
+
+    switch (format) {
+    case GEN_BOOL:
+        GEN_FILL(uint8_t, v != 0);
+        break;
+    case GEN_INT8:
+        GEN_FILL(int8_t, (int8_t)(iv));
+        break;
+    case GEN_INT16:
+        GEN_FILL(int16_t, (int16_t)(iv));
+        break;
+    case GEN_INT32:
+        GEN_FILL(int32_t, (int32_t)(iv));
+        break;
+    case GEN_INT64:
+        GEN_FILL(int64_t, iv);
+        break;
+    case GEN_FLOAT32:
+        GEN_FILL(float, (float)(v));
+        break;
+    case GEN_FLOAT64:
+        GEN_FILL(double, v);
+        break;
+    }
+}
+
+#undef GEN_FILL
+
+/* Copies s's current values into their tags, dropping the generators of
+ * any that have gone.
+ *
+ * Assumes that gen_mtx is held.
+ */
+static void
+gen_publish(struct gen_set* s)
+{
+    struct tag_tree_node* t;
+
+    for (size_t i = 0; i < s->n;) {
+        epoch_enter();
+        /* Straight to the table: generators only exist for tags that do,
+         * and the tree may still be being seeded (see tag_tree_init()). */
+        if ((t = tag_table_get(s->tag_id[i])) == NULL) {
+            epoch_exit();
+            gen_set_remove(s, i);
+            continue;
+        }
+
+        /* A buffered tag gets a new snapshot, which doesn't need the
+         * tag's mutex (or to wait for plc_tag_lock()) at all. */
+        if (t->store->nbufs != 0) {
+            char* buf = tag_store_stage(t->store);
+
+            gen_fill(buf, t->elem_count, s->format[i], s->v[i]);
+            tag_store_publish(t->store, buf);
+            epoch_exit();
+            ++i;
+            continue;
+        }
+
+        tag_store_lock(t->store);
+        if (t->store->lock_owner == NULL) {
+            __atomic_store_n(&t->store->seq, t->store->seq + 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            gen_fill(t->data, t->elem_count, s->format[i], s->v[i]);
+            __atomic_store_n(&t->store->seq, t->store->seq + 1, __ATOMIC_RELEASE);
+            notify_mark(t->store);
+        }
+        MTX_UNLOCK(&t->store->mtx);
+        epoch_exit();
+        ++i;
+    }
+}
+
+/* Publishes what every generator holds, then moves them all on.
+ *
+ * Assumes that gen_mtx is held.
+ */
+static void
+gen_tick()
+{
+    for (int k = GEN_NONE + 1; k < GEN_NKINDS; ++k) {
+        gen_publish(&gen_sets[k]);
+        gen_step(k, &gen_sets[k]);
+    }
+}
+
+static void
+timespec_add_ms(struct timespec* ts, long ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static int
+timespec_cmp(const struct timespec* l, const struct timespec* r)
+{
+    if (l->tv_sec != r->tv_sec) {
+        return l->tv_sec < r->tv_sec ? -1 : 1;
+    }
+    return (l->tv_nsec > r->tv_nsec) - (l->tv_nsec < r->tv_nsec);
+}
+
+static void*
+gen_ticker(void* arg)
+{
+    struct timespec next, now;
+    unsigned seen_gen;
+
+    (void)(arg);
+
+    MTX_LOCK(&gen_mtx);
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    seen_gen = scan_gen;
+
+    while (!ticker_stopping) {
+        /* Ticking on a fixed schedule, rather than sleeping for a scan
+         * after each tick, keeps the rate steady however long ticks take. */
+        gen_tick();
+        timespec_add_ms(&next, scan_ms);
+
+        for (;;) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (ticker_stopping || timespec_cmp(&now, &next) >= 0) {
+                break;
+            }
+            pthread_cond_timedwait(&gen_cond, &gen_mtx, &next);
+            if (scan_gen != seen_gen) {
+                /* A new rate starts from now. */
+                seen_gen = scan_gen;
+                clock_gettime(CLOCK_MONOTONIC, &next);
+                timespec_add_ms(&next, scan_ms);
+            }
+        }
+        /* If we've fallen behind, don't try to catch up. */
+        if (timespec_cmp(&now, &next) > 0) {
+            next = now;
+        }
+    }
+
+    MTX_UNLOCK(&gen_mtx);
+
+    return NULL;
+}
+
+/* Picks up the rate from $PLCSTUB_SCAN_MS the first time it's needed.
+ *
+ * Assumes that gen_mtx is held.
+ */
+static void
+gen_init_scan_ms()
+{
+    const char* env;
+
+    if (scan_ms > 0) {
+        return;
+    }
+    scan_ms = GEN_DEFAULT_SCAN_MS;
+    if ((env = getenv("PLCSTUB_SCAN_MS")) != NULL) {
+        scan_ms = atoi(env);
+        if (scan_ms < 1) {
+            errx(1, "PLCSTUB_SCAN_MS must be at least 1");
+        }
+    }
+}
+
+/* Starts the ticker if it isn't already running.
+ *
+ * Assumes that gen_mtx is held.
+ */
+static void
+gen_start_ticker()
+{
+    static bool cond_inited = false;
+    pthread_condattr_t attr;
+    int ret;
+
+    if (ticker_running) {
+        return;
+    }
+    if (!cond_inited) {
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&gen_cond, &attr);
+        pthread_condattr_destroy(&attr);
+        cond_inited = true;
+    }
+    gen_init_scan_ms();
+
+    pdebug(PLCTAG_DEBUG_DETAIL, "Starting the generator ticker, every %d ms", scan_ms);
+
+    ticker_stopping = false;
+    if ((ret = pthread_create(&ticker, NULL, gen_ticker, NULL)) != 0) {
+        errx(1, "pthread_create: %s", strerror(ret));
+    }
+    ticker_running = true;
+}
+
+/************************ Interface ************************/
+
+void
+gen_attach(int32_t tag_id, struct gen_spec* spec)
+{
+    struct gen_set* s = &gen_sets[spec->kind];
+    size_t i;
+
+    MTX_LOCK(&gen_mtx);
+    gen_set_reserve(s);
+    i = s->n++;
+    __atomic_add_fetch(&gen_count, 1, __ATOMIC_RELAXED);
+
+    s->tag_id[i] = tag_id;
+    s->format[i] = spec->format;
+    s->a[i] = spec->lo;
+    s->b[i] = spec->hi;
+    s->c[i] = spec->step;
+    s->d[i] = 0;
+    s->x[i] = 1;
+    s->y[i] = 0;
+    s->v[i] = spec->lo;
+    s->replay[i] = NULL;
+    s->nreplay[i] = 0;
+    s->pos[i] = 0;
+    gen_seed = gen_seed * 1664525u + 1013904223u;
+    s->rng[i] = gen_seed | 1;
+
+    switch (spec->kind) {
+    case GEN_SINE:
+        s->a[i] = (spec->lo + spec->hi) / 2;
+        s->b[i] = (spec->hi - spec->lo) / 2;
+        gen_sincos(2 * M_PI / spec->step, &s->d[i], &s->c[i]);
+        s->v[i] = s->a[i];
+        break;
+    case GEN_WALK:
+        s->v[i] = (spec->lo + spec->hi) / 2;
+        break;
+    case GEN_COUNTER:
+        s->v[i] = 0;
+        break;
+    case GEN_REPLAY:
+        s->replay[i] = spec->replay;
+        s->nreplay[i] = spec->nreplay;
+        s->v[i] = spec->replay[0];
+        s->pos[i] = (spec->nreplay > 1) ? 1 : 0;
+        spec->replay = NULL;
+        break;
+    default:
+        break;
+    }
+
+    gen_start_ticker();
+    MTX_UNLOCK(&gen_mtx);
+
+    pdebug(PLCTAG_DEBUG_DETAIL, "Generating %s values for tag %d", gen_names[spec->kind], tag_id);
+}
+
+void
+gen_detach(int32_t tag_id)
+{
+    if (__atomic_load_n(&gen_count, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+
+    MTX_LOCK(&gen_mtx);
+    for (int k = GEN_NONE + 1; k < GEN_NKINDS; ++k) {
+        struct gen_set* s = &gen_sets[k];
+
+        for (size_t i = 0; i < s->n;) {
+            if (s->tag_id[i] == tag_id) {
+                gen_set_remove(s, i);
+            } else {
+                ++i;
+            }
+        }
+    }
+    MTX_UNLOCK(&gen_mtx);
+}
+
+int
+plcstub_set_scan_rate(int ms)
+{
+    if (ms < 1) {
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    MTX_LOCK(&gen_mtx);
+    scan_ms = ms;
+    scan_gen++;
+    if (ticker_running) {
+        pthread_cond_signal(&gen_cond);
+    }
+    MTX_UNLOCK(&gen_mtx);
+
+    return PLCTAG_STATUS_OK;
+}
+
+void
+gen_stop(void)
+{
+    MTX_LOCK(&gen_mtx);
+    if (ticker_running) {
+        ticker_stopping = true;
+        pthread_cond_signal(&gen_cond);
+    }
+    MTX_UNLOCK(&gen_mtx);
+}
+
+void
+gen_shutdown(void)
+{
+    gen_stop();
+    MTX_LOCK(&gen_mtx);
+    if (ticker_running) {
+        MTX_UNLOCK(&gen_mtx);
+
+        pthread_join(ticker, NULL);
+
+        MTX_LOCK(&gen_mtx);
+        ticker_running = false;
+    }
+    for (int k = 0; k < GEN_NKINDS; ++k) {
+        gen_set_free(&gen_sets[k]);
+    }
+    __atomic_store_n(&gen_count, 0, __ATOMIC_RELAXED);
+    scan_ms = -1;
+    MTX_UNLOCK(&gen_mtx);
+}
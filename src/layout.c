@@ -0,0 +1,301 @@
+/* layout.c
+ *
+ * Array dimensions and UDT layouts; see layout.h.
+ */
+
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "attr.h"
+#include "debug.h"
+#include "layout.h"
+#include "lock_utils.h"
+
+/* Ensures mutual exclusion on interning.  Readers of udts take no lock:
+ * an entry is written once, before the count that covers it. */
+static pthread_mutex_t layout_mtx = PTHREAD_MUTEX_INITIALIZER;
+static const struct udt* udts[LAYOUT_MAX_UDTS + 1];
+static uint16_t nudts = 0;
+
+/* Parses a decimal number of at least 1 out of [*p, end), advancing *p. */
+static int
+layout_parse_number(const char** p, const char* end, uint32_t* out)
+{
+    uint64_t n = 0;
+    const char* s = *p;
+
+    while (s < end && *s == ' ') {
+        ++s;
+    }
+    if (s == end || *s < '0' || *s > '9') {
+        return -1;
+    }
+    for (; s < end && *s >= '0' && *s <= '9'; ++s) {
+        n = n * 10 + (*s - '0');
+        if (n > UINT32_MAX) {
+            return -1;
+        }
+    }
+    while (s < end && *s == ' ') {
+        ++s;
+    }
+    *p = s;
+    *out = n;
+    return n == 0 ? -1 : 0;
+}
+
+int
+layout_parse_dims(const char* s, size_t len, uint32_t dims[LAYOUT_MAX_DIMS])
+{
+    const char* end = s + len;
+    size_t count = 1;
+    int n = 0;
+
+    memset(dims, 0, LAYOUT_MAX_DIMS * sizeof(*dims));
+    for (;;) {
+        if (n == LAYOUT_MAX_DIMS || layout_parse_number(&s, end, &dims[n]) != 0
+            || count > (SIZE_MAX / 2) / dims[n]) {
+            return -1;
+        }
+        count *= dims[n++];
+        if (s == end) {
+            return n;
+        }
+        if (*s++ != ',') {
+            return -1;
+        }
+    }
+}
+
+size_t
+layout_dims_count(const uint32_t dims[LAYOUT_MAX_DIMS])
+{
+    size_t count = 1;
+
+    for (int i = 0; i < LAYOUT_MAX_DIMS && dims[i] != 0; ++i) {
+        count *= dims[i];
+    }
+    return count;
+}
+
+/* Parses one member, such as "REAL[4]", out of [s, end). */
+static int
+layout_parse_member(const char* s, const char* end, struct udt_member* m)
+{
+    size_t width;
+    const char* bracket;
+
+    while (s < end && *s == ' ') {
+        ++s;
+    }
+    while (end > s && end[-1] == ' ') {
+        --end;
+    }
+    m->count = 0;
+    if ((bracket = memchr(s, '[', end - s)) != NULL) {
+        const char* p = bracket + 1;
+
+        if (end[-1] != ']') {
+            return -1;
+        }
+        if (layout_parse_number(&p, end - 1, &m->count) != 0 || p != end - 1) {
+            return -1;
+        }
+        end = bracket;
+    }
+    return attr_lookup_type(s, end - s, &m->type, &width);
+}
+
+static size_t
+layout_width(enum tag_type type)
+{
+    switch (type) {
+    case TAG_BOOL:
+    case TAG_SINT:
+        return 1;
+    case TAG_INT:
+        return 2;
+    case TAG_DINT:
+    case TAG_REAL:
+        return 4;
+    case TAG_LINT:
+    case TAG_LREAL:
+        return 8;
+    }
+    return 1;
+}
+
+/* Lays the members out, returning the padded size of the whole. */
+static size_t
+layout_place(struct udt_member* members, size_t n)
+{
+    size_t off = 0, align = 4, width, bytes, a;
+    int bits = -1; /* the next free bit of the BOOLs' hidden SINT, if any */
+
+    for (size_t i = 0; i < n; ++i) {
+        struct udt_member* m = &members[i];
+
+        if (m->type == TAG_BOOL && m->count == 0) {
+            if (bits < 0 || bits == 8) {
+                m->offset = off++;
+                bits = 0;
+            } else {
+                m->offset = off - 1;
+            }
+            m->bit = bits++;
+            continue;
+        }
+        bits = -1;
+
+        if (m->type == TAG_BOOL) {
+            a = 4;
+            bytes = (m->count + 31) / 32 * 4;
+        } else {
+            width = layout_width(m->type);
+            a = width;
+            bytes = width * (m->count ? m->count : 1);
+        }
+        off = (off + a - 1) & ~(a - 1);
+        m->offset = off;
+        m->bit = 0;
+        off += bytes;
+        if (a > align) {
+            align = a;
+        }
+    }
+    return (off + align - 1) & ~(align - 1);
+}
+
+const struct udt*
+udt_intern(const char* s, size_t len)
+{
+    struct udt_member members[LAYOUT_MAX_MEMBERS];
+    const char *p = s, *end = s + len, *comma;
+    struct udt* u = NULL;
+    size_t n = 0;
+
+    for (;;) {
+        comma = memchr(p, ',', end - p);
+        if (comma == NULL) {
+            comma = end;
+        }
+        if (n == LAYOUT_MAX_MEMBERS || layout_parse_member(p, comma, &members[n]) != 0) {
+            pdebug(PLCTAG_DEBUG_WARN, "Bad UDT layout %.*s", (int)(len), s);
+            return NULL;
+        }
+        n++;
+        if (comma == end) {
+            break;
+        }
+        p = comma + 1;
+    }
+
+    MTX_LOCK(&layout_mtx);
+    for (uint16_t i = 1; i <= nudts; ++i) {
+        if (strlen(udts[i]->spec) == len && memcmp(udts[i]->spec, s, len) == 0) {
+            MTX_UNLOCK(&layout_mtx);
+            return udts[i];
+        }
+    }
+    if (nudts == LAYOUT_MAX_UDTS) {
+        MTX_UNLOCK(&layout_mtx);
+        pdebug(PLCTAG_DEBUG_WARN, "Too many UDT layouts");
+        return NULL;
+    }
+
+    if ((u = malloc(sizeof(*u) + n * sizeof(*members) + len + 1)) == NULL) {
+        err(1, "malloc");
+    }
+    u->nmembers = n;
+    memcpy(u->members, members, n * sizeof(*members));
+    u->size = layout_place(u->members, n);
+    u->spec = (char*)(u->members + n);
+    memcpy(u->spec, s, len);
+    u->spec[len] = '\0';
+    u->id = nudts + 1;
+    udts[u->id] = u;
+    __atomic_store_n(&nudts, u->id, __ATOMIC_RELEASE);
+    MTX_UNLOCK(&layout_mtx);
+
+    pdebug(PLCTAG_DEBUG_DETAIL, "UDT %u is %s, %zu bytes", u->id, u->spec, u->size);
+    return u;
+}
+
+const struct udt*
+udt_get(uint16_t id)
+{
+    if (id == 0 || id > __atomic_load_n(&nudts, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return udts[id];
+}
+
+void
+layout_shutdown(void)
+{
+    MTX_LOCK(&layout_mtx);
+    for (uint16_t i = 1; i <= nudts; ++i) {
+        free((void*)(udts[i]));
+        udts[i] = NULL;
+    }
+    __atomic_store_n(&nudts, 0, __ATOMIC_RELEASE);
+    MTX_UNLOCK(&layout_mtx);
+}
+
+uint16_t
+layout_type_code(uint16_t type, size_t elem_size)
+{
+    static const uint16_t codes[] = {
+        [TAG_BOOL] = 0xc1,
+        [TAG_SINT] = 0xc2,
+        [TAG_INT] = 0xc3,
+        [TAG_DINT] = 0xc4,
+        [TAG_REAL] = 0xca,
+        [TAG_LINT] = 0xc5,
+        [TAG_LREAL] = 0xcb,
+    };
+
+    if (type > 0 && type <= sizeof(codes) / sizeof(codes[0])) {
+        return codes[type - 1];
+    }
+    switch (elem_size) {
+    case 1:
+        return 0xc2;
+    case 2:
+        return 0xc3;
+    case 4:
+        return 0xc4;
+    case 8:
+        return 0xc5;
+    default:
+        return 0;
+    }
+}
+
+void
+layout_symbol_dims(size_t elem_count, const uint32_t dims[LAYOUT_MAX_DIMS], uint32_t out[LAYOUT_MAX_DIMS])
+{
+    memset(out, 0, LAYOUT_MAX_DIMS * sizeof(*out));
+    if (dims[0] != 0) {
+        memcpy(out, dims, LAYOUT_MAX_DIMS * sizeof(*out));
+    } else if (elem_count > 1) {
+        out[0] = elem_count > UINT32_MAX ? UINT32_MAX : elem_count;
+    }
+}
+
+uint16_t
+layout_symbol_type(uint16_t type, size_t elem_size, size_t elem_count, uint16_t udt,
+    const uint32_t dims[LAYOUT_MAX_DIMS])
+{
+    uint32_t d[LAYOUT_MAX_DIMS];
+    uint16_t code = udt ? 0 : layout_type_code(type, elem_size);
+    int ndims = 0;
+
+    layout_symbol_dims(elem_count, dims, d);
+    while (ndims < LAYOUT_MAX_DIMS && d[ndims] != 0) {
+        ndims++;
+    }
+    return (code ? code : 0x8000 | (udt & LAYOUT_MAX_UDTS)) | ndims << 13;
+}
@@ -0,0 +1,576 @@
+/* notify.c
+ *
+ * Change-notification subscriptions, delivered by a notifier thread.
+ */
+
+#include <err.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "debug.h"
+#include "epoch.h"
+#include "event.h"
+#include "libplctag.h"
+#include "lock_utils.h"
+#include "notify.h"
+#include "plcstub.h"
+#include "stats.h"
+#include "tagtree.h"
+
+/* The notifier looks at the bitmap at least this often (in ms), however
+ * long the subscriptions' intervals are, so that a new subscription with a
+ * short one isn't kept waiting. */
+#define NOTIFY_MAX_TICK_MS 100
+
+uint64_t notify_dirty[NOTIFY_MAX_SLOTS / 64];
+uint64_t notify_summary[NOTIFY_MAX_SLOTS / 64 / 64];
+
+/* One handle's subscription. */
+struct notify_sub {
+    int32_t tag_id;
+    uint64_t interval_ns;
+    double deadband;
+    uint64_t due; /* when the next event may be raised */
+    bool dirty; /* the payload has changed since it was last looked at */
+    char* last; /* the payload as of the last event (or subscribing) */
+};
+
+/* The subscriptions onto one store, kept in its notify_slot.  A slot with
+ * no subscriptions is free. */
+struct notify_slot {
+    struct notify_sub* subs;
+    size_t nsubs;
+    size_t size; /* of the payload */
+    uint16_t type;
+    bool pending; /* on the pending list: somebody's dirty, but not due */
+};
+
+/* Ensures mutual exclusion on everything below.  Taken before any tag's
+ * store mutex. */
+static pthread_mutex_t notify_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t notify_cond; /* wakes the notifier early */
+
+/* Slots (0 is never used), and those that are free. */
+static struct notify_slot* slots;
+static size_t nslots = 1, slots_cap;
+static unsigned* free_slots;
+static size_t nfree, free_cap;
+
+/* Slots with subscriptions still waiting out their interval. */
+static unsigned* pending;
+static size_t npending, pending_cap;
+
+/* The tags to raise events on, once notify_mtx is released. */
+static int32_t* events;
+static size_t nevents, events_cap;
+
+/* Where the current payload is copied to, to compare against. */
+static char* scratch;
+static size_t scratch_cap;
+
+static size_t nsubs = 0;
+static uint64_t tick_ns = NOTIFY_MAX_TICK_MS * 1000000ULL;
+
+static pthread_t notifier;
+static bool notifier_running = false;
+static bool notifier_stopping = false;
+
+/* Grows *p, an array of *cap elements of size bytes, to hold at least n. */
+static void
+notify_reserve(void* p, size_t* cap, size_t n, size_t size)
+{
+    void** arr = p;
+    size_t c;
+
+    if (n <= *cap) {
+        return;
+    }
+    c = *cap ? *cap * 2 : 64;
+    while (c < n) {
+        c *= 2;
+    }
+    if ((*arr = realloc(*arr, c * size)) == NULL) {
+        err(1, "realloc");
+    }
+    *cap = c;
+}
+
+/* Copies t's payload to dst: the current snapshot, for a buffered tag.
+ * Returns false if somebody holds plc_tag_lock() on it, and so may not be
+ * finished changing it, unless force is set, in which case it's copied as
+ * it stands.
+ *
+ * Assumes that notify_mtx is held.
+ */
+static bool
+notify_read(struct tag_tree_node* t, char* dst, bool force)
+{
+    if (t->store->nbufs != 0) {
+        tag_store_snapshot(t->store, dst);
+        return true;
+    }
+
+    tag_store_lock(t->store);
+    if (t->store->lock_owner != NULL && !force) {
+        MTX_UNLOCK(&t->store->mtx);
+        return false;
+    }
+    memcpy(dst, t->data, t->elem_size * t->elem_count);
+    MTX_UNLOCK(&t->store->mtx);
+    return true;
+}
+
+/* Has cur changed from last by enough to tell sub about?  Elements of
+ * REAL and LREAL tags have to have moved by more than the deadband;
+ * anything else, at all. */
+static bool
+notify_changed(const struct notify_slot* s, const struct notify_sub* sub, const char* cur)
+{
+    size_t width = (s->type == TAG_REAL + 1) ? sizeof(float) : (s->type == TAG_LREAL + 1) ? sizeof(double) : 0;
+
+    if (sub->deadband <= 0 || width == 0 || s->size % width != 0) {
+        return memcmp(cur, sub->last, s->size) != 0;
+    }
+
+    for (size_t off = 0; off < s->size; off += width) {
+        double a, b, d;
+
+        if (memcmp(cur + off, sub->last + off, width) == 0) {
+            continue;
+        }
+        if (width == sizeof(float)) {
+            float fa, fb;
+
+            memcpy(&fa, cur + off, sizeof(fa));
+            memcpy(&fb, sub->last + off, sizeof(fb));
+            a = fa;
+            b = fb;
+        } else {
+            memcpy(&a, cur + off, sizeof(a));
+            memcpy(&b, sub->last + off, sizeof(b));
+        }
+        d = a - b;
+        /* NaNs and infinities count as changes. */
+        if (!(d <= sub->deadband && d >= -sub->deadband)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Takes every slot marked in the bitmap, marking its subscriptions dirty
+ * and putting it on the pending list.
+ *
+ * Assumes that notify_mtx is held.
+ */
+static void
+notify_collect()
+{
+    size_t nwords = (nslots + 63) / 64;
+
+    for (size_t i = 0; i < (nwords + 63) / 64; ++i) {
+        uint64_t summary;
+
+        if (__atomic_load_n(&notify_summary[i], __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+        summary = __atomic_exchange_n(&notify_summary[i], 0, __ATOMIC_ACQ_REL);
+        for (; summary != 0; summary &= summary - 1) {
+            size_t w = i * 64 + __builtin_ctzll(summary);
+            uint64_t word = __atomic_exchange_n(&notify_dirty[w], 0, __ATOMIC_ACQ_REL);
+
+            for (; word != 0; word &= word - 1) {
+                unsigned slot = w * 64 + __builtin_ctzll(word);
+                struct notify_slot* s;
+
+                if (slot >= nslots || (s = &slots[slot])->nsubs == 0) {
+                    continue;
+                }
+                for (size_t k = 0; k < s->nsubs; ++k) {
+                    s->subs[k].dirty = true;
+                }
+                if (!s->pending) {
+                    s->pending = true;
+                    notify_reserve(&pending, &pending_cap, npending + 1, sizeof(*pending));
+                    pending[npending++] = slot;
+                }
+            }
+        }
+    }
+}
+
+/* Raises an event for every dirty subscription that's due and whose
+ * payload has changed enough, leaving on the pending list the slots that
+ * still have subscriptions waiting.
+ *
+ * Assumes that notify_mtx is held.
+ */
+static void
+notify_check(uint64_t now)
+{
+    size_t kept = 0;
+
+    for (size_t i = 0; i < npending; ++i) {
+        struct notify_slot* s = &slots[pending[i]];
+        struct tag_tree_node* t = NULL;
+        bool waiting = false, read = false;
+
+        epoch_enter();
+        for (size_t k = 0; k < s->nsubs; ++k) {
+            struct notify_sub* sub = &s->subs[k];
+
+            if (!sub->dirty) {
+                continue;
+            }
+            if (now < sub->due) {
+                waiting = true;
+                continue;
+            }
+
+            /* The payload is read once, for every subscription that's due. */
+            if (!read) {
+                if (t == NULL && (t = tag_table_get(sub->tag_id)) == NULL) {
+                    continue;
+                }
+                if (!notify_read(t, scratch, false)) {
+                    waiting = true;
+                    break;
+                }
+                read = true;
+            }
+
+            sub->dirty = false;
+            if (notify_changed(s, sub, scratch)) {
+                memcpy(sub->last, scratch, s->size);
+                sub->due = now + sub->interval_ns;
+                notify_reserve(&events, &events_cap, nevents + 1, sizeof(*events));
+                events[nevents++] = sub->tag_id;
+            }
+        }
+        epoch_exit();
+
+        s->pending = waiting;
+        if (waiting) {
+            pending[kept++] = pending[i];
+        }
+    }
+    npending = kept;
+}
+
+/* Hands the queued events to their tags' callbacks.
+ *
+ * Assumes that notify_mtx is NOT held, so that callbacks (in inline mode)
+ * can subscribe and unsubscribe.
+ */
+static void
+notify_deliver(int32_t* ids, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        struct tag_tree_node* t;
+        tag_callback_func cb;
+
+        epoch_enter();
+        if ((t = tag_table_get(ids[i])) != NULL && (cb = __atomic_load_n(&t->cb, __ATOMIC_RELAXED)) != NULL) {
+            pdebug(PLCTAG_DEBUG_SPEW, "Calling cb for %d with PLCSTUB_EVENT_CHANGED", ids[i]);
+            event_post(cb, ids[i], PLCSTUB_EVENT_CHANGED, PLCTAG_STATUS_OK);
+        }
+        epoch_exit();
+    }
+}
+
+static void*
+notify_thread(void* arg)
+{
+    int32_t* batch = NULL;
+    size_t n, batch_cap = 0;
+    struct timespec next;
+    uint64_t now;
+
+    (void)(arg);
+
+    MTX_LOCK(&notify_mtx);
+    while (!notifier_stopping) {
+        now = stats_now_ns();
+        notify_collect();
+        notify_check(now);
+
+        if ((n = nevents) > 0) {
+            notify_reserve(&batch, &batch_cap, n, sizeof(*batch));
+            memcpy(batch, events, n * sizeof(*batch));
+            nevents = 0;
+            MTX_UNLOCK(&notify_mtx);
+            notify_deliver(batch, n);
+            MTX_LOCK(&notify_mtx);
+        }
+
+        now += tick_ns;
+        next.tv_sec = now / 1000000000ULL;
+        next.tv_nsec = now % 1000000000ULL;
+        if (!notifier_stopping) {
+            pthread_cond_timedwait(&notify_cond, &notify_mtx, &next);
+        }
+    }
+    MTX_UNLOCK(&notify_mtx);
+
+    free(batch);
+    return NULL;
+}
+
+/* Starts the notifier if it isn't already running.
+ *
+ * Assumes that notify_mtx is held.
+ */
+static void
+notify_start()
+{
+    static bool cond_inited = false;
+    pthread_condattr_t attr;
+    int ret;
+
+    if (notifier_running) {
+        return;
+    }
+    if (!cond_inited) {
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&notify_cond, &attr);
+        pthread_condattr_destroy(&attr);
+        cond_inited = true;
+    }
+
+    pdebug(PLCTAG_DEBUG_DETAIL, "Starting the notifier");
+
+    notifier_stopping = false;
+    if ((ret = pthread_create(&notifier, NULL, notify_thread, NULL)) != 0) {
+        errx(1, "pthread_create: %s", strerror(ret));
+    }
+    notifier_running = true;
+}
+
+/* Works out how often the notifier has to look at the bitmap: as often as
+ * the shortest interval asks for.
+ *
+ * Assumes that notify_mtx is held.
+ */
+static void
+notify_retick()
+{
+    tick_ns = NOTIFY_MAX_TICK_MS * 1000000ULL;
+    for (size_t i = 1; i < nslots; ++i) {
+        for (size_t k = 0; k < slots[i].nsubs; ++k) {
+            if (slots[i].subs[k].interval_ns < tick_ns) {
+                tick_ns = slots[i].subs[k].interval_ns;
+            }
+        }
+    }
+}
+
+/* Finds the tag's subscription, if it has one.
+ *
+ * Assumes that notify_mtx is held.
+ */
+static struct notify_sub*
+notify_find(struct tag_tree_node* t)
+{
+    struct notify_slot* s;
+
+    if (t->store->notify_slot == 0) {
+        return NULL;
+    }
+    s = &slots[t->store->notify_slot];
+    for (size_t k = 0; k < s->nsubs; ++k) {
+        if (s->subs[k].tag_id == t->tag_id) {
+            return &s->subs[k];
+        }
+    }
+    return NULL;
+}
+
+int
+plcstub_subscribe(int32_t tag, int interval_ms, double deadband)
+{
+    struct tag_tree_node* t;
+    struct notify_slot* s;
+    struct notify_sub* sub;
+    unsigned slot;
+
+    if (interval_ms < 1 || !(deadband >= 0)) {
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    MTX_LOCK(&notify_mtx);
+    epoch_enter();
+    if ((t = tag_tree_lookup(tag)) == NULL || tag == METATAG_ID) {
+        epoch_exit();
+        MTX_UNLOCK(&notify_mtx);
+        pdebug(PLCTAG_DEBUG_WARN, "Can't subscribe to tag %d", tag);
+        return t ? PLCTAG_ERR_NOT_ALLOWED : PLCTAG_ERR_NOT_FOUND;
+    }
+
+    /* Other processes' changes to shared storage (see shm.h) have nowhere
+     * to be marked. */
+    if (t->store->shared) {
+        epoch_exit();
+        MTX_UNLOCK(&notify_mtx);
+        pdebug(PLCTAG_DEBUG_WARN, "Can't subscribe to shared tag %d", tag);
+        return PLCTAG_ERR_UNSUPPORTED;
+    }
+
+    /* Subscribing again just changes the terms. */
+    if ((sub = notify_find(t)) != NULL) {
+        sub->interval_ns = interval_ms * 1000000ULL;
+        sub->deadband = deadband;
+        goto done;
+    }
+
+    if ((slot = t->store->notify_slot) == 0) {
+        if (nfree > 0) {
+            slot = free_slots[--nfree];
+        } else if (nslots < NOTIFY_MAX_SLOTS) {
+            notify_reserve(&slots, &slots_cap, nslots + 1, sizeof(*slots));
+            slot = nslots++;
+            memset(&slots[slot], 0, sizeof(slots[slot]));
+        } else {
+            epoch_exit();
+            MTX_UNLOCK(&notify_mtx);
+            pdebug(PLCTAG_DEBUG_WARN, "No room for any more subscriptions");
+            return PLCTAG_ERR_NO_RESOURCES;
+        }
+        s = &slots[slot];
+        s->size = t->elem_size * t->elem_count;
+        s->type = t->store->type;
+        notify_reserve(&scratch, &scratch_cap, s->size, 1);
+        __atomic_store_n(&t->store->notify_slot, slot, __ATOMIC_RELAXED);
+    }
+
+    s = &slots[slot];
+    s->subs = realloc(s->subs, (s->nsubs + 1) * sizeof(*s->subs));
+    if (s->subs == NULL) {
+        err(1, "realloc");
+    }
+    sub = &s->subs[s->nsubs++];
+    *sub = (struct notify_sub) {
+        .tag_id = tag,
+        .interval_ns = interval_ms * 1000000ULL,
+        .deadband = deadband,
+    };
+    if ((sub->last = malloc(s->size ? s->size : 1)) == NULL) {
+        err(1, "malloc");
+    }
+    __atomic_add_fetch(&nsubs, 1, __ATOMIC_RELAXED);
+
+    /* Changes are reported against the payload as it is now (even if it's
+     * in the middle of being changed under plc_tag_lock(), which can cost
+     * an extra event at worst). */
+    notify_read(t, sub->last, true);
+    notify_start();
+
+done:
+    epoch_exit();
+    notify_retick();
+    pthread_cond_signal(&notify_cond);
+    MTX_UNLOCK(&notify_mtx);
+
+    pdebug(PLCTAG_DEBUG_DETAIL, "Subscribed to tag %d every %d ms", tag, interval_ms);
+
+    return PLCTAG_STATUS_OK;
+}
+
+bool
+notify_detach(int32_t tag_id)
+{
+    struct tag_tree_node* t;
+    struct notify_slot* s;
+    struct notify_sub* sub;
+    unsigned slot;
+
+    if (__atomic_load_n(&nsubs, __ATOMIC_RELAXED) == 0) {
+        return false;
+    }
+
+    MTX_LOCK(&notify_mtx);
+    epoch_enter();
+    if ((t = tag_table_get(tag_id)) == NULL || (sub = notify_find(t)) == NULL) {
+        epoch_exit();
+        MTX_UNLOCK(&notify_mtx);
+        return false;
+    }
+
+    slot = t->store->notify_slot;
+    s = &slots[slot];
+    free(sub->last);
+    *sub = s->subs[--s->nsubs];
+    __atomic_sub_fetch(&nsubs, 1, __ATOMIC_RELAXED);
+
+    /* The last one out frees the slot.  A writer may still mark it, which
+     * is harmless: whatever gets it next just looks for changes that
+     * aren't there. */
+    if (s->nsubs == 0) {
+        __atomic_store_n(&t->store->notify_slot, 0, __ATOMIC_RELAXED);
+        free(s->subs);
+        s->subs = NULL;
+        notify_reserve(&free_slots, &free_cap, nfree + 1, sizeof(*free_slots));
+        free_slots[nfree++] = slot;
+    }
+    epoch_exit();
+    notify_retick();
+    MTX_UNLOCK(&notify_mtx);
+
+    return true;
+}
+
+int
+plcstub_unsubscribe(int32_t tag)
+{
+    return notify_detach(tag) ? PLCTAG_STATUS_OK : PLCTAG_ERR_NOT_FOUND;
+}
+
+void
+notify_stop(void)
+{
+    MTX_LOCK(&notify_mtx);
+    if (notifier_running) {
+        notifier_stopping = true;
+        pthread_cond_signal(&notify_cond);
+    }
+    MTX_UNLOCK(&notify_mtx);
+}
+
+void
+notify_shutdown(void)
+{
+    notify_stop();
+    MTX_LOCK(&notify_mtx);
+    if (notifier_running) {
+        MTX_UNLOCK(&notify_mtx);
+        pthread_join(notifier, NULL);
+        MTX_LOCK(&notify_mtx);
+        notifier_running = false;
+    }
+
+    for (size_t i = 1; i < nslots; ++i) {
+        for (size_t k = 0; k < slots[i].nsubs; ++k) {
+            free(slots[i].subs[k].last);
+        }
+        free(slots[i].subs);
+    }
+    free(slots);
+    free(free_slots);
+    free(pending);
+    free(events);
+    free(scratch);
+    slots = NULL;
+    free_slots = pending = NULL;
+    events = NULL;
+    scratch = NULL;
+    nslots = 1;
+    slots_cap = nfree = free_cap = npending = pending_cap = nevents = events_cap = scratch_cap = 0;
+    nsubs = 0;
+    tick_ns = NOTIFY_MAX_TICK_MS * 1000000ULL;
+    memset(notify_dirty, 0, sizeof(notify_dirty));
+    memset(notify_summary, 0, sizeof(notify_summary));
+    MTX_UNLOCK(&notify_mtx);
+}
@@ -5,170 +5,608 @@
  */
 
 #include <err.h>
+#include <errno.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "async.h"
+#include "attr.h"
+#include "conn.h"
+#include "convert.h"
 #include "debug.h"
+#include "epoch.h"
+#include "event.h"
+#include "fixture.h"
+#include "gen.h"
+#include "layout.h"
 #include "plcstub.h"
 #include "libplctag.h"
 #include "lock_utils.h"
+#include "notify.h"
+#include "shm.h"
+#include "stats.h"
 #include "tagtree.h"
-
-/* TODO: there should be a way of unifying these (as well as the _impl functions). */
-typedef void(getter_fn)(char *buf, int offset, void *val);
-typedef void(setter_fn)(char *buf, int offset, void *val);
+#include "trace.h"
 
 /* Accessor / mutator macros */
 
 /* 
+ * Each expansion is a typed fast path: look the tag up, check bounds for
+ * the width of the type and copy it in or out with a fixed-size memcpy,
+ * which the compiler turns into a single load or store.  Reads don't lock
+ * at all (see plcstub_read_fast()).  Anything out of the ordinary (unknown
+ * tags, bad offsets, tags with a callback registered and so events to
+ * deliver, tags locked by another thread, and the metatag, whose size
+ * changes) is punted to plcstub_access_impl().  The lookup and the copy
+ * happen inside an epoch critical section, so that the tag can't be freed
+ * from under us by a concurrent plc_tag_destroy().
+ *
+ * Calls are recorded, value and all, if a trace is being recorded (see
+ * trace.h), at the cost of a load when one isn't.
+ *
  * TODO: To allow returning negative values for error codes from
- * plcstub_get_impl, we may have to look at widening the types underlying each
- * particular type.  Not sure how to do that and maintain API compatability with
- * libplctag, though.
+ * plcstub_access_impl, we may have to look at widening the types underlying
+ * each particular type.  Not sure how to do that and maintain API
+ * compatability with libplctag, though.
  */
+#define TRACE_ACCESS(op, name, val, status)                                 \
+    do {                                                                    \
+        if (trace_enabled()) {                                              \
+            uint64_t traced = 0;                                            \
+            memcpy(&traced, &(val), sizeof(val));                           \
+            trace_call((op), tag, TRACE_TYPE_##name, offset, (status), traced); \
+        }                                                                   \
+    } while (0)
+
 #define GETTER(name, type)                                                  \
-static void                                                                 \
-plcstub_##name##_getter_cb(char *buf, int offset, void *val) {              \
-    pdebug(PLCTAG_DEBUG_SPEW, "reading at offset %d", offset);              \
-    type *p = (type *)(buf + offset);                                       \
-    *(type *)(val) = *p;                                                    \
-}                                                                           \
 type                                                                        \
 plc_tag_get_##name (int32_t tag, int offset) {                              \
-    int impl_ret;                                                           \
+    struct tag_tree_node* t;                                                \
     type val;                                                               \
-    impl_ret = plcstub_get_impl(tag, offset, &val, plcstub_##name##_getter_cb); \
+    int impl_ret;                                                           \
+    epoch_enter();                                                          \
+    t = tag_tree_lookup_fast(tag);                                          \
+    if (t != NULL && tag != METATAG_ID                                      \
+        && plcstub_in_bounds(t, offset, sizeof(type))                       \
+        && plcstub_read_fast(t, offset, &val, sizeof(type))) {              \
+        plcstub_count(t, STAT_READS, sizeof(type));                         \
+        epoch_exit();                                                       \
+        TRACE_ACCESS(TRACE_OP_GET, name, val, PLCTAG_STATUS_OK);            \
+        return val;                                                         \
+    }                                                                       \
+    epoch_exit();                                                           \
+    impl_ret = plcstub_access_impl(tag, offset, &val, sizeof(type), false); \
     if (impl_ret != PLCTAG_STATUS_OK) {                                     \
-        return (type)(impl_ret);                                            \
+        val = (type)(impl_ret);                                             \
     }                                                                       \
+    TRACE_ACCESS(TRACE_OP_GET, name, val, impl_ret);                        \
     return val;                                                             \
 } 
 
 #define SETTER(name, type)                                                  \
-static void                                                                 \
-plcstub_##name##_setter_cb(char *buf, int offset, void *val) {              \
-    pdebug(PLCTAG_DEBUG_SPEW, "writing at offset %d", offset);              \
-    type *p = (type *)(buf + offset);                                       \
-    *p = *(type *)(val);                                                    \
-}                                                                           \
 int                                                                         \
 plc_tag_set_##name (int32_t tag, int offset, type val) {                    \
-    return plcstub_set_impl(tag, offset, &val, plcstub_##name##_setter_cb); \
-}
-
-#define TYPEMAP        \
-/* X(name, type) */    \
-X(bit, int)            \
-X(uint64, uint64_t)    \
-X(int64, int64_t)      \
-X(uint32, uint32_t)    \
-X(int32, int32_t)      \
-X(uint16, uint16_t)    \
-X(int16, int16_t)      \
-X(uint8, uint8_t)      \
-X(int8, int8_t)        \
-X(float64, double)     \
-X(float32, float)
+    struct tag_tree_node* t;                                                \
+    int impl_ret;                                                           \
+    epoch_enter();                                                          \
+    t = tag_tree_lookup_fast(tag);                                          \
+    if (t != NULL && tag != METATAG_ID                                      \
+        && plcstub_in_bounds(t, offset, sizeof(type))                       \
+        && plcstub_write_fast(t, offset, &val, sizeof(type))) {             \
+        plcstub_count(t, STAT_WRITES, sizeof(type));                        \
+        epoch_exit();                                                       \
+        TRACE_ACCESS(TRACE_OP_SET, name, val, PLCTAG_STATUS_OK);            \
+        return PLCTAG_STATUS_OK;                                            \
+    }                                                                       \
+    epoch_exit();                                                           \
+    impl_ret = plcstub_access_impl(tag, offset, &val, sizeof(type), true);  \
+    TRACE_ACCESS(TRACE_OP_SET, name, val, impl_ret);                        \
+    return impl_ret;                                                        \
+}
+
+/* Does [offset, offset + width) lie within the tag's payload?  A tag's
+ * shape never changes once it is published, except for the metatag's, so
+ * this needs t->store->mtx held only for the metatag. */
+static inline bool
+plcstub_in_bounds(struct tag_tree_node* t, int offset, size_t width)
+{
+    return offset >= 0 && (size_t)(offset) + width <= t->elem_count * t->elem_size;
+}
+
+/* Counts an access of width bytes to t's payload. */
+static inline void
+plcstub_count(struct tag_tree_node* t, enum stats_counter s, size_t width)
+{
+    stats_add_access(t->tag_id, s, width);
+}
+
+/* Takes t->store->mtx, counting any time spent waiting for it; only a
+ * lock that is actually contended costs a look at the clock. */
+static inline void
+plcstub_store_lock(struct tag_tree_node* t)
+{
+    uint64_t start;
+    int ret;
+
+    if ((ret = pthread_mutex_trylock(&t->store->mtx)) == 0) {
+        return;
+    }
+    if (ret != EBUSY) {
+        tag_store_recover(t->store, ret);
+        return;
+    }
+    start = stats_now_ns();
+    tag_store_lock(t->store);
+    stats_add(t->tag_id, STAT_LOCK_WAIT_NS, stats_now_ns() - start);
+}
+
+/* Lock-free readers give up on the seqlock and take the mutex after this
+ * many torn reads in a row. */
+#define PLCSTUB_SEQ_RETRIES 8
+
+/* How often waiters on a shared tag's plc_tag_lock() check that its
+ * holder's process is still alive. */
+#define PLCSTUB_REAP_MS 100
+
+/* This thread's identity as a plc_tag_lock() holder: the address of a
+ * thread-local is unique among running threads and free to get at, and
+ * with shm_proc_id folded in, among those of every process sharing tags
+ * (which may well have their thread-locals at the same addresses). */
+static _Thread_local char plcstub_self;
+
+static inline const void*
+plcstub_me(void)
+{
+    return (const void*)((uintptr_t)(&plcstub_self) ^ shm_proc_id);
+}
+
+/* Does this thread hold plc_tag_lock() on t?  Only the owner ever stores
+ * its own identity, so a relaxed load is enough to tell. */
+static inline bool
+plcstub_holds(struct tag_tree_node* t)
+{
+    return __atomic_load_n(&t->store->lock_owner, __ATOMIC_RELAXED) == plcstub_me();
+}
+
+/* Waits for any other thread's plc_tag_lock() on t to be released,
+ * counting the time spent doing so.  The holder of a shared tag's lock may
+ * be in a process that dies holding it, so for those this checks every
+ * PLCSTUB_REAP_MS.
+ *
+ * Assumes that t->store->mtx is held.
+ */
+static void
+plcstub_wait_unlocked(struct tag_tree_node* t)
+{
+    struct timespec deadline;
+    uint64_t start;
+
+    if (t->store->lock_owner == NULL || t->store->lock_owner == plcstub_me()) {
+        return;
+    }
+    start = stats_now_ns();
+    while (t->store->lock_owner != NULL && t->store->lock_owner != plcstub_me()) {
+        if (!t->store->shared) {
+            tag_store_wait(t->store, NULL);
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += PLCSTUB_REAP_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (tag_store_wait(t->store, &deadline) == ETIMEDOUT) {
+            tag_store_reap(t->store, false);
+        }
+    }
+    stats_add(t->tag_id, STAT_LOCK_WAIT_NS, stats_now_ns() - start);
+}
+
+/* Brackets a change to t's payload, so that concurrent seqlock readers
+ * notice it.  A plc_tag_lock() holder has already made seq odd for the
+ * duration, so there's nothing to do for one.
+ *
+ * Assumes that t->store->mtx is held.
+ */
+static inline void
+plcstub_write_begin(struct tag_tree_node* t)
+{
+    if (t->store->lock_owner == NULL) {
+        __atomic_store_n(&t->store->seq, t->store->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+}
+
+static inline void
+plcstub_write_end(struct tag_tree_node* t)
+{
+    if (t->store->lock_owner == NULL) {
+        __atomic_store_n(&t->store->seq, t->store->seq + 1, __ATOMIC_RELEASE);
+        notify_mark(t->store);
+    }
+}
 
+/* Reads width bytes at offset without taking t->store->mtx, by way of the
+ * seqlock, so that readers never hold each other up.  Returns false if
+ * the slow path has to do it instead: the tag has a callback, a writer
+ * keeps getting in the way or another thread holds plc_tag_lock(). */
+static inline bool
+plcstub_read_fast(struct tag_tree_node* t, int offset, void* buf, size_t width)
+{
+    unsigned seq;
+
+    if (__atomic_load_n(&t->cb, __ATOMIC_RELAXED) != NULL) {
+        return false;
+    }
+    if (plcstub_holds(t)) {
+        memcpy(buf, t->data + offset, width);
+        return true;
+    }
+    for (int i = 0; i < PLCSTUB_SEQ_RETRIES; ++i) {
+        seq = __atomic_load_n(&t->store->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            return false;
+        }
+        memcpy(buf, t->data + offset, width);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&t->store->seq, __ATOMIC_RELAXED) == seq) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Writes width bytes at offset, taking t->store->mtx only long enough to bump
+ * the seqlock around the copy (and not at all inside plc_tag_lock()).
+ * Returns false if the slow path has to do it instead. */
+static inline bool
+plcstub_write_fast(struct tag_tree_node* t, int offset, const void* buf, size_t width)
+{
+    if (plcstub_holds(t)) {
+        if (__atomic_load_n(&t->cb, __ATOMIC_RELAXED) != NULL) {
+            return false;
+        }
+        memcpy(t->data + offset, buf, width);
+        return true;
+    }
+
+    plcstub_store_lock(t);
+    if (t->cb != NULL || t->store->lock_owner != NULL) {
+        MTX_UNLOCK(&t->store->mtx);
+        return false;
+    }
+    plcstub_write_begin(t);
+    memcpy(t->data + offset, buf, width);
+    plcstub_write_end(t);
+    MTX_UNLOCK(&t->store->mtx);
+    return true;
+}
+
+/* Gets exclusive use of t's payload for a slow-path access, waiting for
+ * any other thread's plc_tag_lock() to be released.  Returns true if this
+ * thread's own plc_tag_lock() already provides it, in which case nothing
+ * more is locked; otherwise t->store->mtx is held on return.  The metatag's
+ * payload changes under it regardless, so it's always locked. */
+static bool
+plcstub_data_lock(struct tag_tree_node* t)
+{
+    if (t->tag_id != METATAG_ID && plcstub_holds(t)) {
+        return true;
+    }
+
+    plcstub_store_lock(t);
+    plcstub_wait_unlocked(t);
+    return false;
+}
+
+/* The width of a value of the given type, or 0 if it isn't one. */
+static size_t
+plcstub_type_size(enum tag_type type)
+{
+    switch (type) {
+    case TAG_BOOL:
+    case TAG_SINT:
+        return 1;
+    case TAG_INT:
+        return 2;
+    case TAG_DINT:
+    case TAG_REAL:
+        return 4;
+    case TAG_LINT:
+    case TAG_LREAL:
+        return 8;
+    }
+    return 0;
+}
+
+/* How a slow-path access copies its width bytes, if not verbatim: as count
+ * elements, through a conversion kernel (see convert.h) or, without one,
+ * between little-endian and host order. */
+struct plcstub_conv {
+    convert_func fn;
+    size_t count;
+    size_t elem_width;
+    struct convert_args args;
+};
+
+static inline void
+plcstub_copy(void* dst, const void* src, size_t width, const struct plcstub_conv* conv)
+{
+    if (conv == NULL) {
+        memcpy(dst, src, width);
+    } else if (conv->fn != NULL) {
+        conv->fn(dst, src, conv->count, &conv->args);
+    } else {
+        convert_le_copy(dst, src, conv->count, conv->elem_width);
+    }
+}
+
+/* The slow path shared by every accessor and mutator: copies width bytes
+ * between buf and the tag's payload (converting them on the way, given
+ * conv), delivering the read or write events to the tag's callback (if
+ * any) along the way.
+ */
 static int
-plcstub_get_impl(int32_t tag, int offset, void* buf, getter_fn fn)
+plcstub_convert_impl(int32_t tag, int offset, void* buf, size_t width, bool write, const struct plcstub_conv* conv)
 {
     struct tag_tree_node* t;
+    int ev_started = write ? PLCTAG_EVENT_WRITE_STARTED : PLCTAG_EVENT_READ_STARTED;
+    int ev_completed = write ? PLCTAG_EVENT_WRITE_COMPLETED : PLCTAG_EVENT_READ_COMPLETED;
+    bool held;
+    int ret = PLCTAG_STATUS_OK;
+
+    epoch_enter();
 
     t = tag_tree_lookup(tag);
     if (!t) {
         pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", tag);
-        return PLCTAG_ERR_NOT_FOUND;
+        ret = PLCTAG_ERR_NOT_FOUND;
+        goto done;
     }
 
-    /* TODO: I'm not thrilled about holding the lock through the course of all
-     * these callbacks, especially until we know the overhead of doing golang<->native
-     * interop.  Maybe it's better to make a defensive copy where possible? */
-    MTX_LOCK(&t->mtx);
+    /* Events are only queued here (see event.h), so holding the lock
+     * across them is cheap. */
+    held = plcstub_data_lock(t);
 
     if (t->cb) {
         pdebug(PLCTAG_DEBUG_SPEW,
-            "Calling cb for %d with PLCTAG_READ_EVENT_STARTED", tag);
-        t->cb(tag, PLCTAG_EVENT_READ_STARTED, PLCTAG_STATUS_OK);
+            "Calling cb for %d with %s", tag,
+            write ? "PLCTAG_WRITE_EVENT_STARTED" : "PLCTAG_READ_EVENT_STARTED");
+        event_post(t->cb, tag, ev_started, PLCTAG_STATUS_OK);
     }
 
-    if (offset >= t->elem_count * t->elem_size) {
+    if (!plcstub_in_bounds(t, offset, width)) {
         pdebug(PLCTAG_DEBUG_WARN, 
-            "Offset %d out of bounds of [0..%d)", offset, t->elem_count * t->elem_size);
+            "Access of %zu bytes at offset %d out of bounds of [0..%zu)",
+            width, offset, t->elem_count * t->elem_size);
+        stats_add(t->tag_id, STAT_BOUNDS_ERRORS, 1);
         if (t->cb) {
             pdebug(PLCTAG_DEBUG_SPEW,
                 "Calling cb for %d with PLCTAG_EVENT_ABORTED", tag);
-            t->cb(tag, PLCTAG_EVENT_ABORTED, PLCTAG_ERR_BAD_PARAM);
+            event_post(t->cb, tag, PLCTAG_EVENT_ABORTED, PLCTAG_ERR_BAD_PARAM);
         }
-        MTX_UNLOCK(&t->mtx);
-        return PLCTAG_ERR_BAD_PARAM;
+        if (!held) {
+            MTX_UNLOCK(&t->store->mtx);
+        }
+        ret = PLCTAG_ERR_BAD_PARAM;
+        goto done;
     }
 
-    fn(t->data, offset, buf);
+    pdebug(PLCTAG_DEBUG_SPEW, "%s at offset %d", write ? "writing" : "reading", offset);
+    if (write) {
+        plcstub_write_begin(t);
+        plcstub_copy(t->data + offset, buf, width, conv);
+        plcstub_write_end(t);
+    } else {
+        plcstub_copy(buf, t->data + offset, width, conv);
+    }
+    plcstub_count(t, write ? STAT_WRITES : STAT_READS, width);
 
     if (t->cb) {
         pdebug(PLCTAG_DEBUG_SPEW,
-            "Calling cb for %d with PLCTAG_READ_EVENT_COMPLETED", tag);
-        t->cb(tag, PLCTAG_EVENT_READ_COMPLETED, PLCTAG_STATUS_OK);
+            "Calling cb for %d with %s", tag,
+            write ? "PLCTAG_WRITE_EVENT_COMPLETED" : "PLCTAG_READ_EVENT_COMPLETED");
+        event_post(t->cb, tag, ev_completed, PLCTAG_STATUS_OK);
     }
 
-    MTX_UNLOCK(&t->mtx);
+    if (!held) {
+        MTX_UNLOCK(&t->store->mtx);
+    }
 
-    return PLCTAG_STATUS_OK;
+done:
+    epoch_exit();
+    return ret;
 }
 
 static int
-plcstub_set_impl(int32_t tag, int offset, void *value, setter_fn fn)
+plcstub_access_impl(int32_t tag, int offset, void* buf, size_t width, bool write)
 {
-    struct tag_tree_node* t;
+    return plcstub_convert_impl(tag, offset, buf, width, write, NULL);
+}
 
-    t = tag_tree_lookup(tag);
-    if (!t) {
-        pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", tag);
-        return PLCTAG_ERR_NOT_FOUND;
+/* The array accessors: count elements of width bytes each, in host order. */
+static int
+plcstub_array_impl(int32_t tag, int offset, void* buf, int count, size_t width, bool write)
+{
+    struct plcstub_conv conv = { .count = count, .elem_width = width };
+
+    if (buf == NULL || count < 0 || (size_t)(count) > INT_MAX / width) {
+        return PLCTAG_ERR_BAD_PARAM;
     }
+    return plcstub_convert_impl(tag, offset, buf, count * width, write, &conv);
+}
 
-    /* TODO: I'm not thrilled about holding the lock through the course of all
-     * these callbacks, especially until we know the overhead of doing golang<->native
-     * interop.  Maybe it's better to make a defensive copy where possible? */
-    MTX_LOCK(&t->mtx);
+/* The scaled accessors: count elements of the given type, as floats. */
+static int
+plcstub_scaled_impl(int32_t tag, int offset, enum tag_type type, float* buf, int count, float scale, float bias,
+    bool write)
+{
+    size_t width = plcstub_type_size(type);
+    struct plcstub_conv conv = {
+        .count = count,
+        .elem_width = width,
+        .args = { scale, bias, 1.0f / scale, -bias / scale },
+    };
+
+    if (width == 0 || type == TAG_BOOL || buf == NULL || count < 0 || (size_t)(count) > INT_MAX / width
+        || (write && scale == 0.0f)) {
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+    conv.fn = write ? convert_kernels()->set_scaled[type] : convert_kernels()->get_scaled[type];
+    return plcstub_convert_impl(tag, offset, buf, count * width, write, &conv);
+}
 
-    if (t->cb) {
-        pdebug(PLCTAG_DEBUG_SPEW,
-            "Calling cb for %d with PLCTAG_WRITE_EVENT_STARTED", tag);
-        t->cb(tag, PLCTAG_EVENT_WRITE_STARTED, PLCTAG_STATUS_OK);
+/* Orders scatter/gather descriptors by tag, keeping accesses to the same
+ * tag in the order the caller gave them. */
+static int
+plcstub_access_cmp(const void* lhs, const void* rhs)
+{
+    const struct plc_tag_access* l = *(const struct plc_tag_access**)(lhs);
+    const struct plc_tag_access* r = *(const struct plc_tag_access**)(rhs);
+
+    if (l->tag_id != r->tag_id) {
+        return l->tag_id < r->tag_id ? -1 : 1;
     }
+    return (l < r) ? -1 : (l > r);
+}
 
-    if (offset >= t->elem_count * t->elem_size) {
-        pdebug(PLCTAG_DEBUG_WARN, 
-            "Offset %d out of bounds of [0..%d)", offset, t->elem_count * t->elem_size);
-        if (t->cb) {
-            pdebug(PLCTAG_DEBUG_SPEW,
-                "Calling cb for %d with PLCTAG_EVENT_ABORTED", tag);
-            t->cb(tag, PLCTAG_EVENT_ABORTED, PLCTAG_ERR_BAD_PARAM);
-        }
+/* Performs a batch of scatter/gather accesses, one tag at a time: each
+ * distinct tag is looked up and locked once for all of its accesses. */
+static int
+plcstub_multi_impl(struct plc_tag_access* accesses, int n, bool write)
+{
+    struct plc_tag_access *stack_sorted[64], **sorted = stack_sorted;
+    int ret = PLCTAG_STATUS_OK;
+    int ev_started = write ? PLCTAG_EVENT_WRITE_STARTED : PLCTAG_EVENT_READ_STARTED;
+    int ev_completed = write ? PLCTAG_EVENT_WRITE_COMPLETED : PLCTAG_EVENT_READ_COMPLETED;
+
+    if (n < 0 || (n > 0 && accesses == NULL)) {
         return PLCTAG_ERR_BAD_PARAM;
     }
 
-    fn(t->data, offset, &value);
+    if (n > sizeof(stack_sorted) / sizeof(stack_sorted[0])) {
+        sorted = malloc(n * sizeof(*sorted));
+        if (sorted == NULL) {
+            err(1, "malloc");
+        }
+    }
+    for (int i = 0; i < n; ++i) {
+        sorted[i] = &accesses[i];
+    }
+    qsort(sorted, n, sizeof(*sorted), plcstub_access_cmp);
+
+    for (int i = 0, j; i < n; i = j) {
+        int32_t tag = sorted[i]->tag_id;
+        struct tag_tree_node* t;
+        bool aborted = false;
+        bool held;
+
+        for (j = i; j < n && sorted[j]->tag_id == tag; ++j)
+            ;
+
+        epoch_enter();
+        t = tag_tree_lookup(tag);
+        if (!t) {
+            epoch_exit();
+            pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", tag);
+            for (int k = i; k < j; ++k) {
+                sorted[k]->status = PLCTAG_ERR_NOT_FOUND;
+            }
+            continue;
+        }
+
+        held = plcstub_data_lock(t);
 
-    if (t->cb) {
-        pdebug(PLCTAG_DEBUG_SPEW,
-            "Calling cb for %d with PLCTAG_WRITE_EVENT_COMPLETED", tag);
-        t->cb(tag, PLCTAG_EVENT_WRITE_COMPLETED, PLCTAG_STATUS_OK);
+        if (t->cb) {
+            event_post(t->cb, tag, ev_started, PLCTAG_STATUS_OK);
+        }
+
+        /* Readers see all of a tag's writes in a batch or none of them. */
+        if (write) {
+            plcstub_write_begin(t);
+        }
+
+        for (int k = i; k < j; ++k) {
+            struct plc_tag_access* a = sorted[k];
+            size_t width = plcstub_type_size(a->type);
+
+            if (width == 0 || !plcstub_in_bounds(t, a->offset, width)) {
+                pdebug(PLCTAG_DEBUG_WARN, "Bad access of type %d at offset %d of tag %d",
+                    a->type, a->offset, tag);
+                stats_add(t->tag_id, STAT_BOUNDS_ERRORS, 1);
+                a->status = PLCTAG_ERR_BAD_PARAM;
+                aborted = true;
+                continue;
+            }
+
+            if (write) {
+                memcpy(t->data + a->offset, a->buf, width);
+            } else {
+                memcpy(a->buf, t->data + a->offset, width);
+            }
+            plcstub_count(t, write ? STAT_WRITES : STAT_READS, width);
+            a->status = PLCTAG_STATUS_OK;
+        }
+
+        if (write) {
+            plcstub_write_end(t);
+        }
+
+        if (t->cb) {
+            if (aborted) {
+                event_post(t->cb, tag, PLCTAG_EVENT_ABORTED, PLCTAG_ERR_BAD_PARAM);
+            } else {
+                event_post(t->cb, tag, ev_completed, PLCTAG_STATUS_OK);
+            }
+        }
+
+        if (!held) {
+            MTX_UNLOCK(&t->store->mtx);
+        }
+        epoch_exit();
     }
 
-    MTX_UNLOCK(&t->mtx);
+    for (int i = 0; i < n; ++i) {
+        if (accesses[i].status != PLCTAG_STATUS_OK) {
+            ret = accesses[i].status;
+            break;
+        }
+    }
 
-    return PLCTAG_STATUS_OK;
+    if (sorted != stack_sorted) {
+        free(sorted);
+    }
+
+    return ret;
 }
 
 /************************ Public API ************************/
 
 
+int
+plc_tag_abort(int32_t tag)
+{
+    struct tag_tree_node* t;
+
+    epoch_enter();
+    t = tag_tree_lookup(tag);
+    if (!t) {
+        epoch_exit();
+        pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", tag);
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    async_abort(t, PLCTAG_ERR_ABORT);
+    epoch_exit();
+
+    return PLCTAG_STATUS_OK;
+}
+
 int
 plc_tag_check_lib_version(int req_major, int req_minor, int req_patch) {
     (void)(req_major);
@@ -183,107 +621,85 @@ plc_tag_get_debug_level()
     return debug_get_level();
 }
 
-int
-plc_tag_create(const char* attrib, int timeout)
+static int
+plcstub_create_impl(const char* attrib, int timeout)
 {
-    int ret = PLCTAG_STATUS_OK;
-    char *kv_ctx, *kv;
-    char* kv_sep = "&";
+    int ret, gen_ret;
+    struct tag_attrs attrs;
+    struct tag_tree_spec spec;
     struct tag_tree_node* tag;
-
-    /* There are three attributes that we are interested in at the moment:
-     * 1) name: the name of the tag
-     * 2) elem_size: the width of each element in the tag
-     * 3) elem_count: how many elements. (TODO: how does this work with multi-dim arrays?)
-     */
-    char* name = NULL;
-
-    /* TODO: It appears that we need not specify elem_size and elem_count.  What should
-     * the expected "default" value be? 
-     */
-    size_t elem_size = 2;
-    size_t elem_count = 1;
-
-    char* str = strdup(attrib);
-
-    for (kv = strtok_r(str, kv_sep, &kv_ctx);
-         kv != NULL;
-         kv = strtok_r(NULL, kv_sep, &kv_ctx)) {
-        char *key, *val;
-        pdebug(PLCTAG_DEBUG_SPEW, "Current kv-pair: %s", kv);
-
-        key = kv;
-        val = strchr(key, '=');
-        if (val == NULL && (strcmp("protocol", kv) != 0)) {
-            /* At the moment, the only attribute we've seen that isn't a key-value pair
-             * is "protocol".  If we encounter others, we can either check for them or
-             * just ignore them altogether, depending on our confidence of things. */
-            pdebug(PLCTAG_DEBUG_WARN, "Missing '=' in non-'protocol' attribute %s", kv);
-            ret = PLCTAG_ERR_BAD_PARAM;
-            goto done;
-        }
-        *val = '\0';
-        val++;
-        pdebug(PLCTAG_DEBUG_SPEW, "key=%s,val=%s", key, val);
-
-        /* We have a key and value parsed out at ths point. */
-
-        if (strcmp("name", key) == 0) {
-            if (name != NULL) {
-                pdebug(PLCTAG_DEBUG_WARN, "Overwriting attribute %s", "name");
-            }
-            name = strdup(val);
-            if (name == NULL) {
-                err(1, "strdup");
-            }
-        } else if (strcmp("elem_size", key) == 0) {
-            if (elem_size > 0) {
-                pdebug(PLCTAG_DEBUG_WARN, "Overwriting attribute %s", "elem_size");
-            }
-            elem_size = atoi(val);
-        } else if (strcmp("elem_count", key) == 0) {
-            if (elem_count > 0) {
-                pdebug(PLCTAG_DEBUG_WARN, "Overwriting attribute %s", "elem_count");
-            }
-            elem_count = atoi(val);
-        }
+    struct gen_spec gen;
+    size_t elem_size;
+
+    /* Of the attributes, we're interested in the name, the size and count
+     * of the elements (elem_type, or udt, standing in for elem_size, and
+     * dims for elem_count), buffers, and gateway, path and cpu, which pick
+     * the simulated connection. */
+    if ((ret = attr_parse(attrib, &attrs)) != PLCTAG_STATUS_OK) {
+        return ret;
     }
 
-    if (name == NULL) {
+    if (attrs.name.p == NULL || attrs.name.len == 0) {
         pdebug(PLCTAG_DEBUG_WARN, "Missing attribute %s", "name");
-        ret = PLCTAG_ERR_BAD_PARAM;
-        goto done;
+        return PLCTAG_ERR_BAD_PARAM;
     }
 
-    if (strcmp(name, "@tags") == 0) {
-        tag = tag_tree_metanode_create();
+    if (attr_span_eq(&attrs.name, "@tags")) {
+        /* The metatag always exists and is kept up to date as tags come
+         * and go, so there's nothing to build here. */
+        tag = tag_tree_lookup(METATAG_ID);
         if (tag == NULL) {
-            err(1, "tag_tree_metanode_create");
+            errx(1, "tag_tree_lookup(METATAG_ID)");
         }
-        ret = tag->tag_id;
-    } else {
-        tag = tag_tree_node_create();
-        if (tag == NULL) {
-            err(1, "tag_tree_node_create");
-        }
-
-        MTX_LOCK(&tag->mtx);
-        tag->name = name;
-        tag->elem_count = elem_count;
-        tag->elem_size = elem_size;
+        return tag->tag_id;
+    }
 
-        tag->data = calloc(tag->elem_count, tag->elem_size);
-        if (tag->data == NULL) {
-            err(1, "calloc");
+    /* Creating a tag that already exists just makes another handle onto it;
+     * one that doesn't say what shape it should be takes whatever it is. */
+    spec = (struct tag_tree_spec) {
+        .name = attrs.name.p,
+        .name_len = attrs.name.len,
+        .gateway = attrs.gateway,
+        .path = attrs.path,
+        .elem_size = attrs.elem_size,
+        .elem_count = attrs.elem_count,
+        .any_shape = !attrs.shaped,
+        .type = attrs.type + 1,
+        .udt = attrs.udt,
+        .nbufs = attrs.buffers,
+        .conn = conn_get(&attrs.gateway, &attrs.path, &attrs.cpu),
+    };
+    memcpy(spec.dims, attrs.dims, sizeof(spec.dims));
+
+    /* Somebody could destroy the tag as soon as it's created. */
+    epoch_enter();
+    tag = tag_tree_node_create(&spec);
+    ret = tag ? tag->tag_id : PLCTAG_ERR_TOO_LARGE;
+    elem_size = tag ? tag->elem_size : 0;
+    epoch_exit();
+
+    /* The generator has to suit the tag's shape, which might be one that
+     * was adopted from an existing tag rather than given here. */
+    if (ret >= 0 && attrs.gen.p != NULL) {
+        gen_ret = gen_parse(attrs.gen.p, attrs.gen.len, attrs.type, elem_size, &gen);
+        if (gen_ret != PLCTAG_STATUS_OK) {
+            tag_tree_remove(ret);
+            return gen_ret;
         }
+        gen_attach(ret, &gen);
+    }
 
-        ret = tag->tag_id;
+    return ret;
+}
 
-        MTX_UNLOCK(&tag->mtx);
-    }
+int
+plc_tag_create(const char* attrib, int timeout)
+{
+    int ret = plcstub_create_impl(attrib, timeout);
 
-done:
-    free(str);
+    if (trace_enabled()) {
+        trace_create(attrib, timeout, ret);
+    }
     return ret;
 }
 
@@ -380,7 +796,85 @@ plc_tag_decode_error(int rc)
 
 int
 plc_tag_destroy(int32_t tag) {
-    return tag_tree_remove(tag);
+    struct tag_tree_node* t;
+    int ret;
+
+    /* Nothing may still be in flight on the tag once it's gone. */
+    epoch_enter();
+    t = tag_tree_lookup(tag);
+    if (t && tag != METATAG_ID) {
+        async_abort(t, PLCTAG_ERR_ABORT);
+    }
+    epoch_exit();
+    gen_detach(tag);
+    notify_detach(tag);
+
+    ret = tag_tree_remove(tag);
+    if (trace_enabled()) {
+        trace_call(TRACE_OP_DESTROY, tag, 0, 0, ret, 0);
+    }
+    return ret;
+}
+
+/* Tears down every tag at once, leaving the library as it was at startup:
+ * the next call seeds the tree afresh, with IDs starting over, and the
+ * counters, layouts and settings made through plcstub.h are back to their
+ * defaults.  As documented in libplctag.h, this is not thread safe.
+ *
+ * Every background thread is told to stop before any is joined, so that
+ * they wind down together rather than one after another.  The dispatcher
+ * goes last, as the others post events to it until they've stopped.
+ */
+void
+plc_tag_shutdown(void)
+{
+    pdebug(PLCTAG_DEBUG_INFO, "Shutting down");
+    plcstub_trace_stop();
+    gen_stop();
+    notify_stop();
+    async_stop();
+    gen_shutdown();
+    notify_shutdown();
+    async_shutdown();
+    event_shutdown();
+    tag_tree_shutdown();
+    layout_shutdown();
+    conn_shutdown();
+    stats_reset();
+}
+
+/* Only the stub's own counters (see stats.h) are implemented: "stat.reads"
+ * and the like, for tag ID 0 meaning the library as a whole.  Counts too
+ * big for an int are reported as INT_MAX.  Anything else, including
+ * unknown tags, gets default_value, as in libplctag.
+ */
+int
+plc_tag_get_int_attribute(int32_t tag, const char* attrib_name, int default_value)
+{
+    struct tag_tree_node* t;
+    uint64_t count;
+    int s;
+
+    if (attrib_name == NULL || strncmp(attrib_name, "stat.", 5) != 0
+        || (s = stats_find(attrib_name + 5)) < 0) {
+        pdebug(PLCTAG_DEBUG_WARN, "Unsupported attribute %s", attrib_name ? attrib_name : "(null)");
+        return default_value;
+    }
+
+    if (tag == 0) {
+        count = stats_global(s);
+    } else {
+        epoch_enter();
+        if ((t = tag_tree_lookup(tag)) == NULL) {
+            epoch_exit();
+            pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", tag);
+            return default_value;
+        }
+        count = stats_tag(tag, s);
+        epoch_exit();
+    }
+
+    return count > INT_MAX ? INT_MAX : (int)(count);
 }
 
 int
@@ -390,52 +884,112 @@ plc_tag_get_size(int32_t id)
 
     struct tag_tree_node* t;
 
+    epoch_enter();
     t = tag_tree_lookup(id);
     if (!t) {
+        epoch_exit();
         pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", id);
         return PLCTAG_ERR_NOT_FOUND;
     }
-    MTX_LOCK(&t->mtx);
+    tag_store_lock(t->store);
     size = t->elem_count * t->elem_size;
-    MTX_UNLOCK(&t->mtx);
+    MTX_UNLOCK(&t->store->mtx);
+    epoch_exit();
 
     return size;
 }
 
-/* Stubs out the tag read path.  Only checks that the arguments
- * are valid.  It might be interesting to stub out "in-flight"
- * reads and writes for a heavily-concurrent integration test
- * but I suspect that isn't worth our effort.
+int
+plc_tag_get_raw(int32_t tag, int offset, void* buf, int len)
+{
+    if (buf == NULL || len < 0) {
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+    return plcstub_access_impl(tag, offset, buf, len, false);
+}
+
+int
+plc_tag_get_multi(struct plc_tag_access* accesses, int n)
+{
+    return plcstub_multi_impl(accesses, n, false);
+}
+
+int
+plc_tag_get_scaled(int32_t tag, int offset, enum tag_type type, float* buf, int count, float scale, float bias)
+{
+    return plcstub_scaled_impl(tag, offset, type, buf, count, scale, bias, false);
+}
+
+/* Holds the tag for this thread across a batch of accesses, which other
+ * threads then wait out.  The holder's own accesses take no locks at all,
+ * and lock-free readers elsewhere see the tag's seqlock held odd for the
+ * duration, so see either all of the batch or none of it.  Recursive, as
+ * in libplctag.
+ */
+int
+plc_tag_lock(int32_t tag)
+{
+    struct tag_tree_node* t;
+
+    epoch_enter();
+    t = tag_tree_lookup(tag);
+    if (!t) {
+        epoch_exit();
+        pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", tag);
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    plcstub_store_lock(t);
+    if (t->store->lock_owner == plcstub_me()) {
+        t->store->lock_depth++;
+        MTX_UNLOCK(&t->store->mtx);
+        epoch_exit();
+        return PLCTAG_STATUS_OK;
+    }
+    plcstub_wait_unlocked(t);
+    plcstub_write_begin(t);
+    __atomic_store_n(&t->store->lock_owner, plcstub_me(), __ATOMIC_RELAXED);
+    t->store->lock_depth = 1;
+    t->store->lock_pid = shm_pid;
+    MTX_UNLOCK(&t->store->mtx);
+    epoch_exit();
+
+    return PLCTAG_STATUS_OK;
+}
+
+/* Simulates the tag read path: see async_start() for how in-flight
+ * reads are modelled.
  */
 int
 plc_tag_read(int32_t tag_id, int timeout)
 {
-    (void)(timeout);
     struct tag_tree_node* t;
+    int ret;
 
     if (timeout < 0) {
         pdebug(PLCTAG_DEBUG_WARN, "Timeout must not be negative");
-        return PLCTAG_ERR_BAD_PARAM;
+        ret = PLCTAG_ERR_BAD_PARAM;
+        goto done;
     }
 
+    epoch_enter();
     t = tag_tree_lookup(tag_id);
     if (!t) {
+        epoch_exit();
         pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", tag_id);
-        return PLCTAG_ERR_NOT_FOUND;
+        ret = PLCTAG_ERR_NOT_FOUND;
+        goto done;
     }
 
-    MTX_LOCK(&t->mtx);
-    if (t->cb) {
-        pdebug(PLCTAG_DEBUG_SPEW,
-            "Calling cb for %d with PLCTAG_READ_EVENT_STARTED", tag_id);
-        t->cb(tag_id, PLCTAG_EVENT_READ_STARTED, PLCTAG_STATUS_OK);
-        pdebug(PLCTAG_DEBUG_SPEW,
-            "Calling cb for %d with PLCTAG_READ_EVENT_COMPLETED", tag_id);
-        t->cb(tag_id, PLCTAG_EVENT_READ_COMPLETED, PLCTAG_STATUS_OK);
-    }
-    MTX_UNLOCK(&t->mtx);
+    stats_add(t->tag_id, STAT_READ_REQUESTS, 1);
+    ret = async_start(t, ASYNC_OP_READ, timeout, plcstub_holds(t));
+    epoch_exit();
 
-    return PLCTAG_STATUS_OK;
+done:
+    if (trace_enabled()) {
+        trace_call(TRACE_OP_READ, tag_id, 0, timeout, ret, 0);
+    }
+    return ret;
 }
 
 int
@@ -443,41 +997,125 @@ plc_tag_register_callback(int32_t tag_id, tag_callback_func cb)
 {
     struct tag_tree_node* t;
 
+    epoch_enter();
     t = tag_tree_lookup(tag_id);
     if (!t) {
+        epoch_exit();
         pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", tag_id);
         return PLCTAG_ERR_NOT_FOUND;
     }
 
-    MTX_LOCK(&t->mtx);
-    t->cb = cb;
-    MTX_UNLOCK(&t->mtx);
+    tag_store_lock(t->store);
+    __atomic_store_n(&t->cb, cb, __ATOMIC_RELAXED);
+    MTX_UNLOCK(&t->store->mtx);
+    epoch_exit();
+
+    return PLCTAG_STATUS_OK;
+}
 
+/* Log messages go to log_callback_func from the library's log flusher
+ * thread (see debug.c), not from the thread that logged them, and with no
+ * tag locks held. */
+int
+plc_tag_register_logger(void (*log_callback_func)(int32_t tag_id, int debug_level, const char* message))
+{
+    if (log_callback_func == NULL) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+    if (debug_set_logger(log_callback_func) != 0) {
+        return PLCTAG_ERR_DUPLICATE;
+    }
     return PLCTAG_STATUS_OK;
 }
 
+int32_t
+plcstub_load_fixture(const char* path)
+{
+    struct fixture f;
+    int32_t ret;
+
+    if (path == NULL) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+    if ((ret = fixture_open(path, &f)) != PLCTAG_STATUS_OK) {
+        return ret;
+    }
+    if ((ret = tag_tree_bulk_create(f.specs, f.ntags)) >= 0) {
+        fixture_attach_gens(&f, ret);
+    }
+    fixture_close(&f);
+
+    return ret;
+}
+
+int
+plcstub_compile_fixture(const char* src, const char* dst)
+{
+    if (src == NULL || dst == NULL) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+    return fixture_compile(src, dst);
+}
+
+void
+plcstub_flush_log(void)
+{
+    debug_flush();
+}
+
 void
 plc_tag_set_debug_level(int level)
 {
     debug_set_level(level);
 }
 
+int
+plc_tag_set_raw(int32_t tag, int offset, const void* buf, int len)
+{
+    if (buf == NULL || len < 0) {
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+    return plcstub_access_impl(tag, offset, (void*)(buf), len, true);
+}
+
+int
+plc_tag_set_multi(struct plc_tag_access* accesses, int n)
+{
+    return plcstub_multi_impl(accesses, n, true);
+}
+
+int
+plc_tag_set_scaled(int32_t tag, int offset, enum tag_type type, const float* buf, int count, float scale,
+    float bias)
+{
+    return plcstub_scaled_impl(tag, offset, type, (float*)(buf), count, scale, bias, true);
+}
+
 int
 plc_tag_status(int32_t tag)
 {
     struct tag_tree_node* t;
+    int status;
 
+    epoch_enter();
     t = tag_tree_lookup(tag);
     if (!t) {
+        epoch_exit();
         pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", tag);
         return PLCTAG_ERR_NOT_FOUND;
     }
 
-    /* For the stub, let's always just treat the tag status as 
-     * okay.  If we stub out in-flight reads and writes later on,
-     * this would change.
-     */
-    return PLCTAG_STATUS_OK;
+    /* PLCTAG_STATUS_PENDING while a read or write is in flight, otherwise
+     * the outcome of the last one. */
+    tag_store_lock(t->store);
+    if (t->parked && plcstub_holds(t)) {
+        async_finish(t);
+    }
+    status = t->status;
+    MTX_UNLOCK(&t->store->mtx);
+    epoch_exit();
+
+    return status;
 }
 
 int
@@ -486,37 +1124,79 @@ plc_tag_unregister_callback(int32_t tag_id)
     return plc_tag_register_callback(tag_id, NULL);
 }
 
-/* Stubs out the tag write path.
+int
+plc_tag_unregister_logger(void)
+{
+    if (debug_set_logger(NULL) != 0) {
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+    return PLCTAG_STATUS_OK;
+}
+
+int
+plc_tag_unlock(int32_t tag)
+{
+    struct tag_tree_node* t;
+
+    epoch_enter();
+    t = tag_tree_lookup(tag);
+    if (!t) {
+        epoch_exit();
+        pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", tag);
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    tag_store_lock(t->store);
+    if (t->store->lock_owner != plcstub_me()) {
+        MTX_UNLOCK(&t->store->mtx);
+        epoch_exit();
+        pdebug(PLCTAG_DEBUG_WARN, "Tag %d is not locked by this thread", tag);
+        return PLCTAG_ERR_NOT_ALLOWED;
+    }
+    if (--t->store->lock_depth == 0) {
+        __atomic_store_n(&t->store->lock_owner, NULL, __ATOMIC_RELAXED);
+        plcstub_write_end(t);
+        async_requeue(t->store);
+        pthread_cond_broadcast(&t->store->cond);
+    }
+    MTX_UNLOCK(&t->store->mtx);
+    epoch_exit();
+
+    return PLCTAG_STATUS_OK;
+}
+
+/* Simulates the tag write path, as for plc_tag_read().
  */
 int
 plc_tag_write(int32_t tag_id, int timeout)
 {
-    (void)(timeout);
     struct tag_tree_node* t;
+    int ret;
 
     if (timeout < 0) {
         pdebug(PLCTAG_DEBUG_WARN, "Timeout must not be negative");
-        return PLCTAG_ERR_BAD_PARAM;
+        ret = PLCTAG_ERR_BAD_PARAM;
+        goto done;
     }
 
+    epoch_enter();
     t = tag_tree_lookup(tag_id);
     if (!t) {
+        epoch_exit();
         pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", tag_id);
-        return PLCTAG_ERR_NOT_FOUND;
+        ret = PLCTAG_ERR_NOT_FOUND;
+        goto done;
     }
 
-    MTX_LOCK(&t->mtx);
-    if (t->cb) {
-        pdebug(PLCTAG_DEBUG_SPEW,
-            "Calling cb for %d with PLCTAG_WRITE_EVENT_STARTED", tag_id);
-        t->cb(tag_id, PLCTAG_EVENT_WRITE_STARTED, PLCTAG_STATUS_OK);
-        pdebug(PLCTAG_DEBUG_SPEW,
-            "Calling cb for %d with PLCTAG_WRITE_EVENT_COMPLETED", tag_id);
-        t->cb(tag_id, PLCTAG_EVENT_WRITE_COMPLETED, PLCTAG_STATUS_OK);
-    }
-    MTX_UNLOCK(&t->mtx);
+    stats_add(t->tag_id, STAT_WRITE_REQUESTS, 1);
+    ret = async_start(t, ASYNC_OP_WRITE, timeout, plcstub_holds(t));
+    epoch_exit();
 
-    return PLCTAG_STATUS_OK;
+done:
+    if (trace_enabled()) {
+        trace_call(TRACE_OP_WRITE, tag_id, 0, timeout, ret, 0);
+    }
+    return ret;
 }
 
 /* macro expansions */
@@ -527,3 +1207,17 @@ TYPEMAP
 #define X(name, type) GETTER(name, type);
 TYPEMAP
 #undef X
+
+/* The array forms, which go straight to the slow path: one lookup and one
+ * lock for the lot. */
+#define X(name, type)                                                       \
+int                                                                         \
+plc_tag_get_##name##_array(int32_t tag, int offset, type* buf, int count) { \
+    return plcstub_array_impl(tag, offset, buf, count, sizeof(type), false); \
+}                                                                           \
+int                                                                         \
+plc_tag_set_##name##_array(int32_t tag, int offset, const type* buf, int count) { \
+    return plcstub_array_impl(tag, offset, (void*)(buf), count, sizeof(type), true); \
+}
+ARRAYMAP
+#undef X
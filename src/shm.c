@@ -0,0 +1,407 @@
+/* shm.c
+ *
+ * Keeps tag storage in a POSIX shared-memory segment, for processes to
+ * share (see shm.h).
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+#include "shm.h"
+#include "tagtree.h"
+
+#define SHM_MAGIC 0x34306d6873637470ULL /* "ptcshm04" */
+#define SHM_DEFAULT_SIZE ((size_t)(64) << 20)
+#define SHM_NBUCKETS 4096
+/* Everything in the segment is allocated on cache-line boundaries, so that
+ * one store's locks never share a line with another's. */
+#define SHM_ALIGN 64
+
+/* How long to wait for whoever created the segment to set it up. */
+#define SHM_READY_TIMEOUT_MS 5000
+
+/* A tag in the segment's directory; its name is the store's. */
+struct shm_entry {
+    uint64_t next; /* offset of the next in the bucket, or 0 */
+    uint64_t hash;
+    uint64_t store;
+    uint64_t gateway;
+    uint64_t path;
+};
+
+/* The start of the segment.  mtx, which is robust so that a process dying
+ * with it held doesn't wedge the rest, protects used and the directory;
+ * nothing in the segment is ever freed. */
+struct shm_header {
+    uint64_t magic;
+    uint64_t size;
+    uint64_t used;
+    uint32_t ready;
+    uint32_t nprocs;
+    pthread_mutex_t mtx;
+    uint64_t buckets[SHM_NBUCKETS];
+};
+
+uintptr_t shm_proc_id = 0;
+pid_t shm_pid = 0;
+
+static struct shm_header* shm_hdr = NULL;
+static size_t shm_size = 0;
+
+void*
+shm_ptr(uint64_t off)
+{
+    return (char*)(shm_hdr) + off;
+}
+
+static void
+shm_lock(void)
+{
+    int ret = pthread_mutex_lock(&shm_hdr->mtx);
+
+    if (ret == EOWNERDEAD) {
+        pdebug(PLCTAG_DEBUG_WARN, "A process died holding the shared segment's lock");
+        pthread_mutex_consistent(&shm_hdr->mtx);
+    } else if (ret != 0) {
+        errx(1, "pthread_mutex_lock: %s", strerror(ret));
+    }
+}
+
+static void
+shm_unlock(void)
+{
+    pthread_mutex_unlock(&shm_hdr->mtx);
+}
+
+/* Sets this process apart from the others using the segment.  Addresses
+ * don't reach the top 16 bits of a uintptr_t, on the 64-bit platforms this
+ * is for, so that's where it goes. */
+static void
+shm_new_proc_id(void)
+{
+    unsigned n = __atomic_add_fetch(&shm_hdr->nprocs, 1, __ATOMIC_RELAXED);
+
+    shm_proc_id = (uintptr_t)(n % 0xffff + 1) << (sizeof(uintptr_t) * 8 - 16);
+    shm_pid = getpid();
+}
+
+/* A child of a process using the segment is another process using it. */
+static void
+shm_atfork_child(void)
+{
+    if (shm_hdr != NULL) {
+        shm_new_proc_id();
+    }
+}
+
+/* Carves size bytes off the end of what's in use, returning their offset,
+ * or 0 if there's no room.
+ *
+ * Assumes that the segment's lock is held.
+ */
+static uint64_t
+shm_alloc(size_t size)
+{
+    uint64_t off = shm_hdr->used;
+
+    size = (size + (SHM_ALIGN - 1)) & ~(size_t)(SHM_ALIGN - 1);
+    if (size > shm_hdr->size - off) {
+        return 0;
+    }
+    shm_hdr->used = off + size;
+    return off;
+}
+
+/* Copies a string into the segment, returning its offset (or 0). */
+static uint64_t
+shm_strdup(const char* s, size_t len)
+{
+    uint64_t off = shm_alloc(len + 1);
+
+    if (off != 0) {
+        memcpy(shm_ptr(off), s, len);
+        ((char*)(shm_ptr(off)))[len] = '\0';
+    }
+    return off;
+}
+
+/* Sets up a freshly created (and zero-filled) segment. */
+static void
+shm_format(struct shm_header* hdr, size_t size)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (pthread_mutex_init(&hdr->mtx, &attr)) {
+        err(1, "pthread_mutex_init");
+    }
+    pthread_mutexattr_destroy(&attr);
+
+    hdr->magic = SHM_MAGIC;
+    hdr->size = size;
+    hdr->used = (sizeof(*hdr) + (SHM_ALIGN - 1)) & ~(size_t)(SHM_ALIGN - 1);
+    __atomic_store_n(&hdr->ready, 1, __ATOMIC_RELEASE);
+}
+
+/* Opens the named segment, creating it with the given size if it doesn't
+ * exist, and returns its descriptor; *created says which. */
+static int
+shm_open_segment(const char* name, size_t size, bool* created)
+{
+    int fd;
+
+    *created = false;
+    for (;;) {
+        if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) >= 0) {
+            if (ftruncate(fd, size) < 0) {
+                err(1, "ftruncate(%s)", name);
+            }
+            *created = true;
+            return fd;
+        }
+        if (errno != EEXIST) {
+            err(1, "shm_open(%s)", name);
+        }
+        if ((fd = shm_open(name, O_RDWR, 0)) >= 0) {
+            return fd;
+        }
+        /* Removed in between: try creating it again. */
+        if (errno != ENOENT) {
+            err(1, "shm_open(%s)", name);
+        }
+    }
+}
+
+bool
+shm_attach(void)
+{
+    const char *name = getenv("PLCSTUB_SHM"), *s;
+    size_t size = SHM_DEFAULT_SIZE;
+    static bool atfork = false;
+    struct shm_header* hdr;
+    struct stat st;
+    bool created;
+    char* end;
+    int fd;
+
+    if (name == NULL || *name == '\0') {
+        return false;
+    }
+    if ((s = getenv("PLCSTUB_SHM_SIZE")) != NULL && *s != '\0') {
+        errno = 0;
+        size = strtoull(s, &end, 10);
+        if (errno || *end != '\0' || size < sizeof(struct shm_header)) {
+            errx(1, "Bad $PLCSTUB_SHM_SIZE: %s", s);
+        }
+    }
+
+    fd = shm_open_segment(name, size, &created);
+
+    /* Whoever created it may not have sized it yet. */
+    for (int ms = 0; !created; ++ms) {
+        if (fstat(fd, &st) < 0) {
+            err(1, "fstat(%s)", name);
+        }
+        if ((size_t)(st.st_size) >= sizeof(struct shm_header)) {
+            size = st.st_size;
+            break;
+        }
+        if (ms == SHM_READY_TIMEOUT_MS) {
+            errx(1, "Shared segment %s was never set up", name);
+        }
+        usleep(1000);
+    }
+
+    hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED) {
+        err(1, "mmap(%s)", name);
+    }
+    close(fd);
+
+    if (created) {
+        shm_format(hdr, size);
+    }
+    for (int ms = 0; !__atomic_load_n(&hdr->ready, __ATOMIC_ACQUIRE); ++ms) {
+        if (ms == SHM_READY_TIMEOUT_MS) {
+            errx(1, "Shared segment %s was never set up", name);
+        }
+        usleep(1000);
+    }
+    if (hdr->magic != SHM_MAGIC || hdr->size != size) {
+        errx(1, "%s isn't a plcstub shared segment, or is from another version: remove it", name);
+    }
+
+    shm_hdr = hdr;
+    shm_size = size;
+    shm_new_proc_id();
+    if (!atfork) {
+        pthread_atfork(NULL, NULL, shm_atfork_child);
+        atfork = true;
+    }
+
+    pdebug(PLCTAG_DEBUG_INFO, "%s shared segment %s (%zu bytes)", created ? "Created" : "Attached", name, size);
+    return true;
+}
+
+/* Does a string in the segment match a key part that may be missing? */
+static bool
+shm_part_eq(uint64_t off, const char* p, size_t len)
+{
+    const char* s = shm_ptr(off);
+
+    return strlen(s) == len && (len == 0 || memcmp(s, p, len) == 0);
+}
+
+/* Makes the storage for spec in the segment, returning its entry's offset,
+ * or 0 if there's no room.
+ *
+ * Assumes that the segment's lock is held.
+ */
+static uint64_t
+shm_store_create(const struct tag_tree_spec* spec, uint64_t hash)
+{
+    size_t gateway_len = spec->gateway.p ? spec->gateway.len : 0;
+    size_t path_len = spec->path.p ? spec->path.len : 0;
+    size_t data_size = spec->elem_size * spec->elem_count;
+    uint64_t used = shm_hdr->used, off, store_off, data_off, name_off, gateway_off, path_off;
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t cattr;
+    struct shm_entry* e;
+    struct tag_store* store;
+
+    if (spec->elem_size != 0 && spec->elem_count > (SIZE_MAX / 2) / spec->elem_size) {
+        pdebug(PLCTAG_DEBUG_WARN, "Tag size %zu * %zu is too large", spec->elem_size, spec->elem_count);
+        return 0;
+    }
+    if ((off = shm_alloc(sizeof(struct shm_entry))) == 0 || (store_off = shm_alloc(sizeof(struct tag_store))) == 0
+        || (data_off = shm_alloc(data_size)) == 0 || (name_off = shm_strdup(spec->name, spec->name_len)) == 0
+        || (gateway_off = shm_strdup(spec->gateway.p, gateway_len)) == 0
+        || (path_off = shm_strdup(spec->path.p, path_len)) == 0) {
+        shm_hdr->used = used;
+        return 0;
+    }
+
+    store = shm_ptr(store_off);
+    memset(store, 0, sizeof(*store));
+
+    /* Robust, like the directory's, so that a process dying with one held
+     * doesn't wedge the tag for every other (see tag_store_lock()). */
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    if (pthread_mutex_init(&store->mtx, &mattr) || pthread_mutex_init(&store->snap_mtx, &mattr)) {
+        err(1, "pthread_mutex_init");
+    }
+    if (pthread_cond_init(&store->cond, &cattr)) {
+        err(1, "pthread_cond_init");
+    }
+    pthread_mutexattr_destroy(&mattr);
+    pthread_condattr_destroy(&cattr);
+
+    store->shared = true;
+    store->hash = hash;
+    store->elem_size = spec->elem_size;
+    store->elem_count = spec->elem_count;
+    store->type = spec->type;
+    store->udt = spec->udt;
+    memcpy(store->dims, spec->dims, sizeof(store->dims));
+    store->data_off = data_off;
+    store->name_off = name_off;
+    if (spec->init) {
+        memcpy(shm_ptr(data_off), spec->init, data_size);
+    } else {
+        memset(shm_ptr(data_off), 0, data_size);
+    }
+
+    e = shm_ptr(off);
+    e->hash = hash;
+    e->store = store_off;
+    e->gateway = gateway_off;
+    e->path = path_off;
+    e->next = shm_hdr->buckets[hash % SHM_NBUCKETS];
+    shm_hdr->buckets[hash % SHM_NBUCKETS] = off;
+
+    return off;
+}
+
+int
+shm_store_get(const struct tag_tree_spec* spec, uint64_t hash, struct tag_store** store)
+{
+    uint64_t off;
+    struct shm_entry* e = NULL;
+    struct tag_store* s;
+
+    shm_lock();
+
+    for (off = shm_hdr->buckets[hash % SHM_NBUCKETS]; off != 0; off = e->next) {
+        e = shm_ptr(off);
+        s = shm_ptr(e->store);
+        if (e->hash == hash && shm_part_eq(s->name_off, spec->name, spec->name_len)
+            && shm_part_eq(e->gateway, spec->gateway.p, spec->gateway.p ? spec->gateway.len : 0)
+            && shm_part_eq(e->path, spec->path.p, spec->path.p ? spec->path.len : 0)) {
+            break;
+        }
+    }
+
+    if (off == 0 && spec->existing) {
+        shm_unlock();
+        return 1;
+    }
+    if (off == 0 && (off = shm_store_create(spec, hash)) == 0) {
+        shm_unlock();
+        pdebug(PLCTAG_DEBUG_WARN, "No room in the shared segment for tag %.*s", (int)(spec->name_len), spec->name);
+        return -1;
+    }
+
+    shm_unlock();
+
+    s = shm_ptr(((struct shm_entry*)(shm_ptr(off)))->store);
+    if (!spec->any_shape && (s->elem_size != spec->elem_size || s->elem_count != spec->elem_count)) {
+        pdebug(PLCTAG_DEBUG_DETAIL, "Shared tag %.*s has a different shape, so gets storage of its own",
+            (int)(spec->name_len), spec->name);
+        return 1;
+    }
+    *store = s;
+    return 0;
+}
+
+void
+shm_detach(void)
+{
+    if (shm_hdr == NULL) {
+        return;
+    }
+    munmap(shm_hdr, shm_size);
+    shm_hdr = NULL;
+    shm_size = 0;
+    shm_proc_id = 0;
+    shm_pid = 0;
+}
+
+int
+plcstub_shm_remove(const char* name)
+{
+    if (name == NULL || *name == '\0') {
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+    if (shm_unlink(name) < 0) {
+        return errno == ENOENT ? PLCTAG_ERR_NOT_FOUND : PLCTAG_ERR_NOT_ALLOWED;
+    }
+    return PLCTAG_STATUS_OK;
+}
@@ -0,0 +1,195 @@
+/* stats.c
+ *
+ * Instrumentation counters.
+ */
+
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+_Thread_local struct stats_thread* stats_self = NULL;
+
+/* Every thread record ever made, pushed lock-free.  As with epoch.c's, a
+ * record outlives its thread, keeping its counts, to be claimed by a new
+ * one; none is ever freed, though stats_reset() frees their tag tables. */
+static struct stats_thread* threads = NULL;
+
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+static const char* stats_names[STAT_COUNT] = {
+#define X(id, name) [id] = name,
+    STATS_MAP
+#undef X
+};
+
+static void
+stats_thread_exit(void* arg)
+{
+    struct stats_thread* st = arg;
+
+    __atomic_store_n(&st->in_use, false, __ATOMIC_RELEASE);
+}
+
+static void
+stats_make_key()
+{
+    int ret;
+
+    if ((ret = pthread_key_create(&stats_key, stats_thread_exit)) != 0) {
+        errx(1, "pthread_key_create: %s", strerror(ret));
+    }
+}
+
+/* Finds or makes a record for this thread: the slow part of its first
+ * stats_add(). */
+struct stats_thread*
+stats_register(void)
+{
+    struct stats_thread* st;
+    bool unused;
+    int ret;
+
+    pthread_once(&stats_key_once, stats_make_key);
+
+    for (st = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); st != NULL; st = st->next) {
+        unused = false;
+        if (!__atomic_load_n(&st->in_use, __ATOMIC_RELAXED)
+            && __atomic_compare_exchange_n(&st->in_use, &unused, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (st == NULL) {
+        if ((st = aligned_alloc(_Alignof(struct stats_thread), sizeof(*st))) == NULL) {
+            err(1, "aligned_alloc");
+        }
+        memset(st, 0, sizeof(*st));
+        st->in_use = true;
+        st->next = __atomic_load_n(&threads, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&threads, &st->next, st, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    if ((ret = pthread_setspecific(stats_key, st)) != 0) {
+        errx(1, "pthread_setspecific: %s", strerror(ret));
+    }
+    stats_self = st;
+    return st;
+}
+
+uint64_t*
+stats_tag_claim(struct stats_thread* st, int32_t tag_id)
+{
+    uint32_t slot = (uint32_t)(tag_id) & ((1U << STATS_SLOT_BITS) - 1);
+    struct stats_tag** tags = st->tags;
+    struct stats_tag *chunk, *e;
+
+    if (tags == NULL) {
+        if ((tags = calloc(STATS_NCHUNKS, sizeof(*tags))) == NULL) {
+            err(1, "calloc");
+        }
+        __atomic_store_n(&st->tags, tags, __ATOMIC_RELEASE);
+    }
+    if ((chunk = tags[slot >> STATS_CHUNK_BITS]) == NULL) {
+        /* Whole lines, so that no other thread's chunk shares one. */
+        if ((chunk = aligned_alloc(64, STATS_CHUNK_SIZE * sizeof(*chunk))) == NULL) {
+            err(1, "aligned_alloc");
+        }
+        memset(chunk, 0, STATS_CHUNK_SIZE * sizeof(*chunk));
+        __atomic_store_n(&tags[slot >> STATS_CHUNK_BITS], chunk, __ATOMIC_RELEASE);
+    }
+
+    /* A reader summing the counts goes by tag_id, so it mustn't see the new
+     * ID before the old counts are gone. */
+    e = &chunk[slot & STATS_CHUNK_MASK];
+    if (e->tag_id != tag_id) {
+        __atomic_store_n(&e->tag_id, 0, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        for (int i = 0; i < STAT_COUNT; ++i) {
+            __atomic_store_n(&e->count[i], 0, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&e->tag_id, tag_id, __ATOMIC_RELEASE);
+    }
+    return e->count;
+}
+
+uint64_t
+stats_global(enum stats_counter s)
+{
+    uint64_t sum = 0;
+
+    for (struct stats_thread* st = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); st != NULL; st = st->next) {
+        sum += __atomic_load_n(&st->count[s], __ATOMIC_RELAXED);
+    }
+    return sum;
+}
+
+uint64_t
+stats_tag(int32_t tag_id, enum stats_counter s)
+{
+    uint32_t slot = (uint32_t)(tag_id) & ((1U << STATS_SLOT_BITS) - 1);
+    struct stats_tag **tags, *chunk, *e;
+    uint64_t sum = 0, n;
+
+    for (struct stats_thread* st = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); st != NULL; st = st->next) {
+        if ((tags = __atomic_load_n(&st->tags, __ATOMIC_ACQUIRE)) == NULL
+            || (chunk = __atomic_load_n(&tags[slot >> STATS_CHUNK_BITS], __ATOMIC_ACQUIRE)) == NULL) {
+            continue;
+        }
+        e = &chunk[slot & STATS_CHUNK_MASK];
+        if (__atomic_load_n(&e->tag_id, __ATOMIC_ACQUIRE) != tag_id) {
+            continue;
+        }
+        n = __atomic_load_n(&e->count[s], __ATOMIC_RELAXED);
+        /* Unless it was started afresh meanwhile. */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->tag_id, __ATOMIC_RELAXED) == tag_id) {
+            sum += n;
+        }
+    }
+    return sum;
+}
+
+void
+stats_reset(void)
+{
+    for (struct stats_thread* st = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); st != NULL; st = st->next) {
+        for (int i = 0; i < STAT_COUNT; ++i) {
+            __atomic_store_n(&st->count[i], 0, __ATOMIC_RELAXED);
+        }
+        if (st->tags != NULL) {
+            for (int i = 0; i < STATS_NCHUNKS; ++i) {
+                if (st->tags[i] != NULL) {
+                    free(st->tags[i]);
+                }
+            }
+            free(st->tags);
+            __atomic_store_n(&st->tags, NULL, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+int
+stats_find(const char* name)
+{
+    for (int i = 0; i < STAT_COUNT; ++i) {
+        if (strcmp(name, stats_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+uint64_t
+stats_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
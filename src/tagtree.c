@@ -5,16 +5,27 @@
  */
 
 #include <err.h>
+#include <errno.h>
+#include <signal.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "arena.h"
 #include "debug.h"
+#include "epoch.h"
+#include "fixture.h"
 #include "plcstub.h"
 #include "libplctag.h"
+#include "notify.h"
+#include "shm.h"
+#include "stats.h"
 #include "tagtree.h"
+#include "trace.h"
 #include "lock_utils.h"
 
 /* 
@@ -32,270 +43,1178 @@ RB_HEAD(tag_tree_t, tag_tree_node)
 tag_tree = RB_INITIALIZER(&tag_tree);
 static size_t tree_size = 0;
 
+/* Where every node and store, along with its payload and name, is
+ * allocated from. */
+static struct arena tag_arena = ARENA_INITIALIZER;
+
+/*
+ * The index of tag storage by (gateway, path, name): a chained hash table,
+ * doubled whenever it fills up.  Like the tree, it's protected by
+ * tag_tree_mtx, so any number of threads can look things up at once.
+ */
+#define TAG_INDEX_MIN_BUCKETS 256
+
+static struct {
+    struct tag_store** buckets;
+    size_t nbuckets;
+    size_t n;
+} tag_index;
+
 RB_PROTOTYPE(tag_tree_t, tag_tree_node, rb_entry, tagcmp);
 RB_GENERATE(tag_tree_t, tag_tree_node, rb_entry, tagcmp);
 
+/* The ID-indexed view of the tree; see tagtree.h. */
+struct tag_tree_node** tag_table[TAG_TABLE_NCHUNKS];
+
+/* Set once tag_tree_init() has finished, so that inline lookups can skip
+ * calling it, and cleared again by tag_tree_shutdown(). */
+bool tag_tree_ready = false;
+
+/* Publishes (or, if tag is NULL, retracts) a table slot.
+ *
+ * Assumes that tag_tree_mtx is held for writing.
+ */
 static void
-tag_tree_init();
+tag_table_set(int32_t tag_id, struct tag_tree_node* tag)
+{
+    struct tag_tree_node** chunk;
+    int32_t slot = tag_id & TAG_ID_SLOT_MASK;
+    int idx = slot >> TAG_TABLE_CHUNK_BITS;
 
-struct tag_tree_node *
-tag_tree_metanode_create() {
-    size_t total_data_size = 0;
-    struct tag_tree_node *tag, *ret;
-    char *p;
+    if (tag_id <= 0) {
+        errx(1, "tag id %d out of range of the tag table", tag_id);
+    }
 
+    chunk = tag_table[idx];
+    if (chunk == NULL) {
+        if (tag == NULL) {
+            return;
+        }
+        chunk = calloc(TAG_TABLE_CHUNK_SIZE, sizeof(struct tag_tree_node*));
+        if (chunk == NULL) {
+            err(1, "calloc");
+        }
+        __atomic_store_n(&tag_table[idx], chunk, __ATOMIC_RELEASE);
+    }
 
-    RW_WRLOCK(&tag_tree_mtx);
- 
-    RB_FOREACH(tag, tag_tree_t, &tag_tree) {
-        total_data_size += sizeof(struct metatag_t) + strlen(tag->name);
-    }
-    
-    
-    struct tag_tree_node find;
-    find.tag_id = METATAG_ID;
-    tag = RB_FIND(tag_tree_t, &tag_tree, &find);
-    if (tag != NULL) {
-        RB_REMOVE(tag_tree_t, &tag_tree, tag);
-        tree_size--;
-        tag_tree_node_destroy(tag);
-    }
-
-    ret = tag = malloc(sizeof(struct tag_tree_node));
-    if (tag == NULL) {
-        err(1, "malloc");
+    __atomic_store_n(&chunk[slot & TAG_TABLE_CHUNK_MASK], tag, __ATOMIC_RELEASE);
+}
+
+/*
+ * Tag IDs.  Slots that have never been used are handed out in order, by
+ * an atomic counter; the IDs of removed tags go on a FIFO queue, to have
+ * their slots reused (with the next generation) once there are more than
+ * TAG_ID_REUSE_DELAY of them, so that it takes a lot of churn for any one
+ * ID to come round again.  The queue is protected by tag_tree_mtx.
+ */
+#define TAG_ID_REUSE_DELAY 4096
+
+static int32_t tag_id_next = METATAG_ID + 1;
+
+static struct {
+    int32_t* ids;
+    size_t head;
+    size_t n;
+    size_t cap;
+} tag_id_free;
+
+/* Takes n consecutive, never used slots, returning the first (whose ID is
+ * itself, being of generation 0); or returns -1 if there aren't n left. */
+static int32_t
+tag_id_alloc_fresh(size_t n)
+{
+    int32_t first = __atomic_load_n(&tag_id_next, __ATOMIC_RELAXED);
+
+    do {
+        if (n > (size_t)(TAG_ID_NSLOTS - first)) {
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&tag_id_next, &first, first + (int32_t)(n), true, __ATOMIC_RELAXED,
+        __ATOMIC_RELAXED));
+    return first;
+}
+
+/* Allocates an ID for a new tag, or returns -1 if every slot is in use.
+ *
+ * Assumes that tag_tree_mtx is held for writing.
+ */
+static int32_t
+tag_id_alloc()
+{
+    int32_t id, gen;
+
+    if (tag_id_free.n <= TAG_ID_REUSE_DELAY && (id = tag_id_alloc_fresh(1)) >= 0) {
+        return id;
+    }
+    if (tag_id_free.n == 0) {
+        return -1;
+    }
+
+    id = tag_id_free.ids[tag_id_free.head];
+    tag_id_free.head = (tag_id_free.head + 1) % tag_id_free.cap;
+    tag_id_free.n--;
+
+    gen = ((id >> TAG_ID_SLOT_BITS) + 1) & TAG_ID_GEN_MASK;
+    return (gen << TAG_ID_SLOT_BITS) | (id & TAG_ID_SLOT_MASK);
+}
+
+/* Queues the ID of a removed tag for its slot to be reused.
+ *
+ * Assumes that tag_tree_mtx is held for writing.
+ */
+static void
+tag_id_free_push(int32_t id)
+{
+    int32_t* ids;
+    size_t cap;
+
+    if (tag_id_free.n == tag_id_free.cap) {
+        cap = tag_id_free.cap ? tag_id_free.cap * 2 : 1024;
+        ids = malloc(cap * sizeof(*ids));
+        if (ids == NULL) {
+            err(1, "malloc");
+        }
+        for (size_t i = 0; i < tag_id_free.n; ++i) {
+            ids[i] = tag_id_free.ids[(tag_id_free.head + i) % tag_id_free.cap];
+        }
+        free(tag_id_free.ids);
+        tag_id_free.ids = ids;
+        tag_id_free.head = 0;
+        tag_id_free.cap = cap;
     }
-    if (pthread_mutex_init(&tag->mtx, NULL)) {
+
+    tag_id_free.ids[(tag_id_free.head + tag_id_free.n) % tag_id_free.cap] = id;
+    tag_id_free.n++;
+}
+/* 
+ * The serialised contents of the @tags metatag: one metatag_t record (plus
+ * name) per tag, in creation order.  This is maintained incrementally: a
+ * record is appended when a tag is created and tombstoned (its id zeroed)
+ * when the tag is removed.  Tombstones are compacted away lazily, the next
+ * time somebody looks up the metatag.
+ *
+ * The buffer is the metatag node's data, so besides tag_tree_mtx (held for
+ * writing by anybody who modifies it) mutators must also hold the metatag's
+ * mutex, which is what readers of its data take.
+ */
+static struct {
+    struct tag_tree_node* node;
+    size_t cap;
+    size_t ntombstones;
+    uint64_t gen; /* bumped on every change */
+    uint64_t compacted_gen; /* value of gen when there were last no tombstones */
+} metatag;
+
+/* Serialises seeding the tree, which tag_tree_ready says is done.  (Not a
+ * pthread_once_t, which couldn't be reset for tag_tree_shutdown().) */
+static pthread_mutex_t tag_tree_init_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Set if tag storage is kept in a shared segment (see shm.h). */
+static bool tag_shm = false;
+
+static struct tag_tree_node*
+tag_tree_node_alloc(const struct tag_tree_spec* spec);
+
+/* Per-store condition variables wait against CLOCK_MONOTONIC; set up by
+ * tag_tree_init_once(). */
+static pthread_condattr_t tag_cond_attr;
+
+/* Initialises the synchronisation primitives of a freshly allocated store. */
+static void
+tag_store_init_sync(struct tag_store* store)
+{
+    if (pthread_mutex_init(&store->mtx, NULL)) {
+        err(1, "pthread_mutex_init");
+    }
+    if (pthread_cond_init(&store->cond, &tag_cond_attr)) {
+        err(1, "pthread_cond_init");
+    }
+    if (pthread_mutex_init(&store->snap_mtx, NULL)) {
         err(1, "pthread_mutex_init");
     }
-    
-    tag->name = strdup("@tags");
+}
+
+/* Pins a buffered tag's current snapshot, returning its index, so that no
+ * snapshot is written into it until tag_store_unpin().  A snapshot that
+ * stops being current before it is pinned may already be being reused,
+ * so that's checked for afterwards. */
+static int
+tag_store_pin(struct tag_store* store)
+{
+    int i;
+
+    for (;;) {
+        i = __atomic_load_n(&store->snap, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&store->pins[i], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&store->snap, __ATOMIC_SEQ_CST) == i) {
+            return i;
+        }
+        __atomic_sub_fetch(&store->pins[i], 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void
+tag_store_unpin(struct tag_store* store, int i)
+{
+    __atomic_sub_fetch(&store->pins[i], 1, __ATOMIC_RELEASE);
+}
+
+char*
+tag_store_stage(struct tag_store* store)
+{
+    MTX_LOCK(&store->snap_mtx);
+
+    /* With three buffers there's nearly always one free.  Readers only pin
+     * a snapshot for as long as it takes to copy it, so it doesn't take
+     * long for one to come free otherwise. */
+    for (;;) {
+        int snap = __atomic_load_n(&store->snap, __ATOMIC_RELAXED);
+
+        for (int i = 0; i < store->nbufs; ++i) {
+            if (i != snap && __atomic_load_n(&store->pins[i], __ATOMIC_SEQ_CST) == 0) {
+                return store->bufs[i];
+            }
+        }
+        sched_yield();
+    }
+}
+
+void
+tag_store_publish(struct tag_store* store, char* buf)
+{
+    for (int i = 0; i < store->nbufs; ++i) {
+        if (store->bufs[i] == buf) {
+            __atomic_store_n(&store->snap, i, __ATOMIC_SEQ_CST);
+        }
+    }
+    notify_mark(store);
+    MTX_UNLOCK(&store->snap_mtx);
+}
+
+void
+tag_store_snapshot(struct tag_store* store, char* dst)
+{
+    int i = tag_store_pin(store);
+
+    memcpy(dst, store->bufs[i], store->elem_size * store->elem_count);
+    tag_store_unpin(store, i);
+}
+
+bool
+tag_store_reap(struct tag_store* store, bool owner_died)
+{
+    bool reaped = false;
+
+    if (store->lock_owner != NULL && store->lock_pid != shm_pid && kill(store->lock_pid, 0) < 0
+        && errno == ESRCH) {
+        pdebug(PLCTAG_DEBUG_WARN, "Process %d died holding plc_tag_lock() on a shared tag", (int)(store->lock_pid));
+        __atomic_store_n(&store->lock_owner, NULL, __ATOMIC_RELAXED);
+        store->lock_depth = 0;
+        store->holder_waiting = 0;
+        owner_died = true;
+        reaped = true;
+    }
+    /* Either way, seq may have been left odd, which would keep lock-free
+     * readers off for good. */
+    if (owner_died && store->lock_owner == NULL && (store->seq & 1)) {
+        __atomic_store_n(&store->seq, store->seq + 1, __ATOMIC_RELEASE);
+        reaped = true;
+    }
+    if (reaped) {
+        pthread_cond_broadcast(&store->cond);
+    }
+    return reaped;
+}
+
+void
+tag_store_recover(struct tag_store* store, int ret)
+{
+    if (ret != EOWNERDEAD) {
+        errx(1, "pthread_mutex_lock: %s", strerror(ret));
+    }
+    pdebug(PLCTAG_DEBUG_WARN, "A process died holding a shared tag's lock");
+    pthread_mutex_consistent(&store->mtx);
+    tag_store_reap(store, true);
+}
+
+int
+tag_store_wait(struct tag_store* store, const struct timespec* deadline)
+{
+    int ret = deadline ? pthread_cond_timedwait(&store->cond, &store->mtx, deadline)
+                       : pthread_cond_wait(&store->cond, &store->mtx);
+
+    if (ret == EOWNERDEAD) {
+        tag_store_recover(store, ret);
+        ret = 0;
+    } else if (ret != 0 && ret != ETIMEDOUT) {
+        errx(1, "pthread_cond_wait: %s", strerror(ret));
+    }
+    return ret;
+}
+
+void
+tag_store_pull(struct tag_tree_node* t)
+{
+    /* As for any other write to t's payload, lock-free readers have to see
+     * it being changed, unless a plc_tag_lock() holder already makes them
+     * keep off. */
+    if (t->store->lock_owner == NULL) {
+        __atomic_store_n(&t->store->seq, t->store->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+    tag_store_snapshot(t->store, t->data);
+    if (t->store->lock_owner == NULL) {
+        __atomic_store_n(&t->store->seq, t->store->seq + 1, __ATOMIC_RELEASE);
+    }
+}
+
+void
+tag_store_push(struct tag_tree_node* t)
+{
+    char* buf = tag_store_stage(t->store);
+
+    memcpy(buf, t->data, t->elem_size * t->elem_count);
+    tag_store_publish(t->store, buf);
+}
+
+/* Allocates a handle onto store, which already counts it among its refs,
+ * over the given connection. */
+static struct tag_tree_node*
+tag_tree_handle_alloc(struct tag_store* store, struct conn* conn)
+{
+    size_t node_size = (sizeof(struct tag_tree_node) + (TAG_DATA_ALIGN - 1)) & ~(size_t)(TAG_DATA_ALIGN - 1);
+    size_t alloc_size = node_size + (store->nbufs ? store->elem_size * store->elem_count : 0);
+    struct tag_tree_node* tag = arena_alloc(&tag_arena, alloc_size);
+
+    memset(tag, 0, sizeof(struct tag_tree_node));
+    tag->store = store;
+    tag->conn = conn;
+    tag->alloc_size = alloc_size;
+    tag->name = store->shared ? shm_ptr(store->name_off) : store->name;
+    tag->data = store->shared ? shm_ptr(store->data_off) : store->data;
+    tag->elem_size = store->elem_size;
+    tag->elem_count = store->elem_count;
+
+    /* A handle onto a buffered tag starts out with whatever was last
+     * written to it, as though it had just been read. */
+    if (store->nbufs != 0) {
+        tag->data = (char*)(tag) + node_size;
+        tag_store_snapshot(store, tag->data);
+    }
+    return tag;
+}
+
+/* Creates the (initially empty) metatag node.
+ *
+ * Assumes that tag_tree_mtx is held for writing.
+ */
+static void
+tag_tree_metanode_alloc()
+{
+    struct tag_tree_node* tag;
+    struct tag_store* store;
+    size_t alloc_size = sizeof(struct tag_store) + sizeof("@tags");
+
+    store = arena_alloc(&tag_arena, alloc_size);
+    memset(store, 0, sizeof(struct tag_store));
+    tag_store_init_sync(store);
+
+    /* The metatag's data is a growable heap buffer (see
+     * tag_tree_metatag_append()) that hangs off the node, so only its name
+     * lives in the store, which is never shared or indexed. */
+    store->alloc_size = alloc_size;
+    store->refs = 1;
+    store->name = strcpy(store->storage, "@tags");
+    store->gateway = store->path = "";
+
+    tag = tag_tree_handle_alloc(store, NULL);
     tag->tag_id = METATAG_ID;
     tag->elem_count = 1;
-    tag->elem_size = total_data_size;
-    tag->data = p = malloc(tag->elem_size);
-    tag->cb = NULL;
-    
-    pdebug(PLCTAG_DEBUG_DETAIL, "Creating @tags metatag (node ID %d) (%d bytes)", METATAG_ID, tag->elem_size);
 
-    RB_FOREACH(tag, tag_tree_t, &tag_tree) {
-        struct metatag_t *mt = (struct metatag_t *)(p);
-        mt->id = tag->tag_id;
-        mt->type = (1 << 13); /* TODO: type needs more than the dimensions mask */
-        mt->elem_size = tag->elem_size;
-        mt->array_dims[0] = tag->elem_count;
-        mt->array_dims[1] = mt->array_dims[2] = 0; 
-        mt->length = strlen(tag->name);
-        memcpy(mt->data, tag->name, mt->length);
+    pdebug(PLCTAG_DEBUG_DETAIL, "Creating @tags metatag (node ID %d)", METATAG_ID);
+
+    RB_INSERT(tag_tree_t, &tag_tree, tag);
+    tag_table_set(METATAG_ID, tag);
+    tree_size++;
+
+    metatag.node = tag;
+}
+
+/* Grows the metatag's buffer, geometrically, to hold at least need bytes.
+ *
+ * Assumes that tag_tree_mtx is held for writing and the metatag's mutex is
+ * held.
+ */
+static void
+tag_tree_metatag_reserve(size_t need)
+{
+    struct tag_tree_node* meta = metatag.node;
+    size_t cap;
 
-        p = p + sizeof(struct metatag_t) + mt->length;
+    if (need <= metatag.cap) {
+        return;
     }
 
-    pdebug(PLCTAG_DEBUG_SPEW, "Wrote %d of %d bytes as metatag data", (p - ret->data), total_data_size);
+    cap = metatag.cap ? metatag.cap : 1024;
+    while (cap < need) {
+        cap *= 2;
+    }
+    meta->data = realloc(meta->data, cap);
+    if (meta->data == NULL) {
+        err(1, "realloc");
+    }
+    metatag.cap = cap;
+}
 
-    RB_INSERT(tag_tree_t, &tag_tree, ret);
+/* Appends the metatag record for a freshly created tag.
+ *
+ * Assumes that tag_tree_mtx is held for writing.
+ */
+static void
+tag_tree_metatag_append(struct tag_tree_node* tag)
+{
+    struct tag_tree_node* meta = metatag.node;
+    size_t len = strlen(tag->name);
+    size_t need;
+
+    tag_store_lock(meta->store);
+
+    need = meta->elem_size + sizeof(struct metatag_t) + len;
+    tag_tree_metatag_reserve(need);
+
+    struct metatag_t* mt = (struct metatag_t*)(meta->data + meta->elem_size);
+    mt->id = tag->tag_id;
+    /* Tags without dimensions of their own have always been listed here
+     * as arrays of one dimension, scalars included. */
+    uint32_t dims[LAYOUT_MAX_DIMS] = { tag->elem_count > UINT32_MAX ? UINT32_MAX : tag->elem_count };
+    if (tag->store->dims[0] != 0) {
+        memcpy(dims, tag->store->dims, sizeof(dims));
+    }
+    mt->type = layout_symbol_type(tag->store->type, tag->elem_size, tag->elem_count, tag->store->udt, dims);
+    mt->elem_size = tag->elem_size;
+    memcpy(mt->array_dims, dims, sizeof(dims));
+    mt->length = len;
+    memcpy(mt->data, tag->name, len);
+
+    tag->meta_off = meta->elem_size;
+    meta->elem_size = need;
+
+    /* An append never leaves anything new to compact. */
+    __atomic_store_n(&metatag.gen, metatag.gen + 1, __ATOMIC_RELEASE);
+    if (metatag.ntombstones == 0) {
+        __atomic_store_n(&metatag.compacted_gen, metatag.gen, __ATOMIC_RELEASE);
+    }
+
+    MTX_UNLOCK(&meta->store->mtx);
+}
+
+/* Tombstones the metatag record of a tag that is being removed.
+ *
+ * Assumes that tag_tree_mtx is held for writing.
+ */
+static void
+tag_tree_metatag_tombstone(struct tag_tree_node* tag)
+{
+    struct tag_tree_node* meta = metatag.node;
+
+    tag_store_lock(meta->store);
+    ((struct metatag_t*)(meta->data + tag->meta_off))->id = 0;
+    metatag.ntombstones++;
+    __atomic_store_n(&metatag.gen, metatag.gen + 1, __ATOMIC_RELEASE);
+    MTX_UNLOCK(&meta->store->mtx);
+}
+
+/* Squeezes any tombstones out of the metatag, if there are any.  Cheap
+ * (no locks) when nothing was removed since the last call.
+ *
+ * Assumes that tag_tree_mtx is NOT held.
+ */
+static void
+tag_tree_metatag_sync()
+{
+    struct tag_tree_node* meta = metatag.node;
+    char *src, *dst, *end;
+
+    if (__atomic_load_n(&metatag.compacted_gen, __ATOMIC_ACQUIRE)
+        == __atomic_load_n(&metatag.gen, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    RW_WRLOCK(&tag_tree_mtx);
+    tag_store_lock(meta->store);
+
+    if (metatag.ntombstones == 0) {
+        __atomic_store_n(&metatag.compacted_gen, metatag.gen, __ATOMIC_RELEASE);
+        MTX_UNLOCK(&meta->store->mtx);
+        RW_UNLOCK(&tag_tree_mtx);
+        return;
+    }
+
+    pdebug(PLCTAG_DEBUG_DETAIL, "Compacting %d tombstones out of the metatag", metatag.ntombstones);
+
+    src = dst = meta->data;
+    end = meta->data + meta->elem_size;
+    while (src < end) {
+        struct metatag_t* mt = (struct metatag_t*)(src);
+        size_t rec_size = sizeof(struct metatag_t) + mt->length;
+
+        if (mt->id != 0) {
+            tag_table_get(mt->id)->meta_off = dst - meta->data;
+            memmove(dst, src, rec_size);
+            dst += rec_size;
+        }
+        src += rec_size;
+    }
+
+    meta->elem_size = dst - meta->data;
+    metatag.ntombstones = 0;
+    stats_add(METATAG_ID, STAT_METATAG_REBUILDS, 1);
+    __atomic_store_n(&metatag.compacted_gen, metatag.gen, __ATOMIC_RELEASE);
 
+    MTX_UNLOCK(&meta->store->mtx);
     RW_UNLOCK(&tag_tree_mtx);
+}
 
-    return ret;
+/* Hashes a tag's key, FNV-1a style, with a NUL between the parts so that
+ * they can't run into each other. */
+static uint64_t
+tag_index_hash(const char* gateway, size_t gateway_len, const char* path, size_t path_len, const char* name,
+    size_t name_len)
+{
+    const struct {
+        const char* p;
+        size_t len;
+    } parts[] = { { gateway, gateway_len }, { path, path_len }, { name, name_len } };
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); ++i) {
+        for (size_t j = 0; j < parts[i].len; ++j) {
+            h = (h ^ (unsigned char)(parts[i].p[j])) * 0x100000001b3ULL;
+        }
+        h *= 0x100000001b3ULL;
+    }
+    return h;
 }
 
-/* Allocates and initialises a fresh tag in the tag tree. */
-struct tag_tree_node *
-tag_tree_node_create()
+static uint64_t
+tag_index_hash_spec(const struct tag_tree_spec* spec)
+{
+    return tag_index_hash(spec->gateway.p, spec->gateway.p ? spec->gateway.len : 0, spec->path.p,
+        spec->path.p ? spec->path.len : 0, spec->name, spec->name_len);
+}
+
+/* Does a NUL-terminated key part match one that may be missing? */
+static bool
+tag_index_part_eq(const char* s, const char* p, size_t len)
+{
+    return strlen(s) == len && (len == 0 || memcmp(s, p, len) == 0);
+}
+
+/* Finds the indexed storage for spec's gateway, path and name, if any.
+ *
+ * Assumes that tag_tree_mtx is held.
+ */
+static struct tag_store*
+tag_index_find(const struct tag_tree_spec* spec, uint64_t hash)
 {
-    struct tag_tree_node* tag, *metatag, find;
-    int id;
+    struct tag_store* store;
 
+    if (tag_index.nbuckets == 0) {
+        return NULL;
+    }
+    for (store = tag_index.buckets[hash & (tag_index.nbuckets - 1)]; store != NULL; store = store->next) {
+        if (store->hash == hash && tag_index_part_eq(store->name, spec->name, spec->name_len)
+            && tag_index_part_eq(store->gateway, spec->gateway.p, spec->gateway.p ? spec->gateway.len : 0)
+            && tag_index_part_eq(store->path, spec->path.p, spec->path.p ? spec->path.len : 0)) {
+            return store;
+        }
+    }
+    return NULL;
+}
+
+/* Adds storage, whose key isn't already there, to the index.
+ *
+ * Assumes that tag_tree_mtx is held for writing.
+ */
+static void
+tag_index_insert(struct tag_store* store)
+{
+    struct tag_store **buckets, *s, *next;
+    size_t nbuckets;
+
+    if (tag_index.n >= tag_index.nbuckets) {
+        nbuckets = tag_index.nbuckets ? tag_index.nbuckets * 2 : TAG_INDEX_MIN_BUCKETS;
+        buckets = calloc(nbuckets, sizeof(*buckets));
+        if (buckets == NULL) {
+            err(1, "calloc");
+        }
+        for (size_t i = 0; i < tag_index.nbuckets; ++i) {
+            for (s = tag_index.buckets[i]; s != NULL; s = next) {
+                next = s->next;
+                s->next = buckets[s->hash & (nbuckets - 1)];
+                buckets[s->hash & (nbuckets - 1)] = s;
+            }
+        }
+        free(tag_index.buckets);
+        tag_index.buckets = buckets;
+        tag_index.nbuckets = nbuckets;
+    }
+
+    store->next = tag_index.buckets[store->hash & (tag_index.nbuckets - 1)];
+    tag_index.buckets[store->hash & (tag_index.nbuckets - 1)] = store;
+    store->indexed = true;
+    tag_index.n++;
+}
+
+/* Takes storage out of the index.
+ *
+ * Assumes that tag_tree_mtx is held for writing.
+ */
+static void
+tag_index_remove(struct tag_store* store)
+{
+    struct tag_store** pp = &tag_index.buckets[store->hash & (tag_index.nbuckets - 1)];
+
+    while (*pp != store) {
+        pp = &(*pp)->next;
+    }
+    *pp = store->next;
+    store->indexed = false;
+    tag_index.n--;
+}
+
+/* Allocates and initialises a fresh tag in the tag tree as described by
+ * spec, with a zero-filled payload of (elem_size * elem_count) bytes unless
+ * spec says otherwise, or another handle onto the existing tag with that
+ * gateway, path and name.  The tag is complete by the time any other
+ * thread can find it.  Returns NULL if the payload size isn't
+ * representable or every tag ID is in use. */
+struct tag_tree_node *
+tag_tree_node_create(const struct tag_tree_spec* spec)
+{
     tag_tree_init();
-    
-    RW_WRLOCK(&tag_tree_mtx);
 
-    /* TODO: special case for the empty tree?. */
-    tag = RB_MAX(tag_tree_t, &tag_tree);
-    if (tag == NULL) {
-        id = METATAG_ID + 1;
-    } else {
-        id = tag->tag_id + 1;
+    return tag_tree_node_alloc(spec);
+}
+
+/* Copies a key part into a store's storage at *p, unless it's empty. */
+static const char*
+tag_store_copy_part(char** p, const char* s, size_t len)
+{
+    char* dst = *p;
+
+    if (s == NULL || len == 0) {
+        return "";
     }
+    memcpy(dst, s, len);
+    dst[len] = '\0';
+    *p += len + 1;
+    return dst;
+}
 
-    tag = malloc(sizeof(struct tag_tree_node));
-    if (tag == NULL) {
-        err(1, "malloc");
+/* Allocates and initialises storage as described by spec, ready to be put
+ * in the index; returns NULL if the payload size isn't representable. */
+static struct tag_store*
+tag_store_prepare(const struct tag_tree_spec* spec, uint64_t hash)
+{
+    struct tag_store* store;
+    size_t data_size, key_size, alloc_size, ncopies = spec->nbufs ? spec->nbufs : 1;
+    size_t gateway_len = spec->gateway.p ? spec->gateway.len : 0;
+    size_t path_len = spec->path.p ? spec->path.len : 0;
+    char* p;
+
+    /* One allocation holds the storage, its payload and its key, unless
+     * they're borrowed. */
+    if (spec->elem_size != 0 && spec->elem_count > (SIZE_MAX / 2) / spec->elem_size) {
+        pdebug(PLCTAG_DEBUG_WARN, "Tag size %zu * %zu is too large", spec->elem_size, spec->elem_count);
+        return NULL;
     }
-    memset(tag, 0, sizeof(struct tag_tree_node));
+    data_size = (spec->elem_size * spec->elem_count + (TAG_DATA_ALIGN - 1)) & ~(size_t)(TAG_DATA_ALIGN - 1);
+    key_size = (spec->borrow ? 0 : spec->name_len + 1) + (gateway_len + 1) + (path_len + 1);
+    alloc_size = sizeof(struct tag_store) + (spec->borrow ? 0 : data_size * ncopies) + key_size;
+
+    store = arena_alloc(&tag_arena, alloc_size);
+    memset(store, 0, sizeof(struct tag_store));
+    tag_store_init_sync(store);
+
+    store->alloc_size = alloc_size;
+    store->hash = hash;
+    store->elem_size = spec->elem_size;
+    store->elem_count = spec->elem_count;
+    store->nbufs = spec->nbufs;
+    store->type = spec->type;
+    store->udt = spec->udt;
+    memcpy(store->dims, spec->dims, sizeof(store->dims));
+
+    if (spec->borrow) {
+        store->borrowed = true;
+        store->data = (char*)(spec->init);
+        store->name = (char*)(spec->name);
+        p = store->storage;
+    } else {
+        store->data = store->storage;
+        if (spec->init) {
+            memcpy(store->data, spec->init, spec->elem_size * spec->elem_count);
+            memset(store->data + spec->elem_size * spec->elem_count, 0,
+                data_size - spec->elem_size * spec->elem_count);
+        } else {
+            memset(store->data, 0, data_size);
+        }
+        /* The initial payload is the first snapshot. */
+        for (size_t i = 0; i < (size_t)(spec->nbufs); ++i) {
+            store->bufs[i] = store->storage + i * data_size;
+        }
+        if (spec->nbufs != 0) {
+            store->data = NULL;
+        }
+        store->name = memcpy(store->storage + data_size * ncopies, spec->name, spec->name_len);
+        store->name[spec->name_len] = '\0';
+        p = store->name + spec->name_len + 1;
+    }
+    store->gateway = tag_store_copy_part(&p, spec->gateway.p, gateway_len);
+    store->path = tag_store_copy_part(&p, spec->path.p, path_len);
 
-    if (pthread_mutex_init(&tag->mtx, NULL)) {
-        err(1, "pthread_mutex_init");
+    return store;
+}
+
+/* Frees storage that no handle refers to any more, and that isn't (or
+ * never was) in the index.  Storage in the shared segment stays. */
+static void
+tag_store_destroy(struct tag_store* store)
+{
+    if (store->shared) {
+        return;
     }
+    tag_store_lock(store);
+    MTX_UNLOCK(&store->mtx);
+    pthread_mutex_destroy(&store->mtx);
+    pthread_cond_destroy(&store->cond);
+    pthread_mutex_destroy(&store->snap_mtx);
+    arena_free(&tag_arena, store, store->alloc_size);
+}
 
-    /* TODO: should we take the lock before inserting
-     * and let the caller unlock it so that the first 
-     * reader is guaranteed to see the complete object?
-     */
+/* Can a request for spec be served by existing storage?  Being buffered
+ * or not, and how, counts as part of the shape. */
+static bool
+tag_store_fits(const struct tag_store* store, const struct tag_tree_spec* spec)
+{
+    if (spec->any_shape && spec->nbufs == 0) {
+        return true;
+    }
+    return store->nbufs == spec->nbufs
+        && (spec->any_shape || (store->elem_size == spec->elem_size && store->elem_count == spec->elem_count));
+}
 
-    tag->tag_id = id; 
+/* Gives a prepared tag the given ID and makes it visible.
+ *
+ * Assumes that tag_tree_mtx is held for writing.
+ */
+static void
+tag_tree_node_publish(struct tag_tree_node* tag, int32_t id)
+{
+    tag->tag_id = id;
     RB_INSERT(tag_tree_t, &tag_tree, tag);
+    tag_table_set(id, tag);
     tree_size++;
 
+    tag_tree_metatag_append(tag);
+}
+
+/* Does the work of tag_tree_node_create(), without first making sure that
+ * the tree has been initialised (so that the initialiser itself can use it).
+ */
+static struct tag_tree_node*
+tag_tree_node_alloc(const struct tag_tree_spec* spec)
+{
+    uint64_t hash = tag_index_hash_spec(spec);
+    struct tag_store *store, *fresh = NULL, *shared = NULL;
+    struct tag_tree_node* tag;
+    int32_t id;
+
+    /* With a shared segment, that's where the storage is, unless the tag
+     * is buffered or there already with another shape. */
+    if (tag_shm && spec->nbufs == 0 && shm_store_get(spec, hash, &shared) < 0) {
+        return NULL;
+    }
+
+    /* Usually the tag either exists already, and all it takes is a new
+     * handle, or it doesn't, and we can build its storage before taking
+     * the lock for long.  If somebody else creates it in the meantime, we
+     * use theirs. */
+    for (;;) {
+        RW_WRLOCK(&tag_tree_mtx);
+        if ((store = shared) != NULL) {
+            break;
+        }
+        store = tag_index_find(spec, hash);
+        if (store != NULL && !tag_store_fits(store, spec)) {
+            pdebug(PLCTAG_DEBUG_DETAIL, "Tag %s exists with a different shape, so gets storage of its own",
+                store->name);
+            store = NULL;
+            if (fresh) {
+                break;
+            }
+        } else if (store != NULL || fresh != NULL) {
+            break;
+        }
+        RW_UNLOCK(&tag_tree_mtx);
+
+        if (spec->existing) {
+            return NULL;
+        }
+
+        fresh = tag_store_prepare(spec, hash);
+        if (fresh == NULL) {
+            return NULL;
+        }
+    }
+
+    if ((id = tag_id_alloc()) < 0) {
+        RW_UNLOCK(&tag_tree_mtx);
+        pdebug(PLCTAG_DEBUG_WARN, "No room for any more tags");
+        if (fresh != NULL) {
+            tag_store_destroy(fresh);
+        }
+        return NULL;
+    }
 
-    find.tag_id = METATAG_ID;
-    metatag = RB_FIND(tag_tree_t, &tag_tree, &find);
-    if (metatag != NULL) {
-        RB_REMOVE(tag_tree_t, &tag_tree, metatag);
-        tree_size--;
-        tag_tree_node_destroy(metatag);
+    if (store == NULL) {
+        store = fresh;
+        if (tag_index_find(spec, hash) == NULL) {
+            tag_index_insert(store);
+        }
+    } else if (fresh != NULL) {
+        tag_store_destroy(fresh);
     }
 
+    if (!store->shared) {
+        store->refs++;
+    }
+    tag = tag_tree_handle_alloc(store, spec->conn);
+    tag_tree_node_publish(tag, id);
     RW_UNLOCK(&tag_tree_mtx);
-    
 
-    pdebug(PLCTAG_DEBUG_DETAIL, "Created new tag %d", id);
+    pdebug(PLCTAG_DEBUG_DETAIL, "Created new tag %d (%d handles on %s)", id, store->refs, tag->name);
 
     return tag;
 }
 
-void
-tag_tree_node_destroy(struct tag_tree_node *tag) {
-    if (!tag) {
-        return;
+/* Does the work of tag_tree_bulk_create(), as tag_tree_node_alloc() does
+ * for tag_tree_node_create().  These always get storage of their own, which
+ * is indexed unless a tag of the same name already is; or, with a shared
+ * segment, the storage there, as for tag_tree_node_alloc(). */
+static int32_t
+tag_tree_bulk_alloc(const struct tag_tree_spec* specs, size_t n)
+{
+    struct tag_store** stores;
+    struct tag_tree_node* meta = metatag.node;
+    size_t meta_need;
+    int32_t first;
+
+    if (n == 0) {
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    stores = malloc(n * sizeof(*stores));
+    if (stores == NULL) {
+        err(1, "malloc");
     }
-    
-    pdebug(PLCTAG_DEBUG_DETAIL, "Destroying node %d", tag->tag_id);
 
-    MTX_LOCK(&tag->mtx);
+    /* Do all the allocating and copying before taking the lock. */
+    meta_need = 0;
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t hash = tag_index_hash_spec(&specs[i]);
+        int ret = 1;
 
-    pthread_mutex_t mtx = tag->mtx;
-    free(tag->data);
-    free(tag->name);
-    free(tag);
+        if (tag_shm && specs[i].nbufs == 0) {
+            ret = shm_store_get(&specs[i], hash, &stores[i]);
+        }
+        if (ret > 0) {
+            stores[i] = tag_store_prepare(&specs[i], hash);
+        }
+        if (ret < 0 || stores[i] == NULL) {
+            while (i-- > 0) {
+                tag_store_destroy(stores[i]);
+            }
+            free(stores);
+            return ret < 0 ? PLCTAG_ERR_NO_RESOURCES : PLCTAG_ERR_TOO_LARGE;
+        }
+        meta_need += sizeof(struct metatag_t) + specs[i].name_len;
+    }
+
+    RW_WRLOCK(&tag_tree_mtx);
 
-    MTX_UNLOCK(&mtx);
+    if ((first = tag_id_alloc_fresh(n)) < 0) {
+        RW_UNLOCK(&tag_tree_mtx);
+        pdebug(PLCTAG_DEBUG_WARN, "No room for %zu more tags", n);
+        for (size_t i = 0; i < n; ++i) {
+            tag_store_destroy(stores[i]);
+        }
+        free(stores);
+        return PLCTAG_ERR_NO_RESOURCES;
+    }
 
-    pthread_mutex_destroy(&mtx);
+    tag_store_lock(meta->store);
+    tag_tree_metatag_reserve(meta->elem_size + meta_need);
+    MTX_UNLOCK(&meta->store->mtx);
+
+    for (size_t i = 0; i < n; ++i) {
+        if (!stores[i]->shared) {
+            if (tag_index_find(&specs[i], stores[i]->hash) == NULL) {
+                tag_index_insert(stores[i]);
+            }
+            stores[i]->refs = 1;
+        }
+        tag_tree_node_publish(tag_tree_handle_alloc(stores[i], specs[i].conn), first + i);
+    }
+
+    RW_UNLOCK(&tag_tree_mtx);
+
+    pdebug(PLCTAG_DEBUG_DETAIL, "Created tags %d to %d", first, (int)(first + n - 1));
+
+    free(stores);
+    return first;
+}
+
+int32_t
+tag_tree_bulk_create(const struct tag_tree_spec* specs, size_t n)
+{
+    tag_tree_init();
+
+    return tag_tree_bulk_alloc(specs, n);
+}
+
+static void
+tag_tree_node_reclaim(void* p)
+{
+    arena_free(&tag_arena, p, ((struct tag_tree_node*)(p))->alloc_size);
+}
+
+static void
+tag_store_reclaim(void* p)
+{
+    tag_store_destroy(p);
 }
 
 int
 tag_tree_remove(int32_t id) {
     struct tag_tree_node* tag;
+    struct tag_store* store;
+    bool last;
 
     tag_tree_init();
-    
-    tag = tag_tree_lookup(id);
+
+    /* The metatag lives as long as the tree does. */
+    if (id == METATAG_ID) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    RW_WRLOCK(&tag_tree_mtx);
+
+    /* Look the tag up with the write lock held so that two threads racing
+     * on removing the same ID can't both unlink it.  A stale ID isn't
+     * found, even if its slot has been reused. */
+    tag = tag_table_get(id);
     if (!tag) {
-        pdebug(PLCTAG_DEBUG_WARN, "Lookup for tag %d failed", id);
         RW_UNLOCK(&tag_tree_mtx);
+        pdebug(PLCTAG_DEBUG_WARN, "Lookup for tag %d failed", id);
         return PLCTAG_ERR_NOT_FOUND;
     }
 
-    /* FIXME: This is racy: two threads racing on removing the same
-     * ID could yield Weirdness given that IDs get reassigned. */
-    RW_WRLOCK(&tag_tree_mtx);
-
     /* TODO: special case for the empty tree?. */
     RB_REMOVE(tag_tree_t, &tag_tree, tag);
+    tag_table_set(id, NULL);
+    tag_id_free_push(id);
     tree_size--;
-    
+
+    tag_tree_metatag_tombstone(tag);
+
+    /* The storage goes with its last handle, unless it's shared. */
+    store = tag->store;
+    last = !store->shared && --store->refs == 0;
+    if (last && store->indexed) {
+        tag_index_remove(store);
+    }
+
     RW_UNLOCK(&tag_tree_mtx);
 
-    tag_tree_node_destroy(tag);
+    /* Other threads may still be using what they looked up before it
+     * was unlinked, so it's only freed once they're done (see epoch.h). */
+    pdebug(PLCTAG_DEBUG_DETAIL, "Retiring node %d", id);
+    epoch_retire(tag_tree_node_reclaim, tag);
+    if (last) {
+        epoch_retire(tag_store_reclaim, store);
+    }
 
     pdebug(PLCTAG_DEBUG_DETAIL, "Removed tag %d", id);
 
     return PLCTAG_STATUS_OK;
 }
 
-/* invoked the first time the user of the library tries to do anything
- * with the the PLC.
- * 
- * Assumes that tag_tree_mtx is NOT held.
- */
+/* Seeds the tree with the stock dummy tags. */
 static void
-tag_tree_init()
+tag_tree_init_dummies()
 {
-    static bool tag_tree_inited = false; /* Have we called tag_tree_init() yet? */
-
-    /* Check to see if we've inited.  If so, nothing to do. */
-    RW_RDLOCK(&tag_tree_mtx);
+    for (int i = 0; i < NTAGS; ++i) {
+        /* Given as the initial payload, so that a shared dummy already
+         * there keeps whatever it has been set to since. */
+        uint16_t init[2] = { i, 0 };
+        char* name;
+        int len;
+
+        len = asprintf(&name, "DUMMY_AQUA_DATA_%d", i);
+        if (len < 0) {
+            err(1, "asnprintf");
+        }
 
-    if (tag_tree_inited) {
-        RW_UNLOCK(&tag_tree_mtx);
-        return;
+        struct tag_tree_spec spec
+            = { .name = name, .name_len = len, .elem_size = sizeof(uint32_t), .elem_count = 1, .init = init };
+        tag_tree_node_alloc(&spec);
+        free(name);
     }
+}
 
-    /* Upgrade to a writer lock and initialise. */
-    RW_UNLOCK(&tag_tree_mtx);
-    RW_WRLOCK(&tag_tree_mtx);
+/* Seeds the tree with the tags in a fixture file (see fixture.h).  There's
+ * no caller to report a bad fixture to, so that's fatal. */
+static void
+tag_tree_init_fixture(const char* path)
+{
+    struct fixture f;
+    int32_t ret;
 
-    /* Did somebody beat us to initing? If so, lucky us. */
-    if (tag_tree_inited) {
-        RW_UNLOCK(&tag_tree_mtx);
-        return;
+    if ((ret = fixture_open(path, &f)) != PLCTAG_STATUS_OK) {
+        errx(1, "Can't load tag fixture %s: %s", path, plc_tag_decode_error(ret));
     }
-    tag_tree_inited = true;
-    RW_UNLOCK(&tag_tree_mtx);
+    if ((ret = tag_tree_bulk_alloc(f.specs, f.ntags)) < 0) {
+        errx(1, "Can't create the tags in fixture %s: %s", path, plc_tag_decode_error(ret));
+    }
+    fixture_attach_gens(&f, ret);
+    pdebug(PLCTAG_DEBUG_INFO, "Loaded %zu tags from %s", f.ntags, path);
+    fixture_close(&f);
+}
+
+/* Seeds the tree with the metatag and either the dummy tags or those in
+ * $PLCSTUB_FIXTURE.  Run once after startup and after each shutdown, via
+ * tag_tree_init(), which holds tag_tree_init_mtx throughout, so that no
+ * other caller gets past tag_tree_init() until this has returned, and
+ * nobody can observe a half-seeded tree.
+ */
+static void
+tag_tree_init_once()
+{
+    const char* fixture;
 
     pdebug(PLCTAG_DEBUG_DETAIL, "Initing");
 
+    pthread_condattr_init(&tag_cond_attr);
+    pthread_condattr_setclock(&tag_cond_attr, CLOCK_MONOTONIC);
 
-    /* TODO: this should be done as part of a helper that
-     * consumes dummy tags from an input file or something.
-     */
-    for (int i = 0; i < NTAGS; ++i) {
-        char* name, *data;
-        size_t elem_count = 1;
-        size_t elem_size = sizeof(uint32_t);
+    tag_shm = shm_attach();
+    trace_init();
 
-        struct tag_tree_node* tag = tag_tree_node_create();
-        MTX_LOCK(&tag->mtx);
+    RW_WRLOCK(&tag_tree_mtx);
+    tag_tree_metanode_alloc();
+    RW_UNLOCK(&tag_tree_mtx);
 
-        asprintf(&name, "DUMMY_AQUA_DATA_%d", i);
-        if (name == NULL) {
-            err(1, "asnprintf");
-        }
+    fixture = getenv("PLCSTUB_FIXTURE");
+    if (fixture && *fixture) {
+        tag_tree_init_fixture(fixture);
+    } else {
+        tag_tree_init_dummies();
+    }
 
-        data = calloc(elem_count, elem_size);
-        if (!data) {
-            err(1, "calloc");
-        }
-        *(uint16_t*)(data) = i;
-        
-        tag->name = name;
-        tag->data = data;
-        tag->elem_count = elem_count;
-        tag->elem_size = elem_size;
-        MTX_UNLOCK(&tag->mtx);
+    __atomic_store_n(&tag_tree_ready, true, __ATOMIC_RELEASE);
+}
+
+/* invoked every time the user of the library tries to do anything
+ * with the the PLC.  After the first call this is just a load of
+ * tag_tree_ready, which takes no locks.
+ * 
+ * Assumes that tag_tree_mtx is NOT held.
+ */
+void
+tag_tree_init()
+{
+    if (__atomic_load_n(&tag_tree_ready, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    MTX_LOCK(&tag_tree_init_mtx);
+    if (!tag_tree_ready) {
+        tag_tree_init_once();
     }
+    MTX_UNLOCK(&tag_tree_init_mtx);
 }
 
-/* Looks up a tag by ID; returns NULL if no such tag exists. 
+/* Frees every tag in the tree in one go, by releasing the arena they were
+ * allocated from rather than destroying them one at a time.
  *
- * This function does NOT eagerly lock the returned tag; it
- * falls to the caller to do so!
+ * Like plc_tag_shutdown(), this is NOT thread safe: nothing else may be
+ * using the library while it runs.  The next tag_tree_init() seeds the
+ * tree again.
  */
-struct tag_tree_node*
-tag_tree_lookup(int32_t tag_id)
+void
+tag_tree_shutdown(void)
 {
-    struct tag_tree_node *ret;
+    RW_WRLOCK(&tag_tree_mtx);
 
-    tag_tree_init();
+    pdebug(PLCTAG_DEBUG_DETAIL, "Releasing %zu tags", tree_size);
 
-    pdebug(PLCTAG_DEBUG_DETAIL, "Looking up tag id %d", tag_id);
+    if (metatag.node) {
+        free(metatag.node->data);
+    }
+    memset(&metatag, 0, sizeof(metatag));
+    __atomic_store_n(&tag_tree_ready, false, __ATOMIC_RELEASE);
+
+    /* Most of the table is never touched, and even free(NULL) costs, over
+     * thousands of chunks, more than all the rest of this. */
+    for (int i = 0; i < TAG_TABLE_NCHUNKS; ++i) {
+        if (tag_table[i] != NULL) {
+            free(tag_table[i]);
+            tag_table[i] = NULL;
+        }
+    }
+    RB_INIT(&tag_tree);
+    tree_size = 0;
 
+    free(tag_index.buckets);
+    memset(&tag_index, 0, sizeof(tag_index));
 
-    RW_RDLOCK(&tag_tree_mtx);
+    free(tag_id_free.ids);
+    memset(&tag_id_free, 0, sizeof(tag_id_free));
+    tag_id_next = METATAG_ID + 1;
 
-    struct tag_tree_node find;
-    find.tag_id = tag_id;
-    ret = RB_FIND(tag_tree_t, &tag_tree, &find);
+    /* Default mutexes and condition variables own no resources, so there's
+     * no need to visit each node to destroy them first.  Anything retired
+     * has to go first, though, as it gets handed back to the arena. */
+    epoch_shutdown();
+    arena_release(&tag_arena);
+    fixture_unmap_all();
+    shm_detach();
+    tag_shm = false;
 
     RW_UNLOCK(&tag_tree_mtx);
+}
+
+/* Looks up a tag by ID; returns NULL if no such tag exists. 
+ *
+ * This goes through the ID-indexed table rather than the tree, so it
+ * takes no locks and is O(1).  This function does NOT eagerly lock the
+ * returned tag; it falls to the caller to do so!  Nor does it keep the tag
+ * from being destroyed: callers that might race with plc_tag_destroy()
+ * must look it up, and finish with it, inside epoch_enter()/epoch_exit().
+ */
+struct tag_tree_node*
+tag_tree_lookup(int32_t tag_id)
+{
+    tag_tree_init();
 
-    if (ret == NULL && tag_id == METATAG_ID) {
-        return tag_tree_metanode_create();
+    pdebug(PLCTAG_DEBUG_DETAIL, "Looking up tag id %d", tag_id);
+
+    if (tag_id == METATAG_ID) {
+        tag_tree_metatag_sync();
     }
 
-    return ret;
+    return tag_table_get(tag_id);
 }
 
 
@@ -0,0 +1,624 @@
+/* trace.c
+ *
+ * Recording tag traffic to a trace file, and replaying it; see trace.h.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "lock_utils.h"
+#include "plcstub.h"
+#include "stats.h"
+#include "trace.h"
+
+#define TRACE_RING_SIZE 8192 /* records; must be a power of two */
+#define TRACE_FILE_CHUNK (4 * 1024 * 1024) /* the file's initial size */
+#define TRACE_FLUSH_INTERVAL_MS 50
+
+struct trace_ring {
+    uint64_t head; /* written by the owning thread */
+    uint64_t tail; /* written by the tracer */
+    int dead; /* set once the owning thread exits */
+    struct trace_ring* next;
+    struct trace_record buf[TRACE_RING_SIZE];
+};
+
+int trace_on = 0;
+
+/*
+ * Ensures mutual exclusion on the list of rings and on starting and
+ * stopping; the tracer sleeps on it.  The file and its mapping are the
+ * tracer's alone while it runs.
+ */
+static pthread_mutex_t trace_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_cond = PTHREAD_COND_INITIALIZER; /* wakes the tracer */
+static struct trace_ring* rings = NULL;
+static pthread_t tracer;
+static bool tracer_running = false;
+static bool tracer_stopping = false;
+static bool drain_wanted = false;
+static uint32_t trace_dropped = 0;
+
+static int trace_fd = -1;
+static char* trace_map = NULL;
+static size_t trace_map_size = 0;
+static uint64_t trace_used = 0; /* records after the header */
+static uint64_t trace_start_ns = 0; /* CLOCK_MONOTONIC, as stats_now_ns() */
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local struct trace_ring* my_ring = NULL;
+
+/************************ Recording ************************/
+
+static void
+trace_ring_orphan(void* arg)
+{
+    struct trace_ring* ring = arg;
+
+    my_ring = NULL;
+    __atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void
+trace_ring_key_init(void)
+{
+    int ret;
+
+    if ((ret = pthread_key_create(&ring_key, trace_ring_orphan)) != 0) {
+        errx(1, "pthread_key_create: %s", strerror(ret));
+    }
+}
+
+/* Returns this thread's ring, creating it if need be, or NULL if it can't
+ * be had.  Rings outlast recording, and are only freed once their thread
+ * has gone and the tracer has emptied them. */
+static struct trace_ring*
+trace_get_ring(void)
+{
+    struct trace_ring* ring = my_ring;
+
+    if (ring) {
+        return ring;
+    }
+
+    pthread_once(&ring_key_once, trace_ring_key_init);
+
+    if ((ring = malloc(sizeof(*ring))) == NULL) {
+        return NULL;
+    }
+    ring->head = ring->tail = 0;
+    ring->dead = 0;
+    pthread_setspecific(ring_key, ring);
+
+    MTX_LOCK(&trace_mtx);
+    ring->next = rings;
+    __atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+    MTX_UNLOCK(&trace_mtx);
+
+    my_ring = ring;
+    return ring;
+}
+
+/* Appends n records to this thread's ring, all or none of them, waking the
+ * tracer as the ring passes half full. */
+static void
+trace_put(const struct trace_record* recs, size_t n)
+{
+    struct trace_ring* ring = trace_get_ring();
+    uint64_t head, used;
+
+    if (ring == NULL) {
+        __atomic_add_fetch(&trace_dropped, n, __ATOMIC_RELAXED);
+        return;
+    }
+
+    head = ring->head;
+    used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (TRACE_RING_SIZE - used < n) {
+        __atomic_add_fetch(&trace_dropped, n, __ATOMIC_RELAXED);
+        return;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        ring->buf[(head + i) & (TRACE_RING_SIZE - 1)] = recs[i];
+    }
+    __atomic_store_n(&ring->head, head + n, __ATOMIC_RELEASE);
+
+    if (used < TRACE_RING_SIZE / 2 && used + n >= TRACE_RING_SIZE / 2) {
+        MTX_LOCK(&trace_mtx);
+        drain_wanted = true;
+        pthread_cond_signal(&trace_cond);
+        MTX_UNLOCK(&trace_mtx);
+    }
+}
+
+void
+trace_call(enum trace_op op, int32_t tag_id, enum trace_type type, int32_t arg, int32_t status, uint64_t value)
+{
+    struct trace_record r = {
+        .t_ns = stats_now_ns(),
+        .tag_id = tag_id,
+        .op = op,
+        .type = type,
+        .arg = arg,
+        .status = status,
+        .value = value,
+    };
+
+    trace_put(&r, 1);
+}
+
+void
+trace_create(const char* attrib, int timeout, int32_t ret)
+{
+    struct trace_record recs[1 + TRACE_CONT(TRACE_MAX_ATTRIB)];
+    size_t len = attrib ? strnlen(attrib, TRACE_MAX_ATTRIB) : 0;
+
+    recs[0] = (struct trace_record) {
+        .t_ns = stats_now_ns(),
+        .tag_id = ret,
+        .op = TRACE_OP_CREATE,
+        .len = len,
+        .arg = timeout,
+        .status = ret < 0 ? ret : PLCTAG_STATUS_OK,
+    };
+    memset(recs + 1, 0, TRACE_CONT(len) * sizeof(*recs));
+    memcpy(recs + 1, attrib, len);
+
+    trace_put(recs, 1 + TRACE_CONT(len));
+}
+
+/************************ The tracer ************************/
+
+/* Makes room in the file for n more records. */
+static bool
+trace_reserve(size_t n)
+{
+    size_t want = (1 + trace_used + n) * sizeof(struct trace_record), size = trace_map_size;
+    char* map;
+
+    if (want <= trace_map_size) {
+        return true;
+    }
+    while (size < want) {
+        size *= 2;
+    }
+    if (ftruncate(trace_fd, size) < 0) {
+        pdebug(PLCTAG_DEBUG_ERROR, "ftruncate: %s", strerror(errno));
+        return false;
+    }
+    if ((map = mremap(trace_map, trace_map_size, size, MREMAP_MAYMOVE)) == MAP_FAILED) {
+        pdebug(PLCTAG_DEBUG_ERROR, "mremap: %s", strerror(errno));
+        return false;
+    }
+    trace_map = map;
+    trace_map_size = size;
+    return true;
+}
+
+/* Drains every ring into the file.  Records left over from an earlier
+ * recording, by threads that were part way through one when it stopped,
+ * are older than this one and are skipped.  Only called by the tracer. */
+static void
+trace_drain(void)
+{
+    struct trace_record* out;
+    struct trace_header* h;
+    struct trace_ring *ring, **link;
+    struct trace_record* r;
+    uint64_t head, tail;
+    size_t n;
+
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        tail = ring->tail;
+
+        while (tail != head) {
+            r = &ring->buf[tail & (TRACE_RING_SIZE - 1)];
+            n = 1 + (r->op == TRACE_OP_CREATE ? TRACE_CONT(r->len) : 0);
+            if (r->t_ns >= trace_start_ns && trace_reserve(n)) {
+                out = (struct trace_record*)(trace_map);
+                for (size_t i = 0; i < n; ++i) {
+                    out[1 + trace_used + i] = ring->buf[(tail + i) & (TRACE_RING_SIZE - 1)];
+                }
+                out[1 + trace_used].t_ns -= trace_start_ns;
+                trace_used += n;
+            } else if (r->t_ns >= trace_start_ns) {
+                __atomic_add_fetch(&trace_dropped, n, __ATOMIC_RELAXED);
+            }
+            tail += n;
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        }
+    }
+
+    h = (struct trace_header*)(trace_map);
+    h->nrecords = trace_used;
+    h->dropped = __atomic_load_n(&trace_dropped, __ATOMIC_RELAXED);
+
+    /* Free the rings of threads that have gone, now they're empty. */
+    MTX_LOCK(&trace_mtx);
+    for (link = &rings; (ring = *link) != NULL;) {
+        if (__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE)
+            && ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+            *link = ring->next;
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+    MTX_UNLOCK(&trace_mtx);
+}
+
+static void*
+trace_tracer(void* arg)
+{
+    struct timespec deadline;
+    bool stopping;
+
+    (void)(arg);
+
+    MTX_LOCK(&trace_mtx);
+    for (;;) {
+        stopping = tracer_stopping;
+        drain_wanted = false;
+        MTX_UNLOCK(&trace_mtx);
+
+        trace_drain();
+        if (stopping) {
+            return NULL;
+        }
+
+        MTX_LOCK(&trace_mtx);
+        if (drain_wanted || tracer_stopping) {
+            continue;
+        }
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += TRACE_FLUSH_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&trace_cond, &trace_mtx, &deadline);
+    }
+}
+
+static void
+trace_atexit(void)
+{
+    plcstub_trace_stop();
+}
+
+/************************ Interface ************************/
+
+int
+plcstub_trace_start(const char* path)
+{
+    static bool atexit_done = false;
+    struct trace_header* h;
+    struct timespec now;
+    int fd, ret;
+
+    if (path == NULL) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    MTX_LOCK(&trace_mtx);
+    if (tracer_running) {
+        MTX_UNLOCK(&trace_mtx);
+        pdebug(PLCTAG_DEBUG_WARN, "Already recording a trace");
+        return PLCTAG_ERR_DUPLICATE;
+    }
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        MTX_UNLOCK(&trace_mtx);
+        pdebug(PLCTAG_DEBUG_WARN, "Can't open %s: %s", path, strerror(errno));
+        return PLCTAG_ERR_OPEN;
+    }
+    if (ftruncate(fd, TRACE_FILE_CHUNK) < 0
+        || (trace_map = mmap(NULL, TRACE_FILE_CHUNK, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        MTX_UNLOCK(&trace_mtx);
+        pdebug(PLCTAG_DEBUG_WARN, "Can't map %s: %s", path, strerror(errno));
+        close(fd);
+        trace_map = NULL;
+        return PLCTAG_ERR_OPEN;
+    }
+    trace_fd = fd;
+    trace_map_size = TRACE_FILE_CHUNK;
+    trace_used = 0;
+    __atomic_store_n(&trace_dropped, 0, __ATOMIC_RELAXED);
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    h = (struct trace_header*)(trace_map);
+    memcpy(h->magic, TRACE_MAGIC, sizeof(h->magic));
+    h->version = TRACE_VERSION;
+    h->record_size = sizeof(struct trace_record);
+    h->start_ns = (uint64_t)(now.tv_sec) * 1000000000ULL + now.tv_nsec;
+    trace_start_ns = stats_now_ns();
+
+    pdebug(PLCTAG_DEBUG_INFO, "Recording a trace to %s", path);
+
+    tracer_stopping = false;
+    if ((ret = pthread_create(&tracer, NULL, trace_tracer, NULL)) != 0) {
+        errx(1, "pthread_create: %s", strerror(ret));
+    }
+    tracer_running = true;
+    if (!atexit_done) {
+        atexit(trace_atexit);
+        atexit_done = true;
+    }
+    __atomic_store_n(&trace_on, 1, __ATOMIC_RELEASE);
+    MTX_UNLOCK(&trace_mtx);
+
+    return PLCTAG_STATUS_OK;
+}
+
+int
+plcstub_trace_stop(void)
+{
+    size_t size;
+
+    MTX_LOCK(&trace_mtx);
+    if (!tracer_running) {
+        MTX_UNLOCK(&trace_mtx);
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+    __atomic_store_n(&trace_on, 0, __ATOMIC_RELAXED);
+    tracer_stopping = true;
+    pthread_cond_signal(&trace_cond);
+    MTX_UNLOCK(&trace_mtx);
+
+    /* The tracer drains the rings once more on its way out. */
+    pthread_join(tracer, NULL);
+
+    MTX_LOCK(&trace_mtx);
+    tracer_running = false;
+    size = (1 + trace_used) * sizeof(struct trace_record);
+    pdebug(PLCTAG_DEBUG_INFO, "Recorded %llu trace records, dropping %u",
+        (unsigned long long)(trace_used), ((struct trace_header*)(trace_map))->dropped);
+    munmap(trace_map, trace_map_size);
+    if (ftruncate(trace_fd, size) < 0) {
+        pdebug(PLCTAG_DEBUG_WARN, "ftruncate: %s", strerror(errno));
+    }
+    close(trace_fd);
+    trace_map = NULL;
+    trace_fd = -1;
+    MTX_UNLOCK(&trace_mtx);
+
+    return PLCTAG_STATUS_OK;
+}
+
+void
+trace_init(void)
+{
+    const char* path = getenv("PLCSTUB_TRACE");
+
+    if (path != NULL && *path != '\0' && plcstub_trace_start(path) != PLCTAG_STATUS_OK) {
+        pdebug(PLCTAG_DEBUG_ERROR, "Can't record a trace to %s", path);
+    }
+}
+
+/************************ Replaying ************************/
+
+/* Tag IDs as recorded, mapped to those of the tags created in replaying
+ * them.  Open-addressed; IDs that aren't in it (the dummies', say, created
+ * before recording started) are used as they stand. */
+struct trace_ids {
+    int32_t* from;
+    int32_t* to;
+    size_t cap; /* a power of two */
+};
+
+static int32_t
+trace_id(const struct trace_ids* ids, int32_t id)
+{
+    size_t i = (uint32_t)(id) * 2654435761u & (ids->cap - 1);
+
+    for (; ids->from[i] != 0; i = (i + 1) & (ids->cap - 1)) {
+        if (ids->from[i] == id) {
+            return ids->to[i];
+        }
+    }
+    return id;
+}
+
+static void
+trace_id_put(struct trace_ids* ids, int32_t from, int32_t to)
+{
+    size_t i = (uint32_t)(from) * 2654435761u & (ids->cap - 1);
+
+    while (ids->from[i] != 0 && ids->from[i] != from) {
+        i = (i + 1) & (ids->cap - 1);
+    }
+    ids->from[i] = from;
+    ids->to[i] = to;
+}
+
+static const struct trace_record* replay_recs;
+
+/* Orders records by time, keeping those at the same time in the order
+ * they're in the file. */
+static int
+trace_cmp(const void* lhs, const void* rhs)
+{
+    const struct trace_record* l = &replay_recs[*(const uint64_t*)(lhs)];
+    const struct trace_record* r = &replay_recs[*(const uint64_t*)(rhs)];
+    uint64_t li = *(const uint64_t*)(lhs), ri = *(const uint64_t*)(rhs);
+
+    if (l->t_ns != r->t_ns) {
+        return l->t_ns < r->t_ns ? -1 : 1;
+    }
+    return li < ri ? -1 : li > ri;
+}
+
+/* Makes the call that r records, returning whether a getter got what was
+ * got when it was recorded. */
+static bool
+trace_replay_one(const struct trace_record* r, struct trace_ids* ids)
+{
+    char attrib[TRACE_MAX_ATTRIB + 1];
+    int32_t id = trace_id(ids, r->tag_id);
+    int32_t ret;
+
+    switch (r->op) {
+    case TRACE_OP_CREATE:
+        memcpy(attrib, r + 1, r->len);
+        attrib[r->len] = '\0';
+        ret = plc_tag_create(attrib, r->arg);
+        if (r->tag_id > 0 && ret > 0) {
+            trace_id_put(ids, r->tag_id, ret);
+        }
+        break;
+    case TRACE_OP_DESTROY:
+        plc_tag_destroy(id);
+        break;
+    case TRACE_OP_READ:
+        plc_tag_read(id, r->arg);
+        break;
+    case TRACE_OP_WRITE:
+        plc_tag_write(id, r->arg);
+        break;
+    case TRACE_OP_GET:
+        switch (r->type) {
+#define X(name, type)                                                    \
+        case TRACE_TYPE_##name: {                                        \
+            type got = plc_tag_get_##name(id, r->arg), want;             \
+            memcpy(&want, &r->value, sizeof(want));                      \
+            return r->status != PLCTAG_STATUS_OK || memcmp(&got, &want, sizeof(got)) == 0; \
+        }
+        TYPEMAP
+#undef X
+        }
+        break;
+    case TRACE_OP_SET:
+        switch (r->type) {
+#define X(name, type)                                                    \
+        case TRACE_TYPE_##name: {                                        \
+            type val;                                                    \
+            memcpy(&val, &r->value, sizeof(val));                        \
+            plc_tag_set_##name(id, r->arg, val);                         \
+            break;                                                       \
+        }
+        TYPEMAP
+#undef X
+        }
+        break;
+    }
+    return true;
+}
+
+int
+plcstub_trace_replay(const char* path, double speed)
+{
+    const struct trace_header* h;
+    const struct trace_record* recs;
+    struct trace_ids ids = { 0 };
+    struct timespec due;
+    struct stat st;
+    uint64_t *order, n, nheads = 0, ncreates = 0, base, at, differed = 0;
+    size_t step;
+    void* map;
+    int fd;
+
+    if (path == NULL) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        pdebug(PLCTAG_DEBUG_WARN, "Can't open %s: %s", path, strerror(errno));
+        return PLCTAG_ERR_OPEN;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)(st.st_size) < sizeof(*h)
+        || (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        pdebug(PLCTAG_DEBUG_WARN, "Can't map %s", path);
+        return PLCTAG_ERR_OPEN;
+    }
+    close(fd);
+
+    h = map;
+    recs = (const struct trace_record*)(h) + 1;
+    n = st.st_size / sizeof(*recs) - 1;
+    if (memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic)) != 0 || h->version != TRACE_VERSION
+        || h->record_size != sizeof(*recs)) {
+        munmap(map, st.st_size);
+        pdebug(PLCTAG_DEBUG_WARN, "%s isn't a trace", path);
+        return PLCTAG_ERR_BAD_DATA;
+    }
+    if (h->nrecords < n) {
+        n = h->nrecords;
+    }
+    if (h->dropped) {
+        pdebug(PLCTAG_DEBUG_WARN, "%s is missing %u records that were dropped", path, h->dropped);
+    }
+
+    /* Find the records that aren't continuations, and put them in order. */
+    if ((order = malloc((n ? n : 1) * sizeof(*order))) == NULL) {
+        munmap(map, st.st_size);
+        return PLCTAG_ERR_NO_MEM;
+    }
+    for (uint64_t i = 0; i < n; i += step) {
+        if (recs[i].op == TRACE_OP_NONE) {
+            break;
+        }
+        step = 1 + (recs[i].op == TRACE_OP_CREATE ? TRACE_CONT(recs[i].len) : 0);
+        if (i + step > n || (recs[i].op == TRACE_OP_CREATE && recs[i].len > TRACE_MAX_ATTRIB)) {
+            break;
+        }
+        ncreates += recs[i].op == TRACE_OP_CREATE;
+        order[nheads++] = i;
+    }
+    replay_recs = recs;
+    qsort(order, nheads, sizeof(*order), trace_cmp);
+
+    for (ids.cap = 16; ids.cap < 2 * ncreates; ids.cap *= 2) {
+    }
+    ids.from = calloc(ids.cap, sizeof(*ids.from));
+    ids.to = calloc(ids.cap, sizeof(*ids.to));
+    if (ids.from == NULL || ids.to == NULL) {
+        free(ids.from);
+        free(ids.to);
+        free(order);
+        munmap(map, st.st_size);
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    pdebug(PLCTAG_DEBUG_INFO, "Replaying %llu calls from %s", (unsigned long long)(nheads), path);
+
+    base = stats_now_ns();
+    for (uint64_t i = 0; i < nheads; ++i) {
+        const struct trace_record* r = &recs[order[i]];
+
+        if (speed > 0) {
+            at = base + (uint64_t)(r->t_ns / speed);
+            due.tv_sec = at / 1000000000ULL;
+            due.tv_nsec = at % 1000000000ULL;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR) {
+            }
+        }
+        differed += !trace_replay_one(r, &ids);
+    }
+
+    if (differed) {
+        pdebug(PLCTAG_DEBUG_DETAIL, "%llu of the values got differed from those recorded",
+            (unsigned long long)(differed));
+    }
+
+    free(ids.from);
+    free(ids.to);
+    free(order);
+    munmap(map, st.st_size);
+
+    return nheads > INT_MAX ? INT_MAX : (int)(nheads);
+}
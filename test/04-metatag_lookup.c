@@ -1,5 +1,6 @@
 #include <err.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "debug.h"
 #include "libplctag.h"
@@ -43,8 +44,8 @@ main(int argc, char** argv)
     offset += sizeof(s4) * 3;
 
     /* length */
-    if ((s2 = plc_tag_get_int16(METATAG_ID, offset)) != 4) {
-        errx(1, "Read at offset %d: expected %d, got %d", offset, 4, s2);
+    if ((s2 = plc_tag_get_int16(METATAG_ID, offset)) != strlen("DUMMY_AQUA_DATA_0")) {
+        errx(1, "Read at offset %d: expected %zu, got %d", offset, strlen("DUMMY_AQUA_DATA_0"), s2);
     }
     offset += sizeof(s2);
 
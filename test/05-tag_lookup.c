@@ -0,0 +1,76 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+#include "tagtree.h"
+
+/* Enough tags to spill the ID table over into a second chunk. */
+#define NCREATE 5000
+#define NTHREADS 8
+
+static int32_t ids[NCREATE];
+
+static void*
+reader(void* arg)
+{
+    (void)(arg);
+
+    for (int round = 0; round < 10; ++round) {
+        for (int i = 0; i < NCREATE; ++i) {
+            struct tag_tree_node* t = tag_tree_lookup(ids[i]);
+            if (t == NULL) {
+                errx(1, "Lookup of tag %d failed", ids[i]);
+            }
+            if (t->tag_id != ids[i]) {
+                errx(1, "Lookup of tag %d returned tag %d", ids[i], t->tag_id);
+            }
+        }
+    }
+    return NULL;
+}
+
+int
+main(int argc, char** argv)
+{
+    char buf[128];
+    pthread_t threads[NTHREADS];
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    for (int i = 0; i < NCREATE; ++i) {
+        snprintf(buf, sizeof(buf), "protocol=ab_eip&elem_size=4&elem_count=1&name=Lookup_%d", i);
+        if ((ids[i] = plc_tag_create(buf, 1000)) < 0) {
+            errx(1, "plc_tag_create returned %d", ids[i]);
+        }
+    }
+
+    for (int i = 0; i < NTHREADS; ++i) {
+        if (pthread_create(&threads[i], NULL, reader, NULL)) {
+            err(1, "pthread_create");
+        }
+    }
+    for (int i = 0; i < NTHREADS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    /* A removed tag must no longer be found. */
+    if (plc_tag_destroy(ids[NCREATE / 2]) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_destroy(%d) failed", ids[NCREATE / 2]);
+    }
+    if (tag_tree_lookup(ids[NCREATE / 2]) != NULL) {
+        errx(1, "Tag %d still visible after destroy", ids[NCREATE / 2]);
+    }
+    if (plc_tag_destroy(ids[NCREATE / 2]) != PLCTAG_ERR_NOT_FOUND) {
+        errx(1, "Double destroy of %d did not fail", ids[NCREATE / 2]);
+    }
+
+    if (tag_tree_lookup(-1) != NULL || tag_tree_lookup(INT32_MAX) != NULL) {
+        errx(1, "Out-of-range lookup returned a tag");
+    }
+
+    return 0;
+}
@@ -0,0 +1,56 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+#include "tagtree.h"
+
+#define NTHREADS 16
+
+static pthread_barrier_t barrier;
+
+/* Every thread races to be the first user of the library; all of them
+ * must see the fully seeded set of dummy tags. */
+static void*
+racer(void* arg)
+{
+    (void)(arg);
+
+    pthread_barrier_wait(&barrier);
+
+    for (int i = 0; i < NTAGS; ++i) {
+        int32_t id = METATAG_ID + 1 + i;
+        int32_t val;
+
+        if ((val = plc_tag_get_int32(id, 0)) != i) {
+            errx(1, "Tag %d: expected %d, got %d", id, i, val);
+        }
+        if (plc_tag_get_size(id) != sizeof(uint32_t)) {
+            errx(1, "Tag %d: unexpected size %d", id, plc_tag_get_size(id));
+        }
+    }
+    return NULL;
+}
+
+int
+main(int argc, char** argv)
+{
+    pthread_t threads[NTHREADS];
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    pthread_barrier_init(&barrier, NULL, NTHREADS);
+    for (int i = 0; i < NTHREADS; ++i) {
+        if (pthread_create(&threads[i], NULL, racer, NULL)) {
+            err(1, "pthread_create");
+        }
+    }
+    for (int i = 0; i < NTHREADS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    return 0;
+}
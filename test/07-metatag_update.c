@@ -0,0 +1,83 @@
+#include <err.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+#include "tagtree.h"
+
+#define NCREATE 100
+
+/* Walks the @tags metatag, returning how many records it holds.  If
+ * want_id is listed, *found is set. */
+static int
+walk_metatag(int32_t want_id, int* found)
+{
+    int size, offset, n = 0;
+
+    *found = 0;
+    size = plc_tag_get_size(METATAG_ID);
+    for (offset = 0; offset < size; ++n) {
+        int32_t id = plc_tag_get_int32(METATAG_ID, offset);
+        uint16_t len = plc_tag_get_uint16(METATAG_ID, offset + offsetof(struct metatag_t, length));
+
+        if (id <= 0) {
+            errx(1, "Bogus tag id %d at metatag offset %d", id, offset);
+        }
+        if (id == want_id) {
+            *found = 1;
+        }
+        offset += sizeof(struct metatag_t) + len;
+    }
+    if (offset != size) {
+        errx(1, "Metatag records overran its size (%d > %d)", offset, size);
+    }
+
+    return n;
+}
+
+int
+main(int argc, char** argv)
+{
+    char buf[128];
+    int32_t ids[NCREATE];
+    int n, found;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    if ((n = walk_metatag(0, &found)) != NTAGS) {
+        errx(1, "Expected %d dummy tags in the metatag, got %d", NTAGS, n);
+    }
+
+    for (int i = 0; i < NCREATE; ++i) {
+        snprintf(buf, sizeof(buf), "protocol=ab_eip&elem_size=4&elem_count=%d&name=Meta_%d", i + 1, i);
+        if ((ids[i] = plc_tag_create(buf, 1000)) < 0) {
+            errx(1, "plc_tag_create returned %d", ids[i]);
+        }
+        if (walk_metatag(ids[i], &found) != NTAGS + i + 1 || !found) {
+            errx(1, "Tag %d missing from the metatag", ids[i]);
+        }
+    }
+
+    /* Remove every other tag; the survivors must all still be listed. */
+    for (int i = 0; i < NCREATE; i += 2) {
+        if (plc_tag_destroy(ids[i]) != PLCTAG_STATUS_OK) {
+            errx(1, "plc_tag_destroy(%d) failed", ids[i]);
+        }
+    }
+    for (int i = 0; i < NCREATE; ++i) {
+        walk_metatag(ids[i], &found);
+        if (found != (i % 2)) {
+            errx(1, "Tag %d: expected listed=%d, got %d", ids[i], i % 2, found);
+        }
+    }
+
+    /* Creating "@tags" hands back the live metatag. */
+    if (plc_tag_create("protocol=ab_eip&name=@tags", 1000) != METATAG_ID) {
+        errx(1, "plc_tag_create(@tags) did not return the metatag");
+    }
+
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+#include "tagtree.h"
+
+#define NCREATE 1000
+
+static int32_t
+create(const char* name, int elem_size, int elem_count)
+{
+    char buf[256];
+    int32_t id;
+
+    snprintf(buf, sizeof(buf), "protocol=ab_eip&elem_size=%d&elem_count=%d&name=%s", elem_size, elem_count, name);
+    if ((id = plc_tag_create(buf, 1000)) < 0) {
+        errx(1, "plc_tag_create(%s) returned %d", buf, id);
+    }
+    return id;
+}
+
+int
+main(int argc, char** argv)
+{
+    int32_t ids[NCREATE];
+    char name[64];
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    /* A spread of sizes, including some too big for any size class. */
+    for (int i = 0; i < NCREATE; ++i) {
+        int count = (i % 10 == 9) ? 20000 : i + 1;
+
+        snprintf(name, sizeof(name), "Arena_%d", i);
+        ids[i] = create(name, 4, count);
+        if (plc_tag_get_size(ids[i]) != 4 * count) {
+            errx(1, "Tag %d: expected size %d, got %d", ids[i], 4 * count, plc_tag_get_size(ids[i]));
+        }
+        plc_tag_set_int32(ids[i], 0, i);
+        plc_tag_set_int32(ids[i], 4 * (count - 1), -i);
+    }
+
+    for (int i = 0; i < NCREATE; ++i) {
+        int count = (i % 10 == 9) ? 20000 : i + 1;
+        struct tag_tree_node* t = tag_tree_lookup(ids[i]);
+
+        snprintf(name, sizeof(name), "Arena_%d", i);
+        if (strcmp(t->name, name) != 0) {
+            errx(1, "Tag %d: expected name %s, got %s", ids[i], name, t->name);
+        }
+        if (plc_tag_get_int32(ids[i], 0) != i || plc_tag_get_int32(ids[i], 4 * (count - 1)) != -i) {
+            errx(1, "Tag %d: payload was clobbered", ids[i]);
+        }
+    }
+
+    /* Recycled storage must come back zeroed. */
+    for (int i = 0; i < NCREATE; ++i) {
+        plc_tag_destroy(ids[i]);
+    }
+    for (int i = 0; i < NCREATE; ++i) {
+        int count = (i % 10 == 9) ? 20000 : i + 1;
+
+        snprintf(name, sizeof(name), "Arena_%d", i);
+        ids[i] = create(name, 4, count);
+        if (plc_tag_get_int32(ids[i], 0) != 0) {
+            errx(1, "Tag %d: recycled payload not zeroed", ids[i]);
+        }
+    }
+
+    plc_tag_shutdown();
+
+    return 0;
+}
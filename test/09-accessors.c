@@ -0,0 +1,85 @@
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+
+static int nevents[PLCTAG_EVENT_DESTROYED + 1];
+
+void
+callback(int32_t tag_id, int event, int status)
+{
+    nevents[event]++;
+}
+
+#define CHECK_ROUNDTRIP(name, type, offset, val)                                    \
+    do {                                                                            \
+        type got;                                                                   \
+        if (plc_tag_set_##name(tag, (offset), (val)) != PLCTAG_STATUS_OK) {         \
+            errx(1, "plc_tag_set_" #name " at offset %d failed", (offset));        \
+        }                                                                           \
+        if ((got = plc_tag_get_##name(tag, (offset))) != (val)) {                   \
+            errx(1, "plc_tag_get_" #name " at offset %d: value mismatch", (offset)); \
+        }                                                                           \
+    } while (0)
+
+int
+main(int argc, char** argv)
+{
+    int32_t tag;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    tag = plc_tag_create("protocol=ab_eip&elem_size=8&elem_count=2&name=Accessors", 1000);
+    if (tag < 0) {
+        errx(1, "plc_tag_create returned %d", tag);
+    }
+
+    CHECK_ROUNDTRIP(uint64, uint64_t, 8, 0xdeadbeefcafef00dULL);
+    CHECK_ROUNDTRIP(int64, int64_t, 0, -1234567890123LL);
+    CHECK_ROUNDTRIP(uint32, uint32_t, 12, 0xfeedfaceU);
+    CHECK_ROUNDTRIP(int32, int32_t, 4, -42);
+    CHECK_ROUNDTRIP(uint16, uint16_t, 14, 0xbeef);
+    CHECK_ROUNDTRIP(int16, int16_t, 2, -3);
+    CHECK_ROUNDTRIP(uint8, uint8_t, 15, 0xa5);
+    CHECK_ROUNDTRIP(int8, int8_t, 1, -7);
+    CHECK_ROUNDTRIP(float64, double, 8, 3.25);
+    CHECK_ROUNDTRIP(float32, float, 0, -0.5f);
+
+    /* Accesses that straddle the end of the payload must be refused. */
+    if (plc_tag_set_int32(tag, 14, 1) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "Straddling write at offset 14 was accepted");
+    }
+    if (plc_tag_get_int64(tag, 12) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "Straddling read at offset 12 was accepted");
+    }
+    if (plc_tag_get_int8(tag, -1) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "Read at negative offset was accepted");
+    }
+    if (plc_tag_get_int32(tag + 1000, 0) != PLCTAG_ERR_NOT_FOUND) {
+        errx(1, "Read of an unknown tag was accepted");
+    }
+
+    /* With a callback registered, accesses deliver events. */
+    plc_tag_register_callback(tag, callback);
+    CHECK_ROUNDTRIP(int32, int32_t, 0, 99);
+    plc_tag_get_int32(tag, 16);
+    plc_tag_unregister_callback(tag);
+
+    plcstub_flush_events();
+    if (nevents[PLCTAG_EVENT_WRITE_STARTED] != 1 || nevents[PLCTAG_EVENT_WRITE_COMPLETED] != 1) {
+        errx(1, "Expected one write event pair, got %d/%d",
+            nevents[PLCTAG_EVENT_WRITE_STARTED], nevents[PLCTAG_EVENT_WRITE_COMPLETED]);
+    }
+    plcstub_flush_events();
+    if (nevents[PLCTAG_EVENT_READ_STARTED] != 2 || nevents[PLCTAG_EVENT_READ_COMPLETED] != 1
+        || nevents[PLCTAG_EVENT_ABORTED] != 1) {
+        errx(1, "Expected two reads, one aborted; got %d/%d/%d",
+            nevents[PLCTAG_EVENT_READ_STARTED], nevents[PLCTAG_EVENT_READ_COMPLETED],
+            nevents[PLCTAG_EVENT_ABORTED]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+
+#define NELEMS 1000
+
+static int nevents[PLCTAG_EVENT_DESTROYED + 1];
+
+void
+callback(int32_t tag_id, int event, int status)
+{
+    nevents[event]++;
+}
+
+int
+main(int argc, char** argv)
+{
+    int32_t in[NELEMS], out[NELEMS];
+    int32_t a, b;
+    struct plc_tag_access acc[2 * NELEMS];
+    int16_t vals16[NELEMS];
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    a = plc_tag_create("protocol=ab_eip&elem_size=4&elem_count=1000&name=BulkA", 1000);
+    b = plc_tag_create("protocol=ab_eip&elem_size=2&elem_count=1000&name=BulkB", 1000);
+    if (a < 0 || b < 0) {
+        errx(1, "plc_tag_create returned %d/%d", a, b);
+    }
+
+    /* Raw range access. */
+    for (int i = 0; i < NELEMS; ++i) {
+        in[i] = i * 3 - 500;
+    }
+    if (plc_tag_set_raw(a, 0, in, sizeof(in)) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_set_raw failed");
+    }
+    if (plc_tag_get_int32(a, 4 * 10) != in[10]) {
+        errx(1, "plc_tag_set_raw didn't land where expected");
+    }
+    memset(out, 0, sizeof(out));
+    if (plc_tag_get_raw(a, 0, out, sizeof(out)) != PLCTAG_STATUS_OK || memcmp(in, out, sizeof(in)) != 0) {
+        errx(1, "plc_tag_get_raw didn't round-trip");
+    }
+    if (plc_tag_get_raw(a, 4, out, sizeof(out)) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "Out-of-bounds plc_tag_get_raw was accepted");
+    }
+
+    /* Scatter/gather across two interleaved tags. */
+    plc_tag_register_callback(a, callback);
+    for (int i = 0; i < NELEMS; ++i) {
+        vals16[i] = -i;
+        acc[2 * i] = (struct plc_tag_access) { .tag_id = b, .offset = 2 * i, .type = TAG_INT, .buf = &vals16[i] };
+        acc[2 * i + 1] = (struct plc_tag_access) { .tag_id = a, .offset = 4 * i, .type = TAG_DINT, .buf = &in[i] };
+    }
+    if (plc_tag_set_multi(acc, 2 * NELEMS) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_set_multi failed");
+    }
+    if (plc_tag_get_int16(b, 2 * 7) != -7) {
+        errx(1, "plc_tag_set_multi didn't land where expected");
+    }
+
+    memset(out, 0, sizeof(out));
+    memset(vals16, 0, sizeof(vals16));
+    for (int i = 0; i < NELEMS; ++i) {
+        acc[2 * i].buf = &vals16[i];
+        acc[2 * i + 1].buf = &out[i];
+    }
+    if (plc_tag_get_multi(acc, 2 * NELEMS) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_get_multi failed");
+    }
+    for (int i = 0; i < NELEMS; ++i) {
+        if (out[i] != in[i] || vals16[i] != -i) {
+            errx(1, "plc_tag_get_multi element %d mismatch", i);
+        }
+    }
+
+    /* One transaction per tag, not per element. */
+    plcstub_flush_events();
+    if (nevents[PLCTAG_EVENT_WRITE_STARTED] != 1 || nevents[PLCTAG_EVENT_READ_COMPLETED] != 1) {
+        errx(1, "Expected one event pair per tag, got %d writes, %d reads",
+            nevents[PLCTAG_EVENT_WRITE_STARTED], nevents[PLCTAG_EVENT_READ_COMPLETED]);
+    }
+
+    /* Bad descriptors fail individually. */
+    acc[0] = (struct plc_tag_access) { .tag_id = a, .offset = 4 * NELEMS, .type = TAG_DINT, .buf = &out[0] };
+    acc[1] = (struct plc_tag_access) { .tag_id = a + 1000, .offset = 0, .type = TAG_DINT, .buf = &out[1] };
+    acc[2] = (struct plc_tag_access) { .tag_id = b, .offset = 0, .type = TAG_INT, .buf = &vals16[0] };
+    if (plc_tag_get_multi(acc, 3) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "plc_tag_get_multi should have reported the first failure");
+    }
+    if (acc[1].status != PLCTAG_ERR_NOT_FOUND || acc[2].status != PLCTAG_STATUS_OK) {
+        errx(1, "Unexpected per-access statuses %d/%d", acc[1].status, acc[2].status);
+    }
+
+    return 0;
+}
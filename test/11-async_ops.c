@@ -0,0 +1,108 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+
+#define NPIPELINE 200
+
+static int nevents[PLCTAG_EVENT_DESTROYED + 1];
+static pthread_t main_thread;
+static int completed_off_main;
+
+void
+callback(int32_t tag_id, int event, int status)
+{
+    __atomic_add_fetch(&nevents[event], 1, __ATOMIC_SEQ_CST);
+    if ((event == PLCTAG_EVENT_READ_COMPLETED || event == PLCTAG_EVENT_WRITE_COMPLETED)
+        && !pthread_equal(pthread_self(), main_thread)) {
+        __atomic_add_fetch(&completed_off_main, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void
+wait_status(int32_t tag, int want)
+{
+    int status;
+
+    for (int i = 0; (status = plc_tag_status(tag)) == PLCTAG_STATUS_PENDING && i < 5000; ++i) {
+        usleep(1000);
+    }
+    if (status != want) {
+        errx(1, "Tag %d: expected status %d, got %d", tag, want, status);
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+    int32_t tags[NPIPELINE];
+    char buf[128];
+    int ret;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+    main_thread = pthread_self();
+
+    for (int i = 0; i < NPIPELINE; ++i) {
+        snprintf(buf, sizeof(buf), "protocol=ab_eip&elem_size=4&elem_count=1&name=Async_%d", i);
+        if ((tags[i] = plc_tag_create(buf, 1000)) < 0) {
+            errx(1, "plc_tag_create returned %d", tags[i]);
+        }
+        plc_tag_register_callback(tags[i], callback);
+    }
+
+    /* Blocking reads and writes complete before returning. */
+    if ((ret = plc_tag_read(tags[0], 1000)) != PLCTAG_STATUS_OK) {
+        errx(1, "Blocking plc_tag_read returned %d", ret);
+    }
+    if ((ret = plc_tag_write(tags[0], 1000)) != PLCTAG_STATUS_OK) {
+        errx(1, "Blocking plc_tag_write returned %d", ret);
+    }
+
+    /* Pipeline a read of every tag, then poll them all to completion. */
+    for (int i = 0; i < NPIPELINE; ++i) {
+        if ((ret = plc_tag_read(tags[i], 0)) != PLCTAG_STATUS_PENDING) {
+            errx(1, "Non-blocking plc_tag_read returned %d", ret);
+        }
+    }
+    for (int i = 0; i < NPIPELINE; ++i) {
+        wait_status(tags[i], PLCTAG_STATUS_OK);
+    }
+
+    plcstub_flush_events();
+    if (__atomic_load_n(&nevents[PLCTAG_EVENT_READ_STARTED], __ATOMIC_SEQ_CST) != NPIPELINE + 1
+        || __atomic_load_n(&nevents[PLCTAG_EVENT_READ_COMPLETED], __ATOMIC_SEQ_CST) != NPIPELINE + 1) {
+        errx(1, "Expected %d read event pairs, got %d/%d", NPIPELINE + 1,
+            nevents[PLCTAG_EVENT_READ_STARTED], nevents[PLCTAG_EVENT_READ_COMPLETED]);
+    }
+    if (__atomic_load_n(&completed_off_main, __ATOMIC_SEQ_CST) != NPIPELINE + 2) {
+        errx(1, "Completions should be delivered by the workers");
+    }
+
+    /* Aborting a tag with nothing in flight is harmless. */
+    if (plc_tag_abort(tags[1]) != PLCTAG_STATUS_OK || plc_tag_status(tags[1]) != PLCTAG_STATUS_OK) {
+        errx(1, "Idle plc_tag_abort changed the tag's status");
+    }
+
+    /* Destroying tags with operations in flight must be safe. */
+    for (int i = 0; i < NPIPELINE; ++i) {
+        plc_tag_write(tags[i], 0);
+    }
+    for (int i = 0; i < NPIPELINE; ++i) {
+        if (plc_tag_destroy(tags[i]) != PLCTAG_STATUS_OK) {
+            errx(1, "plc_tag_destroy(%d) failed", tags[i]);
+        }
+    }
+
+    if (plc_tag_read(tags[0], 0) != PLCTAG_ERR_NOT_FOUND) {
+        errx(1, "Read of a destroyed tag was accepted");
+    }
+
+    plc_tag_shutdown();
+
+    return 0;
+}
@@ -0,0 +1,81 @@
+#include <err.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+
+static double
+now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static double
+timed_read(int32_t tag)
+{
+    double start = now_ms();
+    int ret;
+
+    if ((ret = plc_tag_read(tag, 5000)) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_read(%d) returned %d", tag, ret);
+    }
+    return now_ms() - start;
+}
+
+int
+main(int argc, char** argv)
+{
+    struct plcstub_conn_params slow = { .latency_us = 20000 };
+    struct plcstub_conn_params narrow = { .bytes_per_sec = 1e6, .packet_size = 500, .packet_us = 10 };
+    int32_t fast_tag, slow_tag, small_tag, big_tag;
+    double ms;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    plcstub_set_conn_params("10.0.0.1", NULL, &slow);
+    plcstub_set_conn_params("10.0.0.2", "1,0", &narrow);
+
+    fast_tag = plc_tag_create("protocol=ab_eip&elem_size=4&elem_count=1&name=Fast", 1000);
+    slow_tag = plc_tag_create("protocol=ab_eip&gateway=10.0.0.1&path=1,4&cpu=lgx&elem_size=4&elem_count=1&name=Slow", 1000);
+    small_tag = plc_tag_create("protocol=ab_eip&gateway=10.0.0.2&path=1,0&cpu=lgx&elem_size=4&elem_count=1&name=Small", 1000);
+    big_tag = plc_tag_create("protocol=ab_eip&gateway=10.0.0.2&path=1,0&cpu=lgx&elem_size=4&elem_count=25000&name=Big", 1000);
+    if (fast_tag < 0 || slow_tag < 0 || small_tag < 0 || big_tag < 0) {
+        errx(1, "plc_tag_create failed");
+    }
+
+    if ((ms = timed_read(fast_tag)) > 10) {
+        errx(1, "Read over the default connection took %.1fms", ms);
+    }
+    if ((ms = timed_read(slow_tag)) < 20) {
+        errx(1, "Read over a 20ms connection took only %.1fms", ms);
+    }
+
+    /* A 100KB read at 1MB/s costs about 100ms more than a 4-byte one. */
+    if ((ms = timed_read(small_tag)) > 10) {
+        errx(1, "Small read over the narrow connection took %.1fms", ms);
+    }
+    if ((ms = timed_read(big_tag)) < 100) {
+        errx(1, "100KB read at 1MB/s took only %.1fms", ms);
+    }
+
+    /* Timeouts shorter than the round trip expire. */
+    if (plc_tag_read(slow_tag, 5) != PLCTAG_ERR_TIMEOUT) {
+        errx(1, "Expected a 5ms read over a 20ms connection to time out");
+    }
+
+    /* Only one operation may be in flight per tag. */
+    if (plc_tag_read(slow_tag, 0) != PLCTAG_STATUS_PENDING) {
+        errx(1, "Non-blocking read did not go pending");
+    }
+    if (plc_tag_write(slow_tag, 0) != PLCTAG_ERR_BUSY) {
+        errx(1, "Overlapping write was not refused");
+    }
+
+    plc_tag_shutdown();
+
+    return 0;
+}
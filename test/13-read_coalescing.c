@@ -0,0 +1,94 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+
+#define NTHREADS 16
+
+static int32_t tag;
+static int nevents[PLCTAG_EVENT_DESTROYED + 1];
+static pthread_barrier_t barrier;
+
+void
+callback(int32_t tag_id, int event, int status)
+{
+    __atomic_add_fetch(&nevents[event], 1, __ATOMIC_SEQ_CST);
+}
+
+static void*
+reader(void* arg)
+{
+    int ret;
+
+    (void)(arg);
+
+    pthread_barrier_wait(&barrier);
+    if ((ret = plc_tag_read(tag, 2000)) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_read returned %d", ret);
+    }
+    return NULL;
+}
+
+int
+main(int argc, char** argv)
+{
+    struct plcstub_conn_params params = { .latency_us = 100000 };
+    pthread_t threads[NTHREADS];
+    struct timespec start, end;
+    double ms;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    plcstub_set_conn_params("10.0.0.9", NULL, &params);
+    tag = plc_tag_create("protocol=ab_eip&gateway=10.0.0.9&path=1,0&elem_size=4&elem_count=1&name=Shared", 1000);
+    if (tag < 0) {
+        errx(1, "plc_tag_create returned %d", tag);
+    }
+    plc_tag_register_callback(tag, callback);
+
+    /* Many concurrent readers of one tag share one transaction. */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_barrier_init(&barrier, NULL, NTHREADS);
+    for (int i = 0; i < NTHREADS; ++i) {
+        if (pthread_create(&threads[i], NULL, reader, NULL)) {
+            err(1, "pthread_create");
+        }
+    }
+    for (int i = 0; i < NTHREADS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+    plcstub_flush_events();
+    if (nevents[PLCTAG_EVENT_READ_STARTED] != 1 || nevents[PLCTAG_EVENT_READ_COMPLETED] != 1) {
+        errx(1, "Expected one coalesced read, got %d started / %d completed",
+            nevents[PLCTAG_EVENT_READ_STARTED], nevents[PLCTAG_EVENT_READ_COMPLETED]);
+    }
+    if (ms > 1000) {
+        errx(1, "Coalesced reads took %.1fms; were they serialised?", ms);
+    }
+
+    /* Non-blocking readers join too, and a write still has to wait its turn. */
+    if (plc_tag_read(tag, 0) != PLCTAG_STATUS_PENDING || plc_tag_read(tag, 0) != PLCTAG_STATUS_PENDING) {
+        errx(1, "Non-blocking reads did not both go pending");
+    }
+    if (plc_tag_write(tag, 0) != PLCTAG_ERR_BUSY) {
+        errx(1, "Write overlapping a read was not refused");
+    }
+    if (plc_tag_read(tag, 2000) != PLCTAG_STATUS_OK) {
+        errx(1, "Blocking read joining a pending one failed");
+    }
+    plcstub_flush_events();
+    if (nevents[PLCTAG_EVENT_READ_STARTED] != 2) {
+        errx(1, "Expected the second batch of reads to coalesce too");
+    }
+
+    plc_tag_shutdown();
+
+    return 0;
+}
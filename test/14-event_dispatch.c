@@ -0,0 +1,106 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+
+#define NWRITES 1000
+
+static int32_t tag;
+static pthread_t main_thread;
+static int nevents;
+static int on_main;
+static int in_order = 1;
+static int reenter = 1;
+static int last_event = -1;
+static int nbatches;
+static int nbatched;
+static int biggest_batch;
+
+void
+callback(int32_t tag_id, int event, int status)
+{
+    __atomic_add_fetch(&nevents, 1, __ATOMIC_SEQ_CST);
+    if (pthread_equal(pthread_self(), main_thread)) {
+        __atomic_add_fetch(&on_main, 1, __ATOMIC_SEQ_CST);
+    }
+
+    /* Each write is a STARTED then a COMPLETED, and must arrive that way. */
+    if (reenter && (event == PLCTAG_EVENT_WRITE_STARTED) == (last_event == PLCTAG_EVENT_WRITE_STARTED)) {
+        in_order = 0;
+    }
+    last_event = event;
+
+    /* Would deadlock if callbacks ran with the tag locked. */
+    if (reenter) {
+        plc_tag_get_size(tag_id);
+    }
+}
+
+void
+batch_callback(const struct plcstub_event* events, int count)
+{
+    ++nbatches;
+    nbatched += count;
+    if (count > biggest_batch) {
+        biggest_batch = count;
+    }
+    for (int i = 0; i < count; ++i) {
+        if (events[i].tag_id != tag) {
+            errx(1, "Batched event for unexpected tag %d", events[i].tag_id);
+        }
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+    main_thread = pthread_self();
+
+    tag = plc_tag_create("protocol=ab_eip&elem_size=4&elem_count=1&name=Events", 1000);
+    if (tag < 0) {
+        errx(1, "plc_tag_create returned %d", tag);
+    }
+    plc_tag_register_callback(tag, callback);
+
+    /* Deferred: events arrive in order, on the dispatcher thread. */
+    for (int i = 0; i < NWRITES; ++i) {
+        plc_tag_set_int32(tag, 0, i);
+    }
+    plcstub_flush_events();
+    if (nevents != 2 * NWRITES || on_main != 0 || !in_order) {
+        errx(1, "Deferred delivery: %d events, %d on the main thread, in order %d",
+            nevents, on_main, in_order);
+    }
+
+    /* Batched delivery replaces the per-tag callback. */
+    if (plcstub_set_event_batch_callback(batch_callback, 0) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "Batch size of 0 accepted");
+    }
+    plcstub_set_event_batch_callback(batch_callback, 16);
+    for (int i = 0; i < NWRITES; ++i) {
+        plc_tag_set_int32(tag, 0, i);
+    }
+    plcstub_flush_events();
+    if (nbatched != 2 * NWRITES || biggest_batch > 16 || nevents != 2 * NWRITES) {
+        errx(1, "Batched delivery: %d events in %d batches (biggest %d), %d unbatched",
+            nbatched, nbatches, biggest_batch, nevents - 2 * NWRITES);
+    }
+    plcstub_set_event_batch_callback(NULL, 0);
+
+    /* Inline: events arrive before the call returns, on the calling thread. */
+    if (plcstub_set_event_mode(PLCSTUB_EVENTS_INLINE) != PLCTAG_STATUS_OK) {
+        errx(1, "plcstub_set_event_mode failed");
+    }
+    nevents = on_main = reenter = 0;
+    plc_tag_get_int16(tag, 0);
+    if (nevents != 2 || on_main != 2) {
+        errx(1, "Inline delivery: %d events, %d on the main thread", nevents, on_main);
+    }
+
+    plc_tag_shutdown();
+    return 0;
+}
@@ -0,0 +1,118 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+
+#define NREADERS 4
+#define NUPDATES 20000
+
+static int32_t tag;
+static int done;
+
+/* Keeps both halves of the tag equal, a plc_tag_lock() at a time. */
+static void*
+writer(void* arg)
+{
+    (void)(arg);
+
+    for (int i = 0; i < NUPDATES; ++i) {
+        plc_tag_lock(tag);
+        plc_tag_set_int32(tag, 0, i);
+        plc_tag_set_int32(tag, 4, i);
+        plc_tag_unlock(tag);
+    }
+    __atomic_store_n(&done, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+static void*
+reader(void* arg)
+{
+    int locked = (arg != NULL);
+    int32_t lo, hi;
+    int64_t both;
+
+    while (!__atomic_load_n(&done, __ATOMIC_SEQ_CST)) {
+        if (locked) {
+            plc_tag_lock(tag);
+            lo = plc_tag_get_int32(tag, 0);
+            hi = plc_tag_get_int32(tag, 4);
+            plc_tag_unlock(tag);
+        } else {
+            /* A lone lock-free read never sees half of a locked batch. */
+            both = plc_tag_get_int64(tag, 0);
+            lo = (int32_t)(both);
+            hi = (int32_t)(both >> 32);
+        }
+        if (lo != hi) {
+            errx(1, "Torn %s read: %d != %d", locked ? "locked" : "lock-free", lo, hi);
+        }
+    }
+    return NULL;
+}
+
+static void*
+unlock_other(void* arg)
+{
+    return (void*)(intptr_t)(plc_tag_unlock(tag));
+}
+
+int
+main(int argc, char** argv)
+{
+    pthread_t w, r[NREADERS], o;
+    void* ret;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    tag = plc_tag_create("protocol=ab_eip&elem_size=4&elem_count=2&name=Locked", 1000);
+    if (tag < 0) {
+        errx(1, "plc_tag_create returned %d", tag);
+    }
+
+    /* Recursive, owned by the locking thread, and balanced. */
+    if (plc_tag_unlock(tag) != PLCTAG_ERR_NOT_ALLOWED) {
+        errx(1, "Unlocking an unlocked tag succeeded");
+    }
+    if (plc_tag_lock(tag) != PLCTAG_STATUS_OK || plc_tag_lock(tag) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_lock failed");
+    }
+    plc_tag_set_int32(tag, 0, 7);
+    pthread_create(&o, NULL, unlock_other, NULL);
+    pthread_join(o, &ret);
+    if ((intptr_t)(ret) != PLCTAG_ERR_NOT_ALLOWED) {
+        errx(1, "Another thread unlocked the tag");
+    }
+    if (plc_tag_unlock(tag) != PLCTAG_STATUS_OK || plc_tag_unlock(tag) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_unlock failed");
+    }
+    if (plc_tag_unlock(tag) != PLCTAG_ERR_NOT_ALLOWED) {
+        errx(1, "Unbalanced plc_tag_unlock succeeded");
+    }
+    if (plc_tag_get_int32(tag, 0) != 7) {
+        errx(1, "Write under lock lost");
+    }
+    plc_tag_set_int32(tag, 0, 0);
+    if (plc_tag_lock(-1) != PLCTAG_ERR_NOT_FOUND) {
+        errx(1, "Locked a nonexistent tag");
+    }
+
+    pthread_create(&w, NULL, writer, NULL);
+    for (intptr_t i = 0; i < NREADERS; ++i) {
+        pthread_create(&r[i], NULL, reader, (void*)(i % 2));
+    }
+    pthread_join(w, NULL);
+    for (int i = 0; i < NREADERS; ++i) {
+        pthread_join(r[i], NULL);
+    }
+
+    if (plc_tag_get_int32(tag, 0) != NUPDATES - 1 || plc_tag_get_int32(tag, 4) != NUPDATES - 1) {
+        errx(1, "Final value %d/%d, expected %d",
+            plc_tag_get_int32(tag, 0), plc_tag_get_int32(tag, 4), NUPDATES - 1);
+    }
+
+    return 0;
+}
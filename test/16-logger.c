@@ -0,0 +1,93 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+
+#define NTHREADS 4
+#define NMESSAGES 5000
+
+static pthread_t main_thread;
+static int nmessages;
+static int off_main = 1;
+static int bad;
+static char first[256];
+
+void
+logger(int32_t tag_id, int level, const char* message)
+{
+    if (pthread_equal(pthread_self(), main_thread)) {
+        off_main = 0;
+    }
+    if (nmessages++ == 0) {
+        snprintf(first, sizeof(first), "%s", message);
+    }
+    if (strstr(message, "Thread ") && !strstr(message, " says hello")) {
+        bad = 1;
+    }
+}
+
+static void*
+chatter(void* arg)
+{
+    for (int i = 0; i < NMESSAGES; ++i) {
+        pdebug(PLCTAG_DEBUG_INFO, "Thread %d, message %d, says hello", (int)(intptr_t)(arg), i);
+    }
+    return NULL;
+}
+
+int
+main(int argc, char** argv)
+{
+    pthread_t threads[NTHREADS];
+    char transient[32];
+    const char* want;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_INFO);
+    main_thread = pthread_self();
+
+    if (plc_tag_register_logger(logger) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_register_logger failed");
+    }
+    if (plc_tag_register_logger(logger) != PLCTAG_ERR_DUPLICATE) {
+        errx(1, "Second logger registered");
+    }
+
+    /* Arguments are captured when logged but formatted later: strings have
+     * to be copied. */
+    snprintf(transient, sizeof(transient), "before");
+    pdebug(PLCTAG_DEBUG_INFO, "%s|%5.2f|%*d|%-3s|%zu|%lld|%x|%c|%%", transient, 3.14159,
+        4, 7, "ab", (size_t)(42), -5LL, 255u, 'z');
+    snprintf(transient, sizeof(transient), "after");
+    plcstub_flush_log();
+
+    want = "before| 3.14|   7|ab |42|-5|ff|z|%";
+    if (nmessages != 1 || !strstr(first, want)) {
+        errx(1, "Expected one message ending in \"%s\", got %d: \"%s\"", want, nmessages, first);
+    }
+
+    for (intptr_t i = 0; i < NTHREADS; ++i) {
+        pthread_create(&threads[i], NULL, chatter, (void*)(i));
+    }
+    for (int i = 0; i < NTHREADS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    plcstub_flush_log();
+
+    if (nmessages != 1 + NTHREADS * NMESSAGES || !off_main || bad) {
+        errx(1, "Got %d messages (expected %d), off the main thread %d, mangled %d",
+            nmessages, 1 + NTHREADS * NMESSAGES, off_main, bad);
+    }
+
+    if (plc_tag_unregister_logger() != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_unregister_logger failed");
+    }
+    if (plc_tag_unregister_logger() != PLCTAG_ERR_NOT_FOUND) {
+        errx(1, "Second plc_tag_unregister_logger succeeded");
+    }
+
+    return 0;
+}
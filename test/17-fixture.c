@@ -0,0 +1,127 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+
+#define NSTARTUP 20000
+
+static void
+write_file(const char* path, const char* contents)
+{
+    FILE* f = fopen(path, "w");
+
+    if (f == NULL || fputs(contents, f) < 0 || fclose(f) != 0) {
+        err(1, "%s", path);
+    }
+}
+
+/* Checks the tags made from the fixture below, starting at first. */
+static void
+check(int32_t first, const char* what)
+{
+    if (first < 0) {
+        errx(1, "%s: load failed with %d", what, first);
+    }
+    if (plc_tag_get_size(first) != 4 || plc_tag_get_float32(first, 0) != 12.5f) {
+        errx(1, "%s: Speed is %d bytes, %f", what, plc_tag_get_size(first), plc_tag_get_float32(first, 0));
+    }
+    if (plc_tag_get_size(first + 1) != 16 || plc_tag_get_int32(first + 1, 0) != 1
+        || plc_tag_get_int32(first + 1, 8) != -3 || plc_tag_get_int32(first + 1, 12) != 0) {
+        errx(1, "%s: bad Counts", what);
+    }
+    if (plc_tag_get_size(first + 2) != 12 || plc_tag_get_int16(first + 2, 10) != 0) {
+        errx(1, "%s: bad Matrix", what);
+    }
+    if (plc_tag_get_size(first + 3) != 32 || plc_tag_get_uint8(first + 3, 31) != 0) {
+        errx(1, "%s: bad Raw", what);
+    }
+    if (plc_tag_get_uint8(first + 4, 0) != 1 || plc_tag_get_float64(first + 5, 0) != -0.25) {
+        errx(1, "%s: bad Flag or Big", what);
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+    const char* csv = "/tmp/plcstub_test_fixture.csv";
+    const char* bin = "/tmp/plcstub_test_fixture.bin";
+    const char* startup = "/tmp/plcstub_test_startup.csv";
+    FILE* f;
+    int32_t first;
+
+    /* A big fixture picked up from the environment at startup, in place of
+     * the dummy tags. */
+    if ((f = fopen(startup, "w")) == NULL) {
+        err(1, "%s", startup);
+    }
+    for (int i = 0; i < NSTARTUP; ++i) {
+        fprintf(f, "Program:Main.Tag_%d,DINT,%d\n", i, i);
+    }
+    fclose(f);
+    setenv("PLCSTUB_FIXTURE", startup, 1);
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    for (int i = 0; i < NSTARTUP; ++i) {
+        if (plc_tag_get_int32(2 + i, 0) != i) {
+            errx(1, "Startup tag %d is %d, expected %d", 2 + i, plc_tag_get_int32(2 + i, 0), i);
+        }
+    }
+    if (plc_tag_get_size(2 + NSTARTUP) != PLCTAG_ERR_NOT_FOUND) {
+        errx(1, "More tags than the startup fixture has");
+    }
+
+    write_file(csv,
+        "# name,type,values...\n"
+        "Program:Main.Speed,REAL,12.5\n"
+        "\n"
+        "Line1_Counts, DINT[4], 1, 0x02, -3\n"
+        "Matrix,INT[2,3]\r\n"
+        "Raw_Block,16[2]\n"
+        "Flag,bool,true\n"
+        "Big,LREAL,-0.25\n");
+    check(plcstub_load_fixture(csv), "text");
+
+    /* The binary form loads the same, and is used in place: writes go to
+     * the tag, not the file. */
+    if (plcstub_compile_fixture(csv, bin) != PLCTAG_STATUS_OK) {
+        errx(1, "plcstub_compile_fixture failed");
+    }
+    first = plcstub_load_fixture(bin);
+    check(first, "binary");
+    plc_tag_set_float32(first, 0, 99.0f);
+    if (plc_tag_get_float32(first, 0) != 99.0f) {
+        errx(1, "Write to a binary fixture tag lost");
+    }
+    check(plcstub_load_fixture(bin), "binary reload");
+    if (plc_tag_destroy(first) != PLCTAG_STATUS_OK) {
+        errx(1, "Destroying a binary fixture tag failed");
+    }
+
+    /* Bad fixtures create nothing. */
+    write_file(csv, "Good,DINT,1\nBad,DINT[2],1,2,3\n");
+    if (plcstub_load_fixture(csv) != PLCTAG_ERR_BAD_DATA) {
+        errx(1, "Fixture with too many values loaded");
+    }
+    write_file(csv, "Bad,NOSUCHTYPE\n");
+    if (plcstub_load_fixture(csv) != PLCTAG_ERR_BAD_DATA) {
+        errx(1, "Fixture with a bad type loaded");
+    }
+    write_file(bin, "PLCSTUBF garbage");
+    if (plcstub_load_fixture(bin) != PLCTAG_ERR_BAD_DATA) {
+        errx(1, "Truncated binary fixture loaded");
+    }
+    if (plcstub_load_fixture("/nonexistent/fixture") != PLCTAG_ERR_OPEN) {
+        errx(1, "Missing fixture loaded");
+    }
+
+    remove(csv);
+    remove(bin);
+    remove(startup);
+    plc_tag_shutdown();
+    return 0;
+}
@@ -0,0 +1,113 @@
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "attr.h"
+#include "conn.h"
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+#include "tagtree.h"
+
+static void
+expect_create_fails(const char* attrib)
+{
+    int ret = plc_tag_create(attrib, 1000);
+
+    if (ret != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "plc_tag_create(\"%s\") returned %d", attrib, ret);
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+    struct tag_attrs attrs;
+    struct tag_tree_node *t, *u;
+    char buf[256];
+    int32_t id, id2;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    /* The input is only read, and the spans point into it. */
+    const char* attrib = "protocol&gateway=10.206.1.40&&path=1,4&cpu=lgx&elem_count=3&name=Foo[2]&debug=4";
+    strcpy(buf, attrib);
+    if (attr_parse(buf, &attrs) != PLCTAG_STATUS_OK) {
+        errx(1, "attr_parse(\"%s\") failed", attrib);
+    }
+    if (strcmp(buf, attrib) != 0) {
+        errx(1, "attr_parse modified its input");
+    }
+    if (!attr_span_eq(&attrs.name, "Foo[2]") || attrs.name.p < buf || attrs.name.p >= buf + sizeof(buf)) {
+        errx(1, "Wrong name %.*s", (int)(attrs.name.len), attrs.name.p);
+    }
+    if (!attr_span_eq(&attrs.gateway, "10.206.1.40") || !attr_span_eq(&attrs.path, "1,4")
+        || !attr_span_eq(&attrs.cpu, "lgx")) {
+        errx(1, "Wrong gateway, path or cpu");
+    }
+    if (attrs.protocol.p != NULL || attrs.elem_type.p != NULL) {
+        errx(1, "Picked up attributes that weren't given");
+    }
+    if (attrs.elem_size != 2 || attrs.elem_count != 3 || attrs.type != -1) {
+        errx(1, "Wrong elem_size %zu, elem_count %zu or type %d", attrs.elem_size, attrs.elem_count, attrs.type);
+    }
+
+    /* elem_type gives the size, unless elem_size says otherwise. */
+    if (attr_parse("name=A&elem_type=lreal", &attrs) != PLCTAG_STATUS_OK
+        || attrs.type != TAG_LREAL || attrs.elem_size != 8) {
+        errx(1, "elem_type=lreal not parsed");
+    }
+    if (attr_parse("elem_size=3&name=A&elem_type=DINT", &attrs) != PLCTAG_STATUS_OK
+        || attrs.type != TAG_DINT || attrs.elem_size != 3) {
+        errx(1, "elem_size did not override elem_type");
+    }
+
+    /* The last of a repeated attribute wins. */
+    if (attr_parse("name=A&name=B&elem_size=1&elem_size=16", &attrs) != PLCTAG_STATUS_OK
+        || !attr_span_eq(&attrs.name, "B") || attrs.elem_size != 16) {
+        errx(1, "Repeated attributes not handled");
+    }
+
+    expect_create_fails("protocol=ab_eip&elem_size=4");
+    expect_create_fails("protocol=ab_eip&name=");
+    expect_create_fails("protocol=ab_eip&name=X&debug");
+    expect_create_fails("protocol=ab_eip&name=X&elem_size=4x");
+    expect_create_fails("protocol=ab_eip&name=X&elem_size=");
+    expect_create_fails("protocol=ab_eip&name=X&elem_count=-1");
+    expect_create_fails("protocol=ab_eip&name=X&elem_count=99999999999999999999999");
+    expect_create_fails("protocol=ab_eip&name=X&elem_type=STRING");
+
+    /* The name is copied into the tag, so the caller's copy can go. */
+    snprintf(buf, sizeof(buf), "protocol&gateway=gw1&path=1,0&elem_type=DINT&elem_count=4&name=AttrTag");
+    if ((id = plc_tag_create(buf, 1000)) < 0) {
+        errx(1, "plc_tag_create returned %d", id);
+    }
+    memset(buf, 'x', sizeof(buf) - 1);
+    if ((t = tag_tree_lookup(id)) == NULL || strcmp(t->name, "AttrTag") != 0) {
+        errx(1, "Tag %d has the wrong name", id);
+    }
+    if (plc_tag_get_size(id) != 16) {
+        errx(1, "Tag %d has size %d", id, plc_tag_get_size(id));
+    }
+
+    /* Tags with the same gateway, path and cpu share a connection. */
+    if ((id2 = plc_tag_create("name=AttrTag2&path=1,0&gateway=gw1", 1000)) < 0) {
+        errx(1, "plc_tag_create returned %d", id2);
+    }
+    u = tag_tree_lookup(id2);
+    if (u == NULL || u->conn != t->conn || t->conn == NULL || strcmp(t->conn->gateway, "gw1") != 0) {
+        errx(1, "Tags %d and %d don't share a connection", id, id2);
+    }
+    if ((id2 = plc_tag_create("name=AttrTag3&path=1,0&gateway=gw1&cpu=lgx", 1000)) < 0) {
+        errx(1, "plc_tag_create returned %d", id2);
+    }
+    if (tag_tree_lookup(id2)->conn == t->conn) {
+        errx(1, "Tags on different cpus share a connection");
+    }
+
+    if (plc_tag_create("protocol=ab_eip&name=@tags", 1000) != METATAG_ID) {
+        errx(1, "@tags is not the metatag");
+    }
+
+    return 0;
+}
@@ -0,0 +1,119 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+#include "tagtree.h"
+
+#define NTHREADS 8
+#define NPER_THREAD 500
+
+static int32_t ids[NTHREADS][NPER_THREAD];
+
+static int32_t
+create(const char* attrib)
+{
+    int32_t id = plc_tag_create(attrib, 1000);
+
+    if (id < 0) {
+        errx(1, "plc_tag_create(%s) returned %d", attrib, id);
+    }
+    return id;
+}
+
+static void*
+creator(void* arg)
+{
+    int32_t* mine = arg;
+
+    for (int i = 0; i < NPER_THREAD; ++i) {
+        mine[i] = create("protocol=ab_eip&gateway=10.0.0.1&path=1,0&elem_size=4&elem_count=4&name=Contended");
+    }
+    return NULL;
+}
+
+int
+main(int argc, char** argv)
+{
+    pthread_t threads[NTHREADS];
+    struct tag_store* store;
+    int32_t a, b, c, d, e;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    /* Handles onto one tag have IDs of their own but share its payload. */
+    a = create("protocol=ab_eip&gateway=10.0.0.1&path=1,0&elem_size=4&elem_count=2&name=Shared");
+    b = create("protocol=ab_eip&path=1,0&name=Shared&gateway=10.0.0.1&elem_count=2&elem_size=4");
+    if (a == b) {
+        errx(1, "Two handles have the same ID %d", a);
+    }
+    if (tag_tree_lookup(a)->store != tag_tree_lookup(b)->store) {
+        errx(1, "Tags %d and %d don't share storage", a, b);
+    }
+    plc_tag_set_int32(a, 4, 1234);
+    if (plc_tag_get_int32(b, 4) != 1234) {
+        errx(1, "Write through tag %d not seen through tag %d", a, b);
+    }
+
+    /* Without a shape, a handle takes the tag's. */
+    c = create("protocol=ab_eip&gateway=10.0.0.1&path=1,0&name=Shared");
+    if (tag_tree_lookup(c)->store != tag_tree_lookup(a)->store || plc_tag_get_size(c) != 8) {
+        errx(1, "Shapeless tag %d didn't join the existing one", c);
+    }
+
+    /* A different gateway or path, or a different shape, is something else. */
+    d = create("protocol=ab_eip&gateway=10.0.0.2&path=1,0&elem_size=4&elem_count=2&name=Shared");
+    e = create("protocol=ab_eip&gateway=10.0.0.1&path=1,0&elem_size=4&elem_count=3&name=Shared");
+    if (tag_tree_lookup(d)->store == tag_tree_lookup(a)->store || plc_tag_get_int32(d, 4) != 0) {
+        errx(1, "Tag on another gateway shares storage");
+    }
+    if (tag_tree_lookup(e)->store == tag_tree_lookup(a)->store || plc_tag_get_size(e) != 12) {
+        errx(1, "Tag of another shape shares storage");
+    }
+
+    /* The storage outlives all but its last handle. */
+    plc_tag_destroy(a);
+    plc_tag_destroy(c);
+    if (plc_tag_get_int32(b, 4) != 1234) {
+        errx(1, "Payload lost with the first handle");
+    }
+    plc_tag_destroy(b);
+    b = create("protocol=ab_eip&gateway=10.0.0.1&path=1,0&elem_size=4&elem_count=2&name=Shared");
+    if (plc_tag_get_int32(b, 4) != 0) {
+        errx(1, "Recreated tag kept the old payload");
+    }
+
+    /* The stock tags are found by name too. */
+    a = create("protocol=ab_eip&name=DUMMY_AQUA_DATA_3");
+    if (plc_tag_get_size(a) != 4 || plc_tag_get_uint16(a, 0) != 3) {
+        errx(1, "DUMMY_AQUA_DATA_3 not found by name");
+    }
+
+    /* Racing creators all end up on the same storage. */
+    for (int i = 0; i < NTHREADS; ++i) {
+        if (pthread_create(&threads[i], NULL, creator, ids[i])) {
+            err(1, "pthread_create");
+        }
+    }
+    for (int i = 0; i < NTHREADS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    store = tag_tree_lookup(ids[0][0])->store;
+    for (int i = 0; i < NTHREADS; ++i) {
+        for (int j = 0; j < NPER_THREAD; ++j) {
+            if (tag_tree_lookup(ids[i][j])->store != store) {
+                errx(1, "Tag %d has storage of its own", ids[i][j]);
+            }
+        }
+    }
+    if (store->refs != NTHREADS * NPER_THREAD) {
+        errx(1, "Storage has %d handles, expected %d", store->refs, NTHREADS * NPER_THREAD);
+    }
+
+    plc_tag_shutdown();
+
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+#include "tagtree.h"
+
+#define NTHREADS 8
+#define NCHURN 20000
+
+static int32_t
+create(const char* name)
+{
+    char buf[128];
+    int32_t id;
+
+    snprintf(buf, sizeof(buf), "protocol=ab_eip&elem_size=4&elem_count=1&name=%s", name);
+    if ((id = plc_tag_create(buf, 1000)) < 0) {
+        errx(1, "plc_tag_create(%s) returned %d", buf, id);
+    }
+    return id;
+}
+
+/* Creates and destroys tags as fast as it can, checking that nothing it
+ * has destroyed can still be reached. */
+static void*
+churner(void* arg)
+{
+    char name[64];
+    int32_t id, prev = 0;
+
+    for (int i = 0; i < NCHURN; ++i) {
+        snprintf(name, sizeof(name), "Churn_%ld_%d", (long)(arg), i);
+        id = create(name);
+        if (id == prev) {
+            errx(1, "ID %d handed out twice in a row", id);
+        }
+        plc_tag_set_int32(id, 0, i);
+        if (plc_tag_get_int32(id, 0) != i) {
+            errx(1, "Tag %d lost its value", id);
+        }
+        if (plc_tag_destroy(id) != PLCTAG_STATUS_OK) {
+            errx(1, "plc_tag_destroy(%d) failed", id);
+        }
+        if (plc_tag_get_size(id) != PLCTAG_ERR_NOT_FOUND || plc_tag_destroy(id) != PLCTAG_ERR_NOT_FOUND) {
+            errx(1, "Destroyed tag %d still reachable", id);
+        }
+        prev = id;
+    }
+    return NULL;
+}
+
+int
+main(int argc, char** argv)
+{
+    pthread_t threads[NTHREADS];
+    int32_t stale, id, fresh;
+    char name[64];
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    /* Destroying the newest tag doesn't give its ID to the next one. */
+    stale = create("Newest");
+    plc_tag_destroy(stale);
+    id = create("Newer");
+    if (id == stale) {
+        errx(1, "ID %d reused straight away", id);
+    }
+
+    /* Once slots do get reused, the old IDs stay dead. */
+    for (int i = 0; i < 10000; ++i) {
+        snprintf(name, sizeof(name), "Reused_%d", i);
+        plc_tag_destroy(create(name));
+    }
+    fresh = create("Fresh");
+    if ((fresh & TAG_ID_SLOT_MASK) == fresh) {
+        errx(1, "Tag %d took a fresh slot with so many free", fresh);
+    }
+    if (tag_tree_lookup(stale) != NULL || tag_tree_lookup(fresh & TAG_ID_SLOT_MASK) != NULL) {
+        errx(1, "Stale ID found a tag");
+    }
+    if (tag_tree_lookup(fresh) == NULL || tag_tree_lookup(id) == NULL) {
+        errx(1, "Live tags not found");
+    }
+
+    for (long i = 0; i < NTHREADS; ++i) {
+        if (pthread_create(&threads[i], NULL, churner, (void*)(i))) {
+            err(1, "pthread_create");
+        }
+    }
+    for (int i = 0; i < NTHREADS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (plc_tag_get_size(id) != 4 || plc_tag_get_size(fresh) != 4) {
+        errx(1, "Churn disturbed the tags that stayed");
+    }
+
+    plc_tag_shutdown();
+
+    return 0;
+}
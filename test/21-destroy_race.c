@@ -0,0 +1,93 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+
+#define NSLOTS 64
+#define NREADERS 6
+#define NROUNDS 20000
+
+/* The tags being churned.  Each payload holds its own ID once set. */
+static int32_t ids[NSLOTS];
+static int done = 0;
+
+static int32_t
+create(int slot, int round)
+{
+    char buf[128];
+    int32_t id;
+
+    snprintf(buf, sizeof(buf), "protocol=ab_eip&elem_size=4&elem_count=16&name=Race_%d_%d", slot, round);
+    if ((id = plc_tag_create(buf, 1000)) < 0) {
+        errx(1, "plc_tag_create(%s) returned %d", buf, id);
+    }
+    plc_tag_set_int32(id, 0, id);
+    plc_tag_set_int32(id, 60, id);
+    return id;
+}
+
+/* Reads tags that may be destroyed under it at any moment.  It may find
+ * them gone, or not yet stamped, but never anybody else's data. */
+static void*
+reader(void* arg)
+{
+    (void)(arg);
+
+    while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+        for (int i = 0; i < NSLOTS; ++i) {
+            int32_t id = __atomic_load_n(&ids[i], __ATOMIC_ACQUIRE);
+            int32_t v = plc_tag_get_int32(id, 60);
+
+            if (v != id && v != 0 && v != PLCTAG_ERR_NOT_FOUND) {
+                errx(1, "Tag %d read %d", id, v);
+            }
+            plc_tag_status(id);
+            plc_tag_get_size(id);
+            if (i % 8 == 0) {
+                plc_tag_read(id, 0);
+            }
+        }
+    }
+    return NULL;
+}
+
+int
+main(int argc, char** argv)
+{
+    pthread_t threads[NREADERS];
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_ERROR);
+
+    for (int i = 0; i < NSLOTS; ++i) {
+        ids[i] = create(i, 0);
+    }
+
+    for (int i = 0; i < NREADERS; ++i) {
+        if (pthread_create(&threads[i], NULL, reader, NULL)) {
+            err(1, "pthread_create");
+        }
+    }
+
+    for (int round = 1; round < NROUNDS; ++round) {
+        int slot = round % NSLOTS;
+        int32_t old = ids[slot];
+
+        __atomic_store_n(&ids[slot], create(slot, round), __ATOMIC_RELEASE);
+        if (plc_tag_destroy(old) != PLCTAG_STATUS_OK) {
+            errx(1, "plc_tag_destroy(%d) failed", old);
+        }
+    }
+
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < NREADERS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    plc_tag_shutdown();
+
+    return 0;
+}
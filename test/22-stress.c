@@ -0,0 +1,443 @@
+/* 22-stress.c
+ *
+ * Runs readers, writers, create/destroy churners and @tags browsers against
+ * the library all at once, checking what they see as they go, and reports
+ * throughput every interval and latency histograms at the end.  The
+ * defaults make for a short run; for a soak, run it by hand, e.g.
+ *
+ *     test/test_22-stress -d 3600 -i 10 -r 16 -w 4 -c 4
+ *
+ * Options:
+ *   -r n  reader threads (default 4)
+ *   -w n  writer threads (default 2)
+ *   -c n  churner threads (default 2)
+ *   -b n  @tags browser threads (default 1)
+ *   -n n  tags shared by readers and writers (default 64)
+ *   -d s  seconds to run for (default 2)
+ *   -i s  seconds between throughput reports (default 1)
+ */
+
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+
+#define MAX_THREADS 256
+#define NSLOTS 64 /* churned tags that readers may look at */
+#define NELEMS 16
+#define NBUCKETS 40 /* latency buckets of [2^i, 2^(i+1)) ns */
+
+enum op {
+    OP_GET,
+    OP_READ,
+    OP_LOCK_WAIT,
+    OP_LOCKED_WRITE,
+    OP_CREATE,
+    OP_DESTROY,
+    OP_BROWSE,
+    OP_COUNT
+};
+
+static const char* op_names[OP_COUNT] = {
+    "get_int32", "plc_tag_read", "lock wait", "locked write", "create", "destroy", "@tags browse"
+};
+
+/* One thread's tallies.  Only that thread writes them; the main thread
+ * samples the counts for its throughput reports. */
+struct stats {
+    uint64_t count[OP_COUNT];
+    uint64_t hist[OP_COUNT][NBUCKETS];
+    uint64_t max[OP_COUNT];
+};
+
+struct worker {
+    void* (*fn)(void*);
+    int index;
+    pthread_t thread;
+    struct stats stats;
+};
+
+static int nreaders = 4, nwriters = 2, nchurners = 2, nbrowsers = 1;
+static int ntags = 64;
+static int duration = 2, interval = 1;
+
+static int32_t* tags; /* stable tags, written under lock */
+static int32_t slots[NSLOTS]; /* churned tags, each holding its own ID */
+static int done = 0;
+
+static uint64_t
+now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+record(struct stats* s, enum op op, uint64_t ns)
+{
+    int b = 0;
+
+    while (b < NBUCKETS - 1 && (ns >> (b + 1)) != 0) {
+        ++b;
+    }
+    ++s->hist[op][b];
+    if (ns > s->max[op]) {
+        s->max[op] = ns;
+    }
+    __atomic_store_n(&s->count[op], s->count[op] + 1, __ATOMIC_RELAXED);
+}
+
+static inline uint32_t
+next_rand(uint32_t* state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static int
+running()
+{
+    return !__atomic_load_n(&done, __ATOMIC_ACQUIRE);
+}
+
+static int32_t
+create(const char* kind, int a, int b)
+{
+    char buf[128];
+    int32_t id;
+
+    snprintf(buf, sizeof(buf), "protocol=ab_eip&elem_size=4&elem_count=%d&name=%s_%d_%d", NELEMS, kind, a, b);
+    if ((id = plc_tag_create(buf, 1000)) < 0) {
+        errx(1, "plc_tag_create(%s) returned %d", buf, id);
+    }
+    return id;
+}
+
+/* Reads stable and churned tags alike.  A churned tag may be gone, or not
+ * yet stamped with its ID, but never shows anybody else's data. */
+static void*
+reader(void* arg)
+{
+    struct worker* w = arg;
+    uint32_t rng = 2463534242u + w->index;
+    uint64_t t0;
+    int32_t id, v;
+
+    while (running()) {
+        uint32_t r = next_rand(&rng);
+
+        if (r & 1) {
+            id = tags[(r >> 1) % ntags];
+            t0 = now_ns();
+            v = plc_tag_get_int32(id, 4 * ((r >> 8) % NELEMS));
+            record(&w->stats, OP_GET, now_ns() - t0);
+            if (v < 0) {
+                errx(1, "Reading stable tag %d returned %d", id, v);
+            }
+        } else {
+            id = __atomic_load_n(&slots[(r >> 1) % NSLOTS], __ATOMIC_ACQUIRE);
+            t0 = now_ns();
+            v = plc_tag_get_int32(id, 4 * (NELEMS - 1));
+            record(&w->stats, OP_GET, now_ns() - t0);
+            if (v != id && v != 0 && v != PLCTAG_ERR_NOT_FOUND) {
+                errx(1, "Churned tag %d read %d", id, v);
+            }
+        }
+
+        if ((r & 0xff) == 0) {
+            t0 = now_ns();
+            plc_tag_read(id, 0);
+            record(&w->stats, OP_READ, now_ns() - t0);
+        }
+    }
+    return NULL;
+}
+
+/* Rewrites every element of a stable tag under its lock, checking first
+ * that nobody else's write has been left half done. */
+static void*
+writer(void* arg)
+{
+    struct worker* w = arg;
+    uint32_t rng = 88675123u + w->index;
+    uint64_t t0, t1;
+    int32_t id, first;
+    int rc;
+
+    while (running()) {
+        uint32_t r = next_rand(&rng);
+
+        id = tags[r % ntags];
+        t0 = now_ns();
+        if ((rc = plc_tag_lock(id)) != PLCTAG_STATUS_OK) {
+            errx(1, "plc_tag_lock(%d) returned %d", id, rc);
+        }
+        t1 = now_ns();
+        record(&w->stats, OP_LOCK_WAIT, t1 - t0);
+
+        first = plc_tag_get_int32(id, 0);
+        for (int i = 1; i < NELEMS; ++i) {
+            int32_t v = plc_tag_get_int32(id, 4 * i);
+            if (v != first) {
+                errx(1, "Tag %d element %d is %d, not %d, under lock", id, i, v, first);
+            }
+        }
+        for (int i = 0; i < NELEMS; ++i) {
+            plc_tag_set_int32(id, 4 * i, (int32_t)(r >> 1));
+        }
+        record(&w->stats, OP_LOCKED_WRITE, now_ns() - t1);
+
+        plc_tag_unlock(id);
+    }
+    return NULL;
+}
+
+/* Replaces churned tags with new ones, destroying the old ones while
+ * readers may still be looking at them. */
+static void*
+churner(void* arg)
+{
+    struct worker* w = arg;
+    uint64_t t0;
+    int32_t id, old;
+    int rc;
+
+    for (int round = 1; running(); ++round) {
+        int slot = (round * nchurners + w->index) % NSLOTS;
+
+        t0 = now_ns();
+        id = create("Churn", w->index, round);
+        record(&w->stats, OP_CREATE, now_ns() - t0);
+        plc_tag_set_int32(id, 4 * (NELEMS - 1), id);
+
+        old = __atomic_exchange_n(&slots[slot], id, __ATOMIC_ACQ_REL);
+        t0 = now_ns();
+        if ((rc = plc_tag_destroy(old)) != PLCTAG_STATUS_OK) {
+            errx(1, "plc_tag_destroy(%d) returned %d", old, rc);
+        }
+        record(&w->stats, OP_DESTROY, now_ns() - t0);
+    }
+    return NULL;
+}
+
+/* Copies out @tags and walks its records, as a tag browser would. */
+static void*
+browser(void* arg)
+{
+    struct worker* w = arg;
+    char* buf = NULL;
+    size_t cap = 0;
+    uint64_t t0;
+    int size, rc;
+
+    while (running()) {
+        t0 = now_ns();
+        if ((size = plc_tag_get_size(1)) < 0) {
+            errx(1, "plc_tag_get_size(@tags) returned %d", size);
+        }
+        if ((size_t)(size) > cap) {
+            cap = 2 * size;
+            if ((buf = realloc(buf, cap)) == NULL) {
+                err(1, "realloc");
+            }
+        }
+        /* @tags may have shrunk since; a short copy is all right. */
+        rc = plc_tag_get_raw(1, 0, buf, size);
+        record(&w->stats, OP_BROWSE, now_ns() - t0);
+        if (rc != PLCTAG_STATUS_OK && rc != PLCTAG_ERR_BAD_PARAM) {
+            errx(1, "Reading @tags returned %d", rc);
+        }
+        if (rc != PLCTAG_STATUS_OK) {
+            continue;
+        }
+
+        for (int off = 0; off + (int)(sizeof(struct metatag_t)) <= size;) {
+            struct metatag_t* m = (struct metatag_t*)(buf + off);
+            off += sizeof(*m) + m->length;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static void
+sum(struct worker* w, int n, uint64_t* counts)
+{
+    memset(counts, 0, OP_COUNT * sizeof(*counts));
+    for (int i = 0; i < n; ++i) {
+        for (int op = 0; op < OP_COUNT; ++op) {
+            counts[op] += __atomic_load_n(&w[i].stats.count[op], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Returns the upper bound of the bucket that the pth fraction of a
+ * histogram falls in. */
+static uint64_t
+percentile(const uint64_t* hist, uint64_t total, double p)
+{
+    uint64_t seen = 0, want = (uint64_t)(p * total);
+
+    for (int b = 0; b < NBUCKETS; ++b) {
+        seen += hist[b];
+        if (seen > want) {
+            return 1ULL << (b + 1);
+        }
+    }
+    return 1ULL << NBUCKETS;
+}
+
+static void
+report_histograms(struct worker* w, int n)
+{
+    for (int op = 0; op < OP_COUNT; ++op) {
+        uint64_t hist[NBUCKETS] = { 0 }, total = 0, max = 0;
+        int lo = NBUCKETS, hi = 0;
+
+        for (int i = 0; i < n; ++i) {
+            for (int b = 0; b < NBUCKETS; ++b) {
+                hist[b] += w[i].stats.hist[op][b];
+            }
+            total += w[i].stats.count[op];
+            if (w[i].stats.max[op] > max) {
+                max = w[i].stats.max[op];
+            }
+        }
+        if (total == 0) {
+            continue;
+        }
+
+        printf("%s: %llu ops, p50 < %lluns, p99 < %lluns, p999 < %lluns, max %lluns\n", op_names[op],
+            (unsigned long long)(total), (unsigned long long)(percentile(hist, total, .5)),
+            (unsigned long long)(percentile(hist, total, .99)), (unsigned long long)(percentile(hist, total, .999)),
+            (unsigned long long)(max));
+        for (int b = 0; b < NBUCKETS; ++b) {
+            if (hist[b]) {
+                lo = (b < lo) ? b : lo;
+                hi = b;
+            }
+        }
+        for (int b = lo; b <= hi; ++b) {
+            printf("  %12lluns %12llu %5.1f%%\n", 1ULL << b, (unsigned long long)(hist[b]), 100.0 * hist[b] / total);
+        }
+    }
+}
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: test_22-stress [-r readers] [-w writers] [-c churners] [-b browsers]\n"
+                    "                      [-n tags] [-d seconds] [-i interval]\n");
+    exit(2);
+}
+
+int
+main(int argc, char** argv)
+{
+    static struct worker workers[MAX_THREADS];
+    uint64_t prev[OP_COUNT] = { 0 }, cur[OP_COUNT];
+    int nworkers = 0, opt;
+
+    while ((opt = getopt(argc, argv, "r:w:c:b:n:d:i:")) != -1) {
+        switch (opt) {
+        case 'r':
+            nreaders = atoi(optarg);
+            break;
+        case 'w':
+            nwriters = atoi(optarg);
+            break;
+        case 'c':
+            nchurners = atoi(optarg);
+            break;
+        case 'b':
+            nbrowsers = atoi(optarg);
+            break;
+        case 'n':
+            ntags = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (nreaders < 0 || nwriters < 0 || nchurners < 0 || nbrowsers < 0 || ntags < 1 || duration < 0 || interval < 1
+        || nreaders + nwriters + nchurners + nbrowsers > MAX_THREADS) {
+        usage();
+    }
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_ERROR);
+
+    if ((tags = calloc(ntags, sizeof(*tags))) == NULL) {
+        err(1, "calloc");
+    }
+    for (int i = 0; i < ntags; ++i) {
+        tags[i] = create("Stress", i, 0);
+    }
+    for (int i = 0; i < NSLOTS; ++i) {
+        slots[i] = create("Churn", -1, i);
+        plc_tag_set_int32(slots[i], 4 * (NELEMS - 1), slots[i]);
+    }
+
+    for (int i = 0; i < nreaders; ++i) {
+        workers[nworkers++] = (struct worker) { .fn = reader, .index = i };
+    }
+    for (int i = 0; i < nwriters; ++i) {
+        workers[nworkers++] = (struct worker) { .fn = writer, .index = i };
+    }
+    for (int i = 0; i < nchurners; ++i) {
+        workers[nworkers++] = (struct worker) { .fn = churner, .index = i };
+    }
+    for (int i = 0; i < nbrowsers; ++i) {
+        workers[nworkers++] = (struct worker) { .fn = browser, .index = i };
+    }
+    for (int i = 0; i < nworkers; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, workers[i].fn, &workers[i])) {
+            err(1, "pthread_create");
+        }
+    }
+
+    printf("%d readers, %d writers, %d churners, %d browsers on %d tags for %ds\n", nreaders, nwriters, nchurners,
+        nbrowsers, ntags, duration);
+    for (int elapsed = 0; elapsed < duration;) {
+        int step = (duration - elapsed < interval) ? duration - elapsed : interval;
+
+        sleep(step);
+        elapsed += step;
+        sum(workers, nworkers, cur);
+        printf("%6ds", elapsed);
+        for (int op = 0; op < OP_COUNT; ++op) {
+            printf("  %s %.0f/s", op_names[op], (double)(cur[op] - prev[op]) / step);
+        }
+        printf("\n");
+        fflush(stdout);
+        memcpy(prev, cur, sizeof(prev));
+    }
+
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < nworkers; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    report_histograms(workers, nworkers);
+
+    plc_tag_shutdown();
+    free(tags);
+
+    return 0;
+}
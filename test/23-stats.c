@@ -0,0 +1,190 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+#include "tagtree.h"
+
+static int32_t tag;
+
+static int
+get_stat(int32_t id, const char* name)
+{
+    return plc_tag_get_int_attribute(id, name, -1);
+}
+
+static void
+expect(int32_t id, const char* name, int want)
+{
+    int got = get_stat(id, name);
+
+    if (got != want) {
+        errx(1, "Tag %d %s is %d, not %d", id, name, got, want);
+    }
+}
+
+static void
+noop_cb(int32_t tag_id, int event, int status)
+{
+    (void)(tag_id);
+    (void)(event);
+    (void)(status);
+}
+
+#define NHAMMERS 4
+#define NHAMMER_READS 100000
+
+static void*
+hammer(void* arg)
+{
+    (void)(arg);
+
+    for (int i = 0; i < NHAMMER_READS; ++i) {
+        plc_tag_get_int32(tag, 0);
+    }
+    return NULL;
+}
+
+static void*
+locker(void* arg)
+{
+    (void)(arg);
+
+    plc_tag_lock(tag);
+    plc_tag_unlock(tag);
+    return NULL;
+}
+
+int
+main(int argc, char** argv)
+{
+    struct plc_tag_access acc[3];
+    int32_t vals[3], other, gone;
+    char buf[8];
+    pthread_t thread, hammers[NHAMMERS];
+    int32_t reused;
+    int reads, bytes;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_NONE);
+
+    tag = plc_tag_create("protocol=ab_eip&elem_size=4&elem_count=4&name=Stats", 1000);
+    other = plc_tag_create("protocol=ab_eip&elem_size=4&elem_count=4&name=Stats", 1000);
+    if (tag < 0 || other < 0) {
+        errx(1, "plc_tag_create failed");
+    }
+
+    /* Fast paths, the slow path and batches all count. */
+    plc_tag_set_int32(tag, 0, 1);
+    plc_tag_set_int16(tag, 4, 2);
+    plc_tag_get_int32(tag, 0);
+    plc_tag_get_raw(tag, 0, buf, sizeof(buf));
+    for (int i = 0; i < 3; ++i) {
+        acc[i] = (struct plc_tag_access) { .tag_id = tag, .offset = 4 * i, .type = TAG_DINT, .buf = &vals[i] };
+    }
+    plc_tag_get_multi(acc, 3);
+    expect(tag, "stat.writes", 2);
+    expect(tag, "stat.reads", 5);
+    expect(tag, "stat.bytes", 4 + 2 + 4 + 8 + 12);
+    expect(tag, "stat.bounds_errors", 0);
+
+    plc_tag_get_int32(tag, 16);
+    plc_tag_set_int8(tag, -1, 0);
+    expect(tag, "stat.bounds_errors", 2);
+    expect(tag, "stat.reads", 5);
+
+    /* Counts are per handle, even onto shared storage. */
+    expect(other, "stat.reads", 0);
+    plc_tag_get_int32(other, 0);
+    expect(other, "stat.reads", 1);
+    expect(tag, "stat.reads", 5);
+
+    /* Threads hammering the same handle lose none of its counts. */
+    for (int i = 0; i < NHAMMERS; ++i) {
+        if (pthread_create(&hammers[i], NULL, hammer, NULL)) {
+            err(1, "pthread_create");
+        }
+    }
+    for (int i = 0; i < NHAMMERS; ++i) {
+        pthread_join(hammers[i], NULL);
+    }
+    expect(tag, "stat.reads", 5 + NHAMMERS * NHAMMER_READS);
+
+    plc_tag_read(tag, 0);
+    plc_tag_read(tag, 1000);
+    plc_tag_write(tag, 1000);
+    expect(tag, "stat.read_requests", 2);
+    expect(tag, "stat.write_requests", 1);
+
+    /* A read's STARTED and COMPLETED, and a write's. */
+    plcstub_set_event_mode(PLCSTUB_EVENTS_INLINE);
+    plc_tag_register_callback(other, noop_cb);
+    plc_tag_get_int32(other, 0);
+    plc_tag_set_int32(other, 0, 0);
+    expect(other, "stat.callbacks", 4);
+    plc_tag_unregister_callback(other);
+
+    /* Waiting out another thread's plc_tag_lock() is counted. */
+    expect(tag, "stat.lock_wait_ns", 0);
+    plc_tag_lock(tag);
+    if (pthread_create(&thread, NULL, locker, NULL)) {
+        err(1, "pthread_create");
+    }
+    usleep(50000);
+    plc_tag_unlock(tag);
+    pthread_join(thread, NULL);
+    if (get_stat(tag, "stat.lock_wait_ns") < 20000000) {
+        errx(1, "Lock wait of %d ns is too short", get_stat(tag, "stat.lock_wait_ns"));
+    }
+
+    /* Compacting @tags after a destroy is a rebuild. */
+    gone = plc_tag_create("protocol=ab_eip&elem_size=4&elem_count=1&name=Gone", 1000);
+    plc_tag_get_size(1);
+    expect(0, "stat.metatag_rebuilds", 0);
+    plc_tag_destroy(gone);
+    plc_tag_get_size(1);
+    expect(0, "stat.metatag_rebuilds", 1);
+    expect(1, "stat.metatag_rebuilds", 1);
+
+    /* The global counts take in every tag's. */
+    reads = get_stat(0, "stat.reads");
+    bytes = get_stat(0, "stat.bytes");
+    if (reads < 6 || bytes < 4 + 2 + 4 + 8 + 12 + 4 + 4 + 4) {
+        errx(1, "Global reads %d and bytes %d are too few", reads, bytes);
+    }
+    plc_tag_get_int32(tag, 0);
+    expect(0, "stat.reads", reads + 1);
+    expect(0, "stat.bytes", bytes + 4);
+
+    /* A handle reusing a destroyed one's slot starts from nothing. */
+    gone = plc_tag_create("protocol=ab_eip&elem_size=4&elem_count=1&name=Reused", 1000);
+    plc_tag_get_int32(gone, 0);
+    plc_tag_destroy(gone);
+    for (int i = 0;; ++i) {
+        reused = plc_tag_create("protocol=ab_eip&elem_size=4&elem_count=1&name=Reused", 1000);
+        if ((reused & TAG_ID_SLOT_MASK) == (gone & TAG_ID_SLOT_MASK)) {
+            break;
+        }
+        plc_tag_destroy(reused);
+        if (i == 100000) {
+            errx(1, "Tag %d's slot was never reused", gone);
+        }
+    }
+    expect(reused, "stat.reads", 0);
+    plc_tag_destroy(reused);
+
+    /* Anything else gets the default. */
+    expect(tag, "stat.nonesuch", -1);
+    expect(tag, "elem_size", -1);
+    expect(gone, "stat.reads", -1);
+    if (plc_tag_get_int_attribute(tag, NULL, 7) != 7) {
+        errx(1, "NULL attribute name not defaulted");
+    }
+
+    plc_tag_shutdown();
+
+    return 0;
+}
@@ -0,0 +1,183 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+
+#define NELEMS 64
+
+static int32_t array_tag;
+static int done;
+
+static int32_t
+create(const char* attrs)
+{
+    int32_t id = plc_tag_create(attrs, 1000);
+
+    if (id < 0) {
+        errx(1, "plc_tag_create(%s) returned %d", attrs, id);
+    }
+    return id;
+}
+
+/* Waits until the tag's first element has moved on from what it was. */
+static void
+wait_change(int32_t tag)
+{
+    int32_t start = plc_tag_get_int32(tag, 0);
+
+    for (int i = 0; i < 1000 && plc_tag_get_int32(tag, 0) == start; ++i) {
+        usleep(1000);
+    }
+}
+
+/* Every update covers the whole of a tag, so a read of the whole of it
+ * never sees two scans' values at once. */
+static void*
+reader(void* arg)
+{
+    int32_t buf[NELEMS];
+
+    (void)(arg);
+
+    while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+        if (plc_tag_get_raw(array_tag, 0, buf, sizeof(buf)) != PLCTAG_STATUS_OK) {
+            errx(1, "plc_tag_get_raw failed");
+        }
+        for (int i = 1; i < NELEMS; ++i) {
+            if (buf[i] != buf[0]) {
+                errx(1, "Torn update: element %d is %d, element 0 %d", i, buf[i], buf[0]);
+            }
+        }
+    }
+    return NULL;
+}
+
+int
+main(int argc, char** argv)
+{
+    char path[] = "/tmp/plcstub_replay_XXXXXX", fixture[] = "/tmp/plcstub_fixture_XXXXXX", attrs[256];
+    int32_t ramp, sine, walk, counter, replay, first, locked;
+    pthread_t thread;
+    FILE* f;
+    int fd;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_NONE);
+    plcstub_set_scan_rate(1);
+
+    ramp = create("protocol=ab_eip&elem_type=DINT&name=Ramp&gen=ramp:10:20:5");
+    sine = create("protocol=ab_eip&elem_type=REAL&name=Sine&gen=sine:-1:1:8");
+    walk = create("protocol=ab_eip&elem_type=INT&name=Walk&gen=walk:0:10:3");
+    counter = create("protocol=ab_eip&elem_type=LINT&name=Counter&gen=counter:2");
+
+    if ((fd = mkstemp(path)) < 0 || (f = fdopen(fd, "w")) == NULL) {
+        err(1, "mkstemp");
+    }
+    fprintf(f, "7\n8, 9\n");
+    fclose(f);
+    snprintf(attrs, sizeof(attrs), "protocol=ab_eip&elem_type=SINT&name=Replay&gen=replay:%s", path);
+    replay = create(attrs);
+
+    for (int scan = 0; scan < 200; ++scan) {
+        int32_t r = plc_tag_get_int32(ramp, 0);
+        float s = plc_tag_get_float32(sine, 0);
+        int16_t w = plc_tag_get_int16(walk, 0);
+        int8_t p = plc_tag_get_int8(replay, 0);
+
+        if (r != 0 && r != 10 && r != 15 && r != 20) {
+            errx(1, "Ramp is %d", r);
+        }
+        if (s < -1.0001 || s > 1.0001) {
+            errx(1, "Sine is %f", s);
+        }
+        if (w < 0 || w > 10) {
+            errx(1, "Walk is %d", w);
+        }
+        if (p != 0 && p != 7 && p != 8 && p != 9) {
+            errx(1, "Replay is %d", p);
+        }
+        usleep(500);
+    }
+
+    /* A counter only ever goes up, by its step. */
+    wait_change(counter);
+    for (int64_t prev = plc_tag_get_int64(counter, 0), i = 0; i < 20; ++i) {
+        int64_t now;
+
+        wait_change(counter);
+        now = plc_tag_get_int64(counter, 0);
+        if (now <= prev || now % 2 != 0) {
+            errx(1, "Counter went from %lld to %lld", (long long)(prev), (long long)(now));
+        }
+        prev = now;
+    }
+    unlink(path);
+
+    /* Readers see each scan whole. */
+    array_tag = create("protocol=ab_eip&elem_size=4&elem_count=64&name=Array&gen=counter");
+    if (pthread_create(&thread, NULL, reader, NULL)) {
+        err(1, "pthread_create");
+    }
+    for (int i = 0; i < 50; ++i) {
+        wait_change(array_tag);
+    }
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+
+    /* A tag held with plc_tag_lock() is left alone. */
+    locked = create("protocol=ab_eip&elem_size=4&elem_count=1&name=Locked&gen=counter");
+    wait_change(locked);
+    plc_tag_lock(locked);
+    {
+        int32_t held = plc_tag_get_int32(locked, 0);
+
+        usleep(20000);
+        if (plc_tag_get_int32(locked, 0) != held) {
+            errx(1, "Locked tag changed under its lock");
+        }
+    }
+    plc_tag_unlock(locked);
+    wait_change(locked);
+
+    /* Destroying a tag stops its generator. */
+    if (plc_tag_destroy(ramp) != PLCTAG_STATUS_OK || plc_tag_destroy(array_tag) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_destroy failed");
+    }
+    usleep(10000);
+
+    /* Fixtures can carry generators too. */
+    if ((fd = mkstemp(fixture)) < 0 || (f = fdopen(fd, "w")) == NULL) {
+        err(1, "mkstemp");
+    }
+    fprintf(f, "Fixture_Static,DINT,5\nFixture_Counter,DINT,gen=counter:3\nFixture_Walk,REAL[4],1,2,gen=walk\n");
+    fclose(f);
+    if ((first = plcstub_load_fixture(fixture)) < 0) {
+        errx(1, "plcstub_load_fixture returned %d", first);
+    }
+    unlink(fixture);
+    wait_change(first + 1);
+    if (plc_tag_get_int32(first, 0) != 5 || plc_tag_get_int32(first + 1, 0) % 3 != 0) {
+        errx(1, "Fixture tags are %d and %d", plc_tag_get_int32(first, 0), plc_tag_get_int32(first + 1, 0));
+    }
+
+    /* Generators have to make sense for the tag. */
+    if (plc_tag_create("protocol=ab_eip&elem_size=3&name=Odd&gen=ramp", 1000) != PLCTAG_ERR_BAD_PARAM
+        || plc_tag_create("protocol=ab_eip&elem_size=4&name=Bad&gen=square", 1000) != PLCTAG_ERR_BAD_PARAM
+        || plc_tag_create("protocol=ab_eip&elem_size=4&name=Bad&gen=ramp:5:1", 1000) != PLCTAG_ERR_BAD_PARAM
+        || plc_tag_create("protocol=ab_eip&elem_size=4&name=Bad&gen=ramp:x", 1000) != PLCTAG_ERR_BAD_PARAM
+        || plc_tag_create("protocol=ab_eip&elem_size=4&name=Bad&gen=replay:/nonexistent", 1000) >= 0) {
+        errx(1, "Bad generator accepted");
+    }
+    if (plcstub_set_scan_rate(0) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "Scan rate of 0 accepted");
+    }
+
+    plc_tag_shutdown();
+
+    return 0;
+}
@@ -0,0 +1,250 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+
+#define NELEMS 256
+#define ROUNDS 2000
+
+static int done;
+
+static int32_t
+create(const char* attrs)
+{
+    int32_t id = plc_tag_create(attrs, 1000);
+
+    if (id < 0) {
+        errx(1, "plc_tag_create(%s) returned %d", attrs, id);
+    }
+    return id;
+}
+
+static void
+expect(int32_t tag, int32_t want, const char* what)
+{
+    int32_t got = plc_tag_get_int32(tag, 0);
+
+    if (got != want) {
+        errx(1, "%s: tag %d is %d, not %d", what, tag, got, want);
+    }
+}
+
+/* Stages every element of a handle of its own, then writes the lot. */
+static void*
+writer(void* arg)
+{
+    const char* attrs = arg;
+    int32_t tag = create(attrs), buf[NELEMS];
+
+    for (int32_t round = 1; round <= ROUNDS; ++round) {
+        for (int i = 0; i < NELEMS; ++i) {
+            buf[i] = round;
+        }
+        if (plc_tag_set_raw(tag, 0, buf, sizeof(buf)) != PLCTAG_STATUS_OK
+            || plc_tag_write(tag, 1000) != PLCTAG_STATUS_OK) {
+            errx(1, "Writing round %d failed", round);
+        }
+    }
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+    plc_tag_destroy(tag);
+    return NULL;
+}
+
+/* Every read gets one write's snapshot, whole. */
+static void*
+reader(void* arg)
+{
+    const char* attrs = arg;
+    int32_t tag = create(attrs), buf[NELEMS];
+
+    while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+        if (plc_tag_read(tag, 1000) != PLCTAG_STATUS_OK
+            || plc_tag_get_raw(tag, 0, buf, sizeof(buf)) != PLCTAG_STATUS_OK) {
+            errx(1, "Reading failed");
+        }
+        for (int i = 1; i < NELEMS; ++i) {
+            if (buf[i] != buf[0]) {
+                errx(1, "Torn snapshot: element %d is %d, element 0 %d", i, buf[i], buf[0]);
+            }
+        }
+    }
+    plc_tag_destroy(tag);
+    return NULL;
+}
+
+static int32_t locked_tag;
+
+/* Stages a whole batch under plc_tag_lock(), element by element, which
+ * no read or write completing meanwhile may overwrite or publish half of. */
+static void*
+lock_setter(void* arg)
+{
+    int32_t tag = locked_tag;
+
+    (void)(arg);
+
+    for (int32_t round = 1; round <= ROUNDS; ++round) {
+        plc_tag_lock(tag);
+        for (int i = 0; i < NELEMS; ++i) {
+            plc_tag_set_int32(tag, 4 * i, round);
+        }
+        for (int i = 0; i < NELEMS; ++i) {
+            if (plc_tag_get_int32(tag, 4 * i) != round) {
+                errx(1, "Locked batch %d overwritten: element %d is %d", round, i, plc_tag_get_int32(tag, 4 * i));
+            }
+        }
+        plc_tag_unlock(tag);
+    }
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Reads and writes the locked handle, and checks that what it publishes
+ * is only ever whole batches. */
+static void*
+lock_reader(void* arg)
+{
+    int32_t other = create(arg), buf[NELEMS];
+    int ret;
+
+    for (unsigned n = 0; !__atomic_load_n(&done, __ATOMIC_ACQUIRE); ++n) {
+        ret = (n % 2) ? plc_tag_write(locked_tag, 1000) : plc_tag_read(locked_tag, 1000);
+        if (ret != PLCTAG_STATUS_OK && ret != PLCTAG_ERR_BUSY) {
+            errx(1, "%s of the locked tag returned %d", (n % 2) ? "Write" : "Read", ret);
+        }
+        if (plc_tag_read(other, 1000) != PLCTAG_STATUS_OK
+            || plc_tag_get_raw(other, 0, buf, sizeof(buf)) != PLCTAG_STATUS_OK) {
+            errx(1, "Reading failed");
+        }
+        for (int i = 1; i < NELEMS; ++i) {
+            if (buf[i] != buf[0]) {
+                errx(1, "Half a locked batch published: element %d is %d, element 0 %d", i, buf[i], buf[0]);
+            }
+        }
+    }
+    plc_tag_destroy(other);
+    return NULL;
+}
+
+static void
+lock_race(const char* attrs)
+{
+    pthread_t threads[2];
+
+    locked_tag = create(attrs);
+    __atomic_store_n(&done, 0, __ATOMIC_RELEASE);
+    if (pthread_create(&threads[0], NULL, lock_setter, NULL)
+        || pthread_create(&threads[1], NULL, lock_reader, (void*)(attrs))) {
+        err(1, "pthread_create");
+    }
+    for (int i = 0; i < 2; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    /* The holder itself can still read and write, blocking or not. */
+    plc_tag_lock(locked_tag);
+    if (plc_tag_read(locked_tag, 1000) != PLCTAG_STATUS_OK || plc_tag_write(locked_tag, 1000) != PLCTAG_STATUS_OK) {
+        errx(1, "The lock holder couldn't read and write");
+    }
+    if (plc_tag_read(locked_tag, 0) != PLCTAG_STATUS_PENDING) {
+        errx(1, "The lock holder's read didn't start");
+    }
+    while (plc_tag_status(locked_tag) == PLCTAG_STATUS_PENDING) {
+        usleep(100);
+    }
+    plc_tag_unlock(locked_tag);
+    plc_tag_destroy(locked_tag);
+}
+
+static void
+race(const char* attrs)
+{
+    pthread_t threads[3];
+
+    __atomic_store_n(&done, 0, __ATOMIC_RELEASE);
+    if (pthread_create(&threads[0], NULL, writer, (void*)(attrs))) {
+        err(1, "pthread_create");
+    }
+    for (int i = 1; i < 3; ++i) {
+        if (pthread_create(&threads[i], NULL, reader, (void*)(attrs))) {
+            err(1, "pthread_create");
+        }
+    }
+    for (int i = 0; i < 3; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+    int32_t a, b, plain, adopted, gen;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_NONE);
+
+    a = create("protocol=ab_eip&elem_size=4&elem_count=4&name=Snap&buffers=2");
+    b = create("protocol=ab_eip&elem_size=4&elem_count=4&name=Snap&buffers=2");
+
+    /* Sets are staged in the handle until it writes, and only show up in
+     * another handle once it reads. */
+    plc_tag_set_int32(a, 0, 5);
+    expect(a, 5, "Staged");
+    expect(b, 0, "Unwritten");
+    if (plc_tag_write(a, 1000) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_write failed");
+    }
+    expect(b, 0, "Unread");
+    if (plc_tag_read(b, 1000) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_read failed");
+    }
+    expect(b, 5, "Read");
+
+    /* A read replaces whatever was staged. */
+    plc_tag_set_int32(b, 0, 6);
+    plc_tag_read(b, 1000);
+    expect(b, 5, "Reread");
+
+    /* A handle that doesn't say how it's buffered takes the existing
+     * tag's buffering, starting with its current snapshot; one that says
+     * otherwise gets a tag of its own. */
+    adopted = create("protocol=ab_eip&name=Snap");
+    expect(adopted, 5, "Adopted");
+    plain = create("protocol=ab_eip&elem_size=4&elem_count=4&name=Snap");
+    expect(plain, 0, "Unbuffered");
+    plc_tag_set_int32(plain, 0, 7);
+    plc_tag_read(b, 1000);
+    expect(b, 5, "Separate");
+
+    /* Readers never see half of a snapshot. */
+    race("protocol=ab_eip&elem_size=4&elem_count=256&name=Race2&buffers=2");
+    race("protocol=ab_eip&elem_size=4&elem_count=256&name=Race3&buffers=3");
+
+    /* Nor does a plc_tag_lock() holder, staging through a handle that
+     * another thread is reading and writing at the same time. */
+    lock_race("protocol=ab_eip&elem_size=4&elem_count=256&name=LockRace&buffers=2");
+
+    /* Generators publish snapshots too. */
+    plcstub_set_scan_rate(1);
+    gen = create("protocol=ab_eip&elem_type=DINT&name=GenSnap&buffers=3&gen=counter");
+    usleep(20000);
+    expect(gen, 0, "Generated but unread");
+    plc_tag_read(gen, 1000);
+    if (plc_tag_get_int32(gen, 0) <= 0) {
+        errx(1, "Generated snapshot not read");
+    }
+
+    if (plc_tag_create("protocol=ab_eip&elem_size=4&name=Bad&buffers=1", 1000) != PLCTAG_ERR_BAD_PARAM
+        || plc_tag_create("protocol=ab_eip&elem_size=4&name=Bad&buffers=4", 1000) != PLCTAG_ERR_BAD_PARAM
+        || plc_tag_create("protocol=ab_eip&elem_size=4&name=Bad&buffers=x", 1000) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "Bad buffers accepted");
+    }
+
+    plc_tag_shutdown();
+
+    return 0;
+}
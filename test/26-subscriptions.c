@@ -0,0 +1,172 @@
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+
+#define NMANY 10000
+#define INTERVAL_MS 10
+
+static int changes[1 << 16];
+
+static void
+count_cb(int32_t tag_id, int event, int status)
+{
+    (void)(status);
+
+    if (event == PLCSTUB_EVENT_CHANGED) {
+        __atomic_add_fetch(&changes[tag_id & 0xffff], 1, __ATOMIC_RELAXED);
+    }
+}
+
+static int32_t
+create(const char* attrs)
+{
+    int32_t id = plc_tag_create(attrs, 1000);
+
+    if (id < 0) {
+        errx(1, "plc_tag_create(%s) returned %d", attrs, id);
+    }
+    return id;
+}
+
+/* Subscribes with the counting callback. */
+static void
+subscribe(int32_t tag, double deadband)
+{
+    if (plc_tag_register_callback(tag, count_cb) != PLCTAG_STATUS_OK
+        || plcstub_subscribe(tag, INTERVAL_MS, deadband) != PLCTAG_STATUS_OK) {
+        errx(1, "Subscribing to tag %d failed", tag);
+    }
+}
+
+/* Gives the notifier a few intervals to catch up, then returns (and
+ * resets) how many changes the tag has had. */
+static int
+settle(int32_t tag)
+{
+    usleep(4 * INTERVAL_MS * 1000);
+    plcstub_flush_events();
+    return __atomic_exchange_n(&changes[tag & 0xffff], 0, __ATOMIC_RELAXED);
+}
+
+static void
+expect(int32_t tag, int want, const char* what)
+{
+    int got = settle(tag);
+
+    if (got != want) {
+        errx(1, "%s: tag %d changed %d times, not %d", what, tag, got, want);
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+    static int32_t many[NMANY];
+    int32_t tag, other, real, gen, buffered;
+    int n;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_NONE);
+
+    tag = create("protocol=ab_eip&elem_type=DINT&name=Sub");
+    subscribe(tag, 0);
+    expect(tag, 0, "Untouched");
+
+    /* A burst of changes comes out as one event, or two if an interval
+     * ended partway through. */
+    for (int i = 1; i <= 100; ++i) {
+        plc_tag_set_int32(tag, 0, i);
+    }
+    n = settle(tag);
+    if (n < 1 || n > 2) {
+        errx(1, "Burst: tag changed %d times", n);
+    }
+    expect(tag, 0, "Quiet");
+
+    /* Writing what's already there isn't a change. */
+    plc_tag_set_int32(tag, 0, 100);
+    expect(tag, 0, "Same value");
+
+    /* Nor is locking without writing, while writing under a lock is. */
+    plc_tag_lock(tag);
+    plc_tag_unlock(tag);
+    expect(tag, 0, "Empty lock");
+    plc_tag_lock(tag);
+    plc_tag_set_int32(tag, 0, 1);
+    plc_tag_set_int32(tag, 0, 2);
+    plc_tag_unlock(tag);
+    expect(tag, 1, "Locked writes");
+
+    /* Writes through any handle count. */
+    other = create("protocol=ab_eip&name=Sub");
+    plc_tag_set_int32(other, 0, 3);
+    expect(tag, 1, "Other handle");
+
+    /* Small changes to REALs are within the deadband. */
+    real = create("protocol=ab_eip&elem_type=REAL&elem_count=2&name=SubReal");
+    subscribe(real, 0.5);
+    plc_tag_set_float32(real, 0, 1.0f);
+    expect(real, 1, "Real");
+    plc_tag_set_float32(real, 0, 1.2f);
+    plc_tag_set_float32(real, 4, -0.4f);
+    expect(real, 0, "Within deadband");
+    plc_tag_set_float32(real, 0, 1.6f);
+    expect(real, 1, "Past deadband");
+
+    /* Only what's written of a buffered tag counts. */
+    buffered = create("protocol=ab_eip&elem_type=DINT&name=SubBuffered&buffers=2");
+    subscribe(buffered, 0);
+    plc_tag_set_int32(buffered, 0, 9);
+    expect(buffered, 0, "Staged");
+    plc_tag_write(buffered, 1000);
+    expect(buffered, 1, "Written");
+
+    /* Generators change things too. */
+    plcstub_set_scan_rate(1);
+    gen = create("protocol=ab_eip&elem_type=DINT&name=SubGen&gen=counter");
+    subscribe(gen, 0);
+    if (settle(gen) < 1) {
+        errx(1, "Generated changes not notified");
+    }
+    plc_tag_destroy(gen);
+
+    /* The notifier's work goes with what changes, not what's subscribed. */
+    for (int i = 0; i < NMANY; ++i) {
+        char attrs[128];
+
+        snprintf(attrs, sizeof(attrs), "protocol=ab_eip&elem_type=DINT&name=SubMany%d", i);
+        many[i] = create(attrs);
+        subscribe(many[i], 0);
+    }
+    for (int i = 0; i < NMANY; i += NMANY / 5) {
+        plc_tag_set_int32(many[i], 0, 1);
+    }
+    n = settle(many[0]);
+    for (int i = 1; i < NMANY; ++i) {
+        n += __atomic_exchange_n(&changes[many[i] & 0xffff], 0, __ATOMIC_RELAXED);
+    }
+    if (n != 5) {
+        errx(1, "%d of the tags changed, not 5", n);
+    }
+
+    /* Unsubscribing stops events. */
+    if (plcstub_unsubscribe(tag) != PLCTAG_STATUS_OK || plcstub_unsubscribe(tag) != PLCTAG_ERR_NOT_FOUND) {
+        errx(1, "plcstub_unsubscribe failed");
+    }
+    plc_tag_set_int32(tag, 0, 4);
+    expect(tag, 0, "Unsubscribed");
+
+    if (plcstub_subscribe(tag, 0, 0) != PLCTAG_ERR_BAD_PARAM || plcstub_subscribe(tag, 10, -1) != PLCTAG_ERR_BAD_PARAM
+        || plcstub_subscribe(12345678, 10, 0) != PLCTAG_ERR_NOT_FOUND
+        || plcstub_subscribe(1, 10, 0) != PLCTAG_ERR_NOT_ALLOWED) {
+        errx(1, "Bad subscription accepted");
+    }
+
+    plc_tag_shutdown();
+
+    return 0;
+}
@@ -0,0 +1,205 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+#include "tagtree.h"
+
+#define NELEMS 64
+#define ROUNDS 2000
+
+static const char shared_attrs[] = "protocol=ab_eip&elem_type=DINT&elem_count=64&name=Shared";
+
+static int32_t
+create(const char* attrs)
+{
+    int32_t id = plc_tag_create(attrs, 1000);
+
+    if (id < 0) {
+        errx(1, "plc_tag_create(%s) returned %d", attrs, id);
+    }
+    return id;
+}
+
+static void
+expect(int32_t tag, int offset, int32_t want, const char* what)
+{
+    int32_t got = plc_tag_get_int32(tag, offset);
+
+    if (got != want) {
+        errx(1, "%s: tag %d has %d at %d, not %d", what, tag, got, offset, want);
+    }
+}
+
+/* Every element of the tag is the same: nobody saw half of a write. */
+static void
+expect_whole(int32_t tag)
+{
+    int32_t buf[NELEMS];
+
+    if (plc_tag_get_raw(tag, 0, buf, sizeof(buf)) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_get_raw failed");
+    }
+    for (int i = 1; i < NELEMS; ++i) {
+        if (buf[i] != buf[0]) {
+            errx(1, "Torn read: element %d is %d, element 0 %d", i, buf[i], buf[0]);
+        }
+    }
+}
+
+static void
+set_all(int32_t tag, int32_t v)
+{
+    plc_tag_lock(tag);
+    for (int i = 0; i < NELEMS; ++i) {
+        plc_tag_set_int32(tag, i * 4, v);
+    }
+    plc_tag_unlock(tag);
+}
+
+/* Runs this program again, as another process on the same segment. */
+static pid_t
+spawn(const char* what)
+{
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        err(1, "fork");
+    }
+    if (pid == 0) {
+        execl("/proc/self/exe", "27-shm", what, (char*)(NULL));
+        err(1, "execl");
+    }
+    return pid;
+}
+
+static void
+reap(pid_t pid, const char* what)
+{
+    int status;
+
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        errx(1, "The %s process failed", what);
+    }
+}
+
+/* What the other process does: sees what the first one did, and does some
+ * of its own. */
+static int
+child(const char* what)
+{
+    int32_t shared, dummy, local;
+
+    shared = create("protocol=ab_eip&name=Shared");
+    if (strcmp(what, "check") == 0) {
+        if (plc_tag_get_size(shared) != NELEMS * 4) {
+            errx(1, "Shared tag is %d bytes", plc_tag_get_size(shared));
+        }
+        expect(shared, 0, 42, "Shared");
+        dummy = create("protocol=ab_eip&name=DUMMY_AQUA_DATA_3");
+        expect(dummy, 0, 7, "Shared dummy");
+        local = create("protocol=ab_eip&elem_type=DINT&name=Local&buffers=2");
+        plc_tag_read(local, 1000);
+        expect(local, 0, 0, "Buffered");
+        plc_tag_set_int32(shared, 4, 99);
+    } else if (strcmp(what, "die-locked") == 0) {
+        /* Half done, under plc_tag_lock(), when the process goes. */
+        plc_tag_lock(shared);
+        plc_tag_set_int32(shared, 0, -1);
+        _exit(0);
+    } else if (strcmp(what, "die-mutex") == 0) {
+        /* Midway through a write, as far as the lock-free readers know. */
+        struct tag_store* store = tag_tree_lookup(shared)->store;
+
+        tag_store_lock(store);
+        __atomic_store_n(&store->seq, store->seq + 1, __ATOMIC_RELEASE);
+        _exit(0);
+    } else {
+        for (int32_t round = 1; round <= ROUNDS; ++round) {
+            set_all(shared, round);
+        }
+    }
+    plc_tag_shutdown();
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    int32_t shared, dummy, local;
+    char name[64];
+    pid_t pid;
+    int status;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_NONE);
+
+    if (argc > 1) {
+        return child(argv[1]);
+    }
+
+    snprintf(name, sizeof(name), "/plcstub_test_%d", (int)(getpid()));
+    plcstub_shm_remove(name);
+    setenv("PLCSTUB_SHM", name, 1);
+
+    shared = create(shared_attrs);
+    plc_tag_set_int32(shared, 0, 42);
+    dummy = create("protocol=ab_eip&name=DUMMY_AQUA_DATA_3");
+    expect(dummy, 0, 3, "Dummy");
+    plc_tag_set_int32(dummy, 0, 7);
+
+    /* Buffered tags stay in the process. */
+    local = create("protocol=ab_eip&elem_type=DINT&name=Local&buffers=2");
+    plc_tag_set_int32(local, 0, 5);
+    plc_tag_write(local, 1000);
+
+    if (plcstub_subscribe(shared, 10, 0) != PLCTAG_ERR_UNSUPPORTED) {
+        errx(1, "Subscribed to a shared tag");
+    }
+
+    /* The other process sees what's been done here, and this one what's
+     * been done there. */
+    reap(spawn("check"), "check");
+    expect(shared, 4, 99, "Set by the other process");
+
+    /* plc_tag_lock() keeps the other process out, and readers here never
+     * see half of what it writes under one. */
+    set_all(shared, 0);
+    pid = spawn("race");
+    for (int i = 0; waitpid(pid, &status, WNOHANG) == 0; ++i) {
+        expect_whole(shared);
+        if (i % 100 == 0) {
+            set_all(shared, -i);
+        }
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        errx(1, "The race process failed");
+    }
+    expect_whole(shared);
+
+    /* Nor does a process that goes without letting go of a shared tag keep
+     * the rest out of it for good. */
+    reap(spawn("die-locked"), "die-locked");
+    set_all(shared, 3);
+    expect_whole(shared);
+    expect(shared, 0, 3, "After a holder died");
+    reap(spawn("die-mutex"), "die-mutex");
+    expect(shared, 0, 3, "After a writer died");
+    set_all(shared, 4);
+    expect_whole(shared);
+    if (plc_tag_lock(shared) != PLCTAG_STATUS_OK || plc_tag_unlock(shared) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_lock after a writer died failed");
+    }
+
+    if (plcstub_shm_remove(name) != PLCTAG_STATUS_OK || plcstub_shm_remove(name) != PLCTAG_ERR_NOT_FOUND) {
+        errx(1, "plcstub_shm_remove failed");
+    }
+
+    plc_tag_shutdown();
+
+    return 0;
+}
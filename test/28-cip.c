@@ -0,0 +1,475 @@
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cip.h"
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+
+#define NELEMS 300
+
+static struct cip_session session;
+static uint8_t reply[CIP_REPLY_MAX];
+static size_t reply_len;
+
+static uint16_t
+get16(const uint8_t* p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t
+get32(const uint8_t* p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)(p[3]) << 24;
+}
+
+static size_t
+put16(uint8_t* p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    return 2;
+}
+
+static size_t
+put32(uint8_t* p, uint32_t v)
+{
+    put16(p, v);
+    put16(p + 2, v >> 16);
+    return 4;
+}
+
+/* Sends an encapsulated request, returning the reply's encapsulation
+ * status; its data is left at reply + CIP_ENCAP_HEADER. */
+static uint32_t
+encap(uint16_t cmd, const uint8_t* data, size_t len)
+{
+    uint8_t req[CIP_ENCAP_HEADER + 8192] = { 0 };
+
+    put16(req, cmd);
+    put16(req + 2, len);
+    put32(req + 4, session.handle);
+    memcpy(req + 12, "context!", 8);
+    memcpy(req + CIP_ENCAP_HEADER, data, len);
+
+    /* Nothing happens until all of it is there. */
+    if (cip_handle(&session, req, CIP_ENCAP_HEADER + len - 1, reply, &reply_len) != 0 || reply_len != 0) {
+        errx(1, "Incomplete request handled");
+    }
+    if (cip_handle(&session, req, CIP_ENCAP_HEADER + len, reply, &reply_len) != (ssize_t)(CIP_ENCAP_HEADER + len)) {
+        errx(1, "Request not consumed");
+    }
+    if (reply_len < CIP_ENCAP_HEADER || get16(reply) != cmd || memcmp(reply + 12, "context!", 8) != 0
+        || get16(reply + 2) != reply_len - CIP_ENCAP_HEADER) {
+        errx(1, "Bad reply to command %04x", cmd);
+    }
+    return get32(reply + 8);
+}
+
+/* Sends a CIP request unconnected, returning where its reply is. */
+static const uint8_t*
+unconnected(const uint8_t* msg, size_t len)
+{
+    uint8_t data[8192] = { 0 };
+    size_t n = 6;
+
+    n += put16(data + n, 2);
+    n += put16(data + n, 0x0000);
+    n += put16(data + n, 0);
+    n += put16(data + n, 0x00b2);
+    n += put16(data + n, len);
+    memcpy(data + n, msg, len);
+    if (encap(0x006f, data, n + len) != 0) {
+        errx(1, "SendRRData failed");
+    }
+    if (get16(reply + CIP_ENCAP_HEADER + 12) != 0x00b2
+        || get16(reply + CIP_ENCAP_HEADER + 14) != reply_len - CIP_ENCAP_HEADER - 16) {
+        errx(1, "Bad SendRRData reply");
+    }
+    return reply + CIP_ENCAP_HEADER + 16;
+}
+
+/* Sends a CIP request over a connection, returning where its reply is. */
+static const uint8_t*
+connected(uint32_t conn, uint32_t back, uint16_t seq, const uint8_t* msg, size_t len)
+{
+    uint8_t data[8192] = { 0 };
+    size_t n = 6;
+
+    n += put16(data + n, 2);
+    n += put16(data + n, 0x00a1);
+    n += put16(data + n, 4);
+    n += put32(data + n, conn);
+    n += put16(data + n, 0x00b1);
+    n += put16(data + n, 2 + len);
+    n += put16(data + n, seq);
+    memcpy(data + n, msg, len);
+    if (encap(0x0070, data, n + len) != 0) {
+        errx(1, "SendUnitData failed");
+    }
+    if (get32(reply + CIP_ENCAP_HEADER + 12) != back || get16(reply + CIP_ENCAP_HEADER + 20) != seq) {
+        errx(1, "Bad SendUnitData reply");
+    }
+    return reply + CIP_ENCAP_HEADER + 22;
+}
+
+/* Builds a request to a tag, by name and maybe element. */
+static size_t
+tag_request(uint8_t* msg, uint8_t service, const char* name, int index)
+{
+    size_t len = strlen(name), n = 2;
+
+    msg[0] = service;
+    msg[n++] = 0x91;
+    msg[n++] = len;
+    memcpy(msg + n, name, len);
+    n += len + (len & 1);
+    if (index >= 0) {
+        msg[n++] = 0x29;
+        msg[n++] = 0;
+        n += put16(msg + n, index);
+    }
+    msg[1] = (n - 2) / 2;
+    return n;
+}
+
+static size_t
+read_request(uint8_t* msg, const char* name, int index, int count, int frag_off)
+{
+    size_t n = tag_request(msg, frag_off < 0 ? 0x4c : 0x52, name, index);
+
+    n += put16(msg + n, count);
+    if (frag_off >= 0) {
+        n += put32(msg + n, frag_off);
+    }
+    return n;
+}
+
+static void
+expect_status(const uint8_t* r, uint8_t service, uint8_t status, uint16_t ext, const char* what)
+{
+    if (r[0] != (service | 0x80) || r[2] != status || (ext && (r[3] != 1 || get16(r + 4) != ext))) {
+        errx(1, "%s: reply %02x status %02x (%d extended), not %02x status %02x", what, r[0], r[2], r[3],
+            service | 0x80, status);
+    }
+}
+
+/* Reads one DINT, unconnected. */
+static int32_t
+read_dint(const char* name, int index)
+{
+    uint8_t msg[256];
+    const uint8_t* r = unconnected(msg, read_request(msg, name, index, 1, -1));
+
+    expect_status(r, 0x4c, 0, 0, name);
+    if (get16(r + 4) != 0xc4) {
+        errx(1, "%s has type %04x", name, get16(r + 4));
+    }
+    return get32(r + 6);
+}
+
+static const uint8_t cm_path[] = { 0x20, 0x06, 0x24, 0x01 };
+
+/* Builds a Large Forward Open, for packets of size bytes. */
+static size_t
+forward_open_request(uint8_t* msg, uint32_t to_id, uint16_t serial, uint16_t size)
+{
+    size_t n = 0;
+
+    memset(msg, 0, 64);
+    msg[n++] = 0x5b;
+    msg[n++] = sizeof(cm_path) / 2;
+    memcpy(msg + n, cm_path, sizeof(cm_path));
+    n += sizeof(cm_path);
+    msg[n++] = 0x0a;
+    msg[n++] = 0xf0;
+    n += put32(msg + n, 0); /* O->T, ours to pick */
+    n += put32(msg + n, to_id); /* T->O */
+    n += put16(msg + n, serial);
+    n += put16(msg + n, 0xf33d); /* vendor */
+    n += put32(msg + n, 0x12345678); /* originator serial */
+    msg[n++] = 1;
+    n += 3;
+    n += put32(msg + n, 2000000);
+    n += put32(msg + n, 0x42000000 | size);
+    n += put32(msg + n, 2000000);
+    n += put32(msg + n, 0x42000000 | size);
+    msg[n++] = 0xa3;
+    msg[n++] = 3;
+    memcpy(msg + n, "\x01\x00\x20\x02\x24\x01", 6);
+    return n + 6;
+}
+
+static size_t
+forward_close_request(uint8_t* msg, uint16_t serial)
+{
+    size_t n = 0;
+
+    msg[n++] = 0x4e;
+    msg[n++] = sizeof(cm_path) / 2;
+    memcpy(msg + n, cm_path, sizeof(cm_path));
+    n += sizeof(cm_path);
+    msg[n++] = 0x0a;
+    msg[n++] = 0xf0;
+    n += put16(msg + n, serial);
+    n += put16(msg + n, 0xf33d);
+    n += put32(msg + n, 0x12345678);
+    msg[n++] = 3;
+    msg[n++] = 0;
+    memcpy(msg + n, "\x01\x00\x20\x02\x24\x01", 6);
+    return n + 6;
+}
+
+int
+main(int argc, char** argv)
+{
+    uint8_t msg[8192], got[NELEMS * 4];
+    const uint8_t* r;
+    int32_t tag, grid;
+    uint32_t conn, small;
+    size_t n, off;
+    int found;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_NONE);
+
+    tag = plc_tag_create("protocol=ab_eip&elem_type=DINT&elem_count=300&name=Cip", 1000);
+    for (int i = 0; i < NELEMS; ++i) {
+        plc_tag_set_int32(tag, i * 4, i * 10);
+    }
+
+    cip_session_init(&session, NULL, NULL);
+
+    /* Nothing but registering without a session. */
+    if (encap(0x006f, msg, 16) != 0x64) {
+        errx(1, "SendRRData without a session accepted");
+    }
+    put16(msg, 1);
+    put16(msg + 2, 0);
+    if (encap(0x0065, msg, 4) != 0 || session.handle == 0 || get32(reply + 4) != session.handle) {
+        errx(1, "RegisterSession failed");
+    }
+    if (encap(0x0004, NULL, 0) != 0 || memcmp(reply + CIP_ENCAP_HEADER + 10, "Communications", 14) != 0) {
+        errx(1, "ListServices failed");
+    }
+    r = reply + CIP_ENCAP_HEADER;
+    if (encap(0x0063, NULL, 0) != 0 || get16(r) != 1 || get16(r + 2) != 0x000c
+        || get16(r + 4) != reply_len - CIP_ENCAP_HEADER - 6 || r[38] != 12 || memcmp(r + 39, "plcstub 1756", 12) != 0
+        || r[51] != 3) {
+        errx(1, "ListIdentity failed");
+    }
+
+    /* Reading and writing, unconnected. */
+    if (read_dint("DUMMY_AQUA_DATA_2", -1) != 2 || read_dint("Cip", 7) != 70) {
+        errx(1, "Read Tag read the wrong values");
+    }
+    r = unconnected(msg, read_request(msg, "Nonesuch", -1, 1, -1));
+    expect_status(r, 0x4c, 0x05, 0, "Unknown tag");
+    r = unconnected(msg, read_request(msg, "Cip", 299, 2, -1));
+    expect_status(r, 0x4c, 0xff, 0x2105, "Out of range");
+
+    /* Elements of arrays of more than one dimension take an index each. */
+    grid = plc_tag_create("protocol=ab_eip&elem_type=DINT&dims=3,4&name=Grid", 1000);
+    plc_tag_set_int32(grid, (2 * 4 + 1) * 4, 21);
+    n = tag_request(msg, 0x4c, "Grid", 2);
+    msg[n++] = 0x28;
+    msg[n++] = 1;
+    msg[1] = (n - 2) / 2;
+    n += put16(msg + n, 1);
+    r = unconnected(msg, n);
+    expect_status(r, 0x4c, 0, 0, "Read Grid[2,1]");
+    if (get32(r + 6) != 21) {
+        errx(1, "Grid[2,1] is %d", (int32_t)(get32(r + 6)));
+    }
+    msg[n - 3] = 4;
+    expect_status(unconnected(msg, n), 0x4c, 0xff, 0x2105, "Grid[2,4]");
+    expect_status(unconnected(msg, read_request(msg, "Grid", 2, 1, -1)), 0x4c, 0xff, 0x2105, "Grid[2]");
+
+    n = tag_request(msg, 0x4d, "Cip", 5);
+    n += put16(msg + n, 0xc4);
+    n += put16(msg + n, 1);
+    n += put32(msg + n, 1234);
+    expect_status(unconnected(msg, n), 0x4d, 0, 0, "Write Tag");
+    if (plc_tag_get_int32(tag, 20) != 1234) {
+        errx(1, "Write Tag didn't write");
+    }
+    put16(msg + tag_request(msg, 0x4d, "Cip", 5), 0xca);
+    expect_status(unconnected(msg, n), 0x4d, 0xff, 0x2107, "Type mismatch");
+    put16(msg + tag_request(msg, 0x4d, "Cip", 5), 0xc4);
+    expect_status(unconnected(msg, n - 2), 0x4d, 0x13, 0, "Short write");
+
+    /* A read too big for one reply comes in fragments. */
+    for (off = 0;;) {
+        r = unconnected(msg, read_request(msg, "Cip", -1, NELEMS, off));
+        n = reply_len - CIP_ENCAP_HEADER - 16 - 6;
+        if ((r[2] != 0 && r[2] != 0x06) || get16(r + 4) != 0xc4 || n == 0 || off + n > sizeof(got)) {
+            errx(1, "Fragmented read at %zu failed (status %02x)", off, r[2]);
+        }
+        memcpy(got + off, r + 6, n);
+        off += n;
+        if (r[2] == 0) {
+            break;
+        }
+    }
+    for (int i = 0; i < NELEMS; ++i) {
+        if ((int32_t)(get32(got + 4 * i)) != (i == 5 ? 1234 : i * 10)) {
+            errx(1, "Fragmented read got %d for element %d", get32(got + 4 * i), i);
+        }
+    }
+
+    /* As are writes, which can also be. */
+    for (int frag = 0; frag < 2; ++frag) {
+        n = tag_request(msg, 0x53, "Cip", 10);
+        n += put16(msg + n, 0xc4);
+        n += put16(msg + n, 2);
+        n += put32(msg + n, frag * 4);
+        n += put32(msg + n, 77 + frag);
+        expect_status(unconnected(msg, n), 0x53, 0, 0, "Write Tag Fragmented");
+    }
+    if (plc_tag_get_int32(tag, 40) != 77 || plc_tag_get_int32(tag, 44) != 78) {
+        errx(1, "Write Tag Fragmented didn't write");
+    }
+
+    /* Unconnected Send carries a request to be passed on. */
+    n = 0;
+    msg[n++] = 0x52;
+    msg[n++] = sizeof(cm_path) / 2;
+    memcpy(msg + n, cm_path, sizeof(cm_path));
+    n += sizeof(cm_path);
+    msg[n++] = 0x0a;
+    msg[n++] = 0xf0;
+    off = n;
+    n += 2;
+    put16(msg + off, read_request(msg + n, "Cip", 1, 1, -1));
+    n += get16(msg + off);
+    msg[n++] = 1; /* route path to the backplane, slot 0 */
+    msg[n++] = 0;
+    msg[n++] = 1;
+    msg[n++] = 0;
+    r = unconnected(msg, n);
+    expect_status(r, 0x4c, 0, 0, "Unconnected Send");
+    if (get32(r + 6) != 10) {
+        errx(1, "Unconnected Send read %d", get32(r + 6));
+    }
+
+    /* Connected, with a Large Forward Open. */
+    r = unconnected(msg, forward_open_request(msg, 0xabcd1234, 0x42, 4002));
+    expect_status(r, 0x5b, 0, 0, "Forward Open");
+    conn = get32(r + 4);
+    if (get32(r + 8) != 0xabcd1234 || get16(r + 12) != 0x42) {
+        errx(1, "Bad Forward Open reply");
+    }
+
+    /* A Multiple Service Packet, one of whose requests fails. */
+    {
+        const char* names[] = { "DUMMY_AQUA_DATA_1", "Cip", "Nonesuch" };
+        const int32_t want[] = { 1, 1234 };
+
+        n = 0;
+        msg[n++] = 0x0a;
+        msg[n++] = 2;
+        memcpy(msg + n, "\x20\x02\x24\x01", 4);
+        n += 4;
+        off = n;
+        n += put16(msg + n, 3);
+        n += 6;
+        for (int i = 0; i < 3; ++i) {
+            put16(msg + off + 2 + 2 * i, n - off);
+            n += read_request(msg + n, names[i], i == 1 ? 5 : -1, 1, -1);
+        }
+        r = connected(conn, 0xabcd1234, 7, msg, n);
+        expect_status(r, 0x0a, 0x1e, 0, "Multiple Service Packet");
+        if (get16(r + 4) != 3) {
+            errx(1, "Multiple Service Packet has %d replies", get16(r + 4));
+        }
+        for (int i = 0; i < 3; ++i) {
+            const uint8_t* sub = r + 4 + get16(r + 6 + 2 * i);
+
+            expect_status(sub, 0x4c, i < 2 ? 0 : 0x05, 0, names[i]);
+            if (i < 2 && (int32_t)(get32(sub + 6)) != want[i]) {
+                errx(1, "Multiple Service Packet read %d from %s", get32(sub + 6), names[i]);
+            }
+        }
+    }
+
+    /* Connected replies can be as big as the connection allows. */
+    r = connected(conn, 0xabcd1234, 8, msg, read_request(msg, "Cip", -1, NELEMS, 0));
+    expect_status(r, 0x52, 0, 0, "Big connected read");
+
+    /* Listing tags, a page at a time, one of each. */
+    found = 0;
+    for (uint32_t instance = 0;;) {
+        n = 0;
+        msg[n++] = 0x55;
+        msg[n++] = 3;
+        memcpy(msg + n, "\x20\x6b\x25\x00", 4);
+        n += 4;
+        n += put16(msg + n, instance);
+        n += put16(msg + n, 4);
+        n += put16(msg + n, 1);
+        n += put16(msg + n, 2);
+        n += put16(msg + n, 7);
+        n += put16(msg + n, 8);
+        r = unconnected(msg, n);
+        if (r[0] != 0xd5 || (r[2] != 0 && r[2] != 0x06)) {
+            errx(1, "Get Instance Attribute List failed (status %02x)", r[2]);
+        }
+        for (off = 4; off < reply_len - CIP_ENCAP_HEADER - 16;) {
+            size_t len = get16(r + off + 4);
+            const uint8_t* p = r + off + 6 + len;
+
+            instance = get32(r + off) + 1;
+            if (len == 3 && memcmp(r + off + 6, "Cip", 3) == 0) {
+                if (get16(p) != 0xc4 || get16(p + 2) != 4 || get32(p + 4) != NELEMS) {
+                    errx(1, "Cip listed as type %04x, size %d, dims %d", get16(p), get16(p + 2), get32(p + 4));
+                }
+                found++;
+            }
+            off += 6 + len + 16;
+        }
+        if (r[2] == 0) {
+            break;
+        }
+    }
+    if (found != 1) {
+        errx(1, "Cip listed %d times", found);
+    }
+
+    /* No connection is too small for an error reply, and no reply goes
+     * past what the connection it's sent on was opened for. */
+    for (int size = 0; size < 6; ++size) {
+        expect_status(unconnected(msg, forward_open_request(msg, 0x5a5a0000, 0x43, size)), 0x5b, 0x01, 0x0109,
+            "Forward Open for tiny packets");
+    }
+    r = unconnected(msg, forward_open_request(msg, 0x5a5a0000, 0x43, 6));
+    expect_status(r, 0x5b, 0, 0, "Forward Open for small packets");
+    small = get32(r + 4);
+    expect_status(connected(small, 0x5a5a0000, 1, msg, forward_open_request(msg, 0x5a5a0001, 0x44, 100)), 0x5b, 0x11,
+        0, "Forward Open over a small connection");
+    expect_status(connected(small, 0x5a5a0000, 2, msg, forward_close_request(msg, 0x42)), 0x4e, 0x11, 0,
+        "Forward Close over a small connection");
+    if (reply_len != CIP_ENCAP_HEADER + 22 + 4) {
+        errx(1, "Reply to a small connection is %zu bytes", reply_len - CIP_ENCAP_HEADER - 22);
+    }
+    expect_status(unconnected(msg, forward_close_request(msg, 0x43)), 0x4e, 0, 0, "Closing the small connection");
+
+    /* Closing the connection, which the one above left open. */
+    n = forward_close_request(msg, 0x42);
+    expect_status(unconnected(msg, n), 0x4e, 0, 0, "Forward Close");
+    expect_status(unconnected(msg, n), 0x4e, 0x01, 0x0107, "Second Forward Close");
+
+    memset(msg, 0, 32);
+    if (cip_handle(&session, msg, CIP_ENCAP_HEADER, reply, &reply_len) != CIP_ENCAP_HEADER || reply_len != 0) {
+        errx(1, "NOP replied to");
+    }
+    put16(msg, 0x0066);
+    if (cip_handle(&session, msg, CIP_ENCAP_HEADER, reply, &reply_len) != -1) {
+        errx(1, "UnRegisterSession didn't close");
+    }
+
+    cip_session_free(&session);
+    plc_tag_shutdown();
+
+    return 0;
+}
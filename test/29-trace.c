@@ -0,0 +1,204 @@
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libplctag.h"
+#include "plcstub.h"
+#include "trace.h"
+
+#define NTHREADS 4
+#define NSETS 1000
+#define TRACED "protocol=ab_eip&elem_size=4&elem_count=4&name=Traced"
+
+static int32_t tag;
+
+static uint64_t
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void*
+setter(void* arg)
+{
+    int i = (int)(intptr_t)(arg);
+
+    for (int n = 0; n < NSETS; ++n) {
+        plc_tag_set_uint8(tag, 12 + i, n);
+    }
+    return NULL;
+}
+
+/* Reads the whole of a trace, checking its header. */
+static struct trace_record*
+load(const char* path, struct trace_header* h)
+{
+    struct trace_record* recs;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        err(1, "%s", path);
+    }
+    if ((recs = malloc(st.st_size)) == NULL || read(fd, recs, st.st_size) != st.st_size) {
+        err(1, "read(%s)", path);
+    }
+    close(fd);
+
+    memcpy(h, recs, sizeof(*h));
+    if (memcmp(h->magic, TRACE_MAGIC, 8) != 0 || h->record_size != sizeof(*recs)) {
+        errx(1, "%s has a bad header", path);
+    }
+    if ((uint64_t)(st.st_size) != (1 + h->nrecords) * sizeof(*recs)) {
+        errx(1, "%s is %lld bytes, for %llu records", path,
+            (long long)(st.st_size), (unsigned long long)(h->nrecords));
+    }
+    return recs + 1;
+}
+
+int
+main(int argc, char** argv)
+{
+    char env_path[64], path[64];
+    struct trace_header h;
+    struct trace_record* recs;
+    pthread_t threads[NTHREADS];
+    int counts[TRACE_OP_SET + 1] = { 0 };
+    int32_t scratch, again;
+    uint64_t start;
+    int n, calls = 0;
+    FILE* f;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_NONE);
+    snprintf(env_path, sizeof(env_path), "/tmp/plcstub-trace-env-%d", (int)(getpid()));
+    snprintf(path, sizeof(path), "/tmp/plcstub-trace-%d", (int)(getpid()));
+
+    /* $PLCSTUB_TRACE starts recording as the library starts up. */
+    setenv("PLCSTUB_TRACE", env_path, 1);
+    if ((tag = plc_tag_create(TRACED, 1000)) < 0) {
+        errx(1, "plc_tag_create: %s", plc_tag_decode_error(tag));
+    }
+    if (plcstub_trace_start(path) != PLCTAG_ERR_DUPLICATE) {
+        errx(1, "Started a second trace");
+    }
+    if (plcstub_trace_stop() != PLCTAG_STATUS_OK || plcstub_trace_stop() != PLCTAG_ERR_NOT_FOUND) {
+        errx(1, "plcstub_trace_stop");
+    }
+    recs = load(env_path, &h);
+    if (h.nrecords != 1 + TRACE_CONT(strlen(TRACED)) || recs[0].op != TRACE_OP_CREATE
+        || recs[0].tag_id != tag || recs[0].arg != 1000 || recs[0].len != strlen(TRACED)
+        || memcmp(recs + 1, TRACED, strlen(TRACED)) != 0) {
+        errx(1, "Wrong record of creating the tag");
+    }
+    free(recs - 1);
+    unlink(env_path);
+    plc_tag_destroy(tag);
+
+    /* Record a session... */
+    if (plcstub_trace_start(path) != PLCTAG_STATUS_OK) {
+        errx(1, "plcstub_trace_start");
+    }
+    tag = plc_tag_create(TRACED, 1000);
+    scratch = plc_tag_create("protocol=ab_eip&elem_size=1&elem_count=1&name=Scratch", 0);
+    if (tag < 0 || scratch < 0) {
+        errx(1, "plc_tag_create");
+    }
+    plc_tag_set_int32(tag, 0, 42);
+    plc_tag_set_float32(tag, 4, 1.5);
+    if (plc_tag_get_int32(tag, 0) != 42 || plc_tag_get_int32(tag, 64) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "plc_tag_get_int32");
+    }
+    plc_tag_read(tag, 100);
+    plc_tag_write(tag, 100);
+    plc_tag_destroy(scratch);
+    for (int i = 0; i < NTHREADS; ++i) {
+        if (pthread_create(&threads[i], NULL, setter, (void*)(intptr_t)(i))) {
+            err(1, "pthread_create");
+        }
+    }
+    for (int i = 0; i < NTHREADS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    usleep(200 * 1000);
+    plc_tag_set_int32(tag, 8, 7);
+    if (plcstub_trace_stop() != PLCTAG_STATUS_OK) {
+        errx(1, "plcstub_trace_stop");
+    }
+    /* ...which this isn't part of. */
+    plc_tag_set_int32(tag, 0, 0);
+
+    recs = load(path, &h);
+    if (h.dropped != 0) {
+        errx(1, "Dropped %u records", h.dropped);
+    }
+    for (uint64_t i = 0; i < h.nrecords; ++i) {
+        if (recs[i].op > TRACE_OP_SET) {
+            errx(1, "Record %llu has op %d", (unsigned long long)(i), recs[i].op);
+        }
+        counts[recs[i].op]++;
+        if (recs[i].op == TRACE_OP_CREATE) {
+            i += TRACE_CONT(recs[i].len);
+        }
+        if (recs[i].op == TRACE_OP_SET && recs[i].tag_id == tag && recs[i].arg == 0
+            && (recs[i].type != TRACE_TYPE_int32 || recs[i].value != 42 || recs[i].status != PLCTAG_STATUS_OK)) {
+            errx(1, "Wrong record of setting 42");
+        }
+        calls++;
+    }
+    if (counts[TRACE_OP_CREATE] != 2 || counts[TRACE_OP_DESTROY] != 1 || counts[TRACE_OP_READ] != 1
+        || counts[TRACE_OP_WRITE] != 1 || counts[TRACE_OP_GET] != 2
+        || counts[TRACE_OP_SET] != 3 + NTHREADS * NSETS) {
+        errx(1, "Wrong counts of records");
+    }
+    free(recs - 1);
+
+    /* Replaying it, as fast as possible, leaves a new handle onto Traced
+     * with the values it had. */
+    plc_tag_destroy(tag);
+    if ((n = plcstub_trace_replay(path, 0)) != calls) {
+        errx(1, "Replayed %d calls, not %d", n, calls);
+    }
+    again = plc_tag_create(TRACED, 1000);
+    if (plc_tag_get_int32(again, 0) != 42 || plc_tag_get_float32(again, 4) != 1.5f
+        || plc_tag_get_int32(again, 8) != 7 || plc_tag_get_uint8(again, 12) != (uint8_t)(NSETS - 1)) {
+        errx(1, "Replay left the wrong values");
+    }
+
+    /* With the original timing it takes as long as recording did, and
+     * less when sped up. */
+    start = now_ms();
+    plcstub_trace_replay(path, 1);
+    if (now_ms() - start < 190) {
+        errx(1, "Replayed too fast: %llu ms", (unsigned long long)(now_ms() - start));
+    }
+    start = now_ms();
+    plcstub_trace_replay(path, 10);
+    if (now_ms() - start >= 150) {
+        errx(1, "Replayed too slowly: %llu ms", (unsigned long long)(now_ms() - start));
+    }
+
+    if (plcstub_trace_replay("/nonexistent/trace", 0) != PLCTAG_ERR_OPEN) {
+        errx(1, "Replayed a missing file");
+    }
+    if ((f = fopen(path, "w")) == NULL) {
+        err(1, "%s", path);
+    }
+    fprintf(f, "%064d", 0);
+    fclose(f);
+    if (plcstub_trace_replay(path, 0) != PLCTAG_ERR_BAD_DATA) {
+        errx(1, "Replayed a file that isn't a trace");
+    }
+    unlink(path);
+
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,195 @@
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "attr.h"
+#include "debug.h"
+#include "layout.h"
+#include "libplctag.h"
+#include "plcstub.h"
+#include "tagtree.h"
+
+#define MOTOR "DINT,REAL[4],BOOL,BOOL,LINT"
+
+static void
+write_file(const char* path, const char* contents)
+{
+    FILE* f = fopen(path, "w");
+
+    if (f == NULL || fputs(contents, f) < 0 || fclose(f) != 0) {
+        err(1, "%s", path);
+    }
+}
+
+/* Finds name's record in @tags, checking it's listed as type, with dims. */
+static void
+expect_listed(const char* name, uint16_t type, uint32_t d0, uint32_t d1, uint32_t d2)
+{
+    char buf[64];
+    int size, off;
+    uint16_t len;
+
+    if (plc_tag_read(METATAG_ID, 1000) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_read(@tags) failed");
+    }
+    size = plc_tag_get_size(METATAG_ID);
+    for (off = 0; off < size; off += 22 + len) {
+        len = plc_tag_get_uint16(METATAG_ID, off + 20);
+        if (len != strlen(name)) {
+            continue;
+        }
+        if (plc_tag_get_raw(METATAG_ID, off + 22, (uint8_t*)(buf), len) != PLCTAG_STATUS_OK
+            || memcmp(buf, name, len) != 0) {
+            continue;
+        }
+        if (plc_tag_get_uint16(METATAG_ID, off + 4) != type || plc_tag_get_uint32(METATAG_ID, off + 8) != d0
+            || plc_tag_get_uint32(METATAG_ID, off + 12) != d1 || plc_tag_get_uint32(METATAG_ID, off + 16) != d2) {
+            errx(1, "%s listed as type %04x, dims %u,%u,%u", name, plc_tag_get_uint16(METATAG_ID, off + 4),
+                plc_tag_get_uint32(METATAG_ID, off + 8), plc_tag_get_uint32(METATAG_ID, off + 12),
+                plc_tag_get_uint32(METATAG_ID, off + 16));
+        }
+        return;
+    }
+    errx(1, "%s isn't listed", name);
+}
+
+/* Checks the tags made from the fixture below, starting at first. */
+static void
+check_fixture(int32_t first, const char* what)
+{
+    const struct udt* motor = udt_intern(MOTOR, strlen(MOTOR));
+    struct tag_tree_node* t;
+
+    if (first < 0) {
+        errx(1, "%s: load failed with %d", what, first);
+    }
+    if ((t = tag_tree_lookup(first)) == NULL || t->store->dims[0] != 4 || t->store->dims[1] != 8
+        || t->store->udt != 0 || plc_tag_get_size(first) != 4 * 8 * 4) {
+        errx(1, "%s: bad Grid", what);
+    }
+    if ((t = tag_tree_lookup(first + 1)) == NULL || t->store->dims[0] != 10 || t->store->dims[1] != 0
+        || t->store->udt != motor->id || plc_tag_get_size(first + 1) != 10 * 32) {
+        errx(1, "%s: bad Motors", what);
+    }
+    if (plc_tag_get_float32(first + 2, 0) != 2.5f) {
+        errx(1, "%s: bad Speed", what);
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+    const char* csv = "/tmp/plcstub_test_layouts.csv";
+    const char* bin = "/tmp/plcstub_test_layouts.bin";
+    const struct udt *u, *v;
+    struct tag_attrs attrs;
+    struct tag_tree_node* t;
+    int32_t id;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    /* Members are aligned to their size, BOOLs share a byte, and the whole
+     * is padded to its widest member. */
+    if ((u = udt_intern(MOTOR, strlen(MOTOR))) == NULL || u->nmembers != 5 || u->size != 32) {
+        errx(1, "Bad layout of %s", MOTOR);
+    }
+    if (u->members[0].offset != 0 || u->members[1].offset != 4 || u->members[1].count != 4
+        || u->members[2].offset != 20 || u->members[2].bit != 0
+        || u->members[3].offset != 20 || u->members[3].bit != 1 || u->members[4].offset != 24) {
+        errx(1, "Bad member offsets in %s", MOTOR);
+    }
+    if (udt_intern(MOTOR, strlen(MOTOR)) != u || udt_get(u->id) != u) {
+        errx(1, "%s interned twice", MOTOR);
+    }
+    if ((v = udt_intern("SINT,BOOL[40],INT", 17)) == NULL || v->members[1].offset != 4
+        || v->members[2].offset != 12 || v->size != 16) {
+        errx(1, "Bad layout of BOOL arrays");
+    }
+    if ((v = udt_intern("SINT , INT", 10)) == NULL || v->size != 4 || v->members[1].offset != 2) {
+        errx(1, "Bad layout of SINT,INT");
+    }
+    if (udt_intern("DINT,NOSUCHTYPE", 15) != NULL || udt_intern("DINT[0]", 7) != NULL
+        || udt_intern("", 0) != NULL || udt_intern("DINT,", 5) != NULL) {
+        errx(1, "Interned a bad layout");
+    }
+
+    /* dims gives the count, and the udt the size. */
+    if (attr_parse("name=A&elem_type=INT&dims=2,3", &attrs) != PLCTAG_STATUS_OK || attrs.elem_count != 6
+        || attrs.elem_size != 2 || attrs.dims[0] != 2 || attrs.dims[1] != 3 || attrs.dims[2] != 0) {
+        errx(1, "dims=2,3 not parsed");
+    }
+    if (attr_parse("name=A&udt=" MOTOR "&elem_count=3", &attrs) != PLCTAG_STATUS_OK || attrs.udt != u->id
+        || attrs.elem_size != 32 || attrs.elem_count != 3 || !attrs.shaped) {
+        errx(1, "udt not parsed");
+    }
+    if (attr_parse("name=A&dims=2,3&elem_count=5", &attrs) != PLCTAG_ERR_BAD_PARAM
+        || attr_parse("name=A&dims=2,0", &attrs) != PLCTAG_ERR_BAD_PARAM
+        || attr_parse("name=A&dims=1,2,3,4", &attrs) != PLCTAG_ERR_BAD_PARAM
+        || attr_parse("name=A&dims=x", &attrs) != PLCTAG_ERR_BAD_PARAM
+        || attr_parse("name=A&udt=DINT&elem_type=DINT", &attrs) != PLCTAG_ERR_BAD_PARAM
+        || attr_parse("name=A&udt=DINT&elem_size=8", &attrs) != PLCTAG_ERR_BAD_PARAM
+        || attr_parse("name=A&udt=DINT,BLOB", &attrs) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "Parsed a contradictory shape");
+    }
+
+    /* Tags with shapes: their payloads are cache-line aligned, and they're
+     * listed with their types and dimensions (scalars, as ever, as arrays
+     * of one). */
+    if ((id = plc_tag_create("protocol=ab_eip&elem_type=INT&dims=2,3&name=Matrix", 1000)) < 0) {
+        errx(1, "plc_tag_create(Matrix) returned %d", id);
+    }
+    if (plc_tag_get_size(id) != 12 || (t = tag_tree_lookup(id)) == NULL || (uintptr_t)(t->data) % TAG_DATA_ALIGN != 0) {
+        errx(1, "Bad Matrix");
+    }
+    expect_listed("Matrix", 0xc3 | 2 << 13, 2, 3, 0);
+    if ((id = plc_tag_create("protocol=ab_eip&udt=" MOTOR "&dims=5&name=Motor", 1000)) < 0) {
+        errx(1, "plc_tag_create(Motor) returned %d", id);
+    }
+    if (plc_tag_get_size(id) != 5 * 32 || (uintptr_t)(tag_tree_lookup(id)->data) % TAG_DATA_ALIGN != 0) {
+        errx(1, "Bad Motor");
+    }
+    plc_tag_set_float32(id, 32 + u->members[1].offset + 4, 1.25f);
+    if (plc_tag_get_float32(id, 32 + 8) != 1.25f) {
+        errx(1, "Motor[1] lost a write");
+    }
+    expect_listed("Motor", 0x8000 | u->id | 1 << 13, 5, 0, 0);
+    if ((id = plc_tag_create("protocol=ab_eip&udt=" MOTOR "&name=OneMotor", 1000)) < 0) {
+        errx(1, "plc_tag_create(OneMotor) returned %d", id);
+    }
+    expect_listed("OneMotor", 0x8000 | u->id | 1 << 13, 1, 0, 0);
+    if ((id = plc_tag_create("protocol=ab_eip&elem_type=REAL&elem_count=4&name=Plain", 1000)) < 0) {
+        errx(1, "plc_tag_create(Plain) returned %d", id);
+    }
+    expect_listed("Plain", 0xca | 1 << 13, 4, 0, 0);
+
+    /* Fixtures give them the same way, in either form. */
+    write_file(csv,
+        "Grid,REAL[4,8]\n"
+        "Motors,{" MOTOR "}[10]\n"
+        "Speed,REAL,2.5\n");
+    check_fixture(plcstub_load_fixture(csv), "text");
+    if (plcstub_compile_fixture(csv, bin) != PLCTAG_STATUS_OK) {
+        errx(1, "plcstub_compile_fixture failed");
+    }
+    check_fixture(plcstub_load_fixture(bin), "binary");
+
+    write_file(csv, "Motors,{DINT,REAL}[2],1\n");
+    if (plcstub_load_fixture(csv) != PLCTAG_ERR_BAD_DATA) {
+        errx(1, "Fixture with UDT values loaded");
+    }
+    write_file(csv, "Motors,{DINT,REAL[4]\n");
+    if (plcstub_load_fixture(csv) != PLCTAG_ERR_BAD_DATA) {
+        errx(1, "Fixture with an unclosed UDT loaded");
+    }
+    write_file(csv, "Cube,DINT[2,2,2,2]\n");
+    if (plcstub_load_fixture(csv) != PLCTAG_ERR_BAD_DATA) {
+        errx(1, "Fixture with four dimensions loaded");
+    }
+
+    remove(csv);
+    remove(bin);
+    plc_tag_shutdown();
+    printf("OK\n");
+    return 0;
+}
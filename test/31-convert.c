@@ -0,0 +1,226 @@
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "convert.h"
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+
+#define MAXN 100
+
+static const size_t widths[] = {
+    [TAG_SINT] = 1, [TAG_INT] = 2, [TAG_DINT] = 4, [TAG_LINT] = 8, [TAG_REAL] = 4, [TAG_LREAL] = 8,
+};
+
+static uint32_t seed = 1;
+
+static uint32_t
+rnd(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+/* Floats that exercise rounding and saturation: ties, huge values, NaN. */
+static float
+awkward(int i)
+{
+    static const float specials[] = {
+        0.5f, 1.5f, 2.5f, -0.5f, -1.5f, -2.5f, 127.5f, -128.5f, 32767.5f, -32768.5f, 1e10f, -1e10f,
+        2147483520.0f, 2147483648.0f, -2147483648.0f, 9.3e18f, -9.3e18f, 1e30f, -1e30f, __builtin_nanf(""),
+        __builtin_inff(), -__builtin_inff(), 8388607.5f, -4194304.5f, 0.0f, -0.0f,
+    };
+
+    if (i % 3 == 0) {
+        return specials[(i / 3) % (sizeof(specials) / sizeof(specials[0]))];
+    }
+    return (float)((int32_t)(rnd())) / (float)(1 << (rnd() % 24));
+}
+
+/* Checks that k's kernels give exactly what the scalar ones do, for every
+ * length up to MAXN and every misalignment of the payload. */
+static void
+check_kernels(const struct convert_kernels* k)
+{
+    const struct convert_kernels* ref = convert_kernels_for(CONVERT_SCALAR);
+    struct convert_args args = { 0.37f, -12.5f, 1 / 0.37f, 12.5f / 0.37f };
+    uint8_t raw[MAXN * 8 + 8], got[MAXN * 8 + 8], want[MAXN * 8 + 8];
+    float in[MAXN], fgot[MAXN + 1], fwant[MAXN + 1];
+
+    for (int type = TAG_SINT; type <= TAG_LREAL; ++type) {
+        for (size_t n = 0; n <= MAXN; ++n) {
+            for (size_t off = 0; off < 4; ++off) {
+                for (size_t i = 0; i < sizeof(raw); ++i) {
+                    raw[i] = rnd();
+                }
+                if (type == TAG_REAL || type == TAG_LREAL) {
+                    /* Keep to finite values, which compare. */
+                    for (size_t i = 0; i < n; ++i) {
+                        float f = awkward(i) / 3.0f;
+                        if (f != f || f - f != 0.0f) {
+                            f = 1.0f;
+                        }
+                        if (type == TAG_REAL) {
+                            memcpy(raw + off + 4 * i, &f, 4);
+                        } else {
+                            double d = f;
+                            memcpy(raw + off + 8 * i, &d, 8);
+                        }
+                    }
+                }
+                memset(fgot, 0xa5, sizeof(fgot));
+                memset(fwant, 0xa5, sizeof(fwant));
+                k->get_scaled[type](fgot, raw + off, n, &args);
+                ref->get_scaled[type](fwant, raw + off, n, &args);
+                if (memcmp(fgot, fwant, sizeof(fgot)) != 0) {
+                    errx(1, "%s get_scaled[%d] differs for %zu at +%zu", k->name, type, n, off);
+                }
+
+                for (size_t i = 0; i < n; ++i) {
+                    in[i] = awkward(i);
+                }
+                memset(got, 0x5a, sizeof(got));
+                memset(want, 0x5a, sizeof(want));
+                k->set_scaled[type](got + off, in, n, &args);
+                ref->set_scaled[type](want + off, in, n, &args);
+                if (memcmp(got, want, sizeof(got)) != 0) {
+                    for (size_t i = 0; i < n * widths[type]; ++i) {
+                        if (got[off + i] != want[off + i]) {
+                            errx(1, "%s set_scaled[%d] differs for %zu at +%zu: element %zu, from %g", k->name,
+                                type, n, off, i / widths[type], in[i / widths[type]] * args.inv_scale + args.inv_bias);
+                        }
+                    }
+                    errx(1, "%s set_scaled[%d] wrote past %zu elements", k->name, type, n);
+                }
+            }
+        }
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+    const struct convert_kernels* k;
+    int16_t counts[40], back16[40];
+    int32_t vals[40], back32[40];
+    float pct[40], fl[40], back[40];
+    int32_t dints, ints;
+    int nkernels = 0;
+
+    /* The scalar kernels can be forced, and vectors are otherwise chosen
+     * where there are any. */
+    setenv("PLCSTUB_SIMD", "scalar", 1);
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+    if (convert_kernels()->isa != CONVERT_SCALAR) {
+        errx(1, "PLCSTUB_SIMD=scalar chose %s", convert_kernels()->name);
+    }
+
+    /* The scalar kernels' rounding and saturation. */
+    {
+        const struct convert_args one = { 1, 0, 1, 0 };
+        const float in[] = { 2.5f, 3.5f, -2.5f, 40000.0f, -40000.0f, __builtin_nanf(""), 1.4999f, -0.6f };
+        const int16_t want[] = { 2, 4, -2, 32767, -32768, -32768, 1, -1 };
+        int16_t out[8];
+
+        convert_kernels_for(CONVERT_SCALAR)->set_scaled[TAG_INT](out, in, 8, &one);
+        for (int i = 0; i < 8; ++i) {
+            if (out[i] != want[i]) {
+                errx(1, "%g set as INT %d, not %d", in[i], out[i], want[i]);
+            }
+        }
+    }
+
+    for (int isa = CONVERT_SCALAR; isa < CONVERT_NISAS; ++isa) {
+        if ((k = convert_kernels_for(isa)) != NULL) {
+            if (k->isa != isa || k->get_scaled[TAG_BOOL] != NULL) {
+                errx(1, "Bad kernel table %s", k->name);
+            }
+            check_kernels(k);
+            printf("%s kernels match\n", k->name);
+            nkernels++;
+        }
+    }
+#if defined(__x86_64__)
+    if (nkernels < 2) {
+        errx(1, "No SSE2 kernels on x86-64");
+    }
+#endif
+
+    dints = plc_tag_create("protocol=ab_eip&elem_type=DINT&elem_count=40&name=Dints", 1000);
+    ints = plc_tag_create("protocol=ab_eip&elem_type=INT&elem_count=40&name=Counts", 1000);
+    if (dints < 0 || ints < 0) {
+        errx(1, "plc_tag_create returned %d/%d", dints, ints);
+    }
+
+    /* Typed arrays land as the element accessors see them. */
+    for (int i = 0; i < 40; ++i) {
+        vals[i] = i * 1000 - 7;
+    }
+    if (plc_tag_set_int32_array(dints, 0, vals, 40) != PLCTAG_STATUS_OK || plc_tag_get_int32(dints, 4 * 9) != vals[9]) {
+        errx(1, "plc_tag_set_int32_array");
+    }
+    if (plc_tag_get_int32_array(dints, 8, back32, 38) != PLCTAG_STATUS_OK || memcmp(back32, vals + 2, 38 * 4) != 0) {
+        errx(1, "plc_tag_get_int32_array");
+    }
+    plc_tag_set_uint8(ints, 0, 0x34);
+    plc_tag_set_uint8(ints, 1, 0x12);
+    if (plc_tag_get_int16_array(ints, 0, back16, 1) != PLCTAG_STATUS_OK || back16[0] != 0x1234) {
+        errx(1, "plc_tag_get_int16_array isn't little-endian");
+    }
+    for (int i = 0; i < 40; ++i) {
+        fl[i] = i * 0.25f;
+    }
+    if (plc_tag_set_float32_array(dints, 0, fl, 40) != PLCTAG_STATUS_OK
+        || plc_tag_get_float32_array(dints, 0, back, 40) != PLCTAG_STATUS_OK || memcmp(fl, back, sizeof(fl)) != 0
+        || plc_tag_get_float32(dints, 4 * 3) != 0.75f) {
+        errx(1, "float32 arrays didn't round-trip");
+    }
+    if (plc_tag_get_int32_array(dints, 4, back32, 40) != PLCTAG_ERR_BAD_PARAM
+        || plc_tag_get_int32_array(dints, 0, NULL, 1) != PLCTAG_ERR_BAD_PARAM
+        || plc_tag_get_int32_array(dints, 0, back32, -1) != PLCTAG_ERR_BAD_PARAM
+        || plc_tag_get_int32_array(dints, 0, back32, 0) != PLCTAG_STATUS_OK
+        || plc_tag_get_int32_array(12345, 0, back32, 1) != PLCTAG_ERR_NOT_FOUND) {
+        errx(1, "Bad array accesses allowed");
+    }
+
+    /* Scaled: 0..27648 counts as 0..100%, and back, saturating. */
+    for (int i = 0; i < 40; ++i) {
+        counts[i] = i * 691;
+    }
+    plc_tag_set_int16_array(ints, 0, counts, 40);
+    if (plc_tag_get_scaled(ints, 0, TAG_INT, pct, 40, 100.0f / 27648, 0) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_get_scaled");
+    }
+    for (int i = 0; i < 40; ++i) {
+        if (pct[i] != (float)(counts[i]) * (100.0f / 27648)) {
+            errx(1, "INT %d scaled to %g", counts[i], pct[i]);
+        }
+    }
+    pct[0] = 50.0f;
+    pct[1] = 1000.0f;
+    pct[2] = -1000.0f;
+    if (plc_tag_set_scaled(ints, 0, TAG_INT, pct, 3, 100.0f / 27648, 0) != PLCTAG_STATUS_OK
+        || plc_tag_get_int16(ints, 0) != 13824 || plc_tag_get_int16(ints, 2) != 32767
+        || plc_tag_get_int16(ints, 4) != -32768 || plc_tag_get_int16(ints, 6) != counts[3]) {
+        errx(1, "plc_tag_set_scaled");
+    }
+    if (plc_tag_set_scaled(dints, 0, TAG_DINT, pct, 1, 0.5f, 10.0f) != PLCTAG_STATUS_OK
+        || plc_tag_get_int32(dints, 0) != 80) {
+        errx(1, "plc_tag_set_scaled with a bias gave %d", plc_tag_get_int32(dints, 0));
+    }
+    if (plc_tag_get_scaled(ints, 0, TAG_BOOL, pct, 1, 1, 0) != PLCTAG_ERR_BAD_PARAM
+        || plc_tag_get_scaled(ints, 0, (enum tag_type)(99), pct, 1, 1, 0) != PLCTAG_ERR_BAD_PARAM
+        || plc_tag_get_scaled(ints, 2, TAG_INT, pct, 40, 1, 0) != PLCTAG_ERR_BAD_PARAM
+        || plc_tag_set_scaled(ints, 0, TAG_INT, pct, 1, 0, 0) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "Bad scaled accesses allowed");
+    }
+
+    plc_tag_shutdown();
+    printf("OK\n");
+    return 0;
+}
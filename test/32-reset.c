@@ -0,0 +1,160 @@
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "layout.h"
+#include "libplctag.h"
+#include "plcstub.h"
+#include "tagtree.h"
+
+#define NCYCLES 2000
+#define NBUSY 20
+
+static int completed = 0;
+static int batched = 0;
+
+static void
+count_cb(int32_t tag_id, int event, int status)
+{
+    (void)(tag_id);
+    (void)(status);
+
+    if (event == PLCTAG_EVENT_READ_COMPLETED) {
+        __atomic_add_fetch(&completed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void
+batch_cb(const struct plcstub_event* events, int count)
+{
+    (void)(events);
+
+    __atomic_add_fetch(&batched, count, __ATOMIC_RELAXED);
+}
+
+static int32_t
+create(const char* attrs)
+{
+    int32_t id = plc_tag_create(attrs, 1000);
+
+    if (id < 0) {
+        errx(1, "plc_tag_create(%s) returned %d", attrs, id);
+    }
+    return id;
+}
+
+static int
+metatag_size(void)
+{
+    if (plc_tag_read(METATAG_ID, 1000) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_read(@tags) failed");
+    }
+    return plc_tag_get_size(METATAG_ID);
+}
+
+/* Reads the tag asynchronously and waits for the callback to hear of it. */
+static void
+read_async(int32_t tag)
+{
+    int before = __atomic_load_n(&completed, __ATOMIC_RELAXED);
+    int ret = plc_tag_read(tag, 0);
+
+    if (ret != PLCTAG_STATUS_PENDING && ret != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_read(%d, 0) returned %d", tag, ret);
+    }
+    while (plc_tag_status(tag) == PLCTAG_STATUS_PENDING) {
+        usleep(100);
+    }
+    plcstub_flush_events();
+    if (__atomic_load_n(&completed, __ATOMIC_RELAXED) != before + 1) {
+        errx(1, "No completion for the read of tag %d", tag);
+    }
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char** argv)
+{
+    int32_t first, id, ramp;
+    int fresh_size;
+    char attrs[128];
+    char spec[32];
+    double start;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    fresh_size = metatag_size();
+    first = create("protocol=ab_eip&elem_type=DINT&name=Cyc");
+    plc_tag_shutdown();
+
+    /* Each cycle starts from scratch: the same IDs, the same dummy tags,
+     * no counts, and layouts numbered from 1 again (so that thousands of
+     * distinct ones never run out). */
+    start = now();
+    for (int i = 0; i < NCYCLES; ++i) {
+        if (metatag_size() != fresh_size) {
+            errx(1, "Cycle %d: @tags is %d bytes, not %d", i, metatag_size(), fresh_size);
+        }
+        if ((id = create("protocol=ab_eip&elem_type=DINT&name=Cyc")) != first) {
+            errx(1, "Cycle %d: created tag %d, not %d", i, id, first);
+        }
+        if (plc_tag_get_int32(id, 0) != 0) {
+            errx(1, "Cycle %d: Cyc kept its value", i);
+        }
+        plc_tag_set_int32(id, 0, i + 1);
+        if (plc_tag_get_int_attribute(0, "stat.writes", -1) != 1) {
+            errx(1, "Cycle %d: %d writes counted", i, plc_tag_get_int_attribute(0, "stat.writes", -1));
+        }
+        snprintf(spec, sizeof(spec), "DINT[%d]", i + 1);
+        snprintf(attrs, sizeof(attrs), "protocol=ab_eip&udt=%s&name=Shaped", spec);
+        id = create(attrs);
+        if (udt_intern(spec, strlen(spec)) == NULL || udt_intern(spec, strlen(spec))->id != 1
+            || plc_tag_get_size(id) != 4 * (i + 1)) {
+            errx(1, "Cycle %d: %s wasn't the first layout", i, spec);
+        }
+        plc_tag_shutdown();
+    }
+    printf("%.0f cycles/s\n", NCYCLES / (now() - start));
+
+    /* Background threads and settings don't outlive a cycle either, and
+     * start up again when next wanted. */
+    for (int i = 0; i < NBUSY; ++i) {
+        id = create("protocol=ab_eip&elem_type=DINT&name=Busy");
+        if (plc_tag_register_callback(id, count_cb) != PLCTAG_STATUS_OK) {
+            errx(1, "Cycle %d: plc_tag_register_callback failed", i);
+        }
+        read_async(id);
+        if (batched != 0) {
+            errx(1, "Cycle %d: the batch callback outlived a shutdown", i);
+        }
+
+        ramp = create("protocol=ab_eip&elem_type=DINT&name=Ramp&gen=ramp:0:1000000:1");
+        if (plcstub_subscribe(id, 1, 0) != PLCTAG_STATUS_OK || plcstub_set_scan_rate(1) != PLCTAG_STATUS_OK) {
+            errx(1, "Cycle %d: plcstub_subscribe or plcstub_set_scan_rate failed", i);
+        }
+        while (plc_tag_get_int32(ramp, 0) < 2) {
+            usleep(100);
+        }
+        if (plcstub_set_event_batch_callback(batch_cb, 16) != PLCTAG_STATUS_OK) {
+            errx(1, "Cycle %d: plcstub_set_event_batch_callback failed", i);
+        }
+        plc_tag_set_int32(id, 0, i + 1);
+        plc_tag_read(id, 0);
+        plc_tag_shutdown();
+        batched = 0;
+    }
+
+    printf("OK\n");
+    return 0;
+}